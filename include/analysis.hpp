@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "chip8.hpp"
+
+class Jit;
+
+/// Version written in the header of analysis cache files.
+constexpr std::uint16_t ANALYSIS_VERSION = 1;
+
+/// What the analysis found out about a byte of a ROM, ORed together in
+/// RomAnalysis::flags.
+///
+/// First byte of an opcode reached from the entry point
+constexpr std::uint8_t BYTE_CODE = 0x01;
+/// Any other byte of a reached opcode: the second one, and the address
+/// following F000
+constexpr std::uint8_t BYTE_OPERAND = 0x02;
+/// Drawn by a DXYN while I held a known address
+constexpr std::uint8_t BYTE_SPRITE = 0x04;
+/// Read or written by FX33, FX55, FX65, 5XY2, 5XY3 or F002 while I held a
+/// known address
+constexpr std::uint8_t BYTE_DATA = 0x08;
+/// Opcode starting a basic block: the entry point, a jump, call or skip
+/// target, or the opcode after a call
+constexpr std::uint8_t BYTE_BLOCK = 0x10;
+/// Opcode a 2NNN calls
+constexpr std::uint8_t BYTE_SUBROUTINE = 0x20;
+/// BNNN: its target depends on a register, so the analysis stops there
+constexpr std::uint8_t BYTE_INDIRECT = 0x40;
+/// Reached opcode that is not an instruction of the machine, which stops the
+/// interpreter
+constexpr std::uint8_t BYTE_INVALID = 0x80;
+
+/// Size of the header of an analysis cache file: "C8AN", version (u16),
+/// machine (u8), quirks (u8), ROM content hash (u64), ROM size (u32),
+/// little endian. RomAnalysis::flags follows, one byte per byte of the ROM.
+constexpr std::size_t ANALYSIS_HEADER_SIZE = 20;
+
+/// The control flow of a ROM, recovered without running it.
+///
+/// Starting from ROM_START, every opcode is decoded with the table
+/// Chip8::emulateCycle dispatches through (opTable), and followed the way its
+/// handler moves pc: 1NNN to its target, 2NNN to its target and back after
+/// it, skips to both the next opcode and the one after it (which is four
+/// bytes further when it is an XO-CHIP F000 NNNN, like skipTaken). 00EE and
+/// 00FD end a path, and so does BNNN, flagged as an indirect jump. Paths
+/// leaving the ROM are not followed.
+///
+/// Along the way I is tracked as a constant where the code makes it one
+/// (ANNN, F000 NNNN, and FX55/FX65 after those, per the quirk profile), so
+/// that the bytes DXYN draws and the ones FX33/FX55/FX65 touch can be told
+/// apart from code. Only the first plane of an XO-CHIP sprite is seen.
+/// Anything else reached by nobody is left unflagged.
+struct RomAnalysis {
+  /// romContentHash of the image analyzed
+  std::uint64_t hash = 0;
+  Machine machine = Machine::Classic;
+  Quirks quirks = Quirks::CosmacVip;
+  /// BYTE_* flags of every byte of the ROM, the first one being ROM_START
+  std::vector<std::uint8_t> flags;
+
+  /// Flags of an address, 0 outside the ROM.
+  std::uint8_t at(unsigned address) const {
+    return address >= ROM_START && address - ROM_START < flags.size()
+               ? flags[address - ROM_START]
+               : 0;
+  }
+
+  /// Number of bytes having all of the flags in mask.
+  std::size_t count(std::uint8_t mask) const;
+};
+
+/// Analyze a ROM image for a machine and quirk profile.
+RomAnalysis analyzeRom(const unsigned char *data, std::size_t size,
+                       Machine machine, Quirks quirks);
+
+/// Write an analysis to a file, see ANALYSIS_HEADER_SIZE.
+bool saveAnalysis(const RomAnalysis &analysis, const std::string &path);
+
+/// Read a file written by saveAnalysis. Returns false if it is not an
+/// analysis of this version.
+bool loadAnalysis(RomAnalysis &analysis, const std::string &path);
+
+/// Directory of analyses, one file per ROM hash, machine and quirk profile,
+/// so a ROM is analyzed once rather than on every run.
+class AnalysisCache {
+private:
+  std::string directory;
+
+public:
+  explicit AnalysisCache(const std::string &directory);
+
+  /// File holding the analysis of a ROM: "<hash>-<machine>-<quirks>.c8an",
+  /// the hash in hex as printed by chip8_roms.
+  std::string pathFor(std::uint64_t hash, Machine machine,
+                      Quirks quirks) const;
+
+  /// The analysis of a ROM image from the cache, or analyzed now and added
+  /// to it. cached tells which. A cache that can not be written only costs
+  /// the analysis on the next run.
+  RomAnalysis get(const unsigned char *data, std::size_t size,
+                  Machine machine, Quirks quirks, bool &cached);
+};
+
+/// Decode every opcode of the analysis into the instruction cache of chip8,
+/// and compile a block at every block start with jit if given, so the first
+/// frames neither decode nor compile. Call it once the ROM is in memory;
+/// what it prepares comes from memory, so it stays correct even if memory no
+/// longer holds the ROM analyzed.
+void warmUp(const RomAnalysis &analysis, Chip8 &chip8, Jit *jit = nullptr);
@@ -0,0 +1,216 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "spsc_queue.hpp"
+
+/// Sample rate of the audio path, in Hz.
+constexpr unsigned AUDIO_SAMPLE_RATE = 48000;
+
+/// Pitch of the buzzer, in Hz. The original hardware had a single tone.
+constexpr double BUZZER_FREQUENCY = 440.0;
+
+/// Samples buffered ahead of the device the mixer aims for: 5 ms, which keeps
+/// the sound within 20 ms of the picture with a frame of samples on top.
+constexpr std::size_t AUDIO_TARGET_FILL = AUDIO_SAMPLE_RATE / 200;
+
+/// The buzzer switched on or off, stamped with the number of opcodes the
+/// runner had executed when it happened.
+struct BuzzerEdge {
+  std::uint64_t cycle;
+  bool on;
+};
+
+/// Turns buzzer edges into 16-bit mono samples and queues them for an audio
+/// backend.
+///
+/// The Runner reports the edges of each frame, then the end of the frame;
+/// the mixer then renders the frame's samples with every edge placed at the
+/// sample matching its opcode count. The tone is a square wave made
+/// band-limited with PolyBLEP (a polynomial correction around each
+/// transition, removing most of the aliasing of a naive square), faded in
+/// and out over a couple of milliseconds so the edges do not click.
+///
+/// Samples go into a lock-free single producer, single consumer ring read by
+/// the backend's thread. With rate control on, the number of samples per
+/// frame is nudged (half a percent at most) to keep the ring at
+/// AUDIO_TARGET_FILL: the emulation and the sound card run on different
+/// clocks, and this absorbs the difference without ever running dry or
+/// piling up latency.
+class AudioMixer {
+private:
+  SpscQueue<std::int16_t> ring;
+  const unsigned rate;
+
+  /// Oscillator phase in [0, 1), and its step per sample
+  double phase;
+  const double phaseStep;
+  /// XO-CHIP pattern played instead of the square wave when hasPattern is
+  /// set, a whole pattern being one period of phase
+  bool hasPattern;
+  unsigned char pattern[16];
+  double patternStep;
+  /// Current and target gain, 0 or 1, and the step between them per sample
+  float gain;
+  float target;
+  const float fadeStep;
+
+  std::vector<BuzzerEdge> edges;
+  std::uint64_t frameStart;
+  /// Fraction of a sample left over by the previous frames
+  double carry;
+
+  bool rateControl;
+  std::atomic<std::uint64_t> produced;
+
+  /// Samples of the frame being rendered
+  std::vector<std::int16_t> frame;
+
+  void render(std::int16_t *out, std::size_t count);
+
+public:
+  /// Largest change of the number of samples per frame rate control makes.
+  static constexpr double MAX_RATE_ADJUST = 0.005;
+
+  explicit AudioMixer(unsigned sampleRate = AUDIO_SAMPLE_RATE);
+
+  AudioMixer(const AudioMixer &) = delete;
+  AudioMixer &operator=(const AudioMixer &) = delete;
+
+  unsigned sampleRate() const { return rate; }
+
+  /// Keep the ring at AUDIO_TARGET_FILL by adjusting the samples per frame,
+  /// for backends consuming in real time. Off by default, frames then get
+  /// exactly sampleRate / 60 samples on average.
+  void setRateControl(bool on) { rateControl = on; }
+
+  /// Producer side. Play the 128 bit XO-CHIP pattern at the rate given by
+  /// pitch (see Chip8::audioPattern) from now on instead of the buzzer
+  /// tone, or the tone again when pattern is nullptr.
+  void setPattern(const unsigned char *pattern, unsigned char pitch);
+
+  /// Producer side. The buzzer switched on or off at this opcode count,
+  /// within the frame being run.
+  void buzzerEdge(std::uint64_t cycle, bool on) {
+    edges.push_back({cycle, on});
+  }
+
+  /// Producer side. The frame being run ended at this opcode count: render
+  /// its samples and queue them. When the ring is full the oldest samples
+  /// are kept and the newest dropped.
+  void endFrame(std::uint64_t cycle);
+
+  /// Consumer side. Take up to count samples, returning how many there were.
+  std::size_t read(std::int16_t *out, std::size_t count);
+
+  /// Either side. Samples queued and not read yet.
+  std::size_t buffered() const;
+
+  /// Either side. Samples rendered since construction.
+  std::uint64_t samplesProduced() const {
+    return produced.load(std::memory_order_relaxed);
+  }
+};
+
+/// Where the mixed samples go.
+class AudioBackend {
+public:
+  virtual ~AudioBackend() = default;
+
+  /// Start taking samples from mixer. Returns false if the output can not be
+  /// opened.
+  virtual bool start(AudioMixer &mixer) = 0;
+
+  /// Take the remaining samples and close the output.
+  virtual void stop() = 0;
+
+  /// True when samples are consumed at the sample rate by a device, which
+  /// can then pace the emulation (see EmulationThread::setAudio).
+  virtual bool realTime() const = 0;
+
+  /// Called after every frame; backends that are not real time take the
+  /// frame's samples there.
+  virtual void frameDone() {}
+};
+
+/// Writes the samples to a 16-bit mono WAV file, as fast as frames are run.
+/// For headless runs and for checking the audio path.
+class WavWriter : public AudioBackend {
+private:
+  std::string path;
+  std::FILE *file;
+  AudioMixer *mixer;
+  std::uint64_t samples;
+  bool failed;
+
+  void drain();
+
+public:
+  explicit WavWriter(const std::string &path);
+  ~WavWriter() override;
+
+  bool start(AudioMixer &mixer) override;
+
+  /// Completes the header. Check ok() afterwards for write errors.
+  void stop() override;
+  bool realTime() const override { return false; }
+  void frameDone() override { drain(); }
+
+  bool ok() const { return !failed; }
+};
+
+/// Streams the samples as raw signed 16-bit little endian mono PCM to the
+/// standard input of a command playing it, like aplay or pacat, from a
+/// thread of its own.
+///
+/// A pipe buffers far more than the latency budget, so the thread does not
+/// rely on the command blocking: it writes CHUNK samples at a time on the
+/// sample clock, LEAD ahead of it, and pads a chunk with silence when the
+/// mixer runs dry. A write that blocks anyway means the device plays slower
+/// than the host clock, and the schedule is pushed back by the time lost.
+class PipeAudio : public AudioBackend {
+private:
+  std::string command;
+  std::FILE *pipe;
+  AudioMixer *mixer;
+  std::thread writer;
+  std::atomic<bool> stopping;
+  std::atomic<bool> failed;
+  std::atomic<std::uint64_t> underruns;
+
+  void writerLoop();
+
+public:
+  /// Samples written to the command at a time: about 2.7 ms.
+  static constexpr std::size_t CHUNK = 128;
+
+  /// How far ahead of the sample clock the command is kept fed.
+  static constexpr std::chrono::milliseconds LEAD{6};
+
+  /// Play through command, %r in it being replaced by the sample rate.
+  explicit PipeAudio(const std::string &command);
+  ~PipeAudio() override;
+
+  bool start(AudioMixer &mixer) override;
+  void stop() override;
+  bool realTime() const override { return true; }
+
+  /// False once the command exited or could not be started.
+  bool ok() const { return !failed.load(std::memory_order_relaxed); }
+
+  /// Chunks padded with silence because the mixer had too few samples.
+  std::uint64_t underrunCount() const {
+    return underruns.load(std::memory_order_relaxed);
+  }
+};
+
+/// Command PipeAudio plays through by default: ALSA's player with a 20 ms
+/// device buffer.
+constexpr const char *DEFAULT_AUDIO_COMMAND =
+    "aplay -q -t raw -f S16_LE -c 1 -r %r --buffer-time=20000";
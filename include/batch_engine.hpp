@@ -0,0 +1,130 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "chip8.hpp"
+
+/// Many independent Chip 8 machines stepped in lockstep, for workloads
+/// running thousands of them at once (searches, reinforcement learning).
+///
+/// State is kept as a structure of arrays: V[r] of every lane is one
+/// contiguous array, and so are I, pc, the timers, each stack level and each
+/// screen row. Every cycle fetches the opcode of all lanes, then:
+///
+/// - if every lane is on the same opcode (lanes running the same ROM with the
+///   same inputs mostly are) and it is a register, skip, jump or timer op,
+///   it runs for all lanes at once over those arrays, 32 lanes per
+///   instruction when built with AVX2 (-mavx2), one lane at a time otherwise;
+/// - else the lanes are grouped by Op and each group runs back to back, so
+///   the per lane dispatch stays predictable even when lanes diverged.
+///
+/// Lanes are classic machines with the COSMAC VIP quirks only: loadLane
+/// takes the low resolution screen and the first 4K of memory of any
+/// machine, and storeLane turns the machine it writes to back into a classic
+/// one.
+///
+/// Lanes behave like Chip8::emulateCycle: addresses wrap at 4K, so a lane
+/// going astray can never touch another one, and a lane that runs into an
+/// unknown opcode or overflows or underflows its stack stops there with its
+/// error set, see Chip8::error.
+class BatchEngine {
+private:
+  std::size_t lanes;
+
+  /// Lanes allocated, rounded up to a whole number of vectors. The extra
+  /// lanes are only ever touched by the all-lanes kernels.
+  std::size_t stride;
+
+  /// Lane l owns memory[l * 4096, l * 4096 + 4095], plus a few bytes at the
+  /// end so 4 byte fetches from the last address stay in the buffer
+  std::vector<unsigned char> memory;
+
+  /// Register r of lane l is at [r * stride + l], same for the stack levels
+  /// and the screen rows
+  std::vector<unsigned char> V;
+  std::vector<std::uint16_t> I;
+  std::vector<std::uint16_t> pc;
+  std::vector<std::uint16_t> stack;
+  std::vector<std::uint16_t> sp;
+  std::vector<MachineError> errors;
+  std::vector<unsigned char> delayTimer;
+  std::vector<unsigned char> soundTimer;
+  std::vector<std::uint64_t> gfx;
+  std::vector<std::uint32_t> dirtyRows;
+
+  /// Keypad of each lane, bit k set while key k is pressed
+  std::vector<std::uint16_t> keys;
+
+  /// Chip8::rngState of each lane
+  std::vector<std::uint32_t> rngState;
+
+  /// Scratch space of a cycle: opcode and Op of each lane, lanes sorted by
+  /// Op, per lane skip conditions
+  std::vector<std::uint16_t> opcodes;
+  std::vector<Op> ops;
+  std::vector<std::uint32_t> groupLanes;
+  std::vector<unsigned char> conditions;
+
+  const Op *decodeTable;
+
+  void fetch();
+  bool runUniform(unsigned short opcode);
+  void runGrouped();
+
+  /// Execute op on each of count lanes, the switch on op is resolved at
+  /// compile time so a group runs without any dispatch.
+  template <Op op>
+  void execGroup(const std::uint32_t *group, std::size_t count);
+
+public:
+  /// Create lanes machines, all of them initialized like Chip8::initialize.
+  explicit BatchEngine(std::size_t lanes);
+
+  /// Number of machines.
+  std::size_t size() const { return lanes; }
+
+  /// Opcodes executed by each lane per step, before the timers tick once
+  unsigned long instructionsPerFrame;
+
+  /// Cycles where all the lanes ran as one, and cycles where they were
+  /// grouped by Op.
+  unsigned long long uniformCycles;
+  unsigned long long groupedCycles;
+
+  /// Copy the state of a machine into one lane, or into every lane.
+  void loadLane(std::size_t lane, const Chip8 &chip8);
+  void loadAll(const Chip8 &chip8);
+
+  /// Copy the state of one lane into a machine, to inspect it or to keep
+  /// running it on its own. The instruction cache of chip8 is flushed.
+  void storeLane(std::size_t lane, Chip8 &chip8) const;
+
+  /// Run one frame on every lane: set the keypads from actions (one 16 bit
+  /// key mask per lane, bit k pressing key k), execute instructionsPerFrame
+  /// opcodes and tick the timers.
+  void step(const std::uint16_t *actions);
+
+  /// Execute count cycles on every lane.
+  void runCycles(unsigned long count);
+
+  /// Decrement the delay and sound timers of every lane.
+  void tickTimers();
+
+  /// State of pixel (x, y) of a lane, 1 or 0.
+  unsigned char pixel(std::size_t lane, int x, int y) const {
+    return static_cast<unsigned char>(
+        (gfx[y * stride + lane] >> (63 - x)) & 1);
+  }
+
+  /// Same as Chip8::screenHash for one lane.
+  std::uint64_t screenHash(std::size_t lane) const;
+
+  /// Chip8::error of a lane, None while it runs.
+  MachineError laneError(std::size_t lane) const { return errors[lane]; }
+
+  /// Rows of a lane touched since the bits were last cleared, see
+  /// Chip8::dirtyRows.
+  std::uint32_t &laneDirtyRows(std::size_t lane) { return dirtyRows[lane]; }
+};
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/// Little endian writer over a buffer the caller sized, for the binary file
+/// formats (save states, movies).
+struct ByteWriter {
+  unsigned char *p;
+
+  void bytes(const void *data, std::size_t size) {
+    std::memcpy(p, data, size);
+    p += size;
+  }
+
+  void u8(unsigned char value) { *p++ = value; }
+
+  void u16(std::uint16_t value) {
+    u8(static_cast<unsigned char>(value));
+    u8(static_cast<unsigned char>(value >> 8));
+  }
+
+  void u32(std::uint32_t value) {
+    u16(static_cast<std::uint16_t>(value));
+    u16(static_cast<std::uint16_t>(value >> 16));
+  }
+
+  void u64(std::uint64_t value) {
+    u32(static_cast<std::uint32_t>(value));
+    u32(static_cast<std::uint32_t>(value >> 32));
+  }
+};
+
+/// Little endian reader matching ByteWriter. No bounds checks, callers
+/// validate the sizes first.
+struct ByteReader {
+  const unsigned char *p;
+
+  void bytes(void *data, std::size_t size) {
+    std::memcpy(data, p, size);
+    p += size;
+  }
+
+  unsigned char u8() { return *p++; }
+
+  std::uint16_t u16() {
+    const std::uint16_t low = u8();
+    return static_cast<std::uint16_t>(low | u8() << 8);
+  }
+
+  std::uint32_t u32() {
+    const std::uint32_t low = u16();
+    return low | static_cast<std::uint32_t>(u16()) << 16;
+  }
+
+  std::uint64_t u64() {
+    const std::uint64_t low = u32();
+    return low | static_cast<std::uint64_t>(u32()) << 32;
+  }
+};
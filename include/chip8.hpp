@@ -1,9 +1,126 @@
-#include <random>
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
 #include <string>
+#include <vector>
+
+#include "dispatch.hpp"
+
+class Profiler;
+class TraceRecorder;
+
+/// Programs are loaded, and start running, at 0x200.
+constexpr unsigned short ROM_START = 0x200;
+
+/// Largest ROM that fits between ROM_START and the end of memory, on the
+/// machine with the most memory (see Chip8::maxRomSize).
+constexpr std::size_t MAX_ROM_SIZE = 65536 - ROM_START;
+
+/// Chip8::soundSetAt when no FX18 ran.
+constexpr unsigned long SOUND_NOT_SET = ~0UL;
+
+/// Bit planes of the screen. XO-CHIP draws on both, the other machines only
+/// on the first one.
+constexpr int PLANE_COUNT = 2;
+
+/// Size of the screen in its high resolution mode, see Chip8::hires.
+constexpr int SCREEN_WIDTH_MAX = 128;
+constexpr int SCREEN_HEIGHT_MAX = 64;
+
+/// Where the 4x5 font of FX29 is loaded.
+constexpr unsigned short FONT_START = 0x50;
+
+/// Where the 8x10 font of FX30 is loaded.
+constexpr unsigned short BIG_FONT_START = 0xA0;
+
+/// Entries of the instruction cache past the end of memory, never valid. pc
+/// runs at most 4 bytes past the last address (a skip from it) before the
+/// fetch wraps it, so the fetch can index the cache with pc as it is.
+constexpr std::size_t CODE_CACHE_SLACK = 4;
+
+/// Levels of the stack, see Chip8::stack.
+constexpr unsigned short STACK_DEPTH = 16;
+
+/// Why a machine stopped, see Chip8::error.
+enum class MachineError : unsigned char {
+  None,
+  /// 2NNN with every level of the stack in use
+  StackOverflow,
+  /// 00EE with nothing on the stack
+  StackUnderflow,
+  /// An opcode the machine does not know
+  UnknownOpcode
+};
+
+/// Name of an error as printed in reports ("stack overflow", ...).
+const char *machineErrorName(MachineError error);
+
+/// Name of a machine as used on command lines ("chip8", "schip", "xochip").
+const char *machineName(Machine machine);
+
+/// Parse a machine name as given by machineName. Returns false if it is none.
+bool parseMachine(const std::string &name, Machine &machine);
+
+/// Machine a ROM file is meant for, from its extension: .sc8 for SUPER-CHIP,
+/// .xo8 for XO-CHIP, the classic machine for anything else.
+Machine machineForPath(const std::string &path);
+
+/// Name of a quirk profile as used on command lines ("cosmac", "chip48",
+/// "schip", "xochip").
+const char *quirksName(Quirks quirks);
+
+/// Parse a quirk profile name as given by quirksName. Returns false if it is
+/// none.
+bool parseQuirks(const std::string &name, Quirks &quirks);
+
+/// Quirks a machine gets unless told otherwise: the COSMAC VIP ones for the
+/// classic machine, its own for SUPER-CHIP and XO-CHIP.
+Quirks defaultQuirks(Machine machine);
 
 class Chip8 {
 private:
-  std::mt19937 rng;
+  /// Opcode to Op table used by the dispatcher, see opTable()
+  const Op *decodeTable;
+
+  /// Instruction cache, one entry per address of memory and CODE_CACHE_SLACK
+  /// more, sized by setMachine. Odd addresses get their own entry as well
+  /// since nothing forces a ROM to keep its code aligned.
+  std::vector<DecodedOp> codeCache;
+
+  /// Handlers of the current quirk profile, see setQuirks.
+  const OpHandler *handlers;
+
+  /// Decode the opcode at address into its cache entry.
+  void predecode(unsigned short address);
+
+  /// Slow path of the fetch, when the entry at pc is not valid: wrap pc
+  /// around the end of memory, then decode the opcode there if needed. The
+  /// entries past memorySize() are never valid, so a pc run past the end of
+  /// memory only ever costs this.
+  const DecodedOp &decodeAtPc();
+
+  /// invalidateCode for the bytes from address on as the switch interpreter
+  /// wrote them, each address wrapped with memoryMask().
+  void invalidateWrapped(unsigned address, unsigned length);
+
+  /// One cycle through the dispatch table. Behind emulateCycle, and
+  /// runCycles without computed goto.
+  void step();
+
+  /// runCycles without telling tracer.
+  void runUntraced(unsigned long count);
+
+#ifdef CHIP8_COMPUTED_GOTO
+  /// Threaded interpreter behind runCycles when built with
+  /// CHIP8_COMPUTED_GOTO. One per quirk profile, setQuirks points threaded
+  /// at the right one.
+  template <Quirks Q> void runThreaded(unsigned long count);
+  void (Chip8::*threaded)(unsigned long count);
+#endif
+
+  /// Runs the cycles itself while attached, fetching from the cache
+  friend class Profiler;
 
 public:
   Chip8();
@@ -15,14 +132,26 @@ public:
   /// The Chip 8 has 35 opcodes which are all two bytes long.
   unsigned short opcode;
 
-  /// The Chip 8 has 4K memory in total
+  /// The machine emulated, Machine::Classic unless changed by setMachine.
+  Machine machine;
+
+  /// Behaviour of the opcodes the CHIP-8 variants disagree on (see
+  /// QuirkSet), defaultQuirks(machine) unless changed by setQuirks.
+  Quirks quirks;
+
+  /// The Chip 8 has 4K memory in total, XO-CHIP 64K (see memorySize), and
+  /// setMachine sizes it to match: other machines do not carry XO-CHIP's.
+  /// Set pc and the stack within it (address & memoryMask()) when writing
+  /// them from outside, the fetch relies on it.
   ///
   /// 0x000-0x1FF - Chip 8 interpreter (contains font set in emu)
   ///
   /// 0x050-0x0A0 - Used for the built in 4x5 pixel font set (0-F)
   ///
-  /// 0x200-0xFFF - Program ROM and work RAM
-  unsigned char memory[4096];
+  /// 0x0A0-0x13F - The 8x10 font set of SUPER-CHIP and XO-CHIP (0-F)
+  ///
+  /// 0x200-0xFFF - Program ROM and work RAM (up to 0xFFFF on XO-CHIP)
+  std::vector<unsigned char> memory;
 
   /// The Chip 8 has 15 8-bit general purpose registers named V0,V1 up to VE.
   /// The 16th register is used for the ‘carry flag’.
@@ -41,43 +170,221 @@ public:
   unsigned short pc;
 
   /// The graphics of the Chip 8 are black and white and the screen has a total
-  /// of 2048 pixels (64 x 32). This array that hold the pixel state (1 or 0)
-  unsigned char gfx[64 * 32];
+  /// of 2048 pixels (64 x 32). SUPER-CHIP adds a 128 x 64 mode, and XO-CHIP
+  /// a second bit plane giving four colors.
+  ///
+  /// gfx[plane][y] is a row of 128 pixels packed into two 64-bit words, the
+  /// leftmost pixel (x = 0) being the most significant bit of the first one,
+  /// so that drawing a sprite row is a shift and an XOR per word, scrolling
+  /// a shift or a move of whole words and clearing the screen a few hundred
+  /// stores. In the 64 x 32 mode only the first word of the first 32 rows is
+  /// used. Use pixel() to read a single pixel.
+  std::uint64_t gfx[PLANE_COUNT][SCREEN_HEIGHT_MAX][2];
+
+  /// Bit y is set when row y of gfx was touched by a draw, a clear or a
+  /// scroll since the bit was last cleared. Touched does not mean changed (a
+  /// sprite drawn then erased within a frame leaves the row as it was),
+  /// consumers compare these rows against what they presented last and clear
+  /// the bits themselves.
+  std::uint64_t dirtyRows;
+
+  /// True in the 128 x 64 mode of SUPER-CHIP and XO-CHIP (00FF), false in
+  /// the 64 x 32 one (00FE).
+  bool hires;
+
+  /// Planes drawn, cleared and scrolled, bit p for plane p (FN01). Always 1
+  /// except on XO-CHIP.
+  unsigned char planeMask;
+
+  /// Size of the screen in the current mode.
+  int width() const { return hires ? SCREEN_WIDTH_MAX : 64; }
+  int height() const { return hires ? SCREEN_HEIGHT_MAX : 32; }
 
-  /// Count at 60 Hz (Execute 60 opcodes in one second). When set above zero it
-  /// will count down to zero.
+  /// Color of the pixel at (x, y) in the current mode: bit p set when it is
+  /// lit on plane p, so 1 or 0 except on XO-CHIP.
+  unsigned char pixel(int x, int y) const {
+    const int shift = 63 - (x & 63);
+    return static_cast<unsigned char>(((gfx[0][y][x >> 6] >> shift) & 1) |
+                                      ((gfx[1][y][x >> 6] >> shift) & 1) << 1);
+  }
+
+  /// FNV-1a hash of the screen in the current mode, rows top to bottom with
+  /// the leftmost pixels in the first byte, so it does not depend on the
+  /// host byte order. The second plane is only hashed on XO-CHIP, so a
+  /// classic screen hashes the same as before it had planes.
+  std::uint64_t screenHash() const;
+
+  /// Count at 60 Hz, independently of how many opcodes run in between (see
+  /// tickTimers). When set above zero it will count down to zero.
   unsigned char delay_timer;
 
-  /// Count at 60 Hz (Execute 60 opcodes in one second). When set above zero it
-  /// will count down to zero. The system’s buzzer sounds whenever the sound
-  /// timer reaches zero.
+  /// Count at 60 Hz, independently of how many opcodes run in between (see
+  /// tickTimers). When set above zero it will count down to zero. The
+  /// system’s buzzer sounds for as long as the sound timer is above zero.
   unsigned char sound_timer;
 
   /// The system has 16 levels of stack
   /// That allow the program to register the location before jump to a certain
   /// address or call a subroutine
-  unsigned short stack[16];
+  unsigned short stack[STACK_DEPTH];
 
   /// Stack Pointer
-  /// To remember which level of the stack is used.
+  /// To remember which level of the stack is used, 0 (empty) to STACK_DEPTH
+  /// (full).
   unsigned short sp;
 
+  /// Set when an opcode could not run: an opcode the machine does not know,
+  /// a call on a full stack or a return from an empty one. It leaves pc and
+  /// the stack as they were, so the machine stays stopped on it. Whoever
+  /// drives the machine checks it between frames, initialize() clears it.
+  MachineError error;
+
   /// Chip 8 has a HEX based keypad (0x0-0xF), this used to store the state of
   /// the keys
   unsigned char key[16];
 
+  /// The HP-48 "RPL user flags" of SUPER-CHIP, saved and restored by
+  /// FX75/FX85. XO-CHIP has all 16 of them.
+  unsigned char rplFlags[16];
+
+  /// XO-CHIP sound: while the sound timer runs, the 128 bits of the pattern
+  /// loaded by F002 are played in a loop at 4000 * 2^((pitch - 64) / 48)
+  /// bits per second (FX3A). Until a pattern is loaded the usual buzzer
+  /// sounds instead.
+  unsigned char audioPattern[16];
+  unsigned char pitch;
+  bool audioPatternLoaded;
+
+  /// State of the generator behind CXNN (xorshift32, never zero). Part of the
+  /// machine state so that save states and forks replay the same numbers.
+  std::uint32_t rngState;
+
+  /// Restart the random sequence from seed. The constructor seeds from the
+  /// host's entropy source, initialize() leaves the sequence alone.
+  void seedRandom(std::uint32_t seed) {
+    rngState = seed ? seed : 0x9E3779B9u;
+  }
+
+  /// Next number of the random sequence.
+  std::uint32_t nextRandom() {
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 17;
+    rngState ^= rngState << 5;
+    return rngState;
+  }
+
+  /// Drop the cached decoding of every opcode overlapping the bytes
+  /// [address, address + length). The opcode starting one byte before address
+  /// is dropped too since its second byte is being replaced.
+  ///
+  /// Stores done by opcodes take care of this themselves, anything else
+  /// writing to memory directly must call it.
+  void invalidateCode(unsigned short address, unsigned short length);
+
+  /// Decode the opcode at address into the instruction cache now rather
+  /// than the first time it runs, unless it already is (see warmUp).
+  void prefetch(unsigned short address) {
+    if (address < memorySize() && !codeCache[address].valid)
+      predecode(address);
+  }
+
+  /// Drop the whole instruction cache.
+  void flushCodeCache();
+
+  /// Bit N is set when memory in [N * 64, N * 64 + 63] was written since the
+  /// bit was last cleared. Updated by invalidateCode and flushCodeCache for
+  /// consumers caching more than single opcodes, like the Jit, which are also
+  /// the ones clearing it. Only covers the first 4K, the Jit does not compile
+  /// code past it.
+  unsigned long long writtenPages;
+
+  /// Bytes of memory the machine has: 4K, or 64K on XO-CHIP.
+  std::size_t memorySize() const {
+    return machine == Machine::XoChip ? 65536 : 4096;
+  }
+
+  /// Addresses opcodes reach through I wrap around memorySize(), 12 bits on
+  /// 4K machines, and so do BNNN and pc when the next opcode is fetched:
+  /// address & memoryMask() is always in memory. Opcodes check once whether
+  /// the bytes they touch are in memory, and only wrap each address when
+  /// they are not.
+  unsigned memoryMask() const {
+    return static_cast<unsigned>(memorySize() - 1);
+  }
+
+  /// Largest ROM that fits between ROM_START and the end of memory.
+  std::size_t maxRomSize() const { return memorySize() - ROM_START; }
+
+  /// Become another machine: switch to its instruction set, size memory and
+  /// the instruction cache for it and drop the whole cache. Memory both have
+  /// in common is kept. Call initialize() afterwards, before loading a ROM.
+  void setMachine(Machine machine);
+
+  /// Switch to another quirk profile. Every handler exists once per profile
+  /// with its quirks decided at compile time, this only swaps the table and
+  /// interpreter loop in use, so opcodes never test the profile. setMachine
+  /// resets it to defaultQuirks(machine), set it after.
+  void setQuirks(Quirks quirks);
+
   /// Load game into the memory starting from 0x200 (512) to 0xFFF (4095)
-  /// Return false in case of failure in loading the game
+  /// Return false in case of failure in loading the game: the file can not
+  /// be read or is larger than maxRomSize().
   bool loadGame(const std::string &gamePath);
 
+  /// Copy a ROM image already in memory (see RomStore) to 0x200. Returns
+  /// false, leaving the machine alone, if it is larger than maxRomSize().
+  bool loadRom(const unsigned char *data, std::size_t size);
+
   /// Initialize registers and memory once.
   ///
-  /// Clearing the memory and resetting the registers to zero.
+  /// Clearing the memory and resetting the registers to zero. Only the
+  /// memory of the current machine is cleared, see memorySize.
   void initialize();
 
   /// Every cycle, the method emulateCycle is called which emulates one cycle of
   /// the Chip 8 CPU. During this cycle, the emulator will Fetch, Decode and
   /// Execute one opcode.
+  ///
+  /// The core does no pacing and no I/O of its own; whoever drives it (see
+  /// Runner) decides how fast it runs and where frames and sound go.
+  ///
+  /// Decoding is a single lookup in a table built once at startup, the
+  /// handlers receive the opcode fields already extracted (see dispatch.hpp).
   void emulateCycle();
+
+  /// Same as emulateCycle but decoding with nested switches on the opcode
+  /// fields. Slower, kept as the reference the dispatch table is checked and
+  /// benchmarked against. Only knows the classic machine with the COSMAC VIP
+  /// quirks.
+  void emulateCycleSwitch();
+
+  /// Execute count cycles in a row. When built with CHIP8_COMPUTED_GOTO this
+  /// uses a threaded interpreter (GCC/Clang computed goto), otherwise it
+  /// calls emulateCycle count times.
+  void runCycles(unsigned long count);
+
+  /// Decrement the delay and sound timers by one. Must be called 60 times per
+  /// second of emulated time, it is not tied to emulateCycle.
+  void tickTimers();
+
+  /// The buzzer sounds for as long as the sound timer is above zero.
+  bool isBuzzerOn() const { return sound_timer > 0; }
+
+  /// Opcodes the last runCycles call (or Jit::runCycles) executed before
+  /// the last FX18 it ran, SOUND_NOT_SET if it ran none. Lets the Runner
+  /// place the moment the buzzer starts within a frame.
+  unsigned long soundSetAt;
+
+  /// When set, every opcode run by emulateCycle and runCycles is recorded
+  /// there (see trace.hpp). Costs two predicted branches per call when
+  /// unset.
+  TraceRecorder *tracer;
+
+#ifdef CHIP8_PROFILE
+  /// While set, emulateCycle and runCycles hand every cycle to this profiler
+  /// (see profiler.hpp). Every translation unit must agree on the flag, it
+  /// changes the layout of the class.
+  Profiler *profiler;
+#endif
 };
 
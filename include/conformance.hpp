@@ -0,0 +1,170 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "chip8.hpp"
+
+class BatchEngine;
+class Jit;
+
+/// Seed of the random sequence of every machine the conformance checks run,
+/// so CXNN draws the same numbers on all of them and from one run to the
+/// next.
+constexpr std::uint32_t CONFORMANCE_SEED = 0xC8C8;
+
+/// The ways the core can execute opcodes, all of which must agree.
+enum class Engine : unsigned char {
+  /// Chip8::emulateCycleSwitch, the reference for the classic machine with
+  /// the COSMAC VIP quirks, the only one it knows
+  Switch,
+  /// Chip8::emulateCycle through the dispatch table, the reference for
+  /// every other machine and quirk profile
+  Table,
+  /// Chip8::runCycles, the threaded interpreter when built with
+  /// CHIP8_COMPUTED_GOTO
+  Threaded,
+  /// Jit::runCycles, when the host can run it
+  Jit,
+  /// A lane of a BatchEngine, classic machine with the COSMAC VIP quirks only
+  Batch
+};
+
+/// Name of an engine as printed in reports ("switch", "table", ...).
+const char *engineName(Engine engine);
+
+/// Name of the first part of the state that differs between a and b,
+/// nullptr when none does: pc, I, V, the last opcode, the stack, the error,
+/// the timers, memory, the screen and its mode, the SUPER-CHIP flags, the
+/// XO-CHIP audio and the random sequence.
+const char *firstDifference(const Chip8 &a, const Chip8 &b);
+
+/// Whether the machine can run on, so every engine has to agree on what it
+/// does next: false once it stopped on an error. pc and I wrapping around
+/// memory are defined, and compared like the rest, as is the error itself.
+bool inDefinedState(const Chip8 &chip8);
+
+/// How the program of a conformance case is made.
+enum class ProgramKind : unsigned char {
+  /// Opcodes drawn at random among those the machine knows, jumps and
+  /// calls kept inside the program
+  Random,
+  /// Sequences real programs are made of: counted loops, subroutines,
+  /// sprites drawn from data and from the fonts, BCD conversions, register
+  /// dumps, arithmetic on the values where the flags change, scrolls and
+  /// plane switches where the machine has them
+  Structured
+};
+
+/// One generated program with its starting state, everything following
+/// from the seed.
+struct ConformanceCase {
+  std::uint32_t seed = 0;
+  Machine machine = Machine::Classic;
+  Quirks quirks = Quirks::CosmacVip;
+  ProgramKind kind = ProgramKind::Random;
+};
+
+/// Initialize chip8 as the case's machine and quirk profile and fill it
+/// with the case: the program at ROM_START, random sprite data after it,
+/// and random registers, stack, timers, keys, screen, flags and random
+/// sequence. One case in eight starts instead on a few opcodes at the end
+/// of memory, sometimes from its last byte, that run across it into a jump
+/// back to the program.
+void generateCase(const ConformanceCase &test, Chip8 &chip8);
+
+/// First disagreement between an engine and the reference.
+struct Mismatch {
+  Engine engine = Engine::Table;
+  /// As named by firstDifference
+  std::string field;
+  /// Opcodes both had run when the states were compared. The engine ran
+  /// them from step - chunk on in one go, since the recompiler only runs a
+  /// block when it may run all of it.
+  unsigned long step = 0;
+  unsigned long chunk = 1;
+  /// Reference pc and opcode at the start of that chunk
+  unsigned short pc = 0;
+  unsigned short opcode = 0;
+};
+
+/// Runs a program on the reference and on every other engine of its
+/// machine side by side, comparing the whole state after every opcode.
+///
+/// The reference is the switch interpreter for the classic machine with the
+/// COSMAC VIP quirks and the dispatch table for the others. The
+/// interpreters and the batch engine are stepped one opcode at a time. The
+/// batch engine runs the case in several lanes, at both ends of its vectors
+/// and in the middle, each compared; in half of the cases the other lanes
+/// run programs of their own, so that the lanes diverge. The
+/// recompiler is handed chunks of random size instead, one opcode in half
+/// of them, so that it runs whole compiled blocks as well as single opcodes
+/// and interpreter fallbacks; it is compared whenever the reference has
+/// caught up.
+///
+/// The engines are built once and reused for every case, so keep one
+/// checker per thread.
+class ConformanceChecker {
+private:
+  Chip8 start;
+  Chip8 reference;
+  Chip8 table;
+  Chip8 threaded;
+  Chip8 compiled;
+  std::unique_ptr<Jit> jit;
+  Chip8 lane;
+  std::unique_ptr<BatchEngine> batch;
+
+public:
+  ConformanceChecker();
+  ~ConformanceChecker();
+
+  ConformanceChecker(const ConformanceChecker &) = delete;
+  ConformanceChecker &operator=(const ConformanceChecker &) = delete;
+
+  /// Engines compared against the reference for a machine and quirk
+  /// profile.
+  std::vector<Engine> enginesFor(Machine machine, Quirks quirks) const;
+
+  /// Generate the case and run up to steps opcodes of it, stopping early
+  /// once the reference leaves the defined state (see inDefinedState).
+  /// Returns false and fills mismatch at the first disagreement. stepsRun
+  /// tells how far the case went.
+  bool check(const ConformanceCase &test, unsigned long steps,
+             Mismatch &mismatch, unsigned long &stepsRun);
+};
+
+/// The screen a ROM must leave after running for a number of opcodes, as
+/// recorded from the reference or drawn by hand.
+struct ScreenExpectation {
+  /// romContentHash of the ROM
+  std::uint64_t romHash = 0;
+  unsigned long cycles = 0;
+  /// Chip8::screenHash at the end
+  std::uint64_t screenHash = 0;
+  bool hasMachine = false;
+  Machine machine = Machine::Classic;
+  bool hasQuirks = false;
+  Quirks quirks = Quirks::CosmacVip;
+};
+
+/// Read a list of expectations, one per line: "<rom hash> <cycles> <screen
+/// hash> [machine [quirks]]", hashes in hex as chip8_roms prints them,
+/// lines starting with '#' ignored. The screen hash can be "@<file>"
+/// instead, a picture named relative to the list: one line per row of the
+/// screen, 64 x 32 or 128 x 64, '#' for a lit pixel and '.' for a dark one.
+/// Returns false if the file or a picture can not be read or a line is not
+/// one.
+bool loadExpectations(const std::string &path,
+                      std::vector<ScreenExpectation> &expectations);
+
+/// Run a ROM image on one engine for cycles opcodes from a fresh machine:
+/// CONFORMANCE_SEED as the random seed, no key pressed, the timers ticking
+/// every instructionsPerFrame(IPS_NORMAL) opcodes. Returns the screen hash
+/// at the end, or 0 if the ROM does not fit or the engine can not run the
+/// machine.
+std::uint64_t runScreenHash(Engine engine, const unsigned char *data,
+                            std::size_t size, unsigned long cycles,
+                            Machine machine, Quirks quirks);
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "chip8.hpp"
+
+/// What a conditional breakpoint compares: V0 to VF, I, the timers or the
+/// stack pointer.
+enum class DebugRegister : unsigned char { V, I, DelayTimer, SoundTimer, Sp };
+
+/// Condition of a breakpoint: "<register> <comparison> <value>", like
+/// "V3 == 5" or "I >= 0x300".
+struct DebugCondition {
+  DebugRegister reg = DebugRegister::V;
+  /// Which V register, when reg is DebugRegister::V
+  unsigned char index = 0;
+  /// One of "==", "!=", "<", "<=", ">", ">="
+  std::string comparison;
+  unsigned value = 0;
+
+  bool holds(const Chip8 &chip8) const;
+  std::string text() const;
+};
+
+/// Parse a condition as given by DebugCondition::text, registers and
+/// numbers as for parseRegister and parseAddress. Returns false if it is
+/// not one.
+bool parseCondition(const std::string &text, DebugCondition &condition);
+
+/// Parse a register name: "V0" to "VF", "I", "DT", "ST" or "SP", in any
+/// case. Returns false if it is none.
+bool parseRegister(const std::string &name, DebugRegister &reg,
+                   unsigned char &index);
+
+/// Parse an address or value: hexadecimal with a "0x" prefix, as the
+/// disassembly prints them, decimal otherwise. Returns false if it is not a
+/// number up to 0xFFFF.
+bool parseAddress(const std::string &text, unsigned &value);
+
+/// Why Debugger::run came back.
+enum class DebugStop : unsigned char {
+  /// Ran as many opcodes as it was asked to
+  Limit,
+  /// pc reached a breakpoint whose condition holds, before running it
+  Breakpoint,
+  /// The last opcode read or wrote watched memory, or changed a watched
+  /// register
+  Watchpoint,
+  /// A step, step over or step out completed
+  Step,
+  /// The machine stopped on an error, an unknown opcode or a stack one,
+  /// see Chip8::error
+  Error
+};
+
+/// Breakpoints, watchpoints and stepping for a Chip8, driving it one frame
+/// of instructionsPerFrame opcodes at a time like a Runner, the timers
+/// ticking between frames.
+///
+/// Breakpoints and memory watchpoints are bitmaps with one bit per address,
+/// so checking an opcode costs a bit test whatever is set, and conditions
+/// are only looked up for the addresses whose bit is set. Register
+/// watchpoints compare the registers watched after every opcode. When
+/// nothing is set and no step is under way, run() hands whole frames to
+/// Chip8::runCycles, which runs at full speed with no check at all.
+class Debugger {
+private:
+  Chip8 &chip8;
+
+  std::vector<std::uint64_t> breakBits;
+  std::vector<std::uint64_t> readBits;
+  std::vector<std::uint64_t> writeBits;
+  std::map<unsigned, DebugCondition> conditions;
+  unsigned breakCount;
+  unsigned watchCount;
+  /// Bit n for Vn, bit 16 for I
+  std::uint32_t registerWatch;
+
+  /// Stepping over a call: stop once back at returnPc with returnSp
+  /// frames. Stepping out: stop once a return leaves fewer than outSp.
+  bool stepping;
+  int returnPc;
+  int returnSp;
+  int outSp;
+
+  /// Opcodes left in the current frame before the timers tick
+  unsigned long frameLeft;
+
+  static bool test(const std::vector<std::uint64_t> &bits, unsigned address) {
+    return bits[address >> 6] >> (address & 63) & 1;
+  }
+  static void set(std::vector<std::uint64_t> &bits, unsigned address,
+                  bool value);
+
+  /// One opcode with every check, returns whether to stop after it
+  bool checkedCycle(bool &watchHit);
+
+  /// The opcode pc points at, as emulateCycle will fetch it
+  unsigned short opcodeAtPc() const;
+
+  /// Memory [first, first + length) the opcode at pc reads and writes
+  void accesses(unsigned &first, unsigned &length, bool &writes) const;
+
+  /// Count opcodes into frames, ticking the timers at their end
+  void advance(unsigned long count);
+
+public:
+  explicit Debugger(Chip8 &chip8, unsigned long instructionsPerFrame);
+
+  /// Opcodes per frame, before the timers tick once
+  unsigned long instructionsPerFrame;
+
+  /// Opcodes and whole frames run through the debugger.
+  unsigned long long cycles;
+  unsigned long long frames;
+
+  /// What the last stop on a watchpoint was about: the memory accessed
+  /// (watchLength 0 when a register changed) and whether it was written,
+  /// or the register changed, 16 for I, and its value before.
+  unsigned watchAddress;
+  unsigned watchLength;
+  bool watchWrite;
+  int watchRegister;
+  unsigned watchOldValue;
+
+  /// Stop before running the opcode at address, when condition holds if
+  /// given. Replaces any breakpoint already there.
+  void addBreakpoint(unsigned address, const DebugCondition *condition);
+  bool removeBreakpoint(unsigned address);
+
+  /// Stop after an opcode reads (read) or writes (write) memory in
+  /// [first, last].
+  void watchMemory(unsigned first, unsigned last, bool read, bool write);
+  void unwatchMemory(unsigned first, unsigned last);
+
+  /// Stop after an opcode changes Vindex, or I when reg is DebugRegister::I.
+  /// Other registers can not be watched.
+  bool watchRegisterChange(DebugRegister reg, unsigned char index,
+                           bool watch);
+
+  /// Drop every breakpoint and watchpoint.
+  void clear();
+
+  /// Breakpoints set, with their condition if any.
+  std::vector<std::pair<unsigned, const DebugCondition *>>
+  breakpoints() const;
+
+  /// Watched memory as "first-last" ranges followed by r and w for how,
+  /// then the registers watched.
+  std::vector<std::string> watchpoints() const;
+
+  /// Run up to count opcodes, stopping early at a breakpoint or
+  /// watchpoint. A breakpoint at pc on entry is not hit again: resuming
+  /// from it runs its opcode first.
+  DebugStop run(unsigned long long count);
+
+  /// Run one opcode.
+  DebugStop step();
+
+  /// Run one opcode, or a whole subroutine when it is a call (2NNN), up to
+  /// count opcodes, breakpoints and watchpoints still stopping it.
+  DebugStop stepOver(unsigned long long count);
+
+  /// Run until the current subroutine returns, up to count opcodes,
+  /// breakpoints and watchpoints still stopping it. Outside of any
+  /// subroutine (sp 0) this runs like run().
+  DebugStop stepOut(unsigned long long count);
+};
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <string>
+
+#include "dispatch.hpp"
+
+/// Text form of one opcode in the usual CHIP-8 assembly syntax ("LD V3,
+/// 0x2A", "DRW V0, V1, 5", "CALL 0x2F6"), "DW 0x1234" for opcodes that are
+/// not instructions of machine. The extensions use the SUPER-CHIP and Octo
+/// names ("SCD 4", "HIGH", "PLANE 3"); the address loaded by the four byte
+/// F000 NNNN is in the following opcode, which is shown as "LD I, LONG".
+std::string disassemble(unsigned short opcode,
+                        Machine machine = Machine::Classic);
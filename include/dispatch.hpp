@@ -0,0 +1,225 @@
+#pragma once
+
+class Chip8;
+
+/// The machines the core can be, each with its own instruction set (see
+/// Chip8::setMachine).
+enum class Machine : unsigned char {
+  /// The original COSMAC VIP interpreter: 64x32, 4K of memory
+  Classic,
+  /// SUPER-CHIP 1.1: adds a 128x64 mode, scrolling, 16x16 sprites, a big
+  /// font and the RPL flags
+  SuperChip,
+  /// XO-CHIP: SUPER-CHIP plus 64K of memory, two bit planes and sampled
+  /// audio patterns
+  XoChip
+};
+
+/// Quirk profiles: how the opcodes the CHIP-8 variants disagree on behave.
+/// Each machine has a default one (see defaultQuirks), any of them can be
+/// used with any machine (see Chip8::setQuirks).
+enum class Quirks : unsigned char {
+  /// The original interpreter: 8XY1/8XY2/8XY3 reset VF, 8XY6/8XYE shift VY
+  /// into VX, FX55/FX65 leave I past the last register, BNNN adds V0
+  CosmacVip,
+  /// The HP-48 interpreter: no VF reset, shifts in place, FX55/FX65 leave I
+  /// on the last register, BXNN adds VX
+  Chip48,
+  /// SUPER-CHIP 1.1: like CHIP-48, but FX55/FX65 leave I alone
+  SuperChip,
+  /// XO-CHIP (Octo): like COSMAC VIP, without the VF reset
+  XoChip
+};
+
+/// Number of quirk profiles.
+constexpr int QUIRKS_COUNT = 4;
+
+/// The behaviours a quirk profile selects.
+struct QuirkSet {
+  /// 8XY1, 8XY2 and 8XY3 set VF to 0
+  bool vfReset;
+  /// 8XY6 and 8XYE shift VY into VX, rather than VX in place
+  bool shiftVy;
+  /// What FX55 and FX65 add to I: X + 1, X or nothing
+  int memoryIncrement;
+  /// BNNN jumps to NNN + VX, X being the top digit of NNN, rather than V0
+  bool jumpVx;
+};
+
+/// The behaviours of a profile. A constant expression, so handlers
+/// specialized on a profile test them at compile time.
+constexpr QuirkSet quirkSet(Quirks quirks) {
+  return quirks == Quirks::CosmacVip   ? QuirkSet{true, true, 2, false}
+         : quirks == Quirks::Chip48    ? QuirkSet{false, false, 1, true}
+         : quirks == Quirks::SuperChip ? QuirkSet{false, false, 0, true}
+                                       : QuirkSet{false, true, 2, false};
+}
+
+/// Every opcode the interpreter knows about. The decode table maps all 64K
+/// possible opcodes to one of these once, so the hot path never has to look
+/// at sub-fields to find out what to do.
+enum class Op : unsigned char {
+  Cls,        // 00E0
+  Ret,        // 00EE
+  Jump,       // 1NNN
+  Call,       // 2NNN
+  SkipEqNN,   // 3XNN
+  SkipNeNN,   // 4XNN
+  SkipEqReg,  // 5XY0
+  SetNN,      // 6XNN
+  AddNN,      // 7XNN
+  SetReg,     // 8XY0
+  Or,         // 8XY1
+  And,        // 8XY2
+  Xor,        // 8XY3
+  AddReg,     // 8XY4
+  SubReg,     // 8XY5
+  ShiftRight, // 8XY6
+  SubnReg,    // 8XY7
+  ShiftLeft,  // 8XYE
+  SkipNeReg,  // 9XY0
+  SetI,       // ANNN
+  JumpV0,     // BNNN
+  Random,     // CXNN
+  Draw,       // DXYN
+  SkipKey,    // EX9E
+  SkipNoKey,  // EXA1
+  GetDelay,   // FX07
+  WaitKey,    // FX0A
+  SetDelay,   // FX15
+  SetSound,   // FX18
+  AddI,       // FX1E
+  FontChar,   // FX29
+  Bcd,        // FX33
+  Store,      // FX55
+  Load,       // FX65
+  // SUPER-CHIP
+  ScrollDown,  // 00CN
+  ScrollRight, // 00FB
+  ScrollLeft,  // 00FC
+  Exit,        // 00FD
+  LowRes,      // 00FE
+  HighRes,     // 00FF
+  DrawExt,     // DXYN on SUPER-CHIP and XO-CHIP, DXY0 drawing 16x16
+  BigFontChar, // FX30
+  SaveFlags,   // FX75
+  LoadFlags,   // FX85
+  // XO-CHIP
+  ScrollUp,   // 00DN
+  StoreRange, // 5XY2
+  LoadRange,  // 5XY3
+  SetILong,   // F000 NNNN
+  Plane,      // FN01
+  Audio,      // F002
+  Pitch,      // FX3A
+  Unknown,
+  Count
+};
+
+/// All ops in the order of the Op enum, used to generate per-op tables (the
+/// handlers, names and labels) so they can not get out of sync with it.
+#define FOR_EACH_OP(X)                                                         \
+  X(Cls)                                                                       \
+  X(Ret)                                                                       \
+  X(Jump)                                                                      \
+  X(Call)                                                                      \
+  X(SkipEqNN)                                                                  \
+  X(SkipNeNN)                                                                  \
+  X(SkipEqReg)                                                                 \
+  X(SetNN)                                                                     \
+  X(AddNN)                                                                     \
+  X(SetReg)                                                                    \
+  X(Or)                                                                        \
+  X(And)                                                                       \
+  X(Xor)                                                                       \
+  X(AddReg)                                                                    \
+  X(SubReg)                                                                    \
+  X(ShiftRight)                                                                \
+  X(SubnReg)                                                                   \
+  X(ShiftLeft)                                                                 \
+  X(SkipNeReg)                                                                 \
+  X(SetI)                                                                      \
+  X(JumpV0)                                                                    \
+  X(Random)                                                                    \
+  X(Draw)                                                                      \
+  X(SkipKey)                                                                   \
+  X(SkipNoKey)                                                                 \
+  X(GetDelay)                                                                  \
+  X(WaitKey)                                                                   \
+  X(SetDelay)                                                                  \
+  X(SetSound)                                                                  \
+  X(AddI)                                                                      \
+  X(FontChar)                                                                  \
+  X(Bcd)                                                                       \
+  X(Store)                                                                     \
+  X(Load)                                                                      \
+  X(ScrollDown)                                                                \
+  X(ScrollRight)                                                               \
+  X(ScrollLeft)                                                                \
+  X(Exit)                                                                      \
+  X(LowRes)                                                                    \
+  X(HighRes)                                                                   \
+  X(DrawExt)                                                                   \
+  X(BigFontChar)                                                               \
+  X(SaveFlags)                                                                 \
+  X(LoadFlags)                                                                 \
+  X(ScrollUp)                                                                  \
+  X(StoreRange)                                                                \
+  X(LoadRange)                                                                 \
+  X(SetILong)                                                                  \
+  X(Plane)                                                                     \
+  X(Audio)                                                                     \
+  X(Pitch)                                                                     \
+  X(Unknown)
+
+/// Number of entries in Op, handy to size per-op arrays.
+constexpr int OP_COUNT = static_cast<int>(Op::Count);
+
+/// The fields of an opcode, extracted once so handlers do not have to.
+///
+/// 0xANNN, 0xAXNN, 0xAXYN
+struct Operands {
+  unsigned short nnn;
+  unsigned char x;
+  unsigned char y;
+  unsigned char n;
+  unsigned char nn;
+};
+
+inline Operands decodeOperands(unsigned short opcode) {
+  Operands operands;
+  operands.nnn = opcode & 0x0FFF;
+  operands.x = (opcode & 0x0F00) >> 8;
+  operands.y = (opcode & 0x00F0) >> 4;
+  operands.n = opcode & 0x000F;
+  operands.nn = opcode & 0x00FF;
+  return operands;
+}
+
+/// An opcode decoded once and kept in the instruction cache, so executing it
+/// again only costs a load: the Op selects the handler, the operands are
+/// passed to it as they are.
+struct DecodedOp {
+  Operands operands;
+  unsigned short opcode;
+  Op op;
+  /// False until the entry is filled and again after its bytes were written.
+  bool valid;
+};
+
+/// Classify one opcode for a machine. This is the slow path used to build
+/// the tables.
+Op decodeOp(unsigned short opcode, Machine machine = Machine::Classic);
+
+/// Table of 65536 entries mapping every opcode to its Op on a machine, built
+/// on the first call and shared by all instances afterwards.
+const Op *opTable(Machine machine = Machine::Classic);
+
+/// Short mnemonic of an Op, for reports.
+const char *opName(Op op);
+
+/// Handler executing one decoded opcode on a machine.
+using OpHandler = void (*)(Chip8 &, const Operands &);
+
+/// Handlers indexed by Op, specialized for a quirk profile.
+const OpHandler *opHandlers(Quirks quirks);
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "frontend.hpp"
+#include "scheduler.hpp"
+#include "spsc_queue.hpp"
+#include "triple_buffer.hpp"
+
+class AudioMixer;
+class Runner;
+
+/// A key of the keypad pressed or released, stamped with the number of
+/// opcodes the runner had executed when it happened.
+struct KeyEvent {
+  std::uint64_t cycle;
+  std::uint8_t key;
+  bool pressed;
+};
+
+/// The screen as a frame ended, as published by an EmulationThread.
+struct ScreenFrame {
+  /// Same layout as Chip8::gfx
+  std::uint64_t gfx[PLANE_COUNT][SCREEN_HEIGHT_MAX][2];
+  bool hires;
+  /// Frames run before this one was published
+  std::uint64_t frame;
+};
+
+/// Runs a Runner on a thread of its own, paced at 60 Hz by a FrameScheduler,
+/// so that a UI thread only presents frames and forwards input and nothing
+/// it does (window events, a slow swap, console output) delays emulation.
+///
+/// The thread is the frontend of the runner. Frames are published through a
+/// lock-free triple buffer, the UI takes the latest one whenever it is ready
+/// to draw. Keys come the other way through a lock-free single producer,
+/// single consumer queue and are applied when the runner next polls the
+/// keypad, at the start of the following frame, so input lags by a frame at
+/// most. A key pressed and released within one frame is held for that frame
+/// rather than missed. Everything else that touches the machine (loading a
+/// state, ...) is posted as a task run between two frames.
+///
+/// With setAudioPacing, frames are paced by the sound card instead: the next
+/// one runs once the audio backend has played the mixer down to its target
+/// fill, so the picture follows the audio clock and the sound never drifts
+/// out of sync. The FrameScheduler takes over again if the backend stalls.
+class EmulationThread : public Frontend {
+private:
+  std::thread thread;
+  std::atomic<bool> stopping;
+  FrameScheduler scheduler;
+
+  SpscQueue<KeyEvent> keys;
+  unsigned char keypad[16];
+
+  TripleBuffer<ScreenFrame> frames;
+  std::uint64_t framesRun;
+
+  std::atomic<bool> buzzer;
+  std::atomic<std::uint64_t> cyclesRun;
+
+  std::mutex tasksMutex;
+  std::vector<std::function<void()>> tasks;
+
+  const AudioMixer *pacer;
+
+  void loop(Runner &runner, const std::function<void()> &frame);
+  void runTasks();
+  void waitForAudio();
+
+public:
+  /// Room for this many key events between two frames, more are dropped.
+  static constexpr std::size_t KEY_QUEUE_SIZE = 256;
+
+  EmulationThread();
+
+  /// Stops the thread if still running.
+  ~EmulationThread();
+
+  EmulationThread(const EmulationThread &) = delete;
+  EmulationThread &operator=(const EmulationThread &) = delete;
+
+  /// Start running frames of runner, which must have this (or a frontend
+  /// passing everything through to it) as its frontend. frame runs one
+  /// frame, runner.runFrame() if empty; a custom one may run something else
+  /// instead, like a step back in time.
+  void start(Runner &runner, std::function<void()> frame = nullptr);
+
+  /// Finish the current frame and stop. Safe to call more than once.
+  void stop();
+
+  /// Longest wait for the audio backend before pacing falls back to the
+  /// clock for good.
+  static constexpr std::chrono::milliseconds AUDIO_STALL{100};
+
+  /// Pace frames by how fast mixer is played (see AudioBackend::realTime)
+  /// rather than by the clock, nullptr to go back to the clock. Call before
+  /// start().
+  void setAudioPacing(const AudioMixer *mixer) { pacer = mixer; }
+
+  /// UI side. Run task on the emulation thread between two frames.
+  void post(std::function<void()> task);
+
+  /// UI side. Press or release key 0x0-0xF. Returns false when too many
+  /// events are pending and this one was dropped.
+  bool pressKey(std::uint8_t key, bool pressed);
+
+  /// UI side. The latest frame if one was published since the last call,
+  /// nullptr otherwise. Valid until the next call.
+  const ScreenFrame *takeFrame() {
+    return frames.update() ? &frames.read() : nullptr;
+  }
+
+  /// Either side. State of the buzzer as of the last frame.
+  bool buzzerOn() const { return buzzer.load(std::memory_order_relaxed); }
+
+  /// Either side. Opcodes executed by the runner as of the last frame.
+  std::uint64_t cycles() const {
+    return cyclesRun.load(std::memory_order_relaxed);
+  }
+
+  // Frontend, called by the runner on the emulation thread
+  void drawFrame(const Chip8 &chip8, std::uint64_t changedRows) override;
+  void setBuzzer(bool on) override;
+  void pollInput(unsigned char key[16]) override;
+  bool quitRequested() override {
+    return stopping.load(std::memory_order_relaxed);
+  }
+};
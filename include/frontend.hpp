@@ -0,0 +1,37 @@
+#pragma once
+
+#include "chip8.hpp"
+
+/// A frontend owns everything the Chip 8 core talks to outside of itself:
+/// the screen, the buzzer and the keypad. The core never calls into a
+/// frontend directly, a Runner sits in between and only calls it when
+/// something actually changed.
+class Frontend {
+public:
+  virtual ~Frontend() = default;
+
+  /// Present the current contents of the Chip 8 screen, chip8.width() by
+  /// chip8.height() pixels. Bit y of changedRows is set for every row that
+  /// differs from the previous call, frames where nothing changed are not
+  /// presented at all. The first call, and the first after a change of
+  /// resolution, have every bit set.
+  virtual void drawFrame(const Chip8 &chip8, std::uint64_t changedRows) = 0;
+
+  /// The buzzer has been switched on or off.
+  virtual void setBuzzer(bool on) = 0;
+
+  /// Copy the current keypad state (1 pressed, 0 released) into key.
+  virtual void pollInput(unsigned char key[16]) = 0;
+
+  /// Return true once the user asked to stop the emulation.
+  virtual bool quitRequested() { return false; }
+};
+
+/// Frontend that discards all output and never presses a key. Used for
+/// headless and batch runs where only the machine state matters.
+class NullFrontend : public Frontend {
+public:
+  void drawFrame(const Chip8 &, std::uint64_t) override {}
+  void setBuzzer(bool) override {}
+  void pollInput(unsigned char *) override {}
+};
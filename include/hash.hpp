@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/// FNV-1a offset basis, the hash of no bytes.
+constexpr std::uint64_t FNV1A64_BASIS = 0xcbf29ce484222325ULL;
+
+/// 64-bit FNV-1a of size bytes, continuing from hash so that several buffers
+/// can be hashed as one. Not cryptographic, meant to compare machine states
+/// and screens between runs.
+inline std::uint64_t fnv1a64(const void *data, std::size_t size,
+                             std::uint64_t hash = FNV1A64_BASIS) {
+  const unsigned char *bytes = static_cast<const unsigned char *>(data);
+  for (std::size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <vector>
+
+#include "chip8.hpp"
+
+/// Dynamic recompiler translating CHIP-8 basic blocks into x86-64 code.
+///
+/// A block is a run of straight-line opcodes (ALU, ANNN, FX1E, FX29, FX07,
+/// FX15) ended by a 1NNN jump or a skip, which are compiled too, or by any
+/// opcode the recompiler does not handle (calls, returns, DXYN, FX0A, FX18,
+/// memory stores and loads, ...). Those are left to the interpreter: the
+/// block exits with pc pointing at them and Jit::runCycles executes them
+/// with Chip8::emulateCycle before entering the next block.
+///
+/// While a block runs, I and pc live in host registers and the remaining cycle
+/// budget in a third one. The V registers stay in the Chip8 object, addressed
+/// off a base register, so that aliasing VF with VX/VY behaves exactly like the
+/// interpreter. Blocks are chained: an exit whose target block exists jumps
+/// straight into it, each block checking the budget on entry, so tight loops
+/// never come back to C++ until the budget runs out.
+///
+/// Only the first 4K of memory is compiled, and XO-CHIP skips are left to the
+/// interpreter since they may jump over a four byte opcode. Changing the
+/// machine flushes the code cache like a write to every page.
+///
+/// Any write to memory through Chip8::invalidateCode marks the written pages;
+/// if one of them holds compiled code the whole code cache is flushed, which
+/// also drops all the links between blocks.
+///
+/// On hosts other than x86-64, or when executable memory can not be mapped,
+/// available() is false and runCycles only uses the interpreter.
+class Jit {
+private:
+  Chip8 &chip8;
+
+  /// Executable buffer: the entry trampoline and exit stub first, then the
+  /// blocks, allocated linearly until the buffer is full
+  unsigned char *code;
+  unsigned long codeSize;
+  unsigned long codeUsed;
+  unsigned long exitStub;
+  unsigned long blocksStart;
+
+  /// Native entry point of the block starting at each address, nullptr if
+  /// not compiled yet, a marker if its first opcode is not handled
+  std::vector<unsigned char *> blocks;
+
+  /// Offsets of rel32 jumps waiting for the block at each address
+  std::vector<std::vector<unsigned long>> pendingLinks;
+
+  /// 64 byte pages of Chip 8 memory holding compiled code, same layout as
+  /// Chip8::writtenPages
+  unsigned long long compiledPages;
+
+  /// Byte offsets of the Chip8 fields from V[0], the block base register
+  int offsetI;
+  int offsetPc;
+  int offsetOpcode;
+  int offsetDelayTimer;
+
+  void emitRuntime();
+  unsigned char *compile(unsigned short address);
+  void flush();
+
+public:
+  explicit Jit(Chip8 &chip8);
+  ~Jit();
+
+  Jit(const Jit &) = delete;
+  Jit &operator=(const Jit &) = delete;
+
+  /// Opcodes executed by compiled blocks
+  unsigned long long nativeCycles;
+
+  /// Opcodes executed by the interpreter because no block could run them
+  unsigned long long interpretedCycles;
+
+  unsigned long long blocksCompiled;
+  unsigned long long flushes;
+
+  /// True if native code can be generated and run on this host.
+  bool available() const { return code != nullptr; }
+
+  /// Compile the block starting at address now rather than when pc first
+  /// gets there, if it is not compiled yet (see warmUp).
+  void precompile(unsigned short address);
+
+  /// Execute exactly count opcodes, like Chip8::runCycles.
+  void runCycles(unsigned long count);
+};
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "chip8.hpp"
+#include "frontend.hpp"
+
+/// Version written in the header of every movie file.
+constexpr std::uint16_t MOVIE_VERSION = 3;
+
+/// Everything needed to replay a session exactly: the machine and the ROM it
+/// ran, the seed of the random generator, the speed, and every change of the
+/// keypad. The keypad is only read at the start of a frame (see
+/// Runner::runFrame), so a change is tied to a frame, and through the speed
+/// to an instruction count.
+///
+/// Hashes of the whole machine state (see stateHash) are stored every
+/// hashInterval frames, so a replay that goes wrong is caught at the first
+/// frame that differs rather than at the end.
+struct Movie {
+  struct KeyChange {
+    /// Frame whose input this is, counted from 0
+    std::uint32_t frame;
+    /// Instructions executed before that frame
+    std::uint64_t cycle;
+    /// Keypad from then on, bit k set while key k is pressed
+    std::uint16_t keys;
+  };
+
+  /// Hash of the program area right after the ROM was loaded, see romHash
+  std::uint64_t romHash = 0;
+  Machine machine = Machine::Classic;
+  Quirks quirks = Quirks::CosmacVip;
+  std::uint32_t seed = 0;
+  std::uint32_t instructionsPerFrame = 0;
+  std::uint32_t hashInterval = 1;
+
+  /// Length of the movie in frames, and hash of the state at the end
+  std::uint32_t frames = 0;
+  std::uint64_t finalHash = 0;
+
+  std::vector<KeyChange> keyChanges;
+
+  /// stateHashes[i] is the state hash after (i + 1) * hashInterval frames
+  std::vector<std::uint64_t> stateHashes;
+
+  /// Write the movie to a file ("C8MV", version, machine and quirks (u8
+  /// each), then the other fields above, all little endian).
+  bool save(const std::string &path) const;
+
+  /// Read a movie written by save. Returns false if the file is not a movie
+  /// of this version or is truncated.
+  bool load(const std::string &path);
+};
+
+/// Hash identifying the loaded program: memory of the machine from 0x200 up,
+/// right after initialize() and loadGame().
+std::uint64_t romHash(const Chip8 &chip8);
+
+/// Frontend recording the session into a movie while passing everything
+/// through to the frontend the player sees. The machine must have just been
+/// initialized, loaded and seeded with movie.seed when recording starts.
+class MovieRecorder : public Frontend {
+private:
+  const Chip8 &chip8;
+  Frontend &output;
+  Movie &movie;
+  std::uint16_t lastKeys;
+
+public:
+  MovieRecorder(const Chip8 &chip8, Frontend &output, Movie &movie);
+
+  void drawFrame(const Chip8 &chip8, std::uint64_t changedRows) override;
+  void setBuzzer(bool on) override;
+  void pollInput(unsigned char key[16]) override;
+  bool quitRequested() override;
+
+  /// Close the movie at the current frame, filling in its length and final
+  /// hash.
+  void finish();
+};
+
+/// Frontend feeding a movie back to the machine and checking its state
+/// against the hashes recorded. Quits once the movie is over.
+class MoviePlayer : public Frontend {
+private:
+  const Chip8 &chip8;
+  const Movie &movie;
+  std::size_t nextChange;
+  std::uint16_t keys;
+
+public:
+  MoviePlayer(const Chip8 &chip8, const Movie &movie);
+
+  /// Frames fed so far.
+  std::uint32_t frame;
+
+  /// First frame after which the state differed from the recording, valid
+  /// when diverged is set. With a hashInterval above 1 the divergence
+  /// happened within the hashInterval frames before it.
+  bool diverged;
+  std::uint32_t divergedFrame;
+
+  void drawFrame(const Chip8 &, std::uint64_t) override {}
+  void setBuzzer(bool) override {}
+  void pollInput(unsigned char key[16]) override;
+  bool quitRequested() override;
+
+  /// Check the final state, once every frame was played.
+  void finish();
+};
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+#include "dispatch.hpp"
+
+class Chip8;
+
+/// Counts where a ROM spends its instructions, and where the interpreter
+/// spends its time running them.
+///
+/// Only available when built with CHIP8_PROFILE: Chip8 then gains a profiler
+/// pointer, and while it is set every cycle of emulateCycle and runCycles
+/// goes through cycle() below instead of the regular dispatch. Without the
+/// flag the core has no trace of it.
+///
+/// Counted for every cycle: the Op, the address it ran from and the
+/// subroutine it ran in. Subroutines are tracked as a tree of call contexts,
+/// a 2NNN entering a child of the current one and a 00EE going back to its
+/// parent, so the same subroutine called from two places is two contexts.
+///
+/// Timed every sampleInterval cycles only: the host nanoseconds spent
+/// fetching the opcode (cache lookup, decoding on a miss) and running its
+/// handler. Reading the clock costs about as much as a handler, timing every
+/// cycle would mostly measure the clock; its cost is measured once and taken
+/// off every sample.
+class Profiler {
+private:
+  struct Context {
+    /// Address of the subroutine, 0x200 for the root
+    std::uint16_t address;
+    std::uint32_t parent;
+    /// Instructions executed in this context, excluding its callees
+    std::uint64_t self;
+    std::uint64_t calls;
+  };
+
+  unsigned sampleInterval;
+  unsigned untilSample;
+
+  /// Nanoseconds between two back to back clock reads, taken off every
+  /// sample
+  std::uint64_t clockOverhead;
+
+  std::uint64_t opCounts[OP_COUNT];
+  std::uint64_t opSamples[OP_COUNT];
+  std::uint64_t opNanos[OP_COUNT];
+  std::uint64_t fetchSamples;
+  std::uint64_t fetchNanos;
+
+  /// Cycles run from each address, one slot per byte of the largest memory
+  /// (XO-CHIP's 64K), so that no two addresses share one
+  std::vector<std::uint64_t> pcCounts;
+  /// Op last executed at each address, for the report
+  std::vector<Op> pcOps;
+
+  std::vector<Context> contexts;
+  /// (parent << 12 | address) to the index of the child context
+  std::unordered_map<std::uint64_t, std::uint32_t> children;
+  std::uint32_t current;
+  std::size_t depth;
+
+  void enter(std::uint16_t address);
+  void leave();
+
+  /// Name of a context in folded stacks, "main" or "sub_2A4"
+  static void writeFrame(std::ostream &out, std::uint16_t address);
+  void writeStack(std::ostream &out, std::uint32_t context) const;
+
+public:
+  /// Contexts deeper than this are counted in their parent, a ROM calling
+  /// without ever returning would otherwise grow the tree forever.
+  static constexpr std::size_t MAX_DEPTH = 64;
+
+  /// Time one cycle out of sampleInterval (at least 1).
+  explicit Profiler(unsigned sampleInterval = 64);
+
+  /// Fetch, execute and account for one cycle of chip8. Behaves exactly
+  /// like emulateCycle otherwise.
+  void cycle(Chip8 &chip8);
+
+  /// Forget everything counted so far.
+  void reset();
+
+  /// Cycles counted since the last reset.
+  std::uint64_t cycles() const;
+
+  /// Readable report: the Ops by count with their estimated host time, the
+  /// top hottest addresses and subroutines.
+  void writeReport(std::ostream &out, std::size_t top = 20) const;
+
+  /// Guest profile in the folded stack format of flamegraph.pl and
+  /// speedscope: one line per call context, "main;sub_2A4;sub_31C 1234",
+  /// weighted by the instructions it executed itself.
+  void writeGuestFolded(std::ostream &out) const;
+
+  /// Host profile in the same format, "emulateCycle;fetch" and
+  /// "emulateCycle;<Op>", weighted by estimated nanoseconds (the average of
+  /// the samples times the count).
+  void writeHostFolded(std::ostream &out) const;
+};
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "dispatch.hpp"
+
+/// Version written in the header of ROM archives.
+constexpr std::uint16_t ROM_ARCHIVE_VERSION = 1;
+
+/// One ROM image held by a RomStore. data points into memory mapped from
+/// the file or archive, read only and shared by everyone loading it.
+struct Rom {
+  /// Path it was added from, or its name in the archive it came from
+  std::string name;
+  /// FNV-1a of the image, see romContentHash
+  std::uint64_t hash;
+  const unsigned char *data;
+  std::size_t size;
+};
+
+/// How a ROM should be run, looked up by the hash of its image. Fields left
+/// at 0 (or unset) are up to the caller.
+struct RomProfile {
+  /// Instructions per second
+  unsigned long ips = 0;
+  /// Machine the ROM was written for, when hasMachine is set
+  bool hasMachine = false;
+  Machine machine = Machine::Classic;
+  /// Quirk profile the ROM expects, when hasQuirks is set
+  bool hasQuirks = false;
+  Quirks quirks = Quirks::CosmacVip;
+};
+
+/// Hash a RomStore indexes ROMs by: FNV-1a of the bytes of the image. Unlike
+/// romHash (movie.hpp) it does not need a machine, nor depend on what
+/// follows the ROM in memory.
+std::uint64_t romContentHash(const unsigned char *data, std::size_t size);
+
+/// Library of ROMs mapped in memory once and indexed by content hash, so
+/// that batch runs loading the same ROMs thousands of times copy them from
+/// memory (Chip8::loadRom, a single bounded memcpy) instead of opening and
+/// reading files.
+///
+/// ROMs come from files, directories (every ROM file in them, each file
+/// mapped on its own) or archives written by writeArchive (a single mapping
+/// for the whole set). Identical images are stored once, under every name
+/// they were added with. Nothing is copied, and the images and Rom pointers
+/// stay valid until the store is destroyed or, for the Rom pointers, more
+/// ROMs are added: fill it first, then any number of threads can read it.
+class RomStore {
+private:
+  struct Mapping {
+    void *address;
+    std::size_t size;
+  };
+  std::vector<Mapping> mappings;
+
+  std::vector<Rom> roms;
+  std::unordered_map<std::uint64_t, std::size_t> byHash;
+  std::unordered_map<std::string, std::size_t> byName;
+  std::unordered_map<std::uint64_t, RomProfile> profiles;
+
+  /// Map a whole file read only, nullptr if it can not be or is empty
+  const unsigned char *mapFile(const std::string &path, std::size_t &size);
+  void unmapLast();
+  /// Index an image under name, unless that name is taken
+  void add(const std::string &name, std::uint64_t hash,
+           const unsigned char *data, std::size_t size);
+
+public:
+  RomStore() = default;
+
+  /// Unmaps everything, invalidating the Rom pointers handed out.
+  ~RomStore();
+
+  RomStore(const RomStore &) = delete;
+  RomStore &operator=(const RomStore &) = delete;
+
+  /// Map one ROM file. Returns false if it can not be read or does not fit
+  /// in memory (see MAX_ROM_SIZE).
+  bool addFile(const std::string &path);
+
+  /// Map every .ch8, .c8, .sc8 and .xo8 file of a directory, in name order.
+  /// Returns false if the directory or one of them can not be read.
+  bool addDirectory(const std::string &path);
+
+  /// Map an archive written by writeArchive. Returns false if it is not an
+  /// archive of this version or is shorter than its index says.
+  bool addArchive(const std::string &path);
+
+  /// Add whatever path is: a directory, an archive or a single ROM file.
+  bool addPath(const std::string &path);
+
+  /// Pack every ROM of the store in one archive: "C8RA", version (u16), ROM
+  /// count (u32), then for each ROM its hash (u64), the offset (u32) and
+  /// size (u16) of its image, the length of its name (u16) and the name,
+  /// then the images. Little endian. An image added under several names is
+  /// stored once and listed under each.
+  bool writeArchive(const std::string &path) const;
+
+  /// Read per ROM profiles: one "<hash> <speed> [machine [quirks]]" line per
+  /// ROM, the hash in hex as printed by chip8_roms, the speed as accepted by
+  /// parseSpeed, the machine as accepted by parseMachine and the quirks by
+  /// parseQuirks. Text after them and lines starting with '#' are ignored.
+  /// Returns false if the file can not be read or a line is malformed.
+  bool loadProfiles(const std::string &path);
+
+  /// Every name added, once each, in the order they were added.
+  const std::vector<Rom> &all() const { return roms; }
+
+  /// The ROM with this content hash, nullptr if none.
+  const Rom *find(std::uint64_t hash) const;
+
+  /// The ROM added under this path or archive name, nullptr if none.
+  const Rom *findName(const std::string &name) const;
+
+  /// The profile of the ROM with this content hash, nullptr if none.
+  const RomProfile *profile(std::uint64_t hash) const;
+};
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "chip8.hpp"
+#include "frontend.hpp"
+
+class AudioMixer;
+class Jit;
+class VideoRecorder;
+
+/// Drives a Chip 8 core one 60 Hz frame at a time and forwards screen and
+/// buzzer changes to a frontend. No sleeping is done here, pacing against the
+/// wall clock is left to a FrameScheduler (or to nobody, for uncapped runs).
+class Runner {
+private:
+  Chip8 &chip8;
+  Frontend *frontend;
+  bool buzzer;
+
+  /// Screen as last handed to the frontend, valid once presentedOnce is set
+  std::uint64_t presented[PLANE_COUNT][SCREEN_HEIGHT_MAX][2];
+  bool presentedHires;
+  bool presentedOnce;
+
+  /// Compare the rows the core touched with what was presented, and hand the
+  /// frame to the frontend if any of them really changed.
+  void presentFrame();
+
+  /// Report a change of the buzzer, which happened at opcode count cycle.
+  void buzzerChanged(unsigned long long cycle);
+
+public:
+  Runner(Chip8 &chip8, Frontend &frontend,
+         unsigned long instructionsPerFrame);
+
+  /// Opcodes executed per frame, before the timers tick once
+  unsigned long instructionsPerFrame;
+
+  /// When set, opcodes run through this recompiler (bound to the same Chip8)
+  /// instead of the interpreter.
+  Jit *jit;
+
+  /// When set, buzzer edges are also sent there, stamped with the opcode
+  /// they happened at, and every frame ends with AudioMixer::endFrame.
+  AudioMixer *audio;
+
+  /// When set, every picture handed to the frontend (and presentNow's) is
+  /// also captured there, and every frame counted.
+  VideoRecorder *video;
+
+  /// Total number of opcodes executed by this runner.
+  unsigned long long cycles;
+
+  /// Total number of frames executed by this runner.
+  unsigned long long frames;
+
+  /// Number of frames handed to the frontend (only frames that changed).
+  unsigned long long framesDrawn;
+
+  /// Number of frames that drew but ended up identical to the previous one,
+  /// like a sprite erased and redrawn in place.
+  unsigned long long framesSkipped;
+
+  /// Run one frame: poll the keypad, execute instructionsPerFrame opcodes,
+  /// tick the timers, then present the rows of the screen that changed.
+  /// Returns false without running anything once the frontend asked to quit
+  /// or the machine stopped on an error (see Chip8::error), which would only
+  /// run the opcode that failed over and over.
+  bool runFrame();
+
+  /// Talk to another frontend from the next frame on, for instance one that
+  /// records the session while passing it through to the current one.
+  void setFrontend(Frontend &frontend) { this->frontend = &frontend; }
+
+  /// Present the screen without running anything, after the machine state
+  /// was replaced (a save state loaded, a step back in time).
+  void presentNow();
+};
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "chip8.hpp"
+
+/// Version written in the header of every save state. Bump it whenever the
+/// layout below changes, loadState refuses any other version.
+constexpr std::uint16_t SAVE_STATE_VERSION = 3;
+
+/// Size of a save state of a machine in bytes. The layout only depends on
+/// the machine, all fields little endian:
+///
+/// "C8ST", version (u16), machine (u8), mode (u8: bit 0 high resolution,
+/// bit 1 audio pattern loaded, bits 2-7 the quirk profile), memory (4K, 64K
+/// for XO-CHIP), V[16], I, pc, sp, opcode (u16 each), stack[16] (u16),
+/// delay timer, sound timer, key[16], random state (u32), plane mask,
+/// pitch, audio pattern[16], RPL flags[16], then the screen as u64 words,
+/// pixel x = 0 in the most significant bit: 32 rows of one word for the
+/// classic machine, 64 rows of two words for SUPER-CHIP, and the same for
+/// each of the two planes of XO-CHIP.
+std::size_t saveStateSize(Machine machine);
+
+/// The largest save state, the one of an XO-CHIP machine.
+constexpr std::size_t MAX_SAVE_STATE_SIZE = 67704;
+
+/// Serialize the whole machine into out, which must hold
+/// saveStateSize(chip8.machine) bytes. The instruction cache is not saved,
+/// it is rebuilt on demand.
+void saveState(const Chip8 &chip8, unsigned char *out);
+
+/// Restore a machine from a save state, switching it to the machine and
+/// quirk profile saved if they are other ones. Returns false, leaving chip8
+/// untouched, if data is not a save state of this version. The instruction
+/// cache is flushed and the whole screen marked dirty.
+bool loadState(Chip8 &chip8, const unsigned char *data, std::size_t size);
+
+/// FNV-1a hash of the save state of chip8, to check that two runs went
+/// through the same states without keeping them.
+std::uint64_t stateHash(const Chip8 &chip8);
+
+/// Same as saveState and loadState, to and from a file.
+bool saveStateFile(const Chip8 &chip8, const std::string &path);
+bool loadStateFile(Chip8 &chip8, const std::string &path);
+
+/// Save state that can be copied around for free: copies share the same
+/// immutable bytes, which are released with the last copy. Branching search
+/// tools keep one per node and fork machines from it.
+class Snapshot {
+private:
+  std::shared_ptr<const std::vector<unsigned char>> image;
+
+public:
+  Snapshot() = default;
+
+  /// Capture the current state of chip8.
+  explicit Snapshot(const Chip8 &chip8);
+
+  /// True for a default constructed snapshot.
+  bool empty() const { return !image; }
+
+  /// Put the captured state back into chip8.
+  void restore(Chip8 &chip8) const;
+
+  /// New machine starting from the captured state.
+  std::unique_ptr<Chip8> fork() const;
+
+  /// The save state itself, size() bytes.
+  const unsigned char *data() const { return image->data(); }
+  std::size_t size() const { return image->size(); }
+};
+
+/// Keeps the last frames of a run so the player can go back in time.
+///
+/// Every keyframeInterval frames the full state is stored; the frames in
+/// between are stored as the XOR of their state with that keyframe, run
+/// length encoded. From one frame to the next only a few registers, the
+/// timers and some screen rows change, so a frame typically costs tens of
+/// bytes and restoring one is a single decode on top of its keyframe.
+class RewindBuffer {
+private:
+  struct Frame {
+    bool keyframe;
+    std::vector<unsigned char> data;
+  };
+
+  std::deque<Frame> frames;
+  std::size_t capacity;
+  std::size_t keyframeInterval;
+  std::size_t storedBytes;
+
+  /// Frames pushed since the newest keyframe, and that keyframe
+  std::size_t sinceKeyframe;
+  const std::vector<unsigned char> *keyframe;
+
+  std::vector<unsigned char> image;
+
+  void findKeyframe();
+  void dropOldest();
+
+public:
+  /// Keep up to capacity frames (5 minutes at 60 Hz by default), with a full
+  /// state every keyframeInterval frames.
+  explicit RewindBuffer(std::size_t capacity = 5 * 60 * 60,
+                        std::size_t keyframeInterval = 60);
+
+  /// Record the current state as the newest frame, dropping the oldest ones
+  /// once the buffer is full.
+  void push(const Chip8 &chip8);
+
+  /// Restore the newest frame into chip8 and drop it, so that calling this
+  /// repeatedly walks back in time. Returns false once the buffer is empty.
+  bool stepBack(Chip8 &chip8);
+
+  /// Number of frames held.
+  std::size_t size() const { return frames.size(); }
+
+  /// Bytes used by the frames held.
+  std::size_t bytes() const { return storedBytes; }
+
+  /// Drop every frame.
+  void clear();
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+
+/// The Chip 8 timers, and so the frames, run at 60 Hz.
+constexpr unsigned long FRAMES_PER_SECOND = 60;
+
+/// Instructions per second commonly used for CHIP-8 games. 700 suits most of
+/// the classic ROMs, slower games want 500 and some newer ones 1000.
+constexpr unsigned long IPS_SLOW = 500;
+constexpr unsigned long IPS_NORMAL = 700;
+constexpr unsigned long IPS_FAST = 1000;
+
+/// Convert instructions per second to instructions per 60 Hz frame (at least
+/// one).
+unsigned long instructionsPerFrame(unsigned long ips);
+
+/// Parse a speed given either as a preset name ("slow", "normal", "fast") or
+/// as a number of instructions per second. Returns 0 if it is neither.
+unsigned long parseSpeed(const std::string &speed);
+
+/// Paces frames against the monotonic clock. Deadlines are kept on an absolute
+/// grid (start + n * period), so the time spent emulating a frame and the
+/// oversleeping of the OS do not accumulate into drift.
+class FrameScheduler {
+private:
+  std::chrono::steady_clock::duration period;
+  std::chrono::steady_clock::time_point deadline;
+
+public:
+  /// If the host falls further behind than this many frames (a debugger
+  /// pause, a suspended laptop), the grid is restarted instead of running all
+  /// the missed frames back to back.
+  static constexpr int MAX_LAG_FRAMES = 5;
+
+  FrameScheduler();
+
+  /// Start the grid now, the first frame is due immediately.
+  void start();
+
+  /// Sleep once until the next frame is due, then advance the deadline by
+  /// one period. Does not sleep when the host is behind schedule.
+  void waitForNextFrame();
+};
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/// Bounded lock-free queue for exactly one producer thread and one consumer
+/// thread.
+///
+/// Each side owns one index and only reads the other's, with acquire/release
+/// ordering, so a push or a pop is a couple of plain loads and stores on x86.
+/// Each side also keeps the last value it read of the other index and only
+/// reloads it when the queue looks full (or empty), so the cache line of the
+/// other side is not pulled in on every operation.
+///
+/// Both sides can also work on runs of slots in place (reserve/publish,
+/// peek/release), for producers that fill many elements with plain stores
+/// before handing them over at once.
+template <typename T> class SpscQueue {
+private:
+  std::vector<T> slots;
+  std::size_t mask;
+
+  /// The indices grow forever and are masked on access; the padding keeps
+  /// the producer's and the consumer's fields on separate cache lines
+  char padStart[64];
+  std::atomic<std::size_t> head;
+  std::size_t cachedTail;
+  char padMiddle[64];
+  std::atomic<std::size_t> tail;
+  std::size_t cachedHead;
+  char padEnd[64];
+
+public:
+  /// Room for capacity elements, rounded up to a power of two.
+  explicit SpscQueue(std::size_t capacity)
+      : head(0), cachedTail(0), tail(0), cachedHead(0) {
+    std::size_t size = 1;
+    while (size < capacity)
+      size <<= 1;
+    slots.resize(size);
+    mask = size - 1;
+  }
+
+  SpscQueue(const SpscQueue &) = delete;
+  SpscQueue &operator=(const SpscQueue &) = delete;
+
+  std::size_t capacity() const { return slots.size(); }
+
+  /// Producer side. Returns false, leaving the queue alone, when it is full.
+  bool tryPush(const T &value) {
+    const std::size_t h = head.load(std::memory_order_relaxed);
+    if (h - cachedTail == slots.size()) {
+      cachedTail = tail.load(std::memory_order_acquire);
+      if (h - cachedTail == slots.size())
+        return false;
+    }
+    slots[h & mask] = value;
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// Producer side. Point first at free slots and return how many can be
+  /// written there in a row, 0 when the queue is full. They are handed to
+  /// the consumer by publish().
+  std::size_t reserve(T *&first) {
+    const std::size_t h = head.load(std::memory_order_relaxed);
+    cachedTail = tail.load(std::memory_order_acquire);
+    if (h - cachedTail == slots.size())
+      return 0;
+    const std::size_t index = h & mask;
+    const std::size_t untilEnd = slots.size() - index;
+    const std::size_t available = slots.size() - (h - cachedTail);
+    first = &slots[index];
+    return available < untilEnd ? available : untilEnd;
+  }
+
+  /// Producer side. Hand the count slots written after reserve() to the
+  /// consumer.
+  void publish(std::size_t count) {
+    head.store(head.load(std::memory_order_relaxed) + count,
+               std::memory_order_release);
+  }
+
+  /// Consumer side. Point first at the oldest elements and return how many
+  /// can be read there in a row, 0 when the queue is empty. They stay in the
+  /// queue until release() is called.
+  std::size_t peek(const T *&first) {
+    const std::size_t t = tail.load(std::memory_order_relaxed);
+    if (cachedHead == t) {
+      cachedHead = head.load(std::memory_order_acquire);
+      if (cachedHead == t)
+        return 0;
+    }
+    const std::size_t index = t & mask;
+    const std::size_t untilEnd = slots.size() - index;
+    const std::size_t available = cachedHead - t;
+    first = &slots[index];
+    return available < untilEnd ? available : untilEnd;
+  }
+
+  /// Consumer side. Drop the count oldest elements, after peek().
+  void release(std::size_t count) {
+    tail.store(tail.load(std::memory_order_relaxed) + count,
+               std::memory_order_release);
+  }
+
+  /// Either side. Elements queued, exact only when the other side is idle.
+  std::size_t size() const {
+    const std::size_t t = tail.load(std::memory_order_acquire);
+    return head.load(std::memory_order_acquire) - t;
+  }
+
+  /// Either side. Exact only when the other side is idle.
+  bool empty() const {
+    return head.load(std::memory_order_acquire) ==
+           tail.load(std::memory_order_acquire);
+  }
+};
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Fixed set of worker threads with one task deque each. Tasks are handed out
+/// round robin; a worker runs the newest task of its own deque first and,
+/// once it is empty, steals the oldest task of another worker, so uneven
+/// tasks (a ROM that runs much slower than the others) do not leave cores
+/// idle at the end of a batch.
+class ThreadPool {
+private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  std::vector<std::unique_ptr<Queue>> queues;
+  std::vector<std::thread> workers;
+
+  /// Guards the counters below, workers sleep on wake when nothing is queued
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  unsigned long queued;
+  unsigned long unfinished;
+  unsigned next;
+  bool stopping;
+
+  bool takeTask(unsigned self, std::function<void()> &task);
+  void workerLoop(unsigned self);
+
+public:
+  /// Start threads workers, or one per hardware thread when 0.
+  explicit ThreadPool(unsigned threads = 0);
+
+  /// Wait for every submitted task, then join the workers.
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  /// Number of worker threads.
+  unsigned size() const { return static_cast<unsigned>(workers.size()); }
+
+  /// Queue a task, it runs on any of the workers.
+  void submit(std::function<void()> task);
+
+  /// Block until every task submitted so far has finished.
+  void wait();
+};
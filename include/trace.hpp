@@ -0,0 +1,259 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#include "chip8.hpp"
+#include "spsc_queue.hpp"
+
+/// Version written in the header of every trace file.
+constexpr std::uint16_t TRACE_VERSION = 2;
+
+/// No register was written by the traced opcode.
+constexpr std::uint8_t TRACE_NO_REGISTER = 0xFF;
+
+/// One executed opcode, as seen right after it ran. Not stored, TraceFile
+/// rebuilds them.
+struct TraceRecord {
+  /// Address it ran from, and the opcode itself
+  std::uint16_t pc;
+  std::uint16_t opcode;
+  /// Index register after it ran
+  std::uint16_t I;
+  /// Register it wrote (VX for the ALU, loads and timers, VF for draws, the
+  /// last one for FX65), TRACE_NO_REGISTER if none, and its new value (0
+  /// if none). The flag set by 8XY4-8XYE along with VX is not recorded.
+  std::uint8_t reg;
+  std::uint8_t value;
+};
+
+/// Register written by an Op, see TraceRecord::reg: TRACE_NO_REGISTER, 0xF
+/// for VF, or TRACE_WRITES_VX for VX.
+constexpr std::uint8_t TRACE_WRITES_VX = 0x10;
+
+inline constexpr std::uint8_t traceWrites(Op op) {
+  switch (op) {
+  case Op::SetNN:
+  case Op::AddNN:
+  case Op::SetReg:
+  case Op::Or:
+  case Op::And:
+  case Op::Xor:
+  case Op::AddReg:
+  case Op::SubReg:
+  case Op::ShiftRight:
+  case Op::SubnReg:
+  case Op::ShiftLeft:
+  case Op::Random:
+  case Op::GetDelay:
+  case Op::WaitKey:
+  case Op::Load:
+    return TRACE_WRITES_VX;
+  case Op::Draw:
+    return 0xF;
+  default:
+    return TRACE_NO_REGISTER;
+  }
+}
+
+/// Size of the header of a trace file: "C8TR", version (u16), run size
+/// (u16), opcodes traced (u64), runs (u64), save state size (u32), 0 (u32),
+/// little endian. The save state of the machine when the trace started
+/// follows (see savestate.hpp), then the runs in order, each one a
+/// TraceRun in little endian.
+constexpr std::size_t TRACE_HEADER_SIZE = 32;
+
+/// Calls of the interpreter for the same number of opcodes, with nothing
+/// from outside the machine changing in between but the timers ticking
+/// once, as the Runner does between two frames, and what the machine was
+/// given from outside before the first of them.
+///
+/// The interpreter is deterministic: the random generator is part of the
+/// machine, so from a known state only the keys and the timers, which the
+/// Runner sets between runCycles calls, decide what runs next.
+struct TraceRun {
+  /// Opcodes run by each call, and the calls
+  std::uint64_t cycles;
+  std::uint64_t calls;
+  /// pc and I when the run started, checked by the replay
+  std::uint16_t pc;
+  std::uint16_t I;
+  /// Bit k set if key k was pressed
+  std::uint16_t keys;
+  std::uint8_t delayTimer;
+  std::uint8_t soundTimer;
+};
+
+/// Records every opcode the interpreter executes into a file, with little
+/// enough overhead to be left on.
+///
+/// Nothing is written per opcode. open() saves the state of the machine,
+/// then emulateCycle and runCycles call runStarts() and runEnded() around
+/// the opcodes they run. A call is added to the last TraceRun if it runs
+/// as many opcodes and starts with the keys, pc and I the last one ended
+/// with and the timers ticked once from there, else it makes a new one.
+/// Headless, that is only when a state is loaded. chip8_trace rebuilds the
+/// opcodes, with their TraceRecord, by replaying the runs from the saved
+/// state.
+///
+/// Runs go through a lock-free single producer, single consumer ring to a
+/// writer thread, which copies them into the file through a moving
+/// memory-mapped window, so the emulation thread never makes a system
+/// call. When the ring is full the emulation waits for the writer instead
+/// of dropping runs, a trace is complete or it is an error.
+///
+/// The trace cannot follow the recompiler, and changes made to the machine
+/// between runs other than to the keys and the timers (loading a state,
+/// writing memory from a debugger) make the replay stop there.
+class TraceRecorder {
+private:
+  /// What a call can start from, compared as a whole
+  struct Inputs {
+    unsigned char key[16];
+    std::uint16_t pc;
+    std::uint16_t I;
+    std::uint8_t delayTimer;
+    std::uint8_t soundTimer;
+
+    void capture(const Chip8 &chip8) {
+      std::memcpy(key, chip8.key, sizeof(key));
+      pc = chip8.pc;
+      I = chip8.I;
+      delayTimer = chip8.delay_timer;
+      soundTimer = chip8.sound_timer;
+    }
+  };
+
+  SpscQueue<TraceRun> ring;
+  std::thread writer;
+  std::atomic<bool> stopping;
+
+  int fd;
+  /// Current window of the file and its offset, size of the saved state
+  /// and runs written after it so far
+  unsigned char *window;
+  std::uint64_t windowOffset;
+  std::size_t stateSize;
+  std::uint64_t written;
+  bool failed;
+
+  /// Run being extended, not handed to the writer yet (none while it has
+  /// no calls), and what the next call starts from if it extends it
+  TraceRun current;
+  Inputs ended;
+  std::uint64_t opcodes;
+  std::uint64_t runs;
+
+  void writerLoop();
+  bool mapWindow(std::uint64_t offset);
+  void writeRuns(const TraceRun *first, std::size_t n);
+
+  /// Hand the current run to the writer, waiting for it if the ring is
+  /// full
+  void publishRun();
+
+  /// Slow path of runStarts(), something changed from outside: start a new
+  /// run
+  void startRun(const Chip8 &chip8, unsigned long count);
+
+public:
+  /// Bytes of the file mapped at a time, a multiple of the page size and
+  /// larger than any save state.
+  static constexpr std::size_t WINDOW_SIZE = 16 << 20;
+
+  /// Buffer up to ringRuns runs between the emulation and the writer.
+  explicit TraceRecorder(std::size_t ringRuns = 1 << 16);
+
+  /// Closes the file if still open.
+  ~TraceRecorder();
+
+  TraceRecorder(const TraceRecorder &) = delete;
+  TraceRecorder &operator=(const TraceRecorder &) = delete;
+
+  /// Create (or truncate) the trace file, save the state of chip8 in it
+  /// and start the writer thread.
+  bool open(const std::string &path, const Chip8 &chip8);
+
+  /// Write whatever is still in the ring, complete the header and close the
+  /// file. Returns false if anything could not be written.
+  bool close();
+
+  /// Opcodes traced since open().
+  std::uint64_t records() const { return opcodes; }
+
+  /// Runs written (or about to be) since open().
+  std::uint64_t runCount() const { return runs + (current.calls != 0); }
+
+  /// Called by the interpreter before it runs count opcodes.
+  void runStarts(const Chip8 &chip8, unsigned long count) {
+    Inputs now;
+    now.capture(chip8);
+    opcodes += count;
+    if (current.calls != 0 && current.cycles == count &&
+        std::memcmp(&now, &ended, sizeof(now)) == 0)
+      ++current.calls;
+    else
+      startRun(chip8, count);
+  }
+
+  /// Called by the interpreter after the opcodes of runStarts() ran.
+  void runEnded(const Chip8 &chip8) {
+    ended.capture(chip8);
+    ended.delayTimer -= ended.delayTimer > 0;
+    ended.soundTimer -= ended.soundTimer > 0;
+  }
+};
+
+/// Reads a trace file back, replaying it from its saved state to rebuild
+/// the record of every opcode in order.
+class TraceFile {
+private:
+  void *map;
+  std::size_t mapSize;
+  const unsigned char *runs;
+  std::uint64_t runsLeft;
+  std::uint64_t count;
+
+  /// Machine replaying the trace, opcodes of each call of the current run,
+  /// opcodes left in the current call and calls after it, and opcodes
+  /// replayed so far
+  Chip8 chip8;
+  std::uint64_t cycles;
+  std::uint64_t cyclesLeft;
+  std::uint64_t callsLeft;
+  std::uint64_t replayed;
+  bool mismatch;
+
+  /// Give the machine what the next run started from
+  bool startRun();
+
+public:
+  TraceFile();
+  ~TraceFile();
+
+  TraceFile(const TraceFile &) = delete;
+  TraceFile &operator=(const TraceFile &) = delete;
+
+  /// Map a file written by TraceRecorder and load its saved state. Returns
+  /// false if it is not a trace of this version or is shorter than its
+  /// header says.
+  bool open(const std::string &path);
+
+  /// Opcodes in the trace.
+  std::uint64_t size() const { return count; }
+
+  /// Opcodes replayed so far, the index of the next record.
+  std::uint64_t position() const { return replayed; }
+
+  /// Run the next opcode and describe it in record. Returns false at the
+  /// end of the trace, or where the replay stopped matching it.
+  bool next(TraceRecord &record);
+
+  /// The replay stopped before the end: a run did not start where the
+  /// last one ended, the machine was changed from outside while traced.
+  bool diverged() const { return mismatch; }
+};
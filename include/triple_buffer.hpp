@@ -0,0 +1,54 @@
+#pragma once
+
+#include <atomic>
+
+/// Lock-free hand-over of the latest value from one writer thread to one
+/// reader thread, like finished frames from an emulation thread to a render
+/// thread.
+///
+/// Three slots rotate between the writer (back), the reader (front) and the
+/// one in between (middle). The writer fills its slot and swaps it with the
+/// middle one, the reader swaps its slot with the middle one when a new value
+/// was put there. Neither side ever waits for the other: the writer
+/// overwrites values the reader skipped, and the reader keeps the last one
+/// until a newer one comes.
+template <typename T> class TripleBuffer {
+private:
+  T slots[3];
+
+  /// Index of the middle slot, with FRESH set while it holds a value the
+  /// reader has not taken
+  static constexpr unsigned FRESH = 4;
+  static constexpr unsigned INDEX = 3;
+  std::atomic<unsigned> middle;
+
+  /// Each side's own slot, on separate cache lines
+  alignas(64) unsigned back;
+  alignas(64) unsigned front;
+
+public:
+  TripleBuffer() : slots(), middle(1), back(0), front(2) {}
+
+  TripleBuffer(const TripleBuffer &) = delete;
+  TripleBuffer &operator=(const TripleBuffer &) = delete;
+
+  /// Writer side. The slot to fill, owned by the writer until publish().
+  T &write() { return slots[back]; }
+
+  /// Writer side. Hand the value written over to the reader.
+  void publish() {
+    back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & INDEX;
+  }
+
+  /// Reader side. Take the latest value published, if there is one the
+  /// reader has not taken yet. Returns false when there is none.
+  bool update() {
+    if (!(middle.load(std::memory_order_relaxed) & FRESH))
+      return false;
+    front = middle.exchange(front, std::memory_order_acq_rel) & INDEX;
+    return true;
+  }
+
+  /// Reader side. The value taken by the last successful update().
+  const T &read() const { return slots[front]; }
+};
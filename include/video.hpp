@@ -0,0 +1,214 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "chip8.hpp"
+#include "spsc_queue.hpp"
+
+/// Version written in the header of every video stream.
+constexpr std::uint16_t VIDEO_VERSION = 1;
+
+/// Frames per second of every video: one per Runner frame.
+constexpr unsigned VIDEO_FRAME_RATE = 60;
+
+/// Size of the header of a video stream: "C8VD", version (u16), frame rate
+/// (u16), frames (u32), pictures (u32), little endian. The pictures follow,
+/// each one as the frame it is first shown at (u32), a mode (u8: bit 0 high
+/// resolution, bit 1 key picture), the size of its data (u32) and the data.
+///
+/// The image of a picture is both planes one after the other, each as its
+/// rows top to bottom, width / 8 bytes per row, leftmost pixel in the most
+/// significant bit: 512 bytes in low resolution, 2048 in high resolution. A
+/// key picture (the first one, and the first after a change of resolution)
+/// stores its image, the others the XOR of their image with the previous
+/// one, both run-length encoded: a control byte c below 128 is followed by
+/// c + 1 bytes to copy, one from 128 up by a single byte to repeat c - 126
+/// times.
+constexpr std::size_t VIDEO_HEADER_SIZE = 16;
+
+/// The screen of a machine as captured, shown from the frame stamped on it
+/// until the next picture's.
+struct VideoPicture {
+  std::uint32_t frame;
+  bool hires;
+  std::uint64_t gfx[PLANE_COUNT][SCREEN_HEIGHT_MAX][2];
+};
+
+/// Encodes pictures, in order, into a file.
+class VideoWriter {
+public:
+  virtual ~VideoWriter() = default;
+
+  /// Create (or truncate) the file.
+  virtual bool open(const std::string &path) = 0;
+
+  /// Add a picture, stamped with a later frame than the previous one.
+  virtual void write(const VideoPicture &picture) = 0;
+
+  /// Complete the file, the video lasting frames frames. Returns false if
+  /// anything could not be written.
+  virtual bool close(std::uint32_t frames) = 0;
+};
+
+/// Lossless stream of every picture, see VIDEO_HEADER_SIZE.
+class RawVideoWriter : public VideoWriter {
+private:
+  std::FILE *file;
+  std::uint32_t pictures;
+  bool previousHires;
+  std::vector<unsigned char> previous;
+  std::vector<unsigned char> image;
+  std::vector<unsigned char> encoded;
+  bool failed;
+
+public:
+  RawVideoWriter();
+  ~RawVideoWriter() override;
+
+  bool open(const std::string &path) override;
+  void write(const VideoPicture &picture) override;
+  bool close(std::uint32_t frames) override;
+};
+
+/// Looping animated GIF, 128 x 64 pixels times scale, in the colors of the
+/// window. Each picture only stores the rows that differ from the one shown
+/// before it.
+///
+/// GIF delays are in hundredths of a second and viewers slow down anything
+/// shorter than two: a picture replaced before that is dropped, the next one
+/// taking its place in time. Flicker is lost, the timing is not. Use the
+/// stream of RawVideoWriter for every picture.
+class GifWriter : public VideoWriter {
+private:
+  unsigned scale;
+  std::FILE *file;
+  bool failed;
+
+  /// Screen shown by the pictures written so far, one color per pixel of
+  /// the 128 x 64 canvas, and the one waiting for its delay to be known
+  std::vector<unsigned char> shown;
+  std::vector<unsigned char> pending;
+  std::uint32_t pendingFrame;
+  bool hasPending;
+
+  void writePending(unsigned delay);
+
+public:
+  explicit GifWriter(unsigned scale = 4);
+  ~GifWriter() override;
+
+  bool open(const std::string &path) override;
+  void write(const VideoPicture &picture) override;
+  bool close(std::uint32_t frames) override;
+};
+
+/// GifWriter for paths ending in ".gif", RawVideoWriter for anything else.
+std::unique_ptr<VideoWriter> videoWriterForPath(const std::string &path,
+                                                unsigned scale = 4);
+
+/// Records the screen into a video without slowing the emulation down.
+///
+/// Attach it with Runner::video: the runner hands it every picture it
+/// presents, which capture() copies into a slot of a lock-free single
+/// producer, single consumer ring, and counts the frames. Frames that
+/// changed nothing cost nothing. A writer thread encodes the pictures into
+/// the file.
+///
+/// What happens when the ring is full is up to the caller. Paced sessions
+/// drop the picture (see dropped()), the one after it taking its place from
+/// the frame it is stamped with, so the video keeps its timing and the
+/// emulation never waits on the encoder. Uncapped runs outpace any encoder
+/// and wait for it instead, like TraceRecorder, so their video is complete.
+class VideoRecorder {
+private:
+  const bool dropWhenFull;
+  SpscQueue<VideoPicture> ring;
+  std::thread writer;
+  std::atomic<bool> stopping;
+  std::unique_ptr<VideoWriter> output;
+
+  std::uint32_t frames;
+  std::uint64_t captured;
+  std::uint64_t droppedPictures;
+
+  void writerLoop();
+
+  /// Slow path of capture(), the ring is full: a free slot once the writer
+  /// made one, or nullptr when dropping
+  VideoPicture *waitForSlot();
+
+public:
+  /// Buffer up to ringPictures pictures, about 2K each, between the
+  /// emulation and the writer.
+  explicit VideoRecorder(bool dropWhenFull, std::size_t ringPictures = 256);
+
+  /// Closes the file if still open.
+  ~VideoRecorder();
+
+  VideoRecorder(const VideoRecorder &) = delete;
+  VideoRecorder &operator=(const VideoRecorder &) = delete;
+
+  /// Start writing to path (see videoWriterForPath), from the current screen
+  /// of chip8.
+  bool open(const std::string &path, const Chip8 &chip8, unsigned scale = 4);
+
+  /// Write whatever is still in the ring and complete the file. Returns
+  /// false if anything could not be written.
+  bool close();
+
+  /// Picture the screen as it is now, shown from the current frame on.
+  void capture(const Chip8 &chip8) {
+    VideoPicture *slot;
+    if (ring.reserve(slot) == 0 && !(slot = waitForSlot()))
+      return;
+    slot->frame = frames;
+    slot->hires = chip8.hires;
+    std::memcpy(slot->gfx, chip8.gfx, sizeof(slot->gfx));
+    ring.publish(1);
+    ++captured;
+  }
+
+  /// One more frame was run.
+  void frameDone() { ++frames; }
+
+  /// Frames recorded, pictures handed to the writer and dropped so far.
+  std::uint32_t framesRecorded() const { return frames; }
+  std::uint64_t pictures() const { return captured; }
+  std::uint64_t dropped() const { return droppedPictures; }
+};
+
+/// Read only view of a video stream written by RawVideoWriter.
+class VideoFile {
+private:
+  std::vector<unsigned char> data;
+  std::size_t offset;
+  std::uint32_t frameCount;
+  std::uint32_t pictureCount;
+  std::uint32_t decoded;
+  /// Image of the last picture decoded, which the next one is a delta of
+  bool hires;
+  std::vector<unsigned char> image;
+  std::vector<unsigned char> delta;
+
+public:
+  VideoFile();
+
+  /// Read a stream. Returns false if it is not a video stream of this
+  /// version.
+  bool open(const std::string &path);
+
+  std::uint32_t frames() const { return frameCount; }
+  std::uint32_t pictures() const { return pictureCount; }
+
+  /// Decode the next picture into picture. Returns false after the last one
+  /// or if the stream is corrupt.
+  bool next(VideoPicture &picture);
+};
@@ -1,22 +1,140 @@
 #include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <chrono>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
 
 #include <GL/freeglut_std.h>
 #include <GL/glut.h>
 
+#include "include/audio.hpp"
 #include "include/chip8.hpp"
+#include "include/emulation_thread.hpp"
+#include "include/movie.hpp"
+#include "include/runner.hpp"
+#include "include/savestate.hpp"
+#include "include/scheduler.hpp"
+#include "include/video.hpp"
 
 // Configuration constants
 constexpr int CHIP8_SCREEN_WIDTH = 64;
 constexpr int CHIP8_SCREEN_HEIGHT = 32;
 constexpr int INITIAL_SCALE = 15;
 
+// The window shows the screen at the high resolution, a pixel of the 64x32
+// mode being 2x2 texels
+constexpr int TEXTURE_WIDTH = SCREEN_WIDTH_MAX;
+constexpr int TEXTURE_HEIGHT = SCREEN_HEIGHT_MAX;
+
+// Shade of each color of Chip8::pixel: off, plane 1, plane 2, both
+constexpr unsigned char LUMINANCE[4] = {0, 255, 170, 85};
+
+// How the screen gets to the window
+enum class RenderPath {
+  // The screen is a 128x64 texture, updated with the changed rows only and
+  // drawn as one scaled quad with nearest filtering
+  Texture,
+  // One flat quad per run of lit pixels, in a single glBegin/glEnd. Used on
+  // software rasterizers (llvmpipe, softpipe) where texturing every fragment
+  // of the window costs more than filling the few lit ones
+  Quads
+};
+
+// How long the GLUT thread sleeps when no new frame is ready, well under a
+// 60 Hz frame
+constexpr std::chrono::milliseconds IDLE_SLEEP(1);
+
+// The screen as shown in the window, updated from the frames the emulation
+// thread publishes. Only touched by the GLUT thread.
+class GlutScreen {
+public:
+  // The screen as texels (see LUMINANCE), row by row
+  unsigned char texels[TEXTURE_HEIGHT][TEXTURE_WIDTH] = {{0}};
+
+  // Rows of texels changed since they were last uploaded
+  std::uint64_t pendingRows = 0;
+
+  // Rows as last expanded into texels, and the mode they were in
+  std::uint64_t shown[PLANE_COUNT][SCREEN_HEIGHT_MAX][2] = {{{0}}};
+  bool shownHires = false;
+
+  // Expand the rows that differ from what is shown. Frames may have been
+  // skipped since the last one, so rows are compared rather than taken from
+  // the runner's changed rows.
+  void update(const ScreenFrame &frame) {
+    const bool modeChanged = frame.hires != shownHires;
+    const int height = frame.hires ? SCREEN_HEIGHT_MAX : 32;
+    for (int y = 0; y < height; ++y) {
+      bool changed = modeChanged;
+      for (int plane = 0; plane < PLANE_COUNT; ++plane) {
+        std::uint64_t *row = shown[plane][y];
+        if (row[0] != frame.gfx[plane][y][0] ||
+            row[1] != frame.gfx[plane][y][1]) {
+          row[0] = frame.gfx[plane][y][0];
+          row[1] = frame.gfx[plane][y][1];
+          changed = true;
+        }
+      }
+      if (changed)
+        expandRow(y, frame.hires ? 1 : 2);
+    }
+    shownHires = frame.hires;
+  }
+
+private:
+  // Expand screen row y into scale rows of texels, each pixel scale texels
+  // wide
+  void expandRow(int y, int scale) {
+    unsigned char *line = texels[y * scale];
+    for (int x = 0; x < TEXTURE_WIDTH / scale; ++x) {
+      const int shift = 63 - (x & 63);
+      const int color = ((shown[0][y][x >> 6] >> shift) & 1) |
+                        ((shown[1][y][x >> 6] >> shift) & 1) << 1;
+      for (int i = 0; i < scale; ++i)
+        line[x * scale + i] = LUMINANCE[color];
+    }
+    for (int i = 1; i < scale; ++i)
+      std::memcpy(texels[y * scale + i], line, TEXTURE_WIDTH);
+    pendingRows |= (scale == 1 ? 1ULL : 3ULL) << (y * scale);
+  }
+};
+
 // Global state
 class EmulatorState {
 public:
   Chip8 chip8;
+  // Runs the machine, the rewind buffer and the recorder on a thread of its
+  // own; the GLUT thread only draws and forwards input
+  EmulationThread emulation;
+  Runner runner{chip8, emulation, instructionsPerFrame(IPS_NORMAL)};
+  RewindBuffer rewind;
+  std::atomic<bool> rewinding{false};
+  // Set once the error the machine stopped on was printed, until it runs
+  // again from a state rewound to or loaded
+  bool errorShown = false;
+  GlutScreen screen;
+  bool buzzer = false;
+  // The buzzer, rendered by the runner and played by an external command;
+  // unset with --no-audio, failed when the command could not play
+  AudioMixer mixer;
+  std::unique_ptr<PipeAudio> audio;
+  std::string state_path;
+  // Set while the session is recorded into movie_path, see --record
+  std::unique_ptr<MovieRecorder> recorder;
+  Movie movie;
+  std::string movie_path;
+  // Set while the screen is recorded into video_path, see --video. Paced,
+  // so pictures the encoder can not keep up with are dropped
+  VideoRecorder video{true};
+  std::string video_path;
+  RenderPath render_path = RenderPath::Texture;
+  GLuint texture = 0;
   int window_scale = INITIAL_SCALE;
   int display_width = CHIP8_SCREEN_WIDTH * INITIAL_SCALE;
   int display_height = CHIP8_SCREEN_HEIGHT * INITIAL_SCALE;
@@ -39,112 +157,179 @@ static EmulatorState emulator;
 // 4 5 6 D           Q W E R
 // 7 8 9 E           A S D F
 // A 0 B F           Z X C V
-void handleKeyPress(unsigned char key, bool pressed) {
-  const int state = pressed ? 1 : 0;
-
+int keypadIndex(unsigned char key) {
   switch (std::tolower(key)) {
   // Row 1
   case '1':
-    emulator.chip8.key[0x1] = state;
-    break;
+    return 0x1;
   case '2':
-    emulator.chip8.key[0x2] = state;
-    break;
+    return 0x2;
   case '3':
-    emulator.chip8.key[0x3] = state;
-    break;
+    return 0x3;
   case '4':
-    emulator.chip8.key[0xC] = state;
-    break;
+    return 0xC;
 
   // Row 2
   case 'q':
-    emulator.chip8.key[0x4] = state;
-    break;
+    return 0x4;
   case 'w':
-    emulator.chip8.key[0x5] = state;
-    break;
+    return 0x5;
   case 'e':
-    emulator.chip8.key[0x6] = state;
-    break;
+    return 0x6;
   case 'r':
-    emulator.chip8.key[0xD] = state;
-    break;
+    return 0xD;
 
   // Row 3
   case 'a':
-    emulator.chip8.key[0x7] = state;
-    break;
+    return 0x7;
   case 's':
-    emulator.chip8.key[0x8] = state;
-    break;
+    return 0x8;
   case 'd':
-    emulator.chip8.key[0x9] = state;
-    break;
+    return 0x9;
   case 'f':
-    emulator.chip8.key[0xE] = state;
-    break;
+    return 0xE;
 
   // Row 4
   case 'z':
-    emulator.chip8.key[0xA] = state;
-    break;
+    return 0xA;
   case 'x':
-    emulator.chip8.key[0x0] = state;
-    break;
+    return 0x0;
   case 'c':
-    emulator.chip8.key[0xB] = state;
-    break;
+    return 0xB;
   case 'v':
-    emulator.chip8.key[0xF] = state;
-    break;
+    return 0xF;
   }
+  return -1;
 }
 
-void drawPixel(int x, int y) {
-  const float left = static_cast<float>(x * emulator.window_scale);
-  const float right = static_cast<float>((x + 1) * emulator.window_scale);
-  const float top = static_cast<float>(y * emulator.window_scale);
-  const float bottom = static_cast<float>((y + 1) * emulator.window_scale);
+void handleKeyPress(unsigned char key, bool pressed) {
+  const int index = keypadIndex(key);
+  if (index >= 0)
+    emulator.emulation.pressKey(static_cast<std::uint8_t>(index), pressed);
+}
 
-  glBegin(GL_QUADS);
+// Quad covering width x height texels from (x, y), inside glBegin
+void emitQuad(int x, int y, int width, int height) {
+  const float scale = emulator.window_scale * 0.5f;
+  const float left = x * scale;
+  const float right = (x + width) * scale;
+  const float top = y * scale;
+  const float bottom = (y + height) * scale;
+
+  glTexCoord2f(0.0f, 0.0f);
   glVertex2f(left, top);
+  glTexCoord2f(1.0f, 0.0f);
   glVertex2f(right, top);
+  glTexCoord2f(1.0f, 1.0f);
   glVertex2f(right, bottom);
+  glTexCoord2f(0.0f, 1.0f);
   glVertex2f(left, bottom);
+}
+
+void renderTexture() {
+  GlutScreen &screen = emulator.screen;
+
+  glBindTexture(GL_TEXTURE_2D, emulator.texture);
+
+  // Upload the span of rows that changed, in one call
+  if (screen.pendingRows) {
+    const int first = __builtin_ctzll(screen.pendingRows);
+    const int last = 63 - __builtin_clzll(screen.pendingRows);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, first, TEXTURE_WIDTH,
+                    last - first + 1, GL_LUMINANCE, GL_UNSIGNED_BYTE,
+                    screen.texels[first]);
+    screen.pendingRows = 0;
+  }
+
+  glEnable(GL_TEXTURE_2D);
+  glBegin(GL_QUADS);
+  emitQuad(0, 0, TEXTURE_WIDTH, TEXTURE_HEIGHT);
   glEnd();
+  glDisable(GL_TEXTURE_2D);
 }
 
-void renderScreen() {
-  glClear(GL_COLOR_BUFFER_BIT);
+void renderQuads() {
+  const GlutScreen &screen = emulator.screen;
 
-  // Render each pixel of the Chip-8 screen
-  for (int y = 0; y < CHIP8_SCREEN_HEIGHT; ++y) {
-    for (int x = 0; x < CHIP8_SCREEN_WIDTH; ++x) {
-      if (emulator.chip8.gfx[y * CHIP8_SCREEN_WIDTH + x] != 0) {
-        glColor3f(1.0f, 1.0f, 1.0f); // White for active pixels
-        drawPixel(x, y);
+  // Merge horizontal runs of texels of the same shade into a single quad
+  // each
+  glBegin(GL_QUADS);
+  for (int y = 0; y < TEXTURE_HEIGHT; ++y) {
+    int x = 0;
+    while (x < TEXTURE_WIDTH) {
+      const unsigned char shade = screen.texels[y][x];
+      if (!shade) {
+        ++x;
+        continue;
       }
+      const int start = x;
+      while (x < TEXTURE_WIDTH && screen.texels[y][x] == shade)
+        ++x;
+      glColor3ub(shade, shade, shade);
+      emitQuad(start, y, x - start, 1);
     }
   }
+  glEnd();
+  emulator.screen.pendingRows = 0;
+}
+
+void renderScreen() {
+  glClear(GL_COLOR_BUFFER_BIT);
+
+  if (emulator.render_path == RenderPath::Texture) {
+    renderTexture();
+  } else {
+    renderQuads();
+  }
 
   glutSwapBuffers();
 }
 
 // GLUT callback functions
-void displayCallback() {
-  if (emulator.chip8.drawFlag) {
-    renderScreen();
-    emulator.chip8.drawFlag = false;
+void displayCallback() { renderScreen(); }
+
+// One frame on the emulation thread. While rewinding, frames are taken back
+// from the rewind buffer instead.
+void emulateFrame() {
+  if (emulator.rewinding.load(std::memory_order_relaxed)) {
+    if (emulator.rewind.stepBack(emulator.chip8))
+      emulator.runner.presentNow();
+    // Still a frame of sound, which audio pacing waits on
+    if (emulator.runner.audio)
+      emulator.mixer.endFrame(emulator.runner.cycles);
+    // The video plays the rewind too
+    if (emulator.runner.video)
+      emulator.video.frameDone();
+  } else if (emulator.runner.runFrame()) {
+    emulator.rewind.push(emulator.chip8);
+    emulator.errorShown = false;
+  } else if (emulator.chip8.error != MachineError::None &&
+             !emulator.errorShown) {
+    // The runner no longer runs the machine, say why the window froze
+    std::cerr << "Error: " << machineErrorName(emulator.chip8.error)
+              << " at 0x" << std::hex << emulator.chip8.pc << std::dec
+              << ", rewind or load a state to go on" << std::endl;
+    emulator.errorShown = true;
   }
 }
 
+// Present the latest frame the emulation thread finished, if there is a new
+// one, otherwise give the core back for a moment
 void idleCallback() {
-  emulator.chip8.emulateCycle();
-
-  if (emulator.chip8.drawFlag) {
-    glutPostRedisplay();
+  // Without sound, at least show that the ROM beeped
+  const bool buzzer = emulator.emulation.buzzerOn();
+  if (buzzer && !emulator.buzzer && !(emulator.audio && emulator.audio->ok()))
+    std::cout << "BEEP!" << std::endl;
+  emulator.buzzer = buzzer;
+
+  const ScreenFrame *frame = emulator.emulation.takeFrame();
+  if (!frame) {
+    std::this_thread::sleep_for(IDLE_SLEEP);
+    return;
   }
+  emulator.screen.update(*frame);
+  if (emulator.screen.pendingRows)
+    glutPostRedisplay();
 }
 
 void reshapeCallback(GLsizei width, GLsizei height) {
@@ -164,18 +349,139 @@ void reshapeCallback(GLsizei width, GLsizei height) {
             << ", scale: " << emulator.window_scale << std::endl;
 }
 
-void keyboardDownCallback(unsigned char key, int x, int y) {
+void keyboardDownCallback(unsigned char key, int /*x*/, int /*y*/) {
   if (key == 27) { // ESC key
     std::cout << "Exiting..." << std::endl;
     exit(0);
   }
+  if (key == 8) { // Backspace, held down to go back in time
+    // A movie only goes forward, going back would record a different run
+    if (emulator.recorder)
+      std::cerr << "Rewind is disabled while recording" << std::endl;
+    else
+      emulator.rewinding.store(true, std::memory_order_relaxed);
+    return;
+  }
   handleKeyPress(key, true);
 }
 
-void keyboardUpCallback(unsigned char key, int x, int y) {
+void keyboardUpCallback(unsigned char key, int /*x*/, int /*y*/) {
+  if (key == 8) {
+    emulator.rewinding.store(false, std::memory_order_relaxed);
+    return;
+  }
   handleKeyPress(key, false);
 }
 
+// Save the machine next to the ROM, between two frames
+void quickSave() {
+  if (saveStateFile(emulator.chip8, emulator.state_path))
+    std::cout << "State saved to " << emulator.state_path << std::endl;
+  else
+    std::cerr << "Error: Failed to save state to " << emulator.state_path
+              << std::endl;
+}
+
+// Load it back, between two frames
+void quickLoad() {
+  if (loadStateFile(emulator.chip8, emulator.state_path)) {
+    // The frames recorded so far lead to a different present
+    emulator.rewind.clear();
+    emulator.runner.presentNow();
+    std::cout << "State loaded from " << emulator.state_path << std::endl;
+  } else {
+    std::cerr << "Error: Failed to load state from " << emulator.state_path
+              << std::endl;
+  }
+}
+
+// F5 saves the machine next to the ROM, F9 loads it back. The machine belongs
+// to the emulation thread, both run there.
+void specialDownCallback(int key, int /*x*/, int /*y*/) {
+  if (key == GLUT_KEY_F5) {
+    emulator.emulation.post(quickSave);
+  } else if (key == GLUT_KEY_F9) {
+    if (emulator.recorder) {
+      std::cerr << "Loading a state is disabled while recording" << std::endl;
+      return;
+    }
+    emulator.emulation.post(quickLoad);
+  }
+}
+
+// Stop the emulation thread when the emulator exits, before anything it uses
+// goes away. Registered last so that it runs first.
+void stopEmulation() { emulator.emulation.stop(); }
+
+// Close the movie when the emulator exits, GLUT never returns from its loop
+void saveMovie() {
+  if (!emulator.recorder)
+    return;
+
+  emulator.recorder->finish();
+  if (emulator.movie.save(emulator.movie_path))
+    std::cout << "Recorded " << emulator.movie.frames << " frames to "
+              << emulator.movie_path << std::endl;
+  else
+    std::cerr << "Error: Failed to write movie: " << emulator.movie_path
+              << std::endl;
+}
+
+// Close the video when the emulator exits, after the emulation thread
+void saveVideo() {
+  if (!emulator.runner.video)
+    return;
+
+  if (emulator.video.close())
+    std::cout << "Recorded " << emulator.video.framesRecorded()
+              << " frames to " << emulator.video_path << " ("
+              << emulator.video.dropped() << " pictures dropped)"
+              << std::endl;
+  else
+    std::cerr << "Error: Failed to write video: " << emulator.video_path
+              << std::endl;
+}
+
+// Record the screen from the first frame on, as a GIF or a video stream
+bool startVideo(const char *path) {
+  if (!emulator.video.open(path, emulator.chip8))
+    return false;
+  emulator.video_path = path;
+  emulator.runner.video = &emulator.video;
+  std::atexit(saveVideo);
+  std::cout << "Recording video to " << path << std::endl;
+  return true;
+}
+
+// Record the session from the first frame on: the machine is seeded with a
+// seed stored in the movie, and every frame goes through the recorder
+void startRecording(const char *path) {
+  emulator.movie_path = path;
+  emulator.movie.seed = std::random_device()();
+  emulator.movie.instructionsPerFrame =
+      static_cast<std::uint32_t>(emulator.runner.instructionsPerFrame);
+  emulator.chip8.seedRandom(emulator.movie.seed);
+
+  emulator.recorder.reset(
+      new MovieRecorder(emulator.chip8, emulator.emulation, emulator.movie));
+  emulator.runner.setFrontend(*emulator.recorder);
+  std::atexit(saveMovie);
+  std::cout << "Recording to " << path << std::endl;
+}
+
+// Play the buzzer through command, and let the sound card pace the frames.
+// When the command can not be run the emulator stays silent, on the clock.
+void startAudio(const std::string &command) {
+  emulator.audio.reset(new PipeAudio(command));
+  if (!emulator.audio->start(emulator.mixer)) {
+    std::cerr << "Warning: Failed to start audio: " << command << std::endl;
+    emulator.audio.reset();
+    return;
+  }
+  emulator.runner.audio = &emulator.mixer;
+  emulator.emulation.setAudioPacing(&emulator.mixer);
+}
+
 void initializeGraphics() {
   glClearColor(0.0f, 0.0f, 0.0f, 1.0f); // Black background
   glColor3f(1.0f, 1.0f, 1.0f); // White foreground
@@ -186,6 +492,34 @@ void initializeGraphics() {
   gluOrtho2D(0, emulator.display_width, emulator.display_height, 0);
   glMatrixMode(GL_MODELVIEW);
   glLoadIdentity();
+
+  // Software rasterizers take the quads path, see RenderPath
+  const char *renderer =
+      reinterpret_cast<const char *>(glGetString(GL_RENDERER));
+  if (renderer && (std::strstr(renderer, "llvmpipe") ||
+                   std::strstr(renderer, "softpipe") ||
+                   std::strstr(renderer, "Software Rasterizer"))) {
+    emulator.render_path = RenderPath::Quads;
+    return;
+  }
+
+  // Screen texture, filled with black until the first frame is presented
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glGenTextures(1, &emulator.texture);
+  glBindTexture(GL_TEXTURE_2D, emulator.texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, TEXTURE_WIDTH,
+               TEXTURE_HEIGHT, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE,
+               emulator.screen.texels);
+
+  if (glGetError() != GL_NO_ERROR) {
+    std::cerr << "Warning: Screen texture unavailable, drawing quads"
+              << std::endl;
+    emulator.render_path = RenderPath::Quads;
+  }
 }
 
 void setupGLUT(int argc, char *argv[]) {
@@ -201,29 +535,105 @@ void setupGLUT(int argc, char *argv[]) {
   glutReshapeFunc(reshapeCallback);
   glutKeyboardFunc(keyboardDownCallback);
   glutKeyboardUpFunc(keyboardUpCallback);
+  glutSpecialFunc(specialDownCallback);
 
   initializeGraphics();
 
   std::cout << "Graphics initialized successfully" << std::endl;
   std::cout << "OpenGL Version: " << glGetString(GL_VERSION) << std::endl;
   std::cout << "Renderer: " << glGetString(GL_RENDERER) << std::endl;
+  std::cout << "Render path: "
+            << (emulator.render_path == RenderPath::Texture ? "texture"
+                                                             : "quads")
+            << std::endl;
 }
 
 int main(int argc, char *argv[]) {
   // Validate command line arguments
-  if (argc != 2) {
-    std::cerr << "Usage: " << argv[0] << " <rom_file>" << std::endl;
+  const char *speed = nullptr;
+  const char *record_path = nullptr;
+  const char *machine_name = nullptr;
+  const char *quirks_name = nullptr;
+  const char *video_path = nullptr;
+  std::string audio_command = DEFAULT_AUDIO_COMMAND;
+  bool valid = argc >= 2;
+  for (int i = 2; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+      record_path = argv[++i];
+    else if (std::strcmp(argv[i], "--machine") == 0 && i + 1 < argc)
+      machine_name = argv[++i];
+    else if (std::strcmp(argv[i], "--quirks") == 0 && i + 1 < argc)
+      quirks_name = argv[++i];
+    else if (std::strcmp(argv[i], "--video") == 0 && i + 1 < argc)
+      video_path = argv[++i];
+    else if (std::strcmp(argv[i], "--audio") == 0 && i + 1 < argc)
+      audio_command = argv[++i];
+    else if (std::strcmp(argv[i], "--no-audio") == 0)
+      audio_command.clear();
+    else if (!speed && argv[i][0] != '-')
+      speed = argv[i];
+    else
+      valid = false;
+  }
+
+  if (!valid) {
+    std::cerr << "Usage: " << argv[0]
+              << " <rom_file> [speed] [--record <movie_file>]"
+              << " [--machine chip8|schip|xochip]"
+              << " [--quirks cosmac|chip48|schip|xochip]"
+              << " [--video <file>]"
+              << " [--audio <command> | --no-audio]" << std::endl;
+    std::cerr << "Speed: slow (" << IPS_SLOW << "), normal (" << IPS_NORMAL
+              << "), fast (" << IPS_FAST << ") or instructions per second"
+              << std::endl;
     std::cerr << "Controls:" << std::endl;
     std::cerr << "  1 2 3 4    ->  1 2 3 C" << std::endl;
     std::cerr << "  Q W E R    ->  4 5 6 D" << std::endl;
     std::cerr << "  A S D F    ->  7 8 9 E" << std::endl;
     std::cerr << "  Z X C V    ->  A 0 B F" << std::endl;
     std::cerr << "    ESC      ->   Exit" << std::endl;
+    std::cerr << "  Backspace  ->   Rewind (hold)" << std::endl;
+    std::cerr << "  F5 / F9    ->   Save / load state" << std::endl;
+    std::cerr << "--record saves the session as a movie for tools/replay"
+              << std::endl;
+    std::cerr << "--machine overrides the machine guessed from the ROM's"
+              << " extension (.sc8, .xo8)" << std::endl;
+    std::cerr << "--quirks overrides the machine's own quirk profile"
+              << std::endl;
+    std::cerr << "--video records the screen, as an animated GIF if <file>"
+              << " ends in .gif, else as a stream for tools/video" << std::endl;
+    std::cerr << "--audio plays raw 16-bit mono samples through <command>, %r"
+              << std::endl;
+    std::cerr << "being the sample rate (default: " << DEFAULT_AUDIO_COMMAND
+              << ")" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (speed) {
+    const unsigned long ips = parseSpeed(speed);
+    if (ips == 0) {
+      std::cerr << "Error: Invalid speed: " << speed << std::endl;
+      return EXIT_FAILURE;
+    }
+    emulator.runner.instructionsPerFrame = instructionsPerFrame(ips);
+  }
+
+  Machine machine = machineForPath(argv[1]);
+  if (machine_name && !parseMachine(machine_name, machine)) {
+    std::cerr << "Error: Unknown machine: " << machine_name << std::endl;
+    return EXIT_FAILURE;
+  }
+  Quirks quirks = defaultQuirks(machine);
+  if (quirks_name && !parseQuirks(quirks_name, quirks)) {
+    std::cerr << "Error: Unknown quirks: " << quirks_name << std::endl;
     return EXIT_FAILURE;
   }
 
   // Initialize Chip-8 system
-  std::cout << "Initializing Chip-8 system..." << std::endl;
+  std::cout << "Initializing " << machineName(machine) << " system..."
+            << std::endl;
+  emulator.chip8.setMachine(machine);
+  emulator.chip8.setQuirks(quirks);
   emulator.chip8.initialize();
 
   // Load ROM file
@@ -233,10 +643,21 @@ int main(int argc, char *argv[]) {
     return EXIT_FAILURE;
   }
   std::cout << "ROM loaded successfully!" << std::endl;
+  emulator.state_path = std::string(argv[1]) + ".state";
+  if (record_path)
+    startRecording(record_path);
+  if (video_path && !startVideo(video_path)) {
+    std::cerr << "Error: Failed to create video: " << video_path << std::endl;
+    return EXIT_FAILURE;
+  }
 
   // Setup graphics and start main loop
   setupGLUT(argc, argv);
   std::cout << "Starting emulation... (Press ESC to exit)" << std::endl;
+  if (!audio_command.empty())
+    startAudio(audio_command);
+  std::atexit(stopEmulation);
+  emulator.emulation.start(emulator.runner, emulateFrame);
   glutMainLoop();
 
   return EXIT_SUCCESS;
@@ -0,0 +1,292 @@
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+
+#include "../include/analysis.hpp"
+#include "../include/bytes.hpp"
+#include "../include/chip8.hpp"
+#include "../include/jit.hpp"
+#include "../include/rom_store.hpp"
+
+static const unsigned char ANALYSIS_MAGIC[4] = {'C', '8', 'A', 'N'};
+
+std::size_t RomAnalysis::count(std::uint8_t mask) const {
+  return static_cast<std::size_t>(
+      std::count_if(flags.begin(), flags.end(),
+                    [mask](std::uint8_t f) { return (f & mask) == mask; }));
+}
+
+namespace {
+
+// What is known of I when an opcode is reached: an address, or one of these
+constexpr int I_UNSEEN = -2;
+constexpr int I_UNKNOWN = -1;
+
+// Walks the ROM from its entry point, following every path an opcode can
+// take, until no opcode is reached with something new known of I
+class Walker {
+private:
+  const unsigned char *data;
+  const std::size_t size;
+  const Machine machine;
+  const QuirkSet quirks;
+  const Op *table;
+  std::vector<std::uint8_t> &flags;
+
+  // I on entry to each opcode reached, merged over every path to it. An
+  // opcode is walked again only when that changes, at most twice
+  std::vector<int> entryI;
+  std::vector<unsigned> work;
+
+  bool inRom(unsigned address) const {
+    return address >= ROM_START && address - ROM_START < size;
+  }
+
+  void reach(unsigned address, int i, bool blockStart) {
+    if (!inRom(address))
+      return;
+    const unsigned offset = address - ROM_START;
+    if (blockStart)
+      flags[offset] |= BYTE_BLOCK;
+
+    const int state = entryI[offset];
+    const int merged = state == I_UNSEEN || state == i ? i : I_UNKNOWN;
+    if (merged != state) {
+      entryI[offset] = merged;
+      work.push_back(address);
+    }
+  }
+
+  // Flag the bytes at I, when I is known
+  void touch(int i, unsigned length, std::uint8_t flag) {
+    if (i < 0)
+      return;
+    for (unsigned k = 0; k < length; ++k) {
+      const unsigned address = (static_cast<unsigned>(i) + k) & 0xFFFF;
+      if (inRom(address))
+        flags[address - ROM_START] |= flag;
+    }
+  }
+
+  // Bytes a taken skip at address moves pc by, see skipTaken
+  unsigned skipLength(unsigned address) const {
+    const unsigned next = address + 2;
+    if (machine == Machine::XoChip && inRom(next) && inRom(next + 1) &&
+        data[next - ROM_START] == 0xF0 && data[next + 1 - ROM_START] == 0x00)
+      return 6;
+    return 4;
+  }
+
+  void step(unsigned address) {
+    // Past the ROM memory is zero, which is no code anyone meant to run
+    if (!inRom(address + 1))
+      return;
+    const unsigned offset = address - ROM_START;
+    const unsigned short opcode =
+        static_cast<unsigned short>(data[offset] << 8 | data[offset + 1]);
+    const Operands o = decodeOperands(opcode);
+    flags[offset] |= BYTE_CODE;
+    flags[offset + 1] |= BYTE_OPERAND;
+
+    int i = entryI[offset];
+    unsigned next = address + 2;
+
+    switch (table[opcode]) {
+    case Op::Unknown:
+      flags[offset] |= BYTE_INVALID;
+      return;
+    case Op::Ret:
+    case Op::Exit:
+      return;
+    case Op::JumpV0:
+      flags[offset] |= BYTE_INDIRECT;
+      return;
+    case Op::Jump:
+      reach(o.nnn, i, true);
+      return;
+    case Op::Call:
+      if (inRom(o.nnn))
+        flags[o.nnn - ROM_START] |= BYTE_SUBROUTINE;
+      reach(o.nnn, i, true);
+      // Whatever the subroutine did to I is not followed
+      reach(next, I_UNKNOWN, true);
+      return;
+    case Op::SkipEqNN:
+    case Op::SkipNeNN:
+    case Op::SkipEqReg:
+    case Op::SkipNeReg:
+    case Op::SkipKey:
+    case Op::SkipNoKey:
+      reach(next, i, true);
+      reach(address + skipLength(address), i, true);
+      return;
+    case Op::SetI:
+      i = o.nnn;
+      break;
+    case Op::SetILong:
+      if (inRom(next + 1)) {
+        flags[offset + 2] |= BYTE_OPERAND;
+        flags[offset + 3] |= BYTE_OPERAND;
+        i = data[offset + 2] << 8 | data[offset + 3];
+      }
+      next += 2;
+      break;
+    case Op::AddI:
+    case Op::FontChar:
+    case Op::BigFontChar:
+      i = I_UNKNOWN;
+      break;
+    case Op::Draw:
+      touch(i, o.n, BYTE_SPRITE);
+      break;
+    case Op::DrawExt:
+      touch(i, o.n == 0 ? 32 : o.n, BYTE_SPRITE);
+      break;
+    case Op::Bcd:
+      touch(i, 3, BYTE_DATA);
+      break;
+    case Op::Store:
+    case Op::Load:
+      touch(i, o.x + 1u, BYTE_DATA);
+      if (i >= 0) {
+        const int increment = quirks.memoryIncrement == 2   ? o.x + 1
+                              : quirks.memoryIncrement == 1 ? o.x
+                                                            : 0;
+        i = (i + increment) & 0xFFFF;
+      }
+      break;
+    case Op::StoreRange:
+    case Op::LoadRange:
+      touch(i, (o.x <= o.y ? o.y - o.x : o.x - o.y) + 1u, BYTE_DATA);
+      break;
+    case Op::Audio:
+      touch(i, 16, BYTE_DATA);
+      break;
+    default:
+      break;
+    }
+    reach(next, i, false);
+  }
+
+public:
+  Walker(const unsigned char *data, std::size_t size, Machine machine,
+         Quirks quirks, std::vector<std::uint8_t> &flags)
+      : data(data), size(size), machine(machine), quirks(quirkSet(quirks)),
+        table(opTable(machine)), flags(flags), entryI(size, I_UNSEEN) {}
+
+  void run() {
+    reach(ROM_START, I_UNKNOWN, true);
+    while (!work.empty()) {
+      const unsigned address = work.back();
+      work.pop_back();
+      step(address);
+    }
+  }
+};
+
+} // namespace
+
+RomAnalysis analyzeRom(const unsigned char *data, std::size_t size,
+                       Machine machine, Quirks quirks) {
+  RomAnalysis analysis;
+  analysis.hash = romContentHash(data, size);
+  analysis.machine = machine;
+  analysis.quirks = quirks;
+  // Nothing past the end of memory can be reached
+  analysis.flags.assign(std::min(size, MAX_ROM_SIZE), 0);
+  Walker(data, analysis.flags.size(), machine, quirks, analysis.flags).run();
+  return analysis;
+}
+
+bool saveAnalysis(const RomAnalysis &analysis, const std::string &path) {
+  std::vector<unsigned char> data(ANALYSIS_HEADER_SIZE +
+                                  analysis.flags.size());
+  ByteWriter w{data.data()};
+  w.bytes(ANALYSIS_MAGIC, sizeof(ANALYSIS_MAGIC));
+  w.u16(ANALYSIS_VERSION);
+  w.u8(static_cast<unsigned char>(analysis.machine));
+  w.u8(static_cast<unsigned char>(analysis.quirks));
+  w.u64(analysis.hash);
+  w.u32(static_cast<std::uint32_t>(analysis.flags.size()));
+  w.bytes(analysis.flags.data(), analysis.flags.size());
+
+  std::ofstream file(path, std::ios::binary);
+  file.write(reinterpret_cast<const char *>(data.data()), data.size());
+  return file.good();
+}
+
+bool loadAnalysis(RomAnalysis &analysis, const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file.is_open())
+    return false;
+
+  const std::vector<unsigned char> data((std::istreambuf_iterator<char>(file)),
+                                        std::istreambuf_iterator<char>());
+  if (data.size() < ANALYSIS_HEADER_SIZE ||
+      !std::equal(ANALYSIS_MAGIC, ANALYSIS_MAGIC + 4, data.begin()))
+    return false;
+
+  ByteReader r{data.data() + sizeof(ANALYSIS_MAGIC)};
+  if (r.u16() != ANALYSIS_VERSION)
+    return false;
+  const unsigned char machine = r.u8();
+  const unsigned char quirks = r.u8();
+  if (machine > static_cast<unsigned char>(Machine::XoChip) ||
+      quirks >= QUIRKS_COUNT)
+    return false;
+  const std::uint64_t hash = r.u64();
+  const std::uint32_t size = r.u32();
+  if (size > MAX_ROM_SIZE || data.size() - ANALYSIS_HEADER_SIZE != size)
+    return false;
+
+  analysis.hash = hash;
+  analysis.machine = static_cast<Machine>(machine);
+  analysis.quirks = static_cast<Quirks>(quirks);
+  analysis.flags.assign(r.p, r.p + size);
+  return true;
+}
+
+AnalysisCache::AnalysisCache(const std::string &directory)
+    : directory(directory) {}
+
+std::string AnalysisCache::pathFor(std::uint64_t hash, Machine machine,
+                                   Quirks quirks) const {
+  char name[64];
+  std::snprintf(name, sizeof(name), "%016llx-%s-%s.c8an",
+                static_cast<unsigned long long>(hash), machineName(machine),
+                quirksName(quirks));
+  return directory + "/" + name;
+}
+
+RomAnalysis AnalysisCache::get(const unsigned char *data, std::size_t size,
+                               Machine machine, Quirks quirks, bool &cached) {
+  const std::uint64_t hash = romContentHash(data, size);
+  const std::string path = pathFor(hash, machine, quirks);
+
+  RomAnalysis analysis;
+  // The name could have been copied around, the header can not lie
+  cached = loadAnalysis(analysis, path) && analysis.hash == hash &&
+           analysis.machine == machine && analysis.quirks == quirks &&
+           analysis.flags.size() == std::min(size, MAX_ROM_SIZE);
+  if (cached)
+    return analysis;
+
+  analysis = analyzeRom(data, size, machine, quirks);
+  saveAnalysis(analysis, path);
+  return analysis;
+}
+
+void warmUp(const RomAnalysis &analysis, Chip8 &chip8, Jit *jit) {
+  const std::size_t size =
+      std::min(analysis.flags.size(), chip8.maxRomSize());
+  for (std::size_t offset = 0; offset < size; ++offset) {
+    const std::uint8_t flags = analysis.flags[offset];
+    const unsigned short address =
+        static_cast<unsigned short>(ROM_START + offset);
+    if (flags & BYTE_CODE)
+      chip8.prefetch(address);
+    if (jit && (flags & BYTE_BLOCK))
+      jit->precompile(address);
+  }
+}
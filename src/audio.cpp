@@ -0,0 +1,316 @@
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../include/audio.hpp"
+#include "../include/scheduler.hpp"
+
+// Room for about 170 ms, far more than the fill rate control aims for
+constexpr std::size_t RING_SIZE = 8192;
+
+// Peak of the tone, a quarter of full scale
+constexpr float AMPLITUDE = 8192.0f;
+
+// Length of the fade in and out around the buzzer edges
+constexpr double FADE_SECONDS = 0.002;
+
+// Correction of a unit step at phase t, for a phase step of dt per sample
+static double polyBlep(double t, double dt) {
+  if (t < dt) {
+    t /= dt;
+    return t + t - t * t - 1.0;
+  }
+  if (t > 1.0 - dt) {
+    t = (t - 1.0) / dt;
+    return t * t + t + t + 1.0;
+  }
+  return 0.0;
+}
+
+AudioMixer::AudioMixer(unsigned sampleRate)
+    : ring(RING_SIZE), rate(sampleRate), phase(0.0),
+      phaseStep(BUZZER_FREQUENCY / sampleRate), hasPattern(false),
+      pattern(), patternStep(0.0), gain(0.0f), target(0.0f),
+      fadeStep(static_cast<float>(1.0 / (FADE_SECONDS * sampleRate))),
+      frameStart(0), carry(0.0), rateControl(false), produced(0) {}
+
+void AudioMixer::setPattern(const unsigned char *pattern,
+                            unsigned char pitch) {
+  hasPattern = pattern != nullptr;
+  if (!hasPattern)
+    return;
+  std::memcpy(this->pattern, pattern, sizeof(this->pattern));
+  // Bits per second, over the 128 bits of a period
+  const double bitRate = 4000.0 * std::pow(2.0, (pitch - 64) / 48.0);
+  patternStep = bitRate / 128.0 / rate;
+}
+
+void AudioMixer::render(std::int16_t *out, std::size_t count) {
+  for (std::size_t i = 0; i < count; ++i) {
+    if (gain == 0.0f && target == 0.0f) {
+      // Silent: keep the oscillator still so every beep starts alike
+      std::fill(out + i, out + count, std::int16_t(0));
+      phase = 0.0;
+      return;
+    }
+
+    double value;
+    if (hasPattern) {
+      // Sampled as is: the bits are made to be played at these rates
+      const int bit = static_cast<int>(phase * 128.0) & 127;
+      value = (pattern[bit >> 3] >> (7 - (bit & 7))) & 1 ? 1.0 : -1.0;
+      phase += patternStep;
+    } else {
+      value = phase < 0.5 ? 1.0 : -1.0;
+      value += polyBlep(phase, phaseStep);
+      value -= polyBlep(phase < 0.5 ? phase + 0.5 : phase - 0.5, phaseStep);
+      phase += phaseStep;
+    }
+    out[i] = static_cast<std::int16_t>(value * gain * AMPLITUDE);
+
+    if (phase >= 1.0)
+      phase -= 1.0;
+    if (gain < target)
+      gain = std::min(target, gain + fadeStep);
+    else if (gain > target)
+      gain = std::max(target, gain - fadeStep);
+  }
+}
+
+void AudioMixer::endFrame(std::uint64_t cycle) {
+  double exact = static_cast<double>(rate) / FRAMES_PER_SECOND;
+  if (rateControl) {
+    // Proportional control: a ring twice as full as the target shortens
+    // the frame by MAX_RATE_ADJUST, an empty one lengthens it as much
+    const double fill = static_cast<double>(buffered());
+    double error = (fill - AUDIO_TARGET_FILL) / AUDIO_TARGET_FILL;
+    error = std::max(-1.0, std::min(1.0, error));
+    exact *= 1.0 - error * MAX_RATE_ADJUST;
+  }
+  exact += carry;
+  const std::size_t count = static_cast<std::size_t>(exact);
+  carry = exact - count;
+
+  frame.resize(count);
+  const std::uint64_t span = cycle > frameStart ? cycle - frameStart : 0;
+  std::size_t done = 0;
+  for (const BuzzerEdge &edge : edges) {
+    std::size_t at = 0;
+    if (span > 0 && edge.cycle > frameStart)
+      at = static_cast<std::size_t>(
+          std::min<std::uint64_t>(edge.cycle - frameStart, span) * count /
+          span);
+    if (at > done) {
+      render(frame.data() + done, at - done);
+      done = at;
+    }
+    target = edge.on ? 1.0f : 0.0f;
+  }
+  render(frame.data() + done, count - done);
+  edges.clear();
+  frameStart = cycle;
+
+  // Queue what fits, in at most two runs since the ring wraps once
+  std::size_t queued = 0;
+  std::int16_t *slots;
+  std::size_t room;
+  while (queued < count && (room = ring.reserve(slots)) > 0) {
+    const std::size_t run = std::min(room, count - queued);
+    std::memcpy(slots, frame.data() + queued, run * sizeof(std::int16_t));
+    ring.publish(run);
+    queued += run;
+  }
+  produced.fetch_add(count, std::memory_order_relaxed);
+}
+
+std::size_t AudioMixer::read(std::int16_t *out, std::size_t count) {
+  std::size_t done = 0;
+  const std::int16_t *samples;
+  std::size_t available;
+  while (done < count && (available = ring.peek(samples)) > 0) {
+    const std::size_t run = std::min(available, count - done);
+    std::memcpy(out + done, samples, run * sizeof(std::int16_t));
+    ring.release(run);
+    done += run;
+  }
+  return done;
+}
+
+std::size_t AudioMixer::buffered() const { return ring.size(); }
+
+// Little endian fields of a WAV header
+static void put16(unsigned char *at, std::uint16_t value) {
+  at[0] = value & 0xFF;
+  at[1] = value >> 8;
+}
+
+static void put32(unsigned char *at, std::uint32_t value) {
+  put16(at, value & 0xFFFF);
+  put16(at + 2, value >> 16);
+}
+
+constexpr std::size_t WAV_HEADER_SIZE = 44;
+
+static void wavHeader(unsigned char header[WAV_HEADER_SIZE], unsigned rate,
+                      std::uint32_t dataBytes) {
+  std::memcpy(header, "RIFF", 4);
+  put32(header + 4, 36 + dataBytes);
+  std::memcpy(header + 8, "WAVEfmt ", 8);
+  put32(header + 16, 16);
+  put16(header + 20, 1); // PCM
+  put16(header + 22, 1); // mono
+  put32(header + 24, rate);
+  put32(header + 28, rate * 2);
+  put16(header + 32, 2);
+  put16(header + 34, 16);
+  std::memcpy(header + 36, "data", 4);
+  put32(header + 40, dataBytes);
+}
+
+WavWriter::WavWriter(const std::string &path)
+    : path(path), file(nullptr), mixer(nullptr), samples(0), failed(false) {}
+
+WavWriter::~WavWriter() { stop(); }
+
+bool WavWriter::start(AudioMixer &mixer) {
+  file = std::fopen(path.c_str(), "wb");
+  if (!file) {
+    failed = true;
+    return false;
+  }
+  this->mixer = &mixer;
+  samples = 0;
+
+  // Sizes are filled in by stop()
+  unsigned char header[WAV_HEADER_SIZE];
+  wavHeader(header, mixer.sampleRate(), 0);
+  failed = std::fwrite(header, sizeof(header), 1, file) != 1;
+  return !failed;
+}
+
+void WavWriter::drain() {
+  if (!file)
+    return;
+  std::int16_t buffer[1024];
+  unsigned char bytes[sizeof(buffer)];
+  std::size_t count;
+  while ((count = mixer->read(buffer, 1024)) > 0) {
+    for (std::size_t i = 0; i < count; ++i)
+      put16(bytes + 2 * i, static_cast<std::uint16_t>(buffer[i]));
+    if (std::fwrite(bytes, 2, count, file) != count)
+      failed = true;
+    samples += count;
+  }
+}
+
+void WavWriter::stop() {
+  if (!file)
+    return;
+  drain();
+
+  unsigned char header[WAV_HEADER_SIZE];
+  wavHeader(header, mixer->sampleRate(),
+            static_cast<std::uint32_t>(samples * 2));
+  if (std::fseek(file, 0, SEEK_SET) != 0 ||
+      std::fwrite(header, sizeof(header), 1, file) != 1)
+    failed = true;
+  if (std::fclose(file) != 0)
+    failed = true;
+  file = nullptr;
+}
+
+// Taken by reference by the chrono operators, so defined once (C++14)
+constexpr std::chrono::milliseconds PipeAudio::LEAD;
+
+PipeAudio::PipeAudio(const std::string &command)
+    : command(command), pipe(nullptr), mixer(nullptr), stopping(false),
+      failed(false), underruns(0) {}
+
+PipeAudio::~PipeAudio() { stop(); }
+
+bool PipeAudio::start(AudioMixer &mixer) {
+  std::string line = command;
+  const std::string rate = std::to_string(mixer.sampleRate());
+  for (std::size_t at; (at = line.find("%r")) != std::string::npos;)
+    line.replace(at, 2, rate);
+
+  // A player that exits must show up as a failed write, not kill us
+  std::signal(SIGPIPE, SIG_IGN);
+  pipe = popen(line.c_str(), "w");
+  if (!pipe) {
+    failed.store(true);
+    return false;
+  }
+#ifdef F_SETPIPE_SZ
+  // The smallest pipe the kernel allows, bounding what a player that reads
+  // ahead can hold on to
+  fcntl(fileno(pipe), F_SETPIPE_SZ, 4096);
+#endif
+
+  this->mixer = &mixer;
+  mixer.setRateControl(true);
+  stopping.store(false);
+  failed.store(false);
+  writer = std::thread([this] { writerLoop(); });
+  return true;
+}
+
+void PipeAudio::writerLoop() {
+  using Clock = std::chrono::steady_clock;
+  const int fd = fileno(pipe);
+  const double rate = mixer->sampleRate();
+  std::int16_t chunk[CHUNK];
+  std::uint64_t written = 0;
+  Clock::time_point start = Clock::now();
+
+  while (!stopping.load(std::memory_order_acquire)) {
+    // The chunk is due once the device is within LEAD of its first sample
+    const auto due =
+        start + std::chrono::duration_cast<Clock::duration>(
+                    std::chrono::duration<double>(written / rate)) -
+        LEAD;
+    std::this_thread::sleep_until(due);
+
+    const std::size_t count = mixer->read(chunk, CHUNK);
+    if (count < CHUNK) {
+      std::fill(chunk + count, chunk + CHUNK, std::int16_t(0));
+      underruns.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    const Clock::time_point before = Clock::now();
+    const char *bytes = reinterpret_cast<const char *>(chunk);
+    std::size_t left = sizeof(chunk);
+    while (left > 0) {
+      const ssize_t done = ::write(fd, bytes, left);
+      if (done < 0 && errno == EINTR)
+        continue;
+      if (done <= 0) {
+        failed.store(true, std::memory_order_relaxed);
+        return;
+      }
+      bytes += done;
+      left -= static_cast<std::size_t>(done);
+    }
+    written += CHUNK;
+
+    // Blocked: the player is full, its clock is behind ours
+    const Clock::duration blocked = Clock::now() - before;
+    if (blocked > std::chrono::milliseconds(1))
+      start += blocked;
+  }
+}
+
+void PipeAudio::stop() {
+  if (writer.joinable()) {
+    stopping.store(true, std::memory_order_release);
+    writer.join();
+  }
+  if (pipe) {
+    pclose(pipe);
+    pipe = nullptr;
+  }
+}
@@ -0,0 +1,727 @@
+#include <algorithm>
+#include <cstring>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "../include/batch_engine.hpp"
+#include "../include/hash.hpp"
+
+// Lanes handled per vector instruction, the lane count is padded to this
+constexpr std::size_t VECTOR_LANES = 32;
+
+// The kernels below apply one op to n lanes of the SoA arrays, 32 lanes per
+// iteration with AVX2, then one lane at a time for the rest (or for all of
+// them without AVX2). Each 32 lane chunk reads and writes the registers in
+// the same order as the handlers in dispatch.cpp, so an op whose X or Y is F
+// sees the flag it just wrote exactly like the interpreter does.
+
+#ifdef __AVX2__
+
+static inline __m256i loadBytes(const unsigned char *p) {
+  return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+}
+
+static inline void storeBytes(unsigned char *p, __m256i v) {
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(p), v);
+}
+
+// 0xFF where a > b, unsigned
+static inline __m256i greaterBytes(__m256i a, __m256i b) {
+  const __m256i lessOrEqual = _mm256_cmpeq_epi8(_mm256_max_epu8(a, b), b);
+  return _mm256_xor_si256(lessOrEqual, _mm256_set1_epi8(-1));
+}
+
+#endif
+
+static void addBytes(unsigned char *dst, unsigned char value, std::size_t n) {
+  std::size_t l = 0;
+#ifdef __AVX2__
+  const __m256i v = _mm256_set1_epi8(static_cast<char>(value));
+  for (; l + 32 <= n; l += 32)
+    storeBytes(dst + l, _mm256_add_epi8(loadBytes(dst + l), v));
+#endif
+  for (; l < n; ++l)
+    dst[l] += value;
+}
+
+// Or, And and Xor: VX = VY op VX, then VF = 0
+enum class Logic { Or, And, Xor };
+
+template <Logic logic>
+static void logicBytes(unsigned char *vx, const unsigned char *vy,
+                       unsigned char *vf, std::size_t n) {
+  std::size_t l = 0;
+#ifdef __AVX2__
+  for (; l + 32 <= n; l += 32) {
+    const __m256i x = loadBytes(vx + l);
+    const __m256i y = loadBytes(vy + l);
+    __m256i r;
+    if (logic == Logic::Or)
+      r = _mm256_or_si256(y, x);
+    else if (logic == Logic::And)
+      r = _mm256_and_si256(y, x);
+    else
+      r = _mm256_xor_si256(y, x);
+    storeBytes(vx + l, r);
+    storeBytes(vf + l, _mm256_setzero_si256());
+  }
+#endif
+  for (; l < n; ++l) {
+    if (logic == Logic::Or)
+      vx[l] = vy[l] | vx[l];
+    else if (logic == Logic::And)
+      vx[l] = vy[l] & vx[l];
+    else
+      vx[l] = vy[l] ^ vx[l];
+    vf[l] = 0;
+  }
+}
+
+// 8XY4, 8XY5, 8XY7, 8XY6 and 8XYE: VF first, from the old VX and VY, then VX
+// from VX and VY read again
+enum class Arith { Add, Sub, Subn, ShiftRight, ShiftLeft };
+
+template <Arith arith>
+static void arithBytes(unsigned char *vx, const unsigned char *vy,
+                       unsigned char *vf, std::size_t n) {
+  std::size_t l = 0;
+#ifdef __AVX2__
+  const __m256i one = _mm256_set1_epi8(1);
+  for (; l + 32 <= n; l += 32) {
+    __m256i x = loadBytes(vx + l);
+    __m256i y = loadBytes(vy + l);
+    __m256i flag;
+    if (arith == Arith::Add) {
+      // carry when y > 0xFF - x
+      flag = greaterBytes(y, _mm256_xor_si256(x, _mm256_set1_epi8(-1)));
+      flag = _mm256_and_si256(flag, one);
+    } else if (arith == Arith::Sub) {
+      flag = _mm256_andnot_si256(greaterBytes(y, x), one);
+    } else if (arith == Arith::Subn) {
+      flag = _mm256_andnot_si256(greaterBytes(x, y), one);
+    } else if (arith == Arith::ShiftRight) {
+      flag = _mm256_and_si256(y, one);
+    } else {
+      flag = _mm256_and_si256(_mm256_srli_epi16(y, 7), one);
+    }
+    storeBytes(vf + l, flag);
+
+    x = loadBytes(vx + l);
+    y = loadBytes(vy + l);
+    __m256i r;
+    if (arith == Arith::Add) {
+      r = _mm256_add_epi8(x, y);
+    } else if (arith == Arith::Sub) {
+      r = _mm256_sub_epi8(x, y);
+    } else if (arith == Arith::Subn) {
+      r = _mm256_sub_epi8(y, x);
+    } else if (arith == Arith::ShiftRight) {
+      r = _mm256_and_si256(_mm256_srli_epi16(y, 1), _mm256_set1_epi8(0x7F));
+    } else {
+      r = _mm256_add_epi8(y, y);
+    }
+    storeBytes(vx + l, r);
+  }
+#endif
+  for (; l < n; ++l) {
+    if (arith == Arith::Add) {
+      vf[l] = (vy[l] > (0xFF - vx[l])) ? 1 : 0;
+      vx[l] += vy[l];
+    } else if (arith == Arith::Sub) {
+      vf[l] = (vy[l] > vx[l]) ? 0 : 1;
+      vx[l] -= vy[l];
+    } else if (arith == Arith::Subn) {
+      vf[l] = (vx[l] > vy[l]) ? 0 : 1;
+      vx[l] = vy[l] - vx[l];
+    } else if (arith == Arith::ShiftRight) {
+      vf[l] = vy[l] & 0b1;
+      vx[l] = vy[l] >> 1;
+    } else {
+      vf[l] = vy[l] >> 7;
+      vx[l] = vy[l] << 1;
+    }
+  }
+}
+
+// conditions[l] = 0xFF where VX == NN (or VX != NN), 0 elsewhere
+template <bool equal>
+static void compareBytes(unsigned char *conditions, const unsigned char *vx,
+                         unsigned char nn, std::size_t n) {
+  std::size_t l = 0;
+#ifdef __AVX2__
+  const __m256i v = _mm256_set1_epi8(static_cast<char>(nn));
+  for (; l + 32 <= n; l += 32) {
+    __m256i c = _mm256_cmpeq_epi8(loadBytes(vx + l), v);
+    if (!equal)
+      c = _mm256_xor_si256(c, _mm256_set1_epi8(-1));
+    storeBytes(conditions + l, c);
+  }
+#endif
+  for (; l < n; ++l)
+    conditions[l] = ((vx[l] == nn) == equal) ? 0xFF : 0;
+}
+
+// Same with VY instead of NN
+template <bool equal>
+static void compareBytes(unsigned char *conditions, const unsigned char *vx,
+                         const unsigned char *vy, std::size_t n) {
+  std::size_t l = 0;
+#ifdef __AVX2__
+  for (; l + 32 <= n; l += 32) {
+    __m256i c = _mm256_cmpeq_epi8(loadBytes(vx + l), loadBytes(vy + l));
+    if (!equal)
+      c = _mm256_xor_si256(c, _mm256_set1_epi8(-1));
+    storeBytes(conditions + l, c);
+  }
+#endif
+  for (; l < n; ++l)
+    conditions[l] = ((vx[l] == vy[l]) == equal) ? 0xFF : 0;
+}
+
+// pc += 4 where conditions is set, pc += 2 elsewhere
+static void skipWords(std::uint16_t *pc, const unsigned char *conditions,
+                      std::size_t n) {
+  std::size_t l = 0;
+#ifdef __AVX2__
+  const __m256i two = _mm256_set1_epi16(2);
+  for (; l + 16 <= n; l += 16) {
+    const __m128i c =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(conditions + l));
+    const __m256i skip = _mm256_and_si256(_mm256_cvtepi8_epi16(c), two);
+    const __m256i step = _mm256_add_epi16(two, skip);
+    __m256i *p = reinterpret_cast<__m256i *>(pc + l);
+    _mm256_storeu_si256(p, _mm256_add_epi16(_mm256_loadu_si256(p), step));
+  }
+#endif
+  for (; l < n; ++l)
+    pc[l] += conditions[l] ? 4 : 2;
+}
+
+// words[l] += value
+static void addWords(std::uint16_t *words, std::uint16_t value,
+                     std::size_t n) {
+  std::size_t l = 0;
+#ifdef __AVX2__
+  const __m256i v = _mm256_set1_epi16(static_cast<short>(value));
+  for (; l + 16 <= n; l += 16) {
+    __m256i *p = reinterpret_cast<__m256i *>(words + l);
+    _mm256_storeu_si256(p, _mm256_add_epi16(_mm256_loadu_si256(p), v));
+  }
+#endif
+  for (; l < n; ++l)
+    words[l] += value;
+}
+
+// words[l] += bytes[l], for FX1E
+static void addBytesToWords(std::uint16_t *words, const unsigned char *bytes,
+                            std::size_t n) {
+  std::size_t l = 0;
+#ifdef __AVX2__
+  for (; l + 16 <= n; l += 16) {
+    const __m128i b =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + l));
+    __m256i *p = reinterpret_cast<__m256i *>(words + l);
+    _mm256_storeu_si256(
+        p, _mm256_add_epi16(_mm256_loadu_si256(p), _mm256_cvtepu8_epi16(b)));
+  }
+#endif
+  for (; l < n; ++l)
+    words[l] += bytes[l];
+}
+
+// bytes[l] -= 1 unless already 0
+static void decrementBytes(unsigned char *bytes, std::size_t n) {
+  std::size_t l = 0;
+#ifdef __AVX2__
+  const __m256i one = _mm256_set1_epi8(1);
+  for (; l + 32 <= n; l += 32)
+    storeBytes(bytes + l, _mm256_subs_epu8(loadBytes(bytes + l), one));
+#endif
+  for (; l < n; ++l) {
+    if (bytes[l] > 0)
+      --bytes[l];
+  }
+}
+
+BatchEngine::BatchEngine(std::size_t lanes)
+    : lanes(lanes),
+      stride((lanes + VECTOR_LANES - 1) / VECTOR_LANES * VECTOR_LANES),
+      memory(stride * 4096 + 4), V(16 * stride), I(stride), pc(stride),
+      stack(STACK_DEPTH * stride), sp(stride), errors(stride),
+      delayTimer(stride), soundTimer(stride), gfx(32 * stride),
+      dirtyRows(stride), keys(stride), rngState(stride), opcodes(stride),
+      ops(stride), groupLanes(stride), conditions(stride),
+      decodeTable(opTable()), instructionsPerFrame(1), uniformCycles(0),
+      groupedCycles(0) {
+  Chip8 initial;
+  initial.initialize();
+  loadAll(initial);
+}
+
+void BatchEngine::loadLane(std::size_t lane, const Chip8 &chip8) {
+  std::memcpy(&memory[lane * 4096], chip8.memory.data(), 4096);
+  for (int r = 0; r < 16; ++r)
+    V[r * stride + lane] = chip8.V[r];
+  I[lane] = chip8.I;
+  pc[lane] = chip8.pc;
+  for (int level = 0; level < STACK_DEPTH; ++level)
+    stack[level * stride + lane] = chip8.stack[level];
+  sp[lane] = chip8.sp;
+  errors[lane] = chip8.error;
+  delayTimer[lane] = chip8.delay_timer;
+  soundTimer[lane] = chip8.sound_timer;
+  for (int y = 0; y < 32; ++y)
+    gfx[y * stride + lane] = chip8.gfx[0][y][0];
+  dirtyRows[lane] = static_cast<std::uint32_t>(chip8.dirtyRows);
+
+  keys[lane] = 0;
+  for (int k = 0; k < 16; ++k) {
+    if (chip8.key[k])
+      keys[lane] |= 1u << k;
+  }
+  rngState[lane] = chip8.rngState;
+}
+
+void BatchEngine::loadAll(const Chip8 &chip8) {
+  // The padding lanes too, so they never run on garbage
+  for (std::size_t lane = 0; lane < stride; ++lane)
+    loadLane(lane, chip8);
+}
+
+void BatchEngine::storeLane(std::size_t lane, Chip8 &chip8) const {
+  if (chip8.machine != Machine::Classic)
+    chip8.setMachine(Machine::Classic);
+  std::memcpy(chip8.memory.data(), &memory[lane * 4096], 4096);
+  for (int r = 0; r < 16; ++r)
+    chip8.V[r] = V[r * stride + lane];
+  chip8.I = I[lane];
+  chip8.pc = pc[lane];
+  for (int level = 0; level < STACK_DEPTH; ++level)
+    chip8.stack[level] = stack[level * stride + lane];
+  chip8.sp = sp[lane];
+  chip8.error = errors[lane];
+  chip8.delay_timer = delayTimer[lane];
+  chip8.sound_timer = soundTimer[lane];
+  std::memset(chip8.gfx, 0, sizeof(chip8.gfx));
+  for (int y = 0; y < 32; ++y)
+    chip8.gfx[0][y][0] = gfx[y * stride + lane];
+  chip8.dirtyRows = dirtyRows[lane];
+  chip8.hires = false;
+  chip8.planeMask = 1;
+  for (int k = 0; k < 16; ++k)
+    chip8.key[k] = (keys[lane] >> k) & 1;
+  chip8.rngState = rngState[lane];
+  chip8.opcode = static_cast<unsigned short>(
+      memory[lane * 4096 + (pc[lane] & 0xFFF)] << 8 |
+      memory[lane * 4096 + ((pc[lane] + 1) & 0xFFF)]);
+  chip8.flushCodeCache();
+}
+
+std::uint64_t BatchEngine::screenHash(std::size_t lane) const {
+  std::uint64_t hash = FNV1A64_BASIS;
+  for (int y = 0; y < 32; ++y) {
+    const std::uint64_t row = gfx[y * stride + lane];
+    unsigned char bytes[8];
+    for (int i = 0; i < 8; ++i) {
+      bytes[i] = static_cast<unsigned char>(row >> (56 - 8 * i));
+    }
+    hash = fnv1a64(bytes, sizeof(bytes), hash);
+  }
+  return hash;
+}
+
+void BatchEngine::fetch() {
+  // pc wraps at 4K when fetched, like Chip8::decodeAtPc
+  std::size_t l = 0;
+#ifdef __AVX2__
+  // Gather the 4 bytes at each lane's pc, the opcode is the first two. At
+  // pc 0xFFF the second one is the next lane's (or the padding), so those
+  // lanes take it from their own address 0 instead
+  const int *base = reinterpret_cast<const int *>(memory.data());
+  const __m256i laneStep = _mm256_set1_epi32(8 * 4096);
+  __m256i laneBase = _mm256_setr_epi32(0, 4096, 2 * 4096, 3 * 4096, 4 * 4096,
+                                       5 * 4096, 6 * 4096, 7 * 4096);
+  for (; l + 8 <= lanes; l += 8) {
+    const __m128i pcs = _mm_and_si128(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(&pc[l])),
+        _mm_set1_epi16(0xFFF));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(&pc[l]), pcs);
+    const __m256i lanePcs = _mm256_cvtepu16_epi32(pcs);
+    const __m256i index = _mm256_add_epi32(laneBase, lanePcs);
+    __m256i bytes = _mm256_i32gather_epi32(base, index, 1);
+    const __m256i last =
+        _mm256_cmpeq_epi32(lanePcs, _mm256_set1_epi32(0xFFF));
+    if (!_mm256_testz_si256(last, last)) {
+      const __m256i first = _mm256_i32gather_epi32(base, laneBase, 1);
+      const __m256i wrapped = _mm256_or_si256(
+          _mm256_and_si256(bytes, _mm256_set1_epi32(0xFF)),
+          _mm256_slli_epi32(_mm256_and_si256(first, _mm256_set1_epi32(0xFF)),
+                            8));
+      bytes = _mm256_blendv_epi8(bytes, wrapped, last);
+    }
+    // Swap the two low bytes and pack the 8 opcodes into 16 bits each
+    const __m256i high = _mm256_and_si256(_mm256_slli_epi32(bytes, 8),
+                                          _mm256_set1_epi32(0xFF00));
+    const __m256i low =
+        _mm256_and_si256(_mm256_srli_epi32(bytes, 8), _mm256_set1_epi32(0xFF));
+    const __m256i swapped = _mm256_or_si256(high, low);
+    const __m256i packed = _mm256_permute4x64_epi64(
+        _mm256_packus_epi32(swapped, swapped), 0b1000);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(&opcodes[l]),
+                     _mm256_castsi256_si128(packed));
+    laneBase = _mm256_add_epi32(laneBase, laneStep);
+  }
+#endif
+  for (; l < lanes; ++l) {
+    const unsigned char *lane = &memory[l * 4096];
+    const unsigned address = pc[l] &= 0xFFF;
+    opcodes[l] = static_cast<std::uint16_t>(lane[address] << 8 |
+                                            lane[(address + 1) & 0xFFF]);
+  }
+}
+
+bool BatchEngine::runUniform(unsigned short opcode) {
+  const Operands o = decodeOperands(opcode);
+  unsigned char *vx = &V[o.x * stride];
+  unsigned char *vy = &V[o.y * stride];
+  unsigned char *vf = &V[0xF * stride];
+  const std::size_t n = stride;
+
+  switch (decodeTable[opcode]) {
+  case Op::Jump:
+    std::fill(pc.begin(), pc.end(), o.nnn);
+    return true;
+  case Op::SkipEqNN:
+    compareBytes<true>(conditions.data(), vx, o.nn, n);
+    skipWords(pc.data(), conditions.data(), n);
+    return true;
+  case Op::SkipNeNN:
+    compareBytes<false>(conditions.data(), vx, o.nn, n);
+    skipWords(pc.data(), conditions.data(), n);
+    return true;
+  case Op::SkipEqReg:
+    compareBytes<true>(conditions.data(), vx, vy, n);
+    skipWords(pc.data(), conditions.data(), n);
+    return true;
+  case Op::SkipNeReg:
+    compareBytes<false>(conditions.data(), vx, vy, n);
+    skipWords(pc.data(), conditions.data(), n);
+    return true;
+  case Op::SetNN:
+    std::memset(vx, o.nn, n);
+    break;
+  case Op::AddNN:
+    addBytes(vx, o.nn, n);
+    break;
+  case Op::SetReg:
+    std::memmove(vx, vy, n);
+    break;
+  case Op::Or:
+    logicBytes<Logic::Or>(vx, vy, vf, n);
+    break;
+  case Op::And:
+    logicBytes<Logic::And>(vx, vy, vf, n);
+    break;
+  case Op::Xor:
+    logicBytes<Logic::Xor>(vx, vy, vf, n);
+    break;
+  case Op::AddReg:
+    arithBytes<Arith::Add>(vx, vy, vf, n);
+    break;
+  case Op::SubReg:
+    arithBytes<Arith::Sub>(vx, vy, vf, n);
+    break;
+  case Op::ShiftRight:
+    arithBytes<Arith::ShiftRight>(vx, vy, vf, n);
+    break;
+  case Op::SubnReg:
+    arithBytes<Arith::Subn>(vx, vy, vf, n);
+    break;
+  case Op::ShiftLeft:
+    arithBytes<Arith::ShiftLeft>(vx, vy, vf, n);
+    break;
+  case Op::SetI:
+    std::fill(I.begin(), I.end(), o.nnn);
+    break;
+  case Op::AddI:
+    addBytesToWords(I.data(), vx, n);
+    break;
+  case Op::GetDelay:
+    std::memcpy(vx, delayTimer.data(), n);
+    break;
+  case Op::SetDelay:
+    std::memcpy(delayTimer.data(), vx, n);
+    break;
+  case Op::SetSound:
+    std::memcpy(soundTimer.data(), vx, n);
+    break;
+  default:
+    // Memory, stack, screen and keypad ops are per lane anyway
+    return false;
+  }
+
+  addWords(pc.data(), 2, n);
+  return true;
+}
+
+// Same behavior as the handlers in dispatch.cpp, on one lane of the arrays
+template <Op op>
+void BatchEngine::execGroup(const std::uint32_t *group, std::size_t count) {
+  for (std::size_t i = 0; i < count; ++i) {
+    const std::size_t lane = group[i];
+    const Operands o = decodeOperands(opcodes[lane]);
+    unsigned char *mem = &memory[lane * 4096];
+    unsigned char &vx = V[o.x * stride + lane];
+    unsigned char &vy = V[o.y * stride + lane];
+    unsigned char &vf = V[0xF * stride + lane];
+    std::uint16_t &laneI = I[lane];
+    std::uint16_t &lanePc = pc[lane];
+    std::uint16_t &laneSp = sp[lane];
+
+    switch (op) {
+    case Op::Cls:
+      for (int y = 0; y < 32; ++y) {
+        std::uint64_t &row = gfx[y * stride + lane];
+        if (row)
+          dirtyRows[lane] |= 1u << y;
+        row = 0;
+      }
+      lanePc += 2;
+      break;
+    case Op::Ret:
+      if (laneSp == 0) {
+        errors[lane] = MachineError::StackUnderflow;
+        break;
+      }
+      lanePc = stack[--laneSp * stride + lane];
+      lanePc += 2;
+      break;
+    case Op::Jump:
+      lanePc = o.nnn;
+      break;
+    case Op::Call:
+      if (laneSp >= STACK_DEPTH) {
+        errors[lane] = MachineError::StackOverflow;
+        break;
+      }
+      stack[laneSp++ * stride + lane] = lanePc;
+      lanePc = o.nnn;
+      break;
+    case Op::SkipEqNN:
+      lanePc += (vx == o.nn) ? 4 : 2;
+      break;
+    case Op::SkipNeNN:
+      lanePc += (vx != o.nn) ? 4 : 2;
+      break;
+    case Op::SkipEqReg:
+      lanePc += (vx == vy) ? 4 : 2;
+      break;
+    case Op::SetNN:
+      vx = o.nn;
+      lanePc += 2;
+      break;
+    case Op::AddNN:
+      vx += o.nn;
+      lanePc += 2;
+      break;
+    case Op::SetReg:
+      vx = vy;
+      lanePc += 2;
+      break;
+    case Op::Or:
+      logicBytes<Logic::Or>(&vx, &vy, &vf, 1);
+      lanePc += 2;
+      break;
+    case Op::And:
+      logicBytes<Logic::And>(&vx, &vy, &vf, 1);
+      lanePc += 2;
+      break;
+    case Op::Xor:
+      logicBytes<Logic::Xor>(&vx, &vy, &vf, 1);
+      lanePc += 2;
+      break;
+    case Op::AddReg:
+      arithBytes<Arith::Add>(&vx, &vy, &vf, 1);
+      lanePc += 2;
+      break;
+    case Op::SubReg:
+      arithBytes<Arith::Sub>(&vx, &vy, &vf, 1);
+      lanePc += 2;
+      break;
+    case Op::ShiftRight:
+      arithBytes<Arith::ShiftRight>(&vx, &vy, &vf, 1);
+      lanePc += 2;
+      break;
+    case Op::SubnReg:
+      arithBytes<Arith::Subn>(&vx, &vy, &vf, 1);
+      lanePc += 2;
+      break;
+    case Op::ShiftLeft:
+      arithBytes<Arith::ShiftLeft>(&vx, &vy, &vf, 1);
+      lanePc += 2;
+      break;
+    case Op::SkipNeReg:
+      lanePc += (vx != vy) ? 4 : 2;
+      break;
+    case Op::SetI:
+      laneI = o.nnn;
+      lanePc += 2;
+      break;
+    case Op::JumpV0:
+      lanePc = (o.nnn + V[lane]) & 0xFFF;
+      break;
+    case Op::Random: {
+      // Same generator as Chip8::nextRandom
+      std::uint32_t &state = rngState[lane];
+      state ^= state << 13;
+      state ^= state >> 17;
+      state ^= state << 5;
+      vx = o.nn & (state & 0xFF);
+      lanePc += 2;
+      break;
+    }
+    case Op::Draw: {
+      const int x = vx % 64;
+      const int y = vy % 32;
+      int height = o.n;
+      if (y + height > 32)
+        height = 32 - y;
+
+      std::uint64_t collision = 0;
+      for (int row = 0; row < height; ++row) {
+        const std::uint64_t sprite =
+            (static_cast<std::uint64_t>(mem[(laneI + row) & 0xFFF]) << 56) >> x;
+        std::uint64_t &line = gfx[(y + row) * stride + lane];
+        collision |= line & sprite;
+        line ^= sprite;
+        if (sprite)
+          dirtyRows[lane] |= 1u << (y + row);
+      }
+      vf = collision != 0;
+      lanePc += 2;
+      break;
+    }
+    case Op::SkipKey:
+      lanePc += ((keys[lane] >> (vx & 0xF)) & 1) ? 4 : 2;
+      break;
+    case Op::SkipNoKey:
+      lanePc += ((keys[lane] >> (vx & 0xF)) & 1) ? 2 : 4;
+      break;
+    case Op::GetDelay:
+      vx = delayTimer[lane];
+      lanePc += 2;
+      break;
+    case Op::WaitKey:
+      if (keys[lane]) {
+        vx = static_cast<unsigned char>(__builtin_ctz(keys[lane]));
+        lanePc += 2;
+      }
+      break;
+    case Op::SetDelay:
+      delayTimer[lane] = vx;
+      lanePc += 2;
+      break;
+    case Op::SetSound:
+      soundTimer[lane] = vx;
+      lanePc += 2;
+      break;
+    case Op::AddI:
+      laneI += vx;
+      lanePc += 2;
+      break;
+    case Op::FontChar:
+      laneI = FONT_START + (vx & 0xF) * 0x5;
+      lanePc += 2;
+      break;
+    case Op::Bcd:
+      mem[laneI & 0xFFF] = vx / 100;
+      mem[(laneI + 1) & 0xFFF] = (vx / 10) % 10;
+      mem[(laneI + 2) & 0xFFF] = (vx % 100) % 10;
+      lanePc += 2;
+      break;
+    case Op::Store:
+      for (int r = 0; r <= o.x; ++r)
+        mem[(laneI + r) & 0xFFF] = V[r * stride + lane];
+      laneI += o.x + 1;
+      lanePc += 2;
+      break;
+    case Op::Load:
+      for (int r = 0; r <= o.x; ++r)
+        V[r * stride + lane] = mem[(laneI + r) & 0xFFF];
+      laneI += o.x + 1;
+      lanePc += 2;
+      break;
+    case Op::Unknown:
+      errors[lane] = MachineError::UnknownOpcode;
+      break;
+    // Lanes only decode the classic instruction set, see opTable()
+    default:
+      break;
+    }
+  }
+}
+
+void BatchEngine::runGrouped() {
+  // Counting sort of the lanes by Op
+  std::uint32_t counts[OP_COUNT] = {0};
+  for (std::size_t l = 0; l < lanes; ++l) {
+    ops[l] = decodeTable[opcodes[l]];
+    ++counts[static_cast<int>(ops[l])];
+  }
+
+  std::uint32_t start[OP_COUNT];
+  std::uint32_t next = 0;
+  for (int op = 0; op < OP_COUNT; ++op) {
+    start[op] = next;
+    next += counts[op];
+  }
+
+  std::uint32_t fill[OP_COUNT];
+  std::copy(start, start + OP_COUNT, fill);
+  for (std::size_t l = 0; l < lanes; ++l)
+    groupLanes[fill[static_cast<int>(ops[l])]++] =
+        static_cast<std::uint32_t>(l);
+
+  // Lanes do not share anything, the order groups run in does not matter
+#define OP_GROUP(name) &BatchEngine::execGroup<Op::name>,
+  static void (BatchEngine::*const groups[OP_COUNT])(const std::uint32_t *,
+                                                     std::size_t) = {
+      FOR_EACH_OP(OP_GROUP)};
+#undef OP_GROUP
+
+  for (int op = 0; op < OP_COUNT; ++op) {
+    if (counts[op])
+      (this->*groups[op])(&groupLanes[start[op]], counts[op]);
+  }
+}
+
+void BatchEngine::runCycles(unsigned long count) {
+  for (unsigned long cycle = 0; cycle < count; ++cycle) {
+    fetch();
+
+    const std::uint16_t first = opcodes[0];
+    bool uniform = true;
+    for (std::size_t l = 1; l < lanes && uniform; ++l)
+      uniform = opcodes[l] == first;
+
+    if (uniform && runUniform(first)) {
+      ++uniformCycles;
+    } else {
+      runGrouped();
+      ++groupedCycles;
+    }
+  }
+}
+
+void BatchEngine::tickTimers() {
+  decrementBytes(delayTimer.data(), stride);
+  decrementBytes(soundTimer.data(), stride);
+}
+
+void BatchEngine::step(const std::uint16_t *actions) {
+  std::copy(actions, actions + lanes, keys.begin());
+  runCycles(instructionsPerFrame);
+  tickTimers();
+}
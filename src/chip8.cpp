@@ -1,12 +1,12 @@
-#include <cstdio>
+#include <algorithm>
 #include <cstdlib>
-#include <exception>
+#include <cstring>
 #include <fstream>
 #include <iostream>
-
-#include <unistd.h>
+#include <random>
 
 #include "../include/chip8.hpp"
+#include "../include/hash.hpp"
 
 const unsigned char chip8_fontset[80] = {
     0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
@@ -27,8 +27,119 @@ const unsigned char chip8_fontset[80] = {
     0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 };
 
-Chip8::Chip8() {
-  // empty
+// 8x10 digits of FX30. SUPER-CHIP only had 0-9, A-F are XO-CHIP's
+const unsigned char chip8_bigfontset[160] = {
+    0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, // 0
+    0x18, 0x78, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0xFF, 0xFF, // 1
+    0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // 2
+    0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 3
+    0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0x03, 0x03, // 4
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 5
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 6
+    0xFF, 0xFF, 0x03, 0x03, 0x06, 0x0C, 0x18, 0x18, 0x18, 0x18, // 7
+    0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 8
+    0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 9
+    0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, // A
+    0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, // B
+    0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C, // C
+    0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // E
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0  // F
+};
+
+const char *machineName(Machine machine) {
+  switch (machine) {
+  case Machine::Classic:
+    return "chip8";
+  case Machine::SuperChip:
+    return "schip";
+  case Machine::XoChip:
+    return "xochip";
+  }
+  return "unknown";
+}
+
+bool parseMachine(const std::string &name, Machine &machine) {
+  for (Machine m : {Machine::Classic, Machine::SuperChip, Machine::XoChip}) {
+    if (name == machineName(m)) {
+      machine = m;
+      return true;
+    }
+  }
+  return false;
+}
+
+Machine machineForPath(const std::string &path) {
+  const std::size_t dot = path.rfind('.');
+  const std::string extension =
+      dot == std::string::npos ? "" : path.substr(dot);
+  if (extension == ".sc8")
+    return Machine::SuperChip;
+  if (extension == ".xo8")
+    return Machine::XoChip;
+  return Machine::Classic;
+}
+
+const char *quirksName(Quirks quirks) {
+  switch (quirks) {
+  case Quirks::CosmacVip:
+    return "cosmac";
+  case Quirks::Chip48:
+    return "chip48";
+  case Quirks::SuperChip:
+    return "schip";
+  case Quirks::XoChip:
+    return "xochip";
+  }
+  return "unknown";
+}
+
+bool parseQuirks(const std::string &name, Quirks &quirks) {
+  for (Quirks q : {Quirks::CosmacVip, Quirks::Chip48, Quirks::SuperChip,
+                   Quirks::XoChip}) {
+    if (name == quirksName(q)) {
+      quirks = q;
+      return true;
+    }
+  }
+  return false;
+}
+
+Quirks defaultQuirks(Machine machine) {
+  switch (machine) {
+  case Machine::SuperChip:
+    return Quirks::SuperChip;
+  case Machine::XoChip:
+    return Quirks::XoChip;
+  default:
+    return Quirks::CosmacVip;
+  }
+}
+
+const char *machineErrorName(MachineError error) {
+  switch (error) {
+  case MachineError::None:
+    return "none";
+  case MachineError::StackOverflow:
+    return "stack overflow";
+  case MachineError::StackUnderflow:
+    return "stack underflow";
+  case MachineError::UnknownOpcode:
+    return "unknown opcode";
+  }
+  return "unknown";
+}
+
+Chip8::Chip8()
+    : decodeTable(opTable()), handlers(opHandlers(Quirks::CosmacVip)),
+      machine(Machine::Classic), quirks(Quirks::CosmacVip),
+      error(MachineError::None), writtenPages(0), soundSetAt(SOUND_NOT_SET),
+      tracer(nullptr) {
+#ifdef CHIP8_PROFILE
+  profiler = nullptr;
+#endif
+  setMachine(Machine::Classic);
+  seedRandom(std::random_device()());
 }
 
 Chip8::~Chip8() {
@@ -47,18 +158,20 @@ void Chip8::initialize() {
   /// program counter should also be set to this location.
 
   // Start of the application block in memory
-  this->pc = 0x200;
+  this->pc = ROM_START;
   // Reset current opcode
   this->opcode = 0;
   // Reset index register
   this->I = 0;
-  // Reset stack pointer
+  // Reset stack pointer, and whatever stopped the machine
   this->sp = 0;
+  this->error = MachineError::None;
 
-  // Clear display
-  for (int i = 0; i < (64 * 32); ++i) {
-    this->gfx[i] = 0;
-  }
+  // Clear display, back to the 64 x 32 mode and the first plane
+  std::memset(this->gfx, 0, sizeof(this->gfx));
+  this->dirtyRows = ~0ULL;
+  this->hires = false;
+  this->planeMask = 1;
 
   // Clear stack
   for (int i = 0; i < 16; ++i) {
@@ -71,13 +184,17 @@ void Chip8::initialize() {
   }
 
   // Clear memory
-  for (int i = 0; i < 4096; ++i) {
-    this->memory[i] = 0;
-  }
+  std::fill(this->memory.begin(), this->memory.end(), 0);
 
   // Load fontset
   for (int i = 0; i < 80; ++i)
-    this->memory[i + 50] = chip8_fontset[i];
+    this->memory[FONT_START + i] = chip8_fontset[i];
+  if (machine != Machine::Classic)
+    std::memcpy(this->memory.data() + BIG_FONT_START, chip8_bigfontset,
+                sizeof(chip8_bigfontset));
+
+  // Nothing decoded from the old memory is valid anymore
+  flushCodeCache();
 
   // Reset key state
   for (int i = 0; i < 16; ++i) {
@@ -88,33 +205,56 @@ void Chip8::initialize() {
   this->delay_timer = 0;
   this->sound_timer = 0;
 
+  // Reset the SUPER-CHIP flags and the XO-CHIP sound
+  std::memset(this->rplFlags, 0, sizeof(this->rplFlags));
+  std::memset(this->audioPattern, 0, sizeof(this->audioPattern));
+  this->pitch = 64;
+  this->audioPatternLoaded = false;
+
   this->drawFlag = true;
 }
 
-void Chip8::emulateCycle() {
-  // Fetch opcode
-  opcode = memory[pc] << 8 | memory[pc + 1];
+void Chip8::invalidateWrapped(unsigned address, unsigned length) {
+  if (address + length <= memorySize()) {
+    invalidateCode(static_cast<unsigned short>(address),
+                   static_cast<unsigned short>(length));
+    return;
+  }
+  for (unsigned i = 0; i < length; ++i)
+    invalidateCode(static_cast<unsigned short>((address + i) & memoryMask()),
+                   1);
+}
 
-  // std::cout << "DEBUG: OPCODE " << std::hex << opcode << std::dec <<
-  // std::endl;
+void Chip8::emulateCycleSwitch() {
+  // Fetch opcode, pc and the second byte of the last address wrapping
+  // around the end of memory like in decodeAtPc
+  pc &= memoryMask();
+  opcode = memory[pc] << 8 | memory[(pc + 1) & memoryMask()];
 
   // Decode opcode
   switch (opcode & 0xF000) {
   case 0x0000:
     switch (opcode & 0x00FF) {
     case 0x00E0: // 0x00E0: Clear screen
-      for (int i = 0; i < (64 * 32); ++i) {
-        gfx[i] = 0;
+      for (int i = 0; i < 32; ++i) {
+        if (gfx[0][i][0])
+          dirtyRows |= 1ULL << i;
+        gfx[0][i][0] = 0;
       }
+      drawFlag = true;
       pc += 2;
       break;
     case 0x00EE: // 0x00EE: Return from subroutine to address pulled from stack
+      if (sp == 0) {
+        error = MachineError::StackUnderflow;
+        break;
+      }
       --sp;
       pc = stack[sp];
       pc += 2;
       break;
     default:
-      printf("Unknown opcode [0x0000]: 0x%X\n", opcode);
+      error = MachineError::UnknownOpcode;
       break;
     }
     break;
@@ -122,6 +262,10 @@ void Chip8::emulateCycle() {
     pc = opcode & 0x0FFF;
     break;
   case 0x2000: // 0x2NNN: Jump to the address NNN, and save return address
+    if (sp >= STACK_DEPTH) {
+      error = MachineError::StackOverflow;
+      break;
+    }
     stack[sp] = pc;
     ++sp;
     pc = opcode & 0x0FFF;
@@ -150,7 +294,7 @@ void Chip8::emulateCycle() {
       }
       break;
     default:
-      printf("Unknown opcode [0x5000]: 0x%X\n", this->opcode);
+      error = MachineError::UnknownOpcode;
       break;
     }
     break;
@@ -226,12 +370,12 @@ void Chip8::emulateCycle() {
     case 0x000E: // 0x8XYE: Set value of VY to VX, and shift one bit to left.
                  // and set VF to the bit shifted out
       // Storw the one bit that would be shifted out
-      V[0xF] = V[(opcode & 0x00F0) >> 4] & 0b10000000;
+      V[0xF] = V[(opcode & 0x00F0) >> 4] >> 7;
       V[(opcode & 0x0F00) >> 8] = V[(opcode & 0x00F0) >> 4] << 1;
       pc += 2;
       break;
     default:
-      printf("Unknown opcode [0x8000]: 0x%X\n", this->opcode);
+      error = MachineError::UnknownOpcode;
       break;
     }
     break;
@@ -248,28 +392,32 @@ void Chip8::emulateCycle() {
     pc += 2;
     break;
   case 0xB000: // 0xBNNN: jump to address NNN + V0
-    pc = (opcode & 0x0FFF) + V[0x0];
+    pc = ((opcode & 0x0FFF) + V[0x0]) & memoryMask();
     break;
   case 0xC000: // 0xCXNN: Set random value masked with NN (AND-bitwise) to VX
-    srand(time(0));
-    V[(opcode & 0x0F00) >> 8] = (opcode & 0x00FF) & (rand() % 255);
+    V[(opcode & 0x0F00) >> 8] = (opcode & 0x00FF) & (nextRandom() & 0xFF);
     pc += 2;
     break;
-  case 0xD000: // 0xDXYN: Draw sprite 8xN at X,Y position.
+  case 0xD000: // 0xDXYN: Draw sprite 8xN at X,Y position. The position wraps
+               // around the screen, the sprite itself is clipped at the edges
   {
-    unsigned short x = V[(opcode & 0x0F00) >> 8];
-    unsigned short y = V[(opcode & 0x00F0) >> 4];
+    unsigned short x = V[(opcode & 0x0F00) >> 8] % 64;
+    unsigned short y = V[(opcode & 0x00F0) >> 4] % 32;
     unsigned short height = opcode & 0x000F;
     unsigned short pixel;
 
+    // Pixel by pixel on purpose, this is the reference the word-wide draw of
+    // the dispatch table is checked against
     V[0xF] = 0;
-    for (int yline = 0; yline < height; yline++) {
-      pixel = memory[I + yline];
-      for (int xline = 0; xline < 8; xline++) {
+    for (int yline = 0; yline < height && y + yline < 32; yline++) {
+      pixel = memory[(I + yline) & memoryMask()];
+      for (int xline = 0; xline < 8 && x + xline < 64; xline++) {
         if ((pixel & (0x80 >> xline)) != 0) {
-          if (gfx[(x + xline + ((y + yline) * 64))] == 1)
+          const std::uint64_t mask = 1ULL << (63 - (x + xline));
+          if (gfx[0][y + yline][0] & mask)
             V[0xF] = 1; // collision detected
-          gfx[x + xline + ((y + yline) * 64)] ^= 1;
+          gfx[0][y + yline][0] ^= mask;
+          dirtyRows |= 1ULL << (y + yline);
         }
       }
     }
@@ -281,7 +429,7 @@ void Chip8::emulateCycle() {
     switch (opcode & 0x00FF) {
     case 0x009E: // 0xEX9E: Skips the next instruction if the key stored in VX
                  // is pressed
-      if (key[V[(opcode & 0x0F00) >> 8]] != 0) {
+      if (key[V[(opcode & 0x0F00) >> 8] & 0xF] != 0) {
         pc += 4;
       } else {
         pc += 2;
@@ -289,12 +437,15 @@ void Chip8::emulateCycle() {
       break;
     case 0x00A1: // 0xEXA1: Skips the next instruction if the key stored in VX
                  // is NOT pressed
-      if (key[V[(opcode & 0x0F00) >> 8]] == 0) {
+      if (key[V[(opcode & 0x0F00) >> 8] & 0xF] == 0) {
         pc += 4;
       } else {
         pc += 2;
       }
       break;
+    default:
+      error = MachineError::UnknownOpcode;
+      break;
     }
     break;
   case 0xF000:
@@ -340,8 +491,10 @@ void Chip8::emulateCycle() {
       } else if (key[15]) {
         V[Vx] = 15;
       } else {
-        pc -= 2;
+        // No key pressed, pc stays on this opcode to run it again
+        break;
       }
+      pc += 2;
     } break;
     case 0x0015: // 0xFX15
       delay_timer = V[(opcode & 0x0F00) >> 8];
@@ -358,20 +511,31 @@ void Chip8::emulateCycle() {
     case 0x0029: // 0xFX29: Sets I to the location of the sprite for the
                  // character in VX. Characters 0-F (in hexadecimal) are
                  // represented by a 4x5 font
-      I = V[(opcode & 0x0F00) >> 8] * 0x5;
+      I = FONT_START + (V[(opcode & 0x0F00) >> 8] & 0xF) * 0x5;
       pc += 2;
       break;
     case 0x0033: // 0xFX33: write the value of vX as BCD value at the addresses
                  // I, I+1 and I+2
-      memory[I] = V[(opcode & 0x0F00) >> 8] / 100;
-      memory[I + 1] = (V[(opcode & 0x0F00) >> 8] / 10) % 10;
-      memory[I + 2] = (V[(opcode & 0x0F00) >> 8] % 100) % 10;
+      // Each address wraps around the end of memory on its own
+      memory[I & memoryMask()] = V[(opcode & 0x0F00) >> 8] / 100;
+      memory[(I + 1) & memoryMask()] = (V[(opcode & 0x0F00) >> 8] / 10) % 10;
+      memory[(I + 2) & memoryMask()] = (V[(opcode & 0x0F00) >> 8] % 100) % 10;
+      invalidateWrapped(I, 3);
       pc += 2;
       break;
     case 0x0055: // 0xFX55: write the content of v0 to vX at the memory pointed
       // to by I, I is incremented by X+1
-      for (int i = 0; i <= ((opcode & 0x0F00) >> 8); ++i)
-        memory[I + i] = V[i];
+      // Checked once for the whole run, only one crossing the end of memory
+      // wraps address by address
+      if (I + ((opcode & 0x0F00) >> 8) + 1u <= memorySize()) {
+        for (int i = 0; i <= ((opcode & 0x0F00) >> 8); ++i)
+          memory[I + i] = V[i];
+        invalidateCode(I, ((opcode & 0x0F00) >> 8) + 1);
+      } else {
+        for (int i = 0; i <= ((opcode & 0x0F00) >> 8); ++i)
+          memory[(I + i) & memoryMask()] = V[i];
+        invalidateWrapped(I, ((opcode & 0x0F00) >> 8) + 1);
+      }
 
       // On the original interpreter, when the operation is done, I = I + X + 1.
       I += ((opcode & 0x0F00) >> 8) + 1;
@@ -380,66 +544,137 @@ void Chip8::emulateCycle() {
     case 0x0065: // 0xFX65: read the bytes from memory pointed to by I into the
                  // V v0 to vX, I is incremented by X+1
 
-      for (int i = 0; i <= ((opcode & 0x0F00) >> 8); ++i)
-        V[i] = memory[I + i];
+      if (I + ((opcode & 0x0F00) >> 8) + 1u <= memorySize()) {
+        for (int i = 0; i <= ((opcode & 0x0F00) >> 8); ++i)
+          V[i] = memory[I + i];
+      } else {
+        for (int i = 0; i <= ((opcode & 0x0F00) >> 8); ++i)
+          V[i] = memory[(I + i) & memoryMask()];
+      }
 
       // On the original interpreter, when the operation is done, I = I + X + 1.
       I += ((opcode & 0x0F00) >> 8) + 1;
       pc += 2;
       break;
     default:
-      printf("Unknown opcode [0xF000]: 0x%X\n", this->opcode);
+      error = MachineError::UnknownOpcode;
       break;
     }
     break;
   default:
-    printf("Unknown opcode: 0x%X\n", this->opcode);
+    error = MachineError::UnknownOpcode;
     break;
   }
+}
+
+std::uint64_t Chip8::screenHash() const {
+  std::uint64_t hash = FNV1A64_BASIS;
+  const int planes = machine == Machine::XoChip ? PLANE_COUNT : 1;
+  const int words = hires ? 2 : 1;
+  for (int plane = 0; plane < planes; ++plane) {
+    for (int y = 0; y < height(); ++y) {
+      unsigned char row[16];
+      for (int i = 0; i < 8 * words; ++i) {
+        row[i] = static_cast<unsigned char>(gfx[plane][y][i >> 3] >>
+                                            (56 - 8 * (i & 7)));
+      }
+      hash = fnv1a64(row, 8 * words, hash);
+    }
+  }
+  return hash;
+}
 
-  // Update timers
+void Chip8::tickTimers() {
   if (delay_timer > 0)
     --delay_timer;
 
-  if (sound_timer > 0) {
-    if (sound_timer == 1)
-      printf("BEEP!\n"); // TODO implement: support for sound
+  if (sound_timer > 0)
     --sound_timer;
+}
+
+void Chip8::setMachine(Machine machine) {
+  this->machine = machine;
+  decodeTable = opTable(machine);
+
+  // New memory is cleared, and everything was decoded for the previous
+  // instruction set
+  memory.resize(memorySize());
+  codeCache.resize(memorySize() + CODE_CACHE_SLACK);
+  for (DecodedOp &entry : codeCache)
+    entry.valid = false;
+  setQuirks(defaultQuirks(machine));
+}
+
+void Chip8::predecode(unsigned short address) {
+  DecodedOp &entry = codeCache[address];
+  // The second byte of the last address wraps around, like pc would
+  entry.opcode = memory[address] << 8 | memory[(address + 1) & memoryMask()];
+  entry.op = decodeTable[entry.opcode];
+  entry.operands = decodeOperands(entry.opcode);
+  entry.valid = true;
+}
+
+const DecodedOp &Chip8::decodeAtPc() {
+  pc &= memoryMask();
+  if (!codeCache[pc].valid)
+    predecode(pc);
+  return codeCache[pc];
+}
+
+void Chip8::invalidateCode(unsigned short address, unsigned short length) {
+  int first = address - 1;
+  int last = address + length;
+  if (first < 0)
+    first = 0;
+  if (last > static_cast<int>(memorySize()))
+    last = static_cast<int>(memorySize());
+
+  for (int i = first; i < last; ++i) {
+    codeCache[i].valid = false;
   }
+  // The opcode at the last address takes its second byte from address 0
+  if (address == 0)
+    codeCache[memoryMask()].valid = false;
 
-  // Simulate 60Hz (60 op per Second)
-  usleep(1000000 / 60000000);
+  for (int page = first >> 6; page <= (last - 1) >> 6 && page < 64; ++page) {
+    writtenPages |= 1ULL << page;
+  }
+}
+
+void Chip8::flushCodeCache() {
+  for (DecodedOp &entry : codeCache)
+    entry.valid = false;
+  writtenPages = ~0ULL;
+}
+
+bool Chip8::loadRom(const unsigned char *data, std::size_t size) {
+  if (size > maxRomSize())
+    return false;
+
+  std::memcpy(memory.data() + ROM_START, data, size);
+  invalidateCode(ROM_START, static_cast<unsigned short>(size));
+  return true;
 }
 
 bool Chip8::loadGame(const std::string &gamePath) {
-  try {
-    // Open the file as a stream of binary and move the file pointer to the end
-    std::ifstream gameFile(gamePath, std::ios::binary | std::ios::ate);
-
-    if (gameFile.is_open()) {
-      // Get size of file and allocate a buffer to hold the contents
-      std::streampos size = gameFile.tellg();
-      char *buffer = new char[size];
-
-      // Go back to the beginning of the file and fill the buffer
-      gameFile.seekg(0, std::ios::beg);
-      gameFile.read(buffer, size);
-      gameFile.close();
-
-      // Load the ROM contents into the Chip8's memory, starting at 0x200
-      for (long i = 0; i < size; ++i) {
-        memory[0x200 + i] = buffer[i];
-      }
+  // Open the file as a stream of binary and move the file pointer to the end
+  std::ifstream gameFile(gamePath, std::ios::binary | std::ios::ate);
+  if (!gameFile.is_open())
+    return false;
 
-      // Free the buffer
-      delete[] buffer;
-    }
-  } catch (const std::exception &e) {
-    std::cerr << e.what() << std::endl;
+  const std::streamoff size = gameFile.tellg();
+  if (size < 0 || size > static_cast<std::streamoff>(maxRomSize())) {
+    std::cerr << "ROM too large: " << size << " bytes, at most "
+              << maxRomSize() << " fit on " << machineName(machine)
+              << std::endl;
     return false;
-    // exit(EXIT_FAILURE);
   }
 
+  // Read the ROM straight into memory, starting at 0x200
+  gameFile.seekg(0, std::ios::beg);
+  if (!gameFile.read(reinterpret_cast<char *>(memory.data() + ROM_START), size))
+    return false;
+  invalidateCode(ROM_START, static_cast<unsigned short>(size));
   return true;
 }
 
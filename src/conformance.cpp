@@ -0,0 +1,805 @@
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include "../include/batch_engine.hpp"
+#include "../include/chip8.hpp"
+#include "../include/conformance.hpp"
+#include "../include/jit.hpp"
+#include "../include/scheduler.hpp"
+
+namespace {
+
+// Bytes of the generated program, from ROM_START, and of the random sprite
+// data right after it. Opcodes reading or writing memory through I in the
+// structured programs use the scratch area after the sprites.
+constexpr unsigned PROGRAM_SIZE = 0x200;
+constexpr unsigned SPRITE_START = ROM_START + PROGRAM_SIZE;
+constexpr unsigned SPRITE_SIZE = 0x100;
+constexpr unsigned SCRATCH_START = SPRITE_START + SPRITE_SIZE;
+
+// Most bytes an opcode reads or writes from I: a 16x16 sprite on both
+// XO-CHIP planes
+constexpr unsigned MAX_I_ACCESS = 64;
+
+// Largest chunk of opcodes handed to the recompiler at once
+constexpr unsigned long MAX_CHUNK = 64;
+
+// Lanes of the batch engine, five vectors of the AVX2 fetch, and the ones
+// running the case: at both ends of a vector, in the middle and last, where
+// a fetch could stray into the next lane or past the end of them all
+constexpr std::size_t BATCH_LANES = 40;
+constexpr std::size_t CASE_LANES[] = {0, 7, 8, 21, 39};
+
+// Other programs the remaining lanes run, when they diverge from the case
+constexpr unsigned NOISE_PROGRAMS = 3;
+
+// Generator behind everything a case is made of (xorshift32, like
+// Chip8::nextRandom), so a seed always makes the same case
+class CaseRandom {
+private:
+  std::uint32_t state;
+
+public:
+  explicit CaseRandom(std::uint32_t seed) : state(seed ? seed : 0x9E3779B9u) {}
+
+  std::uint32_t next() {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+  }
+
+  unsigned below(unsigned bound) { return next() % bound; }
+  unsigned char byte() { return static_cast<unsigned char>(next() >> 24); }
+  bool chance(unsigned outOf) { return below(outOf) == 0; }
+};
+
+// Writes a program opcode by opcode from ROM_START
+class ProgramWriter {
+private:
+  Chip8 &chip8;
+  unsigned address;
+
+public:
+  explicit ProgramWriter(Chip8 &chip8) : chip8(chip8), address(ROM_START) {}
+
+  unsigned here() const { return address; }
+
+  // Room left before the final jump back to the start
+  unsigned left() const { return ROM_START + PROGRAM_SIZE - 2 - address; }
+
+  void emit(unsigned opcode) {
+    chip8.memory[address] = static_cast<unsigned char>(opcode >> 8);
+    chip8.memory[address + 1] = static_cast<unsigned char>(opcode);
+    address += 2;
+  }
+
+  // Replace the opcode written at an earlier address
+  void patch(unsigned at, unsigned opcode) {
+    chip8.memory[at] = static_cast<unsigned char>(opcode >> 8);
+    chip8.memory[at + 1] = static_cast<unsigned char>(opcode);
+  }
+};
+
+// Values where the flags of 8XY4 to 8XYE change
+const unsigned char EDGE_VALUES[] = {0x00, 0x01, 0x7F, 0x80, 0xFE, 0xFF};
+
+unsigned char edgeValue(CaseRandom &random) {
+  if (random.chance(3))
+    return random.byte();
+  return EDGE_VALUES[random.below(sizeof(EDGE_VALUES))];
+}
+
+// An opcode the machine knows, drawn at random. Jumps and calls are kept in
+// the program so that it keeps running code rather than zeros
+unsigned short randomOpcode(CaseRandom &random, const Op *table) {
+  unsigned short opcode;
+  do {
+    opcode = static_cast<unsigned short>(random.next() >> 16);
+  } while (table[opcode] == Op::Unknown);
+
+  const Op op = table[opcode];
+  if (op == Op::Jump || op == Op::Call)
+    opcode = (opcode & 0xF000) |
+             ((ROM_START + random.below(PROGRAM_SIZE)) & ~1);
+  else if (op == Op::JumpV0)
+    opcode = (opcode & 0xF000) |
+             ((ROM_START + random.below(PROGRAM_SIZE - 0x100)) & ~1);
+  return opcode;
+}
+
+void writeRandomProgram(CaseRandom &random, Chip8 &chip8) {
+  ProgramWriter program(chip8);
+  const Op *table = opTable(chip8.machine);
+  while (program.left() > 0)
+    program.emit(randomOpcode(random, table));
+}
+
+// One of the 8XYN, with the values they get set to first
+void emitArithmetic(CaseRandom &random, ProgramWriter &program) {
+  static const unsigned char OPS[] = {0x0, 0x1, 0x2, 0x3, 0x4,
+                                      0x5, 0x6, 0x7, 0xE};
+  const unsigned x = random.below(16);
+  // VF as an operand, to check which of the result and the flag wins
+  const unsigned y = random.chance(8) ? 0xF : random.below(16);
+  program.emit(0x6000 | x << 8 | edgeValue(random));
+  program.emit(0x6000 | y << 8 | edgeValue(random));
+  program.emit(0x8000 | x << 8 | y << 4 | OPS[random.below(sizeof(OPS))]);
+}
+
+// VX counted down from a few iterations, something done in the loop
+void emitLoop(CaseRandom &random, ProgramWriter &program) {
+  const unsigned x = random.below(15);
+  unsigned y = random.below(15);
+  if (y == x)
+    y = (x + 1) % 15;
+  program.emit(0x6000 | x << 8 | (1 + random.below(8)));
+  const unsigned body = program.here();
+  program.emit(0x7000 | y << 8 | random.byte());
+  program.emit(0x7000 | x << 8 | 0xFF);
+  program.emit(0x3000 | x << 8);
+  program.emit(0x1000 | body);
+}
+
+// A call to a subroutine placed right after it, jumped over on return
+void emitSubroutine(CaseRandom &random, ProgramWriter &program) {
+  const unsigned call = program.here();
+  program.emit(0x2000 | (call + 4));
+  program.emit(0x1000); // patched to jump past the subroutine
+  const unsigned count = 1 + random.below(3);
+  for (unsigned i = 0; i < count; ++i)
+    program.emit(0x7000 | random.below(15) << 8 | random.byte());
+  program.emit(0x00EE);
+  program.patch(call + 2, 0x1000 | program.here());
+}
+
+// A sprite from the data after the program, drawn near the edges as often
+// as not to get clipping and wrapping
+void emitSprite(CaseRandom &random, ProgramWriter &program, Machine machine) {
+  const unsigned x = random.below(15);
+  const unsigned y = (x + 1 + random.below(14)) % 15;
+  program.emit(0xA000 | (SPRITE_START + random.below(SPRITE_SIZE - 64)));
+  program.emit(0x6000 | x << 8 |
+               (random.chance(2) ? random.byte() : 56 + random.below(8)));
+  program.emit(0x6000 | y << 8 |
+               (random.chance(2) ? random.byte() : 26 + random.below(6)));
+  // DXY0 draws 16x16 beyond the classic machine
+  const unsigned rows = machine == Machine::Classic ? 1 + random.below(15)
+                                                    : random.below(16);
+  program.emit(0xD000 | x << 8 | y << 4 | rows);
+}
+
+// A digit of the font, VX above 0xF now and then, drawn
+void emitFontDigit(CaseRandom &random, ProgramWriter &program,
+                   Machine machine) {
+  const unsigned x = random.below(15);
+  program.emit(0x6000 | x << 8 |
+               (random.chance(4) ? random.byte() : random.below(16)));
+  if (machine != Machine::Classic && random.chance(2)) {
+    program.emit(0xF030 | x << 8);
+    program.emit(0xD000 | x << 8 | x << 4 | 10);
+  } else {
+    program.emit(0xF029 | x << 8);
+    program.emit(0xD000 | x << 8 | x << 4 | 5);
+  }
+}
+
+// FX33 then the digits read back, FX55 and FX65 around changed registers
+void emitMemory(CaseRandom &random, ProgramWriter &program) {
+  const unsigned x = random.below(16);
+  program.emit(0xA000 | (SCRATCH_START + random.below(0x100)));
+  if (random.chance(2)) {
+    program.emit(0x6000 | x << 8 | random.byte());
+    program.emit(0xF033 | x << 8);
+    program.emit(0xF265);
+  } else {
+    program.emit(0xF055 | x << 8);
+    program.emit(0x6000 | random.below(16) << 8 | random.byte());
+    program.emit(0xF01E | random.below(16) << 8);
+    program.emit(0xF065 | x << 8);
+  }
+}
+
+// Skips over an opcode, over an XO-CHIP F000 NNNN now and then
+void emitSkip(CaseRandom &random, ProgramWriter &program, Machine machine) {
+  const unsigned x = random.below(16);
+  const unsigned y = random.below(16);
+  const unsigned short skips[] = {
+      static_cast<unsigned short>(0x3000 | x << 8 | random.byte()),
+      static_cast<unsigned short>(0x4000 | x << 8 | random.byte()),
+      static_cast<unsigned short>(0x5000 | x << 8 | y << 4),
+      static_cast<unsigned short>(0x9000 | x << 8 | y << 4),
+      static_cast<unsigned short>(0xE09E | x << 8),
+      static_cast<unsigned short>(0xE0A1 | x << 8)};
+  if (random.chance(2))
+    program.emit(0x6000 | x << 8 | random.below(16));
+  program.emit(skips[random.below(6)]);
+  if (machine == Machine::XoChip && random.chance(2)) {
+    program.emit(0xF000);
+    program.emit(SPRITE_START + random.below(SPRITE_SIZE));
+  } else {
+    program.emit(0x7000 | random.below(15) << 8 | random.byte());
+  }
+}
+
+// Random numbers and the timers
+void emitTimers(CaseRandom &random, ProgramWriter &program) {
+  const unsigned x = random.below(16);
+  program.emit(0xC000 | x << 8 | random.byte());
+  program.emit((random.chance(2) ? 0xF015 : 0xF018) | x << 8);
+  program.emit(0xF007 | random.below(16) << 8);
+}
+
+// BNNN landing past the opcode following it, V0 (or VX with the quirk) set
+// to get there
+void emitIndirectJump(ProgramWriter &program) {
+  const unsigned target = program.here() + 6;
+  program.emit(0x6002);
+  program.emit(0x6002 | ((target >> 8) & 0xF) << 8);
+  program.emit(0xB000 | target);
+  program.emit(0x00E0); // jumped over
+}
+
+// What SUPER-CHIP adds: the screen modes, scrolls and the flags
+void emitSuperChip(CaseRandom &random, ProgramWriter &program) {
+  switch (random.below(5)) {
+  case 0:
+    program.emit(random.chance(2) ? 0x00FF : 0x00FE);
+    break;
+  case 1:
+    program.emit(0x00C0 | random.below(16));
+    break;
+  case 2:
+    program.emit(random.chance(2) ? 0x00FB : 0x00FC);
+    break;
+  case 3:
+    program.emit(0xF075 | random.below(8) << 8);
+    break;
+  default:
+    program.emit(0xF085 | random.below(8) << 8);
+    break;
+  }
+}
+
+// What XO-CHIP adds: planes, scrolling up, register ranges, long I, audio
+void emitXoChip(CaseRandom &random, ProgramWriter &program) {
+  switch (random.below(5)) {
+  case 0:
+    program.emit(0xF001 | random.below(4) << 8);
+    break;
+  case 1:
+    program.emit(0x00D0 | random.below(16));
+    break;
+  case 2:
+    program.emit(0xA000 | (SCRATCH_START + random.below(0x100)));
+    program.emit((random.chance(2) ? 0x5002 : 0x5003) |
+                 random.below(16) << 8 | random.below(16) << 4);
+    break;
+  case 3:
+    program.emit(0xF000);
+    program.emit(SPRITE_START + random.below(SPRITE_SIZE - MAX_I_ACCESS));
+    program.emit(0xF002);
+    break;
+  default:
+    program.emit(0xF03A | random.below(16) << 8);
+    break;
+  }
+}
+
+void writeStructuredProgram(CaseRandom &random, Chip8 &chip8) {
+  ProgramWriter program(chip8);
+  const Machine machine = chip8.machine;
+  // The longest snippet is 7 opcodes
+  while (program.left() >= 14) {
+    switch (random.below(machine == Machine::Classic ? 10 : 11)) {
+    case 0:
+    case 1:
+      emitArithmetic(random, program);
+      break;
+    case 2:
+      emitLoop(random, program);
+      break;
+    case 3:
+      emitSubroutine(random, program);
+      break;
+    case 4:
+      emitSprite(random, program, machine);
+      break;
+    case 5:
+      emitFontDigit(random, program, machine);
+      break;
+    case 6:
+      emitMemory(random, program);
+      break;
+    case 7:
+      emitSkip(random, program, machine);
+      break;
+    case 8:
+      emitTimers(random, program);
+      break;
+    case 9:
+      if (random.chance(8))
+        program.emit(0xF00A | random.below(16) << 8);
+      else
+        emitIndirectJump(program);
+      break;
+    default:
+      if (machine == Machine::XoChip && random.chance(2))
+        emitXoChip(random, program);
+      else
+        emitSuperChip(random, program);
+      break;
+    }
+  }
+  while (program.left() > 0)
+    program.emit(0x7000 | random.below(15) << 8 | random.byte());
+  program.emit(0x1000 | ROM_START);
+}
+
+// A few opcodes at the very end of memory, the case starting on them: they
+// run off the end into address 0, where a jump leads back to the program.
+// Half of the time they start on an odd address, so that one opcode takes
+// its second byte from address 0
+void writeTail(CaseRandom &random, Chip8 &chip8) {
+  const Op *table = opTable(chip8.machine);
+  const unsigned count = 1 + random.below(4);
+  const bool odd = random.chance(2);
+  const unsigned start =
+      static_cast<unsigned>(chip8.memorySize()) - 2 * count - (odd ? 1 : 0);
+  for (unsigned i = 0; i < count; ++i) {
+    const unsigned short opcode = randomOpcode(random, table);
+    chip8.memory[start + 2 * i] = static_cast<unsigned char>(opcode >> 8);
+    chip8.memory[start + 2 * i + 1] = static_cast<unsigned char>(opcode);
+  }
+  const unsigned jump = odd ? 1 : 0;
+  if (odd) {
+    chip8.memory[chip8.memorySize() - 1] = static_cast<unsigned char>(
+        randomOpcode(random, table) >> 8);
+    chip8.memory[0] = random.byte();
+  }
+  chip8.memory[jump] = static_cast<unsigned char>(0x10 | ROM_START >> 8);
+  chip8.memory[jump + 1] = static_cast<unsigned char>(ROM_START);
+  chip8.pc = static_cast<unsigned short>(start);
+}
+
+// Everything an opcode can read or change, copied so that each engine
+// starts from the same state. The instruction cache is dropped instead
+void copyState(const Chip8 &from, Chip8 &to) {
+  if (to.machine != from.machine)
+    to.setMachine(from.machine);
+  to.setQuirks(from.quirks);
+  to.memory = from.memory;
+  std::memcpy(to.V, from.V, sizeof(to.V));
+  to.I = from.I;
+  to.pc = from.pc;
+  to.opcode = from.opcode;
+  std::memcpy(to.gfx, from.gfx, sizeof(to.gfx));
+  to.dirtyRows = from.dirtyRows;
+  to.drawFlag = from.drawFlag;
+  to.hires = from.hires;
+  to.planeMask = from.planeMask;
+  to.delay_timer = from.delay_timer;
+  to.sound_timer = from.sound_timer;
+  std::memcpy(to.stack, from.stack, sizeof(to.stack));
+  to.sp = from.sp;
+  to.error = from.error;
+  std::memcpy(to.key, from.key, sizeof(to.key));
+  std::memcpy(to.rplFlags, from.rplFlags, sizeof(to.rplFlags));
+  std::memcpy(to.audioPattern, from.audioPattern, sizeof(to.audioPattern));
+  to.pitch = from.pitch;
+  to.audioPatternLoaded = from.audioPatternLoaded;
+  to.rngState = from.rngState;
+  to.flushCodeCache();
+}
+
+// The opcode the next fetch at address reads, wrapping like it
+unsigned short opcodeAt(const Chip8 &chip8, unsigned short address) {
+  const unsigned at = address & chip8.memoryMask();
+  return static_cast<unsigned short>(
+      chip8.memory[at] << 8 | chip8.memory[(at + 1) & chip8.memoryMask()]);
+}
+
+} // namespace
+
+const char *engineName(Engine engine) {
+  switch (engine) {
+  case Engine::Switch:
+    return "switch";
+  case Engine::Table:
+    return "table";
+  case Engine::Threaded:
+    return "threaded";
+  case Engine::Jit:
+    return "jit";
+  case Engine::Batch:
+    return "batch";
+  }
+  return "?";
+}
+
+const char *firstDifference(const Chip8 &a, const Chip8 &b) {
+  if (a.pc != b.pc)
+    return "pc";
+  if (a.I != b.I)
+    return "I";
+  if (std::memcmp(a.V, b.V, sizeof(a.V)) != 0)
+    return "V";
+  if (a.opcode != b.opcode)
+    return "opcode";
+  if (a.sp != b.sp || std::memcmp(a.stack, b.stack, sizeof(a.stack)) != 0)
+    return "stack";
+  if (a.error != b.error)
+    return "error";
+  if (a.delay_timer != b.delay_timer || a.sound_timer != b.sound_timer)
+    return "timers";
+  if (a.memorySize() != b.memorySize() ||
+      a.memory != b.memory)
+    return "memory";
+  if (std::memcmp(a.gfx, b.gfx, sizeof(a.gfx)) != 0)
+    return "gfx";
+  if (a.hires != b.hires || a.planeMask != b.planeMask)
+    return "mode";
+  if (std::memcmp(a.rplFlags, b.rplFlags, sizeof(a.rplFlags)) != 0)
+    return "flags";
+  if (std::memcmp(a.audioPattern, b.audioPattern, sizeof(a.audioPattern)) !=
+          0 ||
+      a.pitch != b.pitch || a.audioPatternLoaded != b.audioPatternLoaded)
+    return "audio";
+  if (a.rngState != b.rngState)
+    return "rng";
+  return nullptr;
+}
+
+bool inDefinedState(const Chip8 &chip8) {
+  return chip8.error == MachineError::None;
+}
+
+void generateCase(const ConformanceCase &test, Chip8 &chip8) {
+  CaseRandom random(test.seed);
+  chip8.setMachine(test.machine);
+  chip8.setQuirks(test.quirks);
+  chip8.initialize();
+  chip8.seedRandom(random.next());
+
+  if (test.kind == ProgramKind::Structured)
+    writeStructuredProgram(random, chip8);
+  else
+    writeRandomProgram(random, chip8);
+  for (unsigned i = 0; i < SPRITE_SIZE; ++i)
+    chip8.memory[SPRITE_START + i] = random.byte();
+  if (random.chance(8))
+    writeTail(random, chip8);
+  chip8.flushCodeCache();
+
+  for (unsigned char &v : chip8.V)
+    v = edgeValue(random);
+  chip8.I = static_cast<unsigned short>(SPRITE_START +
+                                        random.below(SPRITE_SIZE));
+  // Now and then right at the end of memory, where accesses wrap around
+  if (random.chance(8))
+    chip8.I = static_cast<unsigned short>(chip8.memorySize() - 1 -
+                                          random.below(MAX_I_ACCESS));
+  chip8.sp = static_cast<unsigned short>(random.below(16));
+  for (unsigned short &level : chip8.stack)
+    level = static_cast<unsigned short>(
+        (ROM_START + random.below(PROGRAM_SIZE)) & ~1u);
+  chip8.delay_timer = random.byte();
+  chip8.sound_timer = random.byte();
+
+  // No key at all in half of the cases, so FX0A waits
+  const bool keys = random.chance(2);
+  for (unsigned char &key : chip8.key)
+    key = keys && random.chance(4);
+
+  if (test.machine != Machine::Classic)
+    chip8.hires = random.chance(2);
+  if (test.machine == Machine::XoChip)
+    chip8.planeMask = static_cast<unsigned char>(1 + random.below(3));
+  const int planes = test.machine == Machine::XoChip ? PLANE_COUNT : 1;
+  const int words = chip8.hires ? 2 : 1;
+  for (int plane = 0; plane < planes; ++plane) {
+    for (int y = 0; y < chip8.height(); ++y) {
+      for (int word = 0; word < words; ++word)
+        chip8.gfx[plane][y][word] =
+            static_cast<std::uint64_t>(random.next()) << 32 | random.next();
+    }
+  }
+
+  for (unsigned char &flag : chip8.rplFlags)
+    flag = random.byte();
+  if (test.machine == Machine::XoChip) {
+    for (unsigned char &bits : chip8.audioPattern)
+      bits = random.byte();
+    chip8.pitch = random.byte();
+  }
+}
+
+ConformanceChecker::ConformanceChecker()
+    : jit(new Jit(compiled)), batch(new BatchEngine(BATCH_LANES)) {}
+
+ConformanceChecker::~ConformanceChecker() = default;
+
+std::vector<Engine> ConformanceChecker::enginesFor(Machine machine,
+                                                   Quirks quirks) const {
+  const bool cosmac =
+      machine == Machine::Classic && quirks == Quirks::CosmacVip;
+  std::vector<Engine> engines;
+  if (cosmac)
+    engines.push_back(Engine::Table);
+  engines.push_back(Engine::Threaded);
+  if (jit->available())
+    engines.push_back(Engine::Jit);
+  if (cosmac)
+    engines.push_back(Engine::Batch);
+  return engines;
+}
+
+bool ConformanceChecker::check(const ConformanceCase &test,
+                               unsigned long steps, Mismatch &mismatch,
+                               unsigned long &stepsRun) {
+  generateCase(test, start);
+  const bool useSwitch =
+      test.machine == Machine::Classic && test.quirks == Quirks::CosmacVip;
+  auto stepReference = [&]() {
+    if (useSwitch)
+      reference.emulateCycleSwitch();
+    else
+      reference.emulateCycle();
+  };
+
+  // How far the case stays defined, so that no engine is ever asked to run
+  // past it: the recompiler runs ahead of the comparisons
+  copyState(start, reference);
+  unsigned long limit = 0;
+  while (limit < steps && inDefinedState(reference)) {
+    stepReference();
+    ++limit;
+  }
+  stepsRun = limit;
+
+  const std::vector<Engine> engines = enginesFor(test.machine, test.quirks);
+  bool useTable = false, useThreaded = false, useJit = false,
+       useBatch = false;
+  for (Engine engine : engines) {
+    useTable |= engine == Engine::Table;
+    useThreaded |= engine == Engine::Threaded;
+    useJit |= engine == Engine::Jit;
+    useBatch |= engine == Engine::Batch;
+  }
+
+  CaseRandom chunks(test.seed ^ 0x5EED5EEDu);
+  copyState(start, reference);
+  copyState(start, table);
+  copyState(start, threaded);
+  copyState(start, compiled);
+  if (useBatch) {
+    // Every lane on the case, which runs it through the all-lanes kernels,
+    // or the others on programs of their own, so that the lanes diverge and
+    // run grouped by Op
+    const bool diverge = chunks.chance(2);
+    batch->loadAll(start);
+    for (unsigned program = 0; diverge && program < NOISE_PROGRAMS;
+         ++program) {
+      ConformanceCase noise = test;
+      noise.seed = test.seed * 31 + program + 1;
+      generateCase(noise, lane);
+      for (std::size_t l = program; l < BATCH_LANES; l += NOISE_PROGRAMS)
+        batch->loadLane(l, lane);
+    }
+    for (std::size_t l : CASE_LANES)
+      batch->loadLane(l, start);
+  }
+  // storeLane leaves what a lane does not hold, the persistent flags, alone
+  copyState(start, lane);
+
+  auto differs = [&](Engine engine, const Chip8 &chip8, unsigned long step,
+                     unsigned long chunk, unsigned short pc,
+                     unsigned short opcode) {
+    const char *field = firstDifference(reference, chip8);
+    if (!field)
+      return false;
+    mismatch.engine = engine;
+    mismatch.field = field;
+    mismatch.step = step;
+    mismatch.chunk = chunk;
+    mismatch.pc = pc;
+    mismatch.opcode = opcode;
+    return true;
+  };
+
+  unsigned long jitFrom = 0, jitTo = 0;
+  unsigned short jitPc = 0, jitOpcode = 0;
+  for (unsigned long step = 0; step < limit;) {
+    const unsigned short pc = reference.pc;
+    const unsigned short opcode = opcodeAt(reference, pc);
+
+    if (useJit && step == jitTo) {
+      unsigned long chunk =
+          chunks.chance(2) ? 1 : 1 + chunks.below(MAX_CHUNK);
+      if (chunk > limit - step)
+        chunk = limit - step;
+      jit->runCycles(chunk);
+      jitFrom = step;
+      jitTo = step + chunk;
+      jitPc = pc;
+      jitOpcode = opcode;
+    }
+
+    stepReference();
+    ++step;
+
+    if (useTable) {
+      table.emulateCycle();
+      if (differs(Engine::Table, table, step, 1, pc, opcode))
+        return false;
+    }
+    if (useThreaded) {
+      threaded.runCycles(1);
+      if (differs(Engine::Threaded, threaded, step, 1, pc, opcode))
+        return false;
+    }
+    if (useBatch) {
+      batch->runCycles(1);
+      for (std::size_t l : CASE_LANES) {
+        batch->storeLane(l, lane);
+        // A lane does not keep the opcode it ran, storeLane gives the next
+        lane.opcode = reference.opcode;
+        if (differs(Engine::Batch, lane, step, 1, pc, opcode)) {
+          mismatch.field += " (lane " + std::to_string(l) + ")";
+          return false;
+        }
+      }
+    }
+    if (useJit && step == jitTo &&
+        differs(Engine::Jit, compiled, step, jitTo - jitFrom, jitPc,
+                jitOpcode))
+      return false;
+  }
+  return true;
+}
+
+namespace {
+
+// Screen hash of a picture file as the machine would have it: 32 rows of 64
+// pixels or 64 rows of 128 for the high resolution mode, '#' for a lit pixel
+// and '.' for a dark one, lit on the first plane only
+bool pictureHash(const std::string &path, Machine machine,
+                 std::uint64_t &hash) {
+  std::ifstream file(path);
+  if (!file.is_open())
+    return false;
+  std::vector<std::string> rows;
+  std::string row;
+  while (std::getline(file, row))
+    rows.push_back(row);
+
+  Chip8 chip8;
+  chip8.setMachine(machine);
+  chip8.initialize();
+  chip8.hires = rows.size() == SCREEN_HEIGHT_MAX;
+  if (static_cast<int>(rows.size()) != chip8.height())
+    return false;
+  for (int y = 0; y < chip8.height(); ++y) {
+    if (static_cast<int>(rows[y].size()) != chip8.width())
+      return false;
+    for (int x = 0; x < chip8.width(); ++x) {
+      if (rows[y][x] == '#')
+        chip8.gfx[0][y][x >> 6] |= std::uint64_t(1) << (63 - (x & 63));
+      else if (rows[y][x] != '.')
+        return false;
+    }
+  }
+  hash = chip8.screenHash();
+  return true;
+}
+
+} // namespace
+
+bool loadExpectations(const std::string &path,
+                      std::vector<ScreenExpectation> &expectations) {
+  std::ifstream file(path);
+  if (!file.is_open())
+    return false;
+  // Pictures are named relative to the file naming them
+  const std::size_t slash = path.rfind('/');
+  const std::string directory =
+      slash == std::string::npos ? "" : path.substr(0, slash + 1);
+
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream fields(line);
+    std::string romHash, cycles, screenHash, machine, quirks;
+    if (!(fields >> romHash) || romHash[0] == '#')
+      continue;
+    if (!(fields >> cycles >> screenHash))
+      return false;
+
+    ScreenExpectation expectation;
+    char *end;
+    expectation.romHash = std::strtoull(romHash.c_str(), &end, 16);
+    if (*end != '\0')
+      return false;
+    expectation.cycles = std::strtoul(cycles.c_str(), &end, 10);
+    if (*end != '\0' || expectation.cycles == 0)
+      return false;
+    if (fields >> machine) {
+      if (!parseMachine(machine, expectation.machine))
+        return false;
+      expectation.hasMachine = true;
+    }
+    if (fields >> quirks) {
+      if (!parseQuirks(quirks, expectation.quirks))
+        return false;
+      expectation.hasQuirks = true;
+    }
+    if (screenHash[0] == '@') {
+      if (!pictureHash(directory + screenHash.substr(1), expectation.machine,
+                       expectation.screenHash))
+        return false;
+    } else {
+      expectation.screenHash = std::strtoull(screenHash.c_str(), &end, 16);
+      if (*end != '\0')
+        return false;
+    }
+    expectations.push_back(expectation);
+  }
+  return true;
+}
+
+std::uint64_t runScreenHash(Engine engine, const unsigned char *data,
+                            std::size_t size, unsigned long cycles,
+                            Machine machine, Quirks quirks) {
+  if ((engine == Engine::Switch || engine == Engine::Batch) &&
+      (machine != Machine::Classic || quirks != Quirks::CosmacVip))
+    return 0;
+
+  Chip8 chip8;
+  chip8.setMachine(machine);
+  chip8.setQuirks(quirks);
+  chip8.initialize();
+  chip8.seedRandom(CONFORMANCE_SEED);
+  if (!chip8.loadRom(data, size))
+    return 0;
+
+  std::unique_ptr<Jit> jit;
+  std::unique_ptr<BatchEngine> batch;
+  if (engine == Engine::Jit) {
+    jit.reset(new Jit(chip8));
+    if (!jit->available())
+      return 0;
+  } else if (engine == Engine::Batch) {
+    batch.reset(new BatchEngine(1));
+    batch->loadLane(0, chip8);
+  }
+
+  const unsigned long ipf = instructionsPerFrame(IPS_NORMAL);
+  for (unsigned long done = 0; done < cycles;) {
+    const unsigned long count = cycles - done < ipf ? cycles - done : ipf;
+    switch (engine) {
+    case Engine::Switch:
+      for (unsigned long i = 0; i < count; ++i)
+        chip8.emulateCycleSwitch();
+      break;
+    case Engine::Table:
+      for (unsigned long i = 0; i < count; ++i)
+        chip8.emulateCycle();
+      break;
+    case Engine::Threaded:
+      chip8.runCycles(count);
+      break;
+    case Engine::Jit:
+      jit->runCycles(count);
+      break;
+    case Engine::Batch:
+      batch->runCycles(count);
+      batch->tickTimers();
+      break;
+    }
+    if (engine != Engine::Batch)
+      chip8.tickTimers();
+    done += count;
+  }
+  return batch ? batch->screenHash(0) : chip8.screenHash();
+}
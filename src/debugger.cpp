@@ -0,0 +1,465 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "../include/debugger.hpp"
+
+// Bitmaps of one bit per address of the largest memory
+constexpr std::size_t BITMAP_WORDS = 65536 / 64;
+
+// Watched register bit of I, after V0 to VF
+constexpr int WATCH_I = 16;
+
+bool parseAddress(const std::string &text, unsigned &value) {
+  const bool hex = text.size() > 2 && text[0] == '0' &&
+                   (text[1] == 'x' || text[1] == 'X');
+  const char *digits = text.c_str() + (hex ? 2 : 0);
+  if (*digits == '\0' || *digits == '-' || *digits == '+')
+    return false;
+  char *end;
+  const unsigned long parsed = std::strtoul(digits, &end, hex ? 16 : 10);
+  if (*end != '\0' || parsed > 0xFFFF)
+    return false;
+  value = static_cast<unsigned>(parsed);
+  return true;
+}
+
+bool parseRegister(const std::string &name, DebugRegister &reg,
+                   unsigned char &index) {
+  std::string upper(name);
+  for (char &c : upper)
+    c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+
+  index = 0;
+  if (upper.size() == 2 && upper[0] == 'V' &&
+      std::isxdigit(static_cast<unsigned char>(upper[1]))) {
+    reg = DebugRegister::V;
+    index = static_cast<unsigned char>(
+        std::strtoul(upper.c_str() + 1, nullptr, 16));
+  } else if (upper == "I") {
+    reg = DebugRegister::I;
+  } else if (upper == "DT") {
+    reg = DebugRegister::DelayTimer;
+  } else if (upper == "ST") {
+    reg = DebugRegister::SoundTimer;
+  } else if (upper == "SP") {
+    reg = DebugRegister::Sp;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool parseCondition(const std::string &text, DebugCondition &condition) {
+  const std::size_t start = text.find_first_of("=!<>");
+  if (start == std::string::npos)
+    return false;
+  std::size_t end = text.find_first_not_of("=!<>", start);
+  if (end == std::string::npos)
+    end = text.size();
+
+  // Spaces around the operands are optional
+  auto trim = [](const std::string &s) {
+    const std::size_t first = s.find_first_not_of(" \t");
+    if (first == std::string::npos)
+      return std::string();
+    return s.substr(first, s.find_last_not_of(" \t") - first + 1);
+  };
+
+  DebugCondition parsed;
+  parsed.comparison = text.substr(start, end - start);
+  static const char *const comparisons[] = {"==", "!=", "<", "<=", ">", ">="};
+  if (std::find(std::begin(comparisons), std::end(comparisons),
+                parsed.comparison) == std::end(comparisons))
+    return false;
+  if (!parseRegister(trim(text.substr(0, start)), parsed.reg, parsed.index) ||
+      !parseAddress(trim(text.substr(end)), parsed.value))
+    return false;
+  condition = parsed;
+  return true;
+}
+
+bool DebugCondition::holds(const Chip8 &chip8) const {
+  unsigned current = 0;
+  switch (reg) {
+  case DebugRegister::V:
+    current = chip8.V[index];
+    break;
+  case DebugRegister::I:
+    current = chip8.I;
+    break;
+  case DebugRegister::DelayTimer:
+    current = chip8.delay_timer;
+    break;
+  case DebugRegister::SoundTimer:
+    current = chip8.sound_timer;
+    break;
+  case DebugRegister::Sp:
+    current = chip8.sp;
+    break;
+  }
+
+  if (comparison == "==")
+    return current == value;
+  if (comparison == "!=")
+    return current != value;
+  if (comparison == "<")
+    return current < value;
+  if (comparison == "<=")
+    return current <= value;
+  if (comparison == ">")
+    return current > value;
+  return current >= value;
+}
+
+std::string DebugCondition::text() const {
+  static const char *const names[] = {"V", "I", "DT", "ST", "SP"};
+  char buffer[32];
+  if (reg == DebugRegister::V)
+    std::snprintf(buffer, sizeof(buffer), "V%X %s 0x%X", index,
+                  comparison.c_str(), value);
+  else
+    std::snprintf(buffer, sizeof(buffer), "%s %s 0x%X",
+                  names[static_cast<int>(reg)], comparison.c_str(), value);
+  return buffer;
+}
+
+Debugger::Debugger(Chip8 &chip8, unsigned long instructionsPerFrame)
+    : chip8(chip8), breakBits(BITMAP_WORDS), readBits(BITMAP_WORDS),
+      writeBits(BITMAP_WORDS), breakCount(0), watchCount(0),
+      registerWatch(0), stepping(false), returnPc(-1), returnSp(-1),
+      outSp(-1), frameLeft(instructionsPerFrame),
+      instructionsPerFrame(instructionsPerFrame), cycles(0), frames(0),
+      watchAddress(0), watchLength(0), watchWrite(false), watchRegister(-1),
+      watchOldValue(0) {}
+
+void Debugger::set(std::vector<std::uint64_t> &bits, unsigned address,
+                   bool value) {
+  const std::uint64_t mask = 1ULL << (address & 63);
+  if (value)
+    bits[address >> 6] |= mask;
+  else
+    bits[address >> 6] &= ~mask;
+}
+
+void Debugger::addBreakpoint(unsigned address,
+                             const DebugCondition *condition) {
+  address &= 0xFFFF;
+  if (!test(breakBits, address)) {
+    set(breakBits, address, true);
+    ++breakCount;
+  }
+  if (condition)
+    conditions[address] = *condition;
+  else
+    conditions.erase(address);
+}
+
+bool Debugger::removeBreakpoint(unsigned address) {
+  address &= 0xFFFF;
+  if (!test(breakBits, address))
+    return false;
+  set(breakBits, address, false);
+  conditions.erase(address);
+  --breakCount;
+  return true;
+}
+
+void Debugger::watchMemory(unsigned first, unsigned last, bool read,
+                           bool write) {
+  for (unsigned address = first; address <= last && address <= 0xFFFF;
+       ++address) {
+    const bool was = test(readBits, address) || test(writeBits, address);
+    if (read)
+      set(readBits, address, true);
+    if (write)
+      set(writeBits, address, true);
+    if (!was && (read || write))
+      ++watchCount;
+  }
+}
+
+void Debugger::unwatchMemory(unsigned first, unsigned last) {
+  for (unsigned address = first; address <= last && address <= 0xFFFF;
+       ++address) {
+    if (test(readBits, address) || test(writeBits, address))
+      --watchCount;
+    set(readBits, address, false);
+    set(writeBits, address, false);
+  }
+}
+
+bool Debugger::watchRegisterChange(DebugRegister reg, unsigned char index,
+                                   bool watch) {
+  int bit;
+  if (reg == DebugRegister::V)
+    bit = index & 0xF;
+  else if (reg == DebugRegister::I)
+    bit = WATCH_I;
+  else
+    return false;
+
+  if (watch)
+    registerWatch |= 1u << bit;
+  else
+    registerWatch &= ~(1u << bit);
+  return true;
+}
+
+void Debugger::clear() {
+  std::fill(breakBits.begin(), breakBits.end(), 0);
+  std::fill(readBits.begin(), readBits.end(), 0);
+  std::fill(writeBits.begin(), writeBits.end(), 0);
+  conditions.clear();
+  breakCount = 0;
+  watchCount = 0;
+  registerWatch = 0;
+}
+
+std::vector<std::pair<unsigned, const DebugCondition *>>
+Debugger::breakpoints() const {
+  std::vector<std::pair<unsigned, const DebugCondition *>> found;
+  for (std::size_t word = 0; word < BITMAP_WORDS; ++word) {
+    for (std::uint64_t bits = breakBits[word]; bits != 0; bits &= bits - 1) {
+      const unsigned address =
+          static_cast<unsigned>(word * 64 + __builtin_ctzll(bits));
+      const auto condition = conditions.find(address);
+      found.emplace_back(address, condition != conditions.end()
+                                      ? &condition->second
+                                      : nullptr);
+    }
+  }
+  return found;
+}
+
+std::vector<std::string> Debugger::watchpoints() const {
+  std::vector<std::string> found;
+  char text[32];
+
+  // Runs of addresses watched the same way
+  unsigned address = 0;
+  while (address <= 0xFFFF) {
+    const bool read = test(readBits, address);
+    const bool write = test(writeBits, address);
+    unsigned last = address;
+    while (last < 0xFFFF && test(readBits, last + 1) == read &&
+           test(writeBits, last + 1) == write)
+      ++last;
+    if (read || write) {
+      std::snprintf(text, sizeof(text), "0x%03X-0x%03X %s%s", address, last,
+                    read ? "r" : "", write ? "w" : "");
+      found.push_back(text);
+    }
+    address = last + 1;
+  }
+
+  for (int bit = 0; bit <= WATCH_I; ++bit) {
+    if (!(registerWatch >> bit & 1))
+      continue;
+    if (bit == WATCH_I)
+      std::snprintf(text, sizeof(text), "I");
+    else
+      std::snprintf(text, sizeof(text), "V%X", bit);
+    found.push_back(text);
+  }
+  return found;
+}
+
+unsigned short Debugger::opcodeAtPc() const {
+  // pc may have run past the end of memory, the fetch wraps it
+  const unsigned pc = chip8.pc & chip8.memoryMask();
+  return static_cast<unsigned short>(
+      chip8.memory[pc] << 8 | chip8.memory[(pc + 1) & chip8.memoryMask()]);
+}
+
+void Debugger::accesses(unsigned &first, unsigned &length,
+                        bool &writes) const {
+  const unsigned short opcode = opcodeAtPc();
+  const Operands o = decodeOperands(opcode);
+  const unsigned range = (o.x <= o.y ? o.y - o.x : o.x - o.y) + 1u;
+
+  first = chip8.I;
+  length = 0;
+  writes = false;
+  switch (opTable(chip8.machine)[opcode]) {
+  case Op::Draw:
+    length = o.n;
+    break;
+  case Op::DrawExt:
+    // One sprite per plane drawn, one after the other
+    length = (o.n == 0 ? 32u : o.n) *
+             static_cast<unsigned>(__builtin_popcount(chip8.planeMask & 3));
+    break;
+  case Op::Load:
+    length = o.x + 1u;
+    break;
+  case Op::LoadRange:
+    length = range;
+    break;
+  case Op::Audio:
+    length = 16;
+    break;
+  case Op::Bcd:
+    length = 3;
+    writes = true;
+    break;
+  case Op::Store:
+    length = o.x + 1u;
+    writes = true;
+    break;
+  case Op::StoreRange:
+    length = range;
+    writes = true;
+    break;
+  default:
+    break;
+  }
+}
+
+bool Debugger::checkedCycle(bool &watchHit) {
+  watchHit = false;
+  if (watchCount) {
+    unsigned first, length;
+    bool writes;
+    accesses(first, length, writes);
+    const std::vector<std::uint64_t> &bits = writes ? writeBits : readBits;
+    for (unsigned i = 0; i < length; ++i) {
+      if (test(bits, (first + i) & chip8.memoryMask())) {
+        watchHit = true;
+        watchAddress = first;
+        watchLength = length;
+        watchWrite = writes;
+        watchRegister = -1;
+        break;
+      }
+    }
+  }
+
+  unsigned char before[16];
+  const unsigned short beforeI = chip8.I;
+  if (registerWatch)
+    std::memcpy(before, chip8.V, sizeof(before));
+
+  chip8.emulateCycle();
+
+  if (registerWatch && !watchHit) {
+    for (int bit = 0; bit < 16; ++bit) {
+      if (registerWatch >> bit & 1 && before[bit] != chip8.V[bit]) {
+        watchHit = true;
+        watchRegister = bit;
+        watchOldValue = before[bit];
+        break;
+      }
+    }
+    if (!watchHit && registerWatch >> WATCH_I & 1 && beforeI != chip8.I) {
+      watchHit = true;
+      watchRegister = WATCH_I;
+      watchOldValue = beforeI;
+    }
+    if (watchHit)
+      watchLength = 0;
+  }
+
+  return stepping &&
+         ((returnPc >= 0 && chip8.pc == returnPc && chip8.sp == returnSp) ||
+          (outSp >= 0 && chip8.sp < outSp));
+}
+
+void Debugger::advance(unsigned long count) {
+  while (count > 0) {
+    const unsigned long taken = std::min(count, frameLeft);
+    frameLeft -= taken;
+    cycles += taken;
+    count -= taken;
+    if (frameLeft == 0) {
+      chip8.tickTimers();
+      ++frames;
+      frameLeft = instructionsPerFrame;
+    }
+  }
+}
+
+DebugStop Debugger::run(unsigned long long count) {
+  bool resuming = true;
+
+  while (count > 0) {
+    const unsigned short pc =
+        static_cast<unsigned short>(chip8.pc & chip8.memoryMask());
+    if (chip8.error != MachineError::None)
+      return DebugStop::Error;
+
+    // Nothing to check: the rest of the frame at full speed
+    if (breakCount == 0 && watchCount == 0 && registerWatch == 0 &&
+        !stepping) {
+      const unsigned long chunk = static_cast<unsigned long>(
+          std::min<unsigned long long>(count, frameLeft));
+      chip8.runCycles(chunk);
+      advance(chunk);
+      count -= chunk;
+      if (chip8.error != MachineError::None)
+        return DebugStop::Error;
+      continue;
+    }
+
+    if (!resuming && test(breakBits, pc)) {
+      const auto condition = conditions.find(pc);
+      if (condition == conditions.end() || condition->second.holds(chip8))
+        return DebugStop::Breakpoint;
+    }
+    resuming = false;
+
+    bool watchHit;
+    const bool done = checkedCycle(watchHit);
+    advance(1);
+    --count;
+    if (chip8.error != MachineError::None)
+      return DebugStop::Error;
+    if (watchHit)
+      return DebugStop::Watchpoint;
+    if (done)
+      return DebugStop::Step;
+  }
+  return DebugStop::Limit;
+}
+
+DebugStop Debugger::step() {
+  if (chip8.error != MachineError::None)
+    return DebugStop::Error;
+
+  bool watchHit;
+  checkedCycle(watchHit);
+  advance(1);
+  if (chip8.error != MachineError::None)
+    return DebugStop::Error;
+  return watchHit ? DebugStop::Watchpoint : DebugStop::Step;
+}
+
+DebugStop Debugger::stepOver(unsigned long long count) {
+  const unsigned short pc = chip8.pc;
+  if (opTable(chip8.machine)[opcodeAtPc()] != Op::Call)
+    return step();
+
+  // The call returns to the opcode after it, with the stack as it is now
+  stepping = true;
+  returnPc = (pc + 2) & 0xFFFF;
+  returnSp = chip8.sp;
+  const DebugStop stop = run(count);
+  stepping = false;
+  returnPc = -1;
+  returnSp = -1;
+  return stop;
+}
+
+DebugStop Debugger::stepOut(unsigned long long count) {
+  if (chip8.sp == 0)
+    return run(count);
+
+  stepping = true;
+  outSp = chip8.sp;
+  const DebugStop stop = run(count);
+  stepping = false;
+  outSp = -1;
+  return stop;
+}
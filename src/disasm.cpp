@@ -0,0 +1,160 @@
+#include <cstdio>
+
+#include "../include/disasm.hpp"
+#include "../include/dispatch.hpp"
+
+std::string disassemble(unsigned short opcode, Machine machine) {
+  const Operands o = decodeOperands(opcode);
+  char text[32];
+
+  switch (decodeOp(opcode, machine)) {
+  case Op::Cls:
+    return "CLS";
+  case Op::Ret:
+    return "RET";
+  case Op::Jump:
+    std::snprintf(text, sizeof(text), "JP 0x%03X", o.nnn);
+    break;
+  case Op::Call:
+    std::snprintf(text, sizeof(text), "CALL 0x%03X", o.nnn);
+    break;
+  case Op::SkipEqNN:
+    std::snprintf(text, sizeof(text), "SE V%X, 0x%02X", o.x, o.nn);
+    break;
+  case Op::SkipNeNN:
+    std::snprintf(text, sizeof(text), "SNE V%X, 0x%02X", o.x, o.nn);
+    break;
+  case Op::SkipEqReg:
+    std::snprintf(text, sizeof(text), "SE V%X, V%X", o.x, o.y);
+    break;
+  case Op::SetNN:
+    std::snprintf(text, sizeof(text), "LD V%X, 0x%02X", o.x, o.nn);
+    break;
+  case Op::AddNN:
+    std::snprintf(text, sizeof(text), "ADD V%X, 0x%02X", o.x, o.nn);
+    break;
+  case Op::SetReg:
+    std::snprintf(text, sizeof(text), "LD V%X, V%X", o.x, o.y);
+    break;
+  case Op::Or:
+    std::snprintf(text, sizeof(text), "OR V%X, V%X", o.x, o.y);
+    break;
+  case Op::And:
+    std::snprintf(text, sizeof(text), "AND V%X, V%X", o.x, o.y);
+    break;
+  case Op::Xor:
+    std::snprintf(text, sizeof(text), "XOR V%X, V%X", o.x, o.y);
+    break;
+  case Op::AddReg:
+    std::snprintf(text, sizeof(text), "ADD V%X, V%X", o.x, o.y);
+    break;
+  case Op::SubReg:
+    std::snprintf(text, sizeof(text), "SUB V%X, V%X", o.x, o.y);
+    break;
+  case Op::ShiftRight:
+    std::snprintf(text, sizeof(text), "SHR V%X, V%X", o.x, o.y);
+    break;
+  case Op::SubnReg:
+    std::snprintf(text, sizeof(text), "SUBN V%X, V%X", o.x, o.y);
+    break;
+  case Op::ShiftLeft:
+    std::snprintf(text, sizeof(text), "SHL V%X, V%X", o.x, o.y);
+    break;
+  case Op::SkipNeReg:
+    std::snprintf(text, sizeof(text), "SNE V%X, V%X", o.x, o.y);
+    break;
+  case Op::SetI:
+    std::snprintf(text, sizeof(text), "LD I, 0x%03X", o.nnn);
+    break;
+  case Op::JumpV0:
+    std::snprintf(text, sizeof(text), "JP V0, 0x%03X", o.nnn);
+    break;
+  case Op::Random:
+    std::snprintf(text, sizeof(text), "RND V%X, 0x%02X", o.x, o.nn);
+    break;
+  case Op::Draw:
+    std::snprintf(text, sizeof(text), "DRW V%X, V%X, %d", o.x, o.y, o.n);
+    break;
+  case Op::SkipKey:
+    std::snprintf(text, sizeof(text), "SKP V%X", o.x);
+    break;
+  case Op::SkipNoKey:
+    std::snprintf(text, sizeof(text), "SKNP V%X", o.x);
+    break;
+  case Op::GetDelay:
+    std::snprintf(text, sizeof(text), "LD V%X, DT", o.x);
+    break;
+  case Op::WaitKey:
+    std::snprintf(text, sizeof(text), "LD V%X, K", o.x);
+    break;
+  case Op::SetDelay:
+    std::snprintf(text, sizeof(text), "LD DT, V%X", o.x);
+    break;
+  case Op::SetSound:
+    std::snprintf(text, sizeof(text), "LD ST, V%X", o.x);
+    break;
+  case Op::AddI:
+    std::snprintf(text, sizeof(text), "ADD I, V%X", o.x);
+    break;
+  case Op::FontChar:
+    std::snprintf(text, sizeof(text), "LD F, V%X", o.x);
+    break;
+  case Op::Bcd:
+    std::snprintf(text, sizeof(text), "LD B, V%X", o.x);
+    break;
+  case Op::Store:
+    std::snprintf(text, sizeof(text), "LD [I], V%X", o.x);
+    break;
+  case Op::Load:
+    std::snprintf(text, sizeof(text), "LD V%X, [I]", o.x);
+    break;
+  case Op::ScrollDown:
+    std::snprintf(text, sizeof(text), "SCD %d", o.n);
+    break;
+  case Op::ScrollUp:
+    std::snprintf(text, sizeof(text), "SCU %d", o.n);
+    break;
+  case Op::ScrollRight:
+    return "SCR";
+  case Op::ScrollLeft:
+    return "SCL";
+  case Op::Exit:
+    return "EXIT";
+  case Op::LowRes:
+    return "LOW";
+  case Op::HighRes:
+    return "HIGH";
+  case Op::DrawExt:
+    std::snprintf(text, sizeof(text), "DRW V%X, V%X, %d", o.x, o.y, o.n);
+    break;
+  case Op::BigFontChar:
+    std::snprintf(text, sizeof(text), "LD HF, V%X", o.x);
+    break;
+  case Op::SaveFlags:
+    std::snprintf(text, sizeof(text), "LD R, V%X", o.x);
+    break;
+  case Op::LoadFlags:
+    std::snprintf(text, sizeof(text), "LD V%X, R", o.x);
+    break;
+  case Op::StoreRange:
+    std::snprintf(text, sizeof(text), "SAVE V%X - V%X", o.x, o.y);
+    break;
+  case Op::LoadRange:
+    std::snprintf(text, sizeof(text), "LOAD V%X - V%X", o.x, o.y);
+    break;
+  case Op::SetILong:
+    return "LD I, LONG";
+  case Op::Plane:
+    std::snprintf(text, sizeof(text), "PLANE %d", o.x);
+    break;
+  case Op::Audio:
+    return "AUDIO";
+  case Op::Pitch:
+    std::snprintf(text, sizeof(text), "PITCH V%X", o.x);
+    break;
+  default:
+    std::snprintf(text, sizeof(text), "DW 0x%04X", opcode);
+    break;
+  }
+  return text;
+}
@@ -0,0 +1,966 @@
+#include <cstring>
+
+#include "../include/chip8.hpp"
+#include "../include/dispatch.hpp"
+#include "../include/profiler.hpp"
+#include "../include/trace.hpp"
+
+Op decodeOp(unsigned short opcode, Machine machine) {
+  const bool schip = machine != Machine::Classic;
+  const bool xo = machine == Machine::XoChip;
+
+  switch (opcode & 0xF000) {
+  case 0x0000:
+    switch (opcode & 0x00FF) {
+    case 0x00E0:
+      return Op::Cls;
+    case 0x00EE:
+      return Op::Ret;
+    case 0x00FB:
+      if (schip)
+        return Op::ScrollRight;
+      break;
+    case 0x00FC:
+      if (schip)
+        return Op::ScrollLeft;
+      break;
+    case 0x00FD:
+      if (schip)
+        return Op::Exit;
+      break;
+    case 0x00FE:
+      if (schip)
+        return Op::LowRes;
+      break;
+    case 0x00FF:
+      if (schip)
+        return Op::HighRes;
+      break;
+    }
+    if ((opcode & 0xFFF0) == 0x00C0 && schip)
+      return Op::ScrollDown;
+    if ((opcode & 0xFFF0) == 0x00D0 && xo)
+      return Op::ScrollUp;
+    break;
+  case 0x1000:
+    return Op::Jump;
+  case 0x2000:
+    return Op::Call;
+  case 0x3000:
+    return Op::SkipEqNN;
+  case 0x4000:
+    return Op::SkipNeNN;
+  case 0x5000:
+    if ((opcode & 0x000F) == 0x0000)
+      return Op::SkipEqReg;
+    if ((opcode & 0x000F) == 0x0002 && xo)
+      return Op::StoreRange;
+    if ((opcode & 0x000F) == 0x0003 && xo)
+      return Op::LoadRange;
+    break;
+  case 0x6000:
+    return Op::SetNN;
+  case 0x7000:
+    return Op::AddNN;
+  case 0x8000:
+    switch (opcode & 0x000F) {
+    case 0x0000:
+      return Op::SetReg;
+    case 0x0001:
+      return Op::Or;
+    case 0x0002:
+      return Op::And;
+    case 0x0003:
+      return Op::Xor;
+    case 0x0004:
+      return Op::AddReg;
+    case 0x0005:
+      return Op::SubReg;
+    case 0x0006:
+      return Op::ShiftRight;
+    case 0x0007:
+      return Op::SubnReg;
+    case 0x000E:
+      return Op::ShiftLeft;
+    }
+    break;
+  case 0x9000:
+    return Op::SkipNeReg;
+  case 0xA000:
+    return Op::SetI;
+  case 0xB000:
+    return Op::JumpV0;
+  case 0xC000:
+    return Op::Random;
+  case 0xD000:
+    return schip ? Op::DrawExt : Op::Draw;
+  case 0xE000:
+    switch (opcode & 0x00FF) {
+    case 0x009E:
+      return Op::SkipKey;
+    case 0x00A1:
+      return Op::SkipNoKey;
+    }
+    break;
+  case 0xF000:
+    if (opcode == 0xF000 && xo)
+      return Op::SetILong;
+    if (opcode == 0xF002 && xo)
+      return Op::Audio;
+    switch (opcode & 0x00FF) {
+    case 0x0001:
+      if (xo)
+        return Op::Plane;
+      break;
+    case 0x0007:
+      return Op::GetDelay;
+    case 0x000A:
+      return Op::WaitKey;
+    case 0x0015:
+      return Op::SetDelay;
+    case 0x0018:
+      return Op::SetSound;
+    case 0x001E:
+      return Op::AddI;
+    case 0x0029:
+      return Op::FontChar;
+    case 0x0033:
+      return Op::Bcd;
+    case 0x0055:
+      return Op::Store;
+    case 0x0065:
+      return Op::Load;
+    case 0x0030:
+      if (schip)
+        return Op::BigFontChar;
+      break;
+    case 0x003A:
+      if (xo)
+        return Op::Pitch;
+      break;
+    case 0x0075:
+      if (schip)
+        return Op::SaveFlags;
+      break;
+    case 0x0085:
+      if (schip)
+        return Op::LoadFlags;
+      break;
+    }
+    break;
+  }
+
+  return Op::Unknown;
+}
+
+namespace {
+
+struct Table {
+  Op ops[65536];
+
+  explicit Table(Machine machine) {
+    for (int i = 0; i < 65536; ++i) {
+      ops[i] = decodeOp(static_cast<unsigned short>(i), machine);
+    }
+  }
+};
+
+} // namespace
+
+const Op *opTable(Machine machine) {
+  switch (machine) {
+  case Machine::SuperChip: {
+    static const Table table(Machine::SuperChip);
+    return table.ops;
+  }
+  case Machine::XoChip: {
+    static const Table table(Machine::XoChip);
+    return table.ops;
+  }
+  default: {
+    static const Table table(Machine::Classic);
+    return table.ops;
+  }
+  }
+}
+
+const char *opName(Op op) {
+#define OP_NAME(name) #name,
+  static const char *const names[OP_COUNT] = {FOR_EACH_OP(OP_NAME)};
+#undef OP_NAME
+
+  const int index = static_cast<int>(op);
+  return index < OP_COUNT ? names[index] : "Invalid";
+}
+
+// Handlers. They must behave exactly like the matching case of
+// Chip8::emulateCycleSwitch(), which is kept as the reference. The SUPER-CHIP
+// and XO-CHIP ones have no counterpart there, the reference only knows the
+// classic machine.
+
+// Bytes a taken skip moves pc by: XO-CHIP skips F000 NNNN, which is four
+// bytes long, as a whole
+static inline int skipTaken(const Chip8 &c) {
+  if (c.machine == Machine::XoChip && c.memory[(c.pc + 2) & 0xFFFF] == 0xF0 &&
+      c.memory[(c.pc + 3) & 0xFFFF] == 0x00)
+    return 6;
+  return 4;
+}
+
+// Whether the length bytes from address on are all in memory. Opcodes going
+// through I check it once and then touch the bytes directly; only a run
+// crossing the end of memory takes the paths below, wrapping each address.
+// Those stay out of line, so the interpreter loop the handlers are inlined
+// into carries none of their buffers
+static inline bool inMemory(const Chip8 &c, unsigned address,
+                            unsigned length) {
+  return address + length <= c.memorySize();
+}
+
+// Bytes from registers[0] on, every step-th one, to memory from address on
+__attribute__((noinline)) static void
+storeWrapped(Chip8 &c, unsigned address, const unsigned char *registers,
+             int length, int step = 1) {
+  for (int i = 0; i < length; ++i) {
+    const unsigned short at =
+        static_cast<unsigned short>((address + i) & c.memoryMask());
+    c.memory[at] = registers[i * step];
+    c.invalidateCode(at, 1);
+  }
+}
+
+__attribute__((noinline)) static void
+loadWrapped(const Chip8 &c, unsigned address, unsigned char *registers,
+            int length, int step = 1) {
+  for (int i = 0; i < length; ++i)
+    registers[i * step] = c.memory[(address + i) & c.memoryMask()];
+}
+
+// Rows 0 to rows - 1 of the dirtyRows mask
+static inline std::uint64_t rowMask(int rows) {
+  return rows >= 64 ? ~0ULL : (1ULL << rows) - 1;
+}
+
+template <Quirks Q>
+static inline void execCls(Chip8 &c, const Operands &) {
+  // Only the selected planes, which is just the first one but on XO-CHIP
+  for (int plane = 0; plane < PLANE_COUNT; ++plane) {
+    if (!(c.planeMask & (1 << plane)))
+      continue;
+    for (int i = 0; i < SCREEN_HEIGHT_MAX; ++i) {
+      std::uint64_t *row = c.gfx[plane][i];
+      if (row[0] | row[1])
+        c.dirtyRows |= 1ULL << i;
+      row[0] = 0;
+      row[1] = 0;
+    }
+  }
+  c.drawFlag = true;
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execRet(Chip8 &c, const Operands &) {
+  if (c.sp == 0) {
+    c.error = MachineError::StackUnderflow;
+    return;
+  }
+  --c.sp;
+  c.pc = c.stack[c.sp];
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execJump(Chip8 &c, const Operands &o) {
+  c.pc = o.nnn;
+}
+
+template <Quirks Q>
+static inline void execCall(Chip8 &c, const Operands &o) {
+  if (c.sp >= STACK_DEPTH) {
+    c.error = MachineError::StackOverflow;
+    return;
+  }
+  c.stack[c.sp] = c.pc;
+  ++c.sp;
+  c.pc = o.nnn;
+}
+
+template <Quirks Q>
+static inline void execSkipEqNN(Chip8 &c, const Operands &o) {
+  c.pc += (c.V[o.x] == o.nn) ? skipTaken(c) : 2;
+}
+
+template <Quirks Q>
+static inline void execSkipNeNN(Chip8 &c, const Operands &o) {
+  c.pc += (c.V[o.x] != o.nn) ? skipTaken(c) : 2;
+}
+
+template <Quirks Q>
+static inline void execSkipEqReg(Chip8 &c, const Operands &o) {
+  c.pc += (c.V[o.x] == c.V[o.y]) ? skipTaken(c) : 2;
+}
+
+template <Quirks Q>
+static inline void execSetNN(Chip8 &c, const Operands &o) {
+  c.V[o.x] = o.nn;
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execAddNN(Chip8 &c, const Operands &o) {
+  c.V[o.x] += o.nn;
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execSetReg(Chip8 &c, const Operands &o) {
+  c.V[o.x] = c.V[o.y];
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execOr(Chip8 &c, const Operands &o) {
+  c.V[o.x] = c.V[o.y] | c.V[o.x];
+  if (quirkSet(Q).vfReset)
+    c.V[0xF] = 0;
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execAnd(Chip8 &c, const Operands &o) {
+  c.V[o.x] = c.V[o.y] & c.V[o.x];
+  if (quirkSet(Q).vfReset)
+    c.V[0xF] = 0;
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execXor(Chip8 &c, const Operands &o) {
+  c.V[o.x] = c.V[o.y] ^ c.V[o.x];
+  if (quirkSet(Q).vfReset)
+    c.V[0xF] = 0;
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execAddReg(Chip8 &c, const Operands &o) {
+  c.V[0xF] = (c.V[o.y] > (0xFF - c.V[o.x])) ? 1 : 0; // carry
+  c.V[o.x] += c.V[o.y];
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execSubReg(Chip8 &c, const Operands &o) {
+  c.V[0xF] = (c.V[o.y] > c.V[o.x]) ? 0 : 1; // borrow
+  c.V[o.x] -= c.V[o.y];
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execShiftRight(Chip8 &c, const Operands &o) {
+  const int source = quirkSet(Q).shiftVy ? o.y : o.x;
+  c.V[0xF] = c.V[source] & 0b1;
+  c.V[o.x] = c.V[source] >> 1;
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execSubnReg(Chip8 &c, const Operands &o) {
+  c.V[0xF] = (c.V[o.x] > c.V[o.y]) ? 0 : 1; // borrow
+  c.V[o.x] = c.V[o.y] - c.V[o.x];
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execShiftLeft(Chip8 &c, const Operands &o) {
+  const int source = quirkSet(Q).shiftVy ? o.y : o.x;
+  c.V[0xF] = c.V[source] >> 7;
+  c.V[o.x] = c.V[source] << 1;
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execSkipNeReg(Chip8 &c, const Operands &o) {
+  c.pc += (c.V[o.x] != c.V[o.y]) ? skipTaken(c) : 2;
+}
+
+template <Quirks Q>
+static inline void execSetI(Chip8 &c, const Operands &o) {
+  c.I = o.nnn;
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execJumpV0(Chip8 &c, const Operands &o) {
+  c.pc = (o.nnn + c.V[quirkSet(Q).jumpVx ? o.x : 0x0]) & c.memoryMask();
+}
+
+template <Quirks Q>
+static inline void execRandom(Chip8 &c, const Operands &o) {
+  c.V[o.x] = o.nn & (c.nextRandom() & 0xFF);
+  c.pc += 2;
+}
+
+// DXYN of the classic machine, the sprite read from data
+static inline void drawSprite(Chip8 &c, const Operands &o,
+                              const unsigned char *data) {
+  const int x = c.V[o.x] % 64;
+  const int y = c.V[o.y] % 32;
+
+  // Rows past the bottom are clipped, and so are the bits shifted past the
+  // right edge: the sprite byte starts at the top of the word
+  int height = o.n;
+  if (y + height > 32)
+    height = 32 - y;
+
+  std::uint64_t collision = 0;
+  for (int row = 0; row < height; ++row) {
+    const std::uint64_t sprite =
+        (static_cast<std::uint64_t>(data[row]) << 56) >> x;
+    std::uint64_t &line = c.gfx[0][y + row][0];
+    collision |= line & sprite;
+    line ^= sprite;
+    if (sprite)
+      c.dirtyRows |= 1ULL << (y + row);
+  }
+  c.V[0xF] = collision != 0;
+}
+
+__attribute__((noinline)) static void drawSpriteWrapped(Chip8 &c,
+                                                        const Operands &o) {
+  unsigned char sprite[15];
+  loadWrapped(c, c.I, sprite, o.n);
+  drawSprite(c, o, sprite);
+}
+
+template <Quirks Q>
+static inline void execDraw(Chip8 &c, const Operands &o) {
+  if (inMemory(c, c.I, o.n))
+    drawSprite(c, o, c.memory.data() + c.I);
+  else
+    drawSpriteWrapped(c, o);
+  c.drawFlag = true;
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execSkipKey(Chip8 &c, const Operands &o) {
+  c.pc += (c.key[c.V[o.x] & 0xF] != 0) ? skipTaken(c) : 2;
+}
+
+template <Quirks Q>
+static inline void execSkipNoKey(Chip8 &c, const Operands &o) {
+  c.pc += (c.key[c.V[o.x] & 0xF] == 0) ? skipTaken(c) : 2;
+}
+
+template <Quirks Q>
+static inline void execGetDelay(Chip8 &c, const Operands &o) {
+  c.V[o.x] = c.delay_timer;
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execWaitKey(Chip8 &c, const Operands &o) {
+  // The lowest pressed key wins, if none is pressed pc stays here and this
+  // opcode runs again
+  for (int i = 0; i < 16; ++i) {
+    if (c.key[i]) {
+      c.V[o.x] = i;
+      c.pc += 2;
+      return;
+    }
+  }
+}
+
+template <Quirks Q>
+static inline void execSetDelay(Chip8 &c, const Operands &o) {
+  c.delay_timer = c.V[o.x];
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execSetSound(Chip8 &c, const Operands &o) {
+  c.sound_timer = c.V[o.x];
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execAddI(Chip8 &c, const Operands &o) {
+  c.I += c.V[o.x];
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execFontChar(Chip8 &c, const Operands &o) {
+  c.I = FONT_START + (c.V[o.x] & 0xF) * 0x5;
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execBcd(Chip8 &c, const Operands &o) {
+  const unsigned char digits[3] = {
+      static_cast<unsigned char>(c.V[o.x] / 100),
+      static_cast<unsigned char>((c.V[o.x] / 10) % 10),
+      static_cast<unsigned char>((c.V[o.x] % 100) % 10)};
+  if (inMemory(c, c.I, 3)) {
+    c.memory[c.I] = digits[0];
+    c.memory[c.I + 1] = digits[1];
+    c.memory[c.I + 2] = digits[2];
+    c.invalidateCode(c.I, 3);
+  } else {
+    storeWrapped(c, c.I, digits, 3);
+  }
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execStore(Chip8 &c, const Operands &o) {
+  if (inMemory(c, c.I, o.x + 1)) {
+    for (int i = 0; i <= o.x; ++i)
+      c.memory[c.I + i] = c.V[i];
+    c.invalidateCode(c.I, o.x + 1);
+  } else {
+    storeWrapped(c, c.I, c.V, o.x + 1);
+  }
+
+  // On the original interpreter, when the operation is done, I = I + X + 1.
+  c.I += quirkSet(Q).memoryIncrement == 2   ? o.x + 1
+         : quirkSet(Q).memoryIncrement == 1 ? o.x
+                                            : 0;
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execLoad(Chip8 &c, const Operands &o) {
+  if (inMemory(c, c.I, o.x + 1)) {
+    for (int i = 0; i <= o.x; ++i)
+      c.V[i] = c.memory[c.I + i];
+  } else {
+    loadWrapped(c, c.I, c.V, o.x + 1);
+  }
+
+  c.I += quirkSet(Q).memoryIncrement == 2   ? o.x + 1
+         : quirkSet(Q).memoryIncrement == 1 ? o.x
+                                            : 0;
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execScrollDown(Chip8 &c, const Operands &o) {
+  // Whole rows move, in the resolution of the current mode
+  const int height = c.height();
+  const int n = o.n < height ? o.n : height;
+  for (int plane = 0; plane < PLANE_COUNT; ++plane) {
+    if (!(c.planeMask & (1 << plane)))
+      continue;
+    std::uint64_t(*rows)[2] = c.gfx[plane];
+    std::memmove(rows[n], rows[0], (height - n) * sizeof(rows[0]));
+    std::memset(rows[0], 0, n * sizeof(rows[0]));
+  }
+  c.dirtyRows |= rowMask(height);
+  c.drawFlag = true;
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execScrollUp(Chip8 &c, const Operands &o) {
+  const int height = c.height();
+  const int n = o.n < height ? o.n : height;
+  for (int plane = 0; plane < PLANE_COUNT; ++plane) {
+    if (!(c.planeMask & (1 << plane)))
+      continue;
+    std::uint64_t(*rows)[2] = c.gfx[plane];
+    std::memmove(rows[0], rows[n], (height - n) * sizeof(rows[0]));
+    std::memset(rows[height - n], 0, n * sizeof(rows[0]));
+  }
+  c.dirtyRows |= rowMask(height);
+  c.drawFlag = true;
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execScrollRight(Chip8 &c, const Operands &) {
+  // Four pixels of the current mode: a shift of each row, carrying across
+  // the two words in the 128 x 64 mode
+  const int height = c.height();
+  for (int plane = 0; plane < PLANE_COUNT; ++plane) {
+    if (!(c.planeMask & (1 << plane)))
+      continue;
+    for (int y = 0; y < height; ++y) {
+      std::uint64_t *row = c.gfx[plane][y];
+      if (c.hires)
+        row[1] = (row[1] >> 4) | (row[0] << 60);
+      row[0] >>= 4;
+    }
+  }
+  c.dirtyRows |= rowMask(height);
+  c.drawFlag = true;
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execScrollLeft(Chip8 &c, const Operands &) {
+  const int height = c.height();
+  for (int plane = 0; plane < PLANE_COUNT; ++plane) {
+    if (!(c.planeMask & (1 << plane)))
+      continue;
+    for (int y = 0; y < height; ++y) {
+      std::uint64_t *row = c.gfx[plane][y];
+      row[0] = (row[0] << 4) | (c.hires ? row[1] >> 60 : 0);
+      if (c.hires)
+        row[1] <<= 4;
+    }
+  }
+  c.dirtyRows |= rowMask(height);
+  c.drawFlag = true;
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execExit(Chip8 &, const Operands &) {
+  // The program is over: stay on this opcode, like FX0A with no key
+}
+
+// Switch mode, clearing every plane like XO-CHIP does
+static inline void setResolution(Chip8 &c, bool hires) {
+  std::memset(c.gfx, 0, sizeof(c.gfx));
+  c.hires = hires;
+  c.dirtyRows = ~0ULL;
+  c.drawFlag = true;
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execLowRes(Chip8 &c, const Operands &) {
+  setResolution(c, false);
+}
+
+template <Quirks Q>
+static inline void execHighRes(Chip8 &c, const Operands &) {
+  setResolution(c, true);
+}
+
+// DXYN of the SUPER-CHIP and XO-CHIP machines, the sprites read from data
+static inline void drawPlanes(Chip8 &c, const Operands &o,
+                              const unsigned char *data) {
+  const int width = c.width();
+  const int height = c.height();
+  const int x = c.V[o.x] & (width - 1);
+  const int y = c.V[o.y] & (height - 1);
+
+  // DXY0 draws 16 rows of 16 pixels, two bytes each
+  const bool large = o.n == 0;
+  const int rows = large ? 16 : o.n;
+  const int visible = y + rows > height ? height - y : rows;
+
+  // Each selected plane takes its own sprite, one after the other in memory
+  const int size = large ? 32 : rows;
+  std::uint64_t collision = 0;
+  for (int plane = 0; plane < PLANE_COUNT; ++plane) {
+    if (!(c.planeMask & (1 << plane)))
+      continue;
+    for (int row = 0; row < visible; ++row) {
+      std::uint64_t sprite;
+      if (large)
+        sprite = static_cast<std::uint64_t>(data[2 * row] << 8 |
+                                            data[2 * row + 1])
+                 << 48;
+      else
+        sprite = static_cast<std::uint64_t>(data[row]) << 56;
+
+      // Split across the two words of the row; pixels past the right edge
+      // fall off the end of the second word, or off the first one in the
+      // 64 x 32 mode
+      std::uint64_t left, right;
+      if (x < 64) {
+        left = sprite >> x;
+        right = x > 0 && width > 64 ? sprite << (64 - x) : 0;
+      } else {
+        left = 0;
+        right = sprite >> (x - 64);
+      }
+
+      std::uint64_t *line = c.gfx[plane][y + row];
+      collision |= (line[0] & left) | (line[1] & right);
+      line[0] ^= left;
+      line[1] ^= right;
+      if (left | right)
+        c.dirtyRows |= 1ULL << (y + row);
+    }
+    data += size;
+  }
+  c.V[0xF] = collision != 0;
+}
+
+__attribute__((noinline)) static void drawPlanesWrapped(Chip8 &c,
+                                                        const Operands &o) {
+  unsigned char sprites[PLANE_COUNT * 32];
+  loadWrapped(c, c.I, sprites, sizeof(sprites));
+  drawPlanes(c, o, sprites);
+}
+
+template <Quirks Q>
+static inline void execDrawExt(Chip8 &c, const Operands &o) {
+  // Sized for the largest sprites on every plane, which saves counting the
+  // planes and only sends a few more draws the slow way
+  if (inMemory(c, c.I, PLANE_COUNT * 32))
+    drawPlanes(c, o, c.memory.data() + c.I);
+  else
+    drawPlanesWrapped(c, o);
+  c.drawFlag = true;
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execBigFontChar(Chip8 &c, const Operands &o) {
+  c.I = BIG_FONT_START + (c.V[o.x] & 0xF) * 10;
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execSaveFlags(Chip8 &c, const Operands &o) {
+  for (int i = 0; i <= o.x; ++i)
+    c.rplFlags[i] = c.V[i];
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execLoadFlags(Chip8 &c, const Operands &o) {
+  for (int i = 0; i <= o.x; ++i)
+    c.V[i] = c.rplFlags[i];
+  c.pc += 2;
+}
+
+// VX to VY, or down to VY when X > Y, to or from memory at I. I is left
+// alone, unlike FX55/FX65
+template <Quirks Q>
+static inline void execStoreRange(Chip8 &c, const Operands &o) {
+  const int step = o.x <= o.y ? 1 : -1;
+  const int count = (o.x <= o.y ? o.y - o.x : o.x - o.y) + 1;
+  if (inMemory(c, c.I, count)) {
+    for (int i = 0; i < count; ++i)
+      c.memory[c.I + i] = c.V[o.x + i * step];
+    c.invalidateCode(c.I, static_cast<unsigned short>(count));
+  } else {
+    storeWrapped(c, c.I, c.V + o.x, count, step);
+  }
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execLoadRange(Chip8 &c, const Operands &o) {
+  const int step = o.x <= o.y ? 1 : -1;
+  const int count = (o.x <= o.y ? o.y - o.x : o.x - o.y) + 1;
+  if (inMemory(c, c.I, count)) {
+    for (int i = 0; i < count; ++i)
+      c.V[o.x + i * step] = c.memory[c.I + i];
+  } else {
+    loadWrapped(c, c.I, c.V + o.x, count, step);
+  }
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execSetILong(Chip8 &c, const Operands &) {
+  // The address is the next two bytes, read as data rather than decoded
+  c.I = static_cast<unsigned short>(c.memory[(c.pc + 2) & 0xFFFF] << 8 |
+                                    c.memory[(c.pc + 3) & 0xFFFF]);
+  c.pc += 4;
+}
+
+template <Quirks Q>
+static inline void execPlane(Chip8 &c, const Operands &o) {
+  c.planeMask = o.x & 0x3;
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execAudio(Chip8 &c, const Operands &) {
+  if (inMemory(c, c.I, 16))
+    std::memcpy(c.audioPattern, c.memory.data() + c.I, 16);
+  else
+    loadWrapped(c, c.I, c.audioPattern, 16);
+  c.audioPatternLoaded = true;
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execPitch(Chip8 &c, const Operands &o) {
+  c.pitch = c.V[o.x];
+  c.pc += 2;
+}
+
+template <Quirks Q>
+static inline void execUnknown(Chip8 &c, const Operands &) {
+  c.error = MachineError::UnknownOpcode;
+}
+
+namespace {
+
+// The handlers of one quirk profile, every quirk test in them folded away
+template <Quirks Q> struct Handlers {
+  static const OpHandler table[OP_COUNT];
+};
+
+#define OP_HANDLER(name) exec##name<Q>,
+template <Quirks Q>
+const OpHandler Handlers<Q>::table[OP_COUNT] = {FOR_EACH_OP(OP_HANDLER)};
+#undef OP_HANDLER
+
+} // namespace
+
+const OpHandler *opHandlers(Quirks quirks) {
+  switch (quirks) {
+  case Quirks::Chip48:
+    return Handlers<Quirks::Chip48>::table;
+  case Quirks::SuperChip:
+    return Handlers<Quirks::SuperChip>::table;
+  case Quirks::XoChip:
+    return Handlers<Quirks::XoChip>::table;
+  default:
+    return Handlers<Quirks::CosmacVip>::table;
+  }
+}
+
+void Chip8::setQuirks(Quirks quirks) {
+  this->quirks = quirks;
+  handlers = opHandlers(quirks);
+#ifdef CHIP8_COMPUTED_GOTO
+  switch (quirks) {
+  case Quirks::Chip48:
+    threaded = &Chip8::runThreaded<Quirks::Chip48>;
+    break;
+  case Quirks::SuperChip:
+    threaded = &Chip8::runThreaded<Quirks::SuperChip>;
+    break;
+  case Quirks::XoChip:
+    threaded = &Chip8::runThreaded<Quirks::XoChip>;
+    break;
+  default:
+    threaded = &Chip8::runThreaded<Quirks::CosmacVip>;
+    break;
+  }
+#endif
+  // Compiled code has the old behaviours built in
+  writtenPages = ~0ULL;
+}
+
+inline void Chip8::step() {
+  // Fetch the opcode already decoded, decoding it only the first time it is
+  // seen or after its bytes were overwritten
+  const DecodedOp *fetched = &codeCache[pc];
+  if (!fetched->valid)
+    fetched = &decodeAtPc();
+  const DecodedOp &entry = *fetched;
+  opcode = entry.opcode;
+
+  // Execute it with a single table lookup
+  handlers[static_cast<int>(entry.op)](*this, entry.operands);
+}
+
+void Chip8::emulateCycle() {
+  if (tracer)
+    tracer->runStarts(*this, 1);
+
+#ifdef CHIP8_PROFILE
+  if (profiler)
+    profiler->cycle(*this);
+  else
+    step();
+#else
+  step();
+#endif
+
+  if (tracer)
+    tracer->runEnded(*this);
+}
+
+#ifdef CHIP8_COMPUTED_GOTO
+
+// GCC/Clang "labels as values": every handler ends with its own indirect jump
+// to the next one instead of all of them going back through a single call
+// site, which gives the branch predictor one history per opcode.
+//
+// Built for every quirk profile, setQuirks picks the one to use.
+template <Quirks Q> void Chip8::runThreaded(unsigned long count) {
+#define OP_LABEL(name) &&label##name,
+  static const void *const labels[OP_COUNT] = {FOR_EACH_OP(OP_LABEL)};
+#undef OP_LABEL
+
+  const unsigned long total = count;
+
+  const DecodedOp *entry;
+
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    if (count-- == 0)                                                          \
+      return;                                                                  \
+    entry = &codeCache[pc];                                                    \
+    if (!entry->valid)                                                         \
+      entry = &decodeAtPc();                                                   \
+    opcode = entry->opcode;                                                    \
+    goto *labels[static_cast<int>(entry->op)];                                 \
+  } while (0)
+
+  DISPATCH();
+
+// The test on the Op is folded away in every handler but FX18's
+#define OP_CASE(name)                                                          \
+  label##name : exec##name<Q>(*this, entry->operands);                         \
+  if (Op::name == Op::SetSound)                                                \
+    soundSetAt = total - count - 1;                                            \
+  DISPATCH();
+  FOR_EACH_OP(OP_CASE)
+#undef OP_CASE
+#undef DISPATCH
+}
+
+void Chip8::runUntraced(unsigned long count) {
+#ifdef CHIP8_PROFILE
+  // Profiled cycles all go through the profiler's own dispatch
+  if (profiler) {
+    for (unsigned long i = 0; i < count; ++i) {
+      profiler->cycle(*this);
+      if ((opcode & 0xF0FF) == 0xF018)
+        soundSetAt = i;
+    }
+    return;
+  }
+#endif
+
+  (this->*threaded)(count);
+}
+
+#else
+
+void Chip8::runUntraced(unsigned long count) {
+#ifdef CHIP8_PROFILE
+  if (profiler) {
+    for (unsigned long i = 0; i < count; ++i) {
+      profiler->cycle(*this);
+      if ((opcode & 0xF0FF) == 0xF018)
+        soundSetAt = i;
+    }
+    return;
+  }
+#endif
+
+  for (unsigned long i = 0; i < count; ++i) {
+    step();
+    if ((opcode & 0xF0FF) == 0xF018)
+      soundSetAt = i;
+  }
+}
+
+#endif
+
+void Chip8::runCycles(unsigned long count) {
+  soundSetAt = SOUND_NOT_SET;
+  // Only the runs are traced, chip8_trace replays the opcodes in them
+  if (tracer)
+    tracer->runStarts(*this, count);
+  runUntraced(count);
+  if (tracer)
+    tracer->runEnded(*this);
+}
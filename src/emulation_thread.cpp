@@ -0,0 +1,112 @@
+#include <cstring>
+#include <utility>
+
+#include "../include/audio.hpp"
+#include "../include/emulation_thread.hpp"
+#include "../include/runner.hpp"
+
+// Odr-used by operator+ below, which takes it by reference
+constexpr std::chrono::milliseconds EmulationThread::AUDIO_STALL;
+
+EmulationThread::EmulationThread()
+    : stopping(false), keys(KEY_QUEUE_SIZE), keypad(), framesRun(0),
+      buzzer(false), cyclesRun(0), pacer(nullptr) {}
+
+EmulationThread::~EmulationThread() { stop(); }
+
+void EmulationThread::start(Runner &runner, std::function<void()> frame) {
+  if (thread.joinable())
+    return;
+  stopping.store(false);
+  thread = std::thread([this, &runner, frame] { loop(runner, frame); });
+}
+
+void EmulationThread::stop() {
+  if (!thread.joinable())
+    return;
+  stopping.store(true, std::memory_order_release);
+  thread.join();
+}
+
+void EmulationThread::post(std::function<void()> task) {
+  std::lock_guard<std::mutex> lock(tasksMutex);
+  tasks.push_back(std::move(task));
+}
+
+bool EmulationThread::pressKey(std::uint8_t key, bool pressed) {
+  return keys.tryPush({cycles(), static_cast<std::uint8_t>(key & 0xF),
+                       pressed});
+}
+
+void EmulationThread::runTasks() {
+  std::vector<std::function<void()>> pending;
+  {
+    std::lock_guard<std::mutex> lock(tasksMutex);
+    pending.swap(tasks);
+  }
+  for (const std::function<void()> &task : pending)
+    task();
+}
+
+void EmulationThread::loop(Runner &runner,
+                           const std::function<void()> &frame) {
+  scheduler.start();
+  while (!stopping.load(std::memory_order_acquire)) {
+    runTasks();
+    framesRun = runner.frames;
+    if (frame)
+      frame();
+    else
+      runner.runFrame();
+    cyclesRun.store(runner.cycles, std::memory_order_relaxed);
+    if (pacer)
+      waitForAudio();
+    else
+      scheduler.waitForNextFrame();
+  }
+}
+
+void EmulationThread::waitForAudio() {
+  const auto deadline = std::chrono::steady_clock::now() + AUDIO_STALL;
+  while (pacer->buffered() > AUDIO_TARGET_FILL) {
+    if (stopping.load(std::memory_order_relaxed))
+      return;
+    if (std::chrono::steady_clock::now() > deadline) {
+      // The player is gone or stuck, keep going on the clock
+      pacer = nullptr;
+      scheduler.start();
+      return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+// Only called for frames that changed, see Runner
+void EmulationThread::drawFrame(const Chip8 &chip8, std::uint64_t) {
+  ScreenFrame &next = frames.write();
+  std::memcpy(next.gfx, chip8.gfx, sizeof(next.gfx));
+  next.hires = chip8.hires;
+  next.frame = framesRun;
+  frames.publish();
+}
+
+void EmulationThread::setBuzzer(bool on) {
+  buzzer.store(on, std::memory_order_relaxed);
+}
+
+void EmulationThread::pollInput(unsigned char key[16]) {
+  // Apply the events in order, but leave the release of a key pressed in
+  // this same poll for the next frame so that the ROM sees the press
+  std::uint16_t pressedNow = 0;
+  const KeyEvent *event;
+  while (keys.peek(event) > 0) {
+    const std::uint16_t bit = static_cast<std::uint16_t>(1u << event->key);
+    if (!event->pressed && (pressedNow & bit))
+      break;
+    keypad[event->key] = event->pressed ? 1 : 0;
+    if (event->pressed)
+      pressedNow |= bit;
+    keys.release(1);
+  }
+  std::memcpy(key, keypad, sizeof(keypad));
+}
@@ -0,0 +1,585 @@
+#include <cstring>
+#include <initializer_list>
+
+#if defined(__x86_64__) && defined(__unix__)
+#include <sys/mman.h>
+#define CHIP8_JIT_SUPPORTED 1
+#endif
+
+#include "../include/dispatch.hpp"
+#include "../include/jit.hpp"
+
+namespace {
+
+// Size of the executable buffer, flushed as a whole when it fills up
+constexpr unsigned long CODE_SIZE = 1 << 20;
+
+// Longest block, in opcodes. Blocks only run when the remaining budget covers
+// all of them, so long blocks would mostly fall back to the interpreter when
+// the runner asks for a dozen opcodes per frame.
+constexpr int MAX_BLOCK_OPS = 32;
+
+// Upper bound of the native code of one block: the biggest opcode (8XY4 and
+// friends) is under 64 bytes, plus the entry check and three exits
+constexpr unsigned long MAX_BLOCK_BYTES = MAX_BLOCK_OPS * 64 + 128;
+
+// Blocks whose first opcode can not be compiled point here
+unsigned char uncompilableMarker;
+unsigned char *const UNCOMPILABLE = &uncompilableMarker;
+
+// What the trampoline reads and the exit stub writes back
+struct Context {
+  long long budget;
+};
+
+// Trampoline: rdi = &V[0], rsi = context, rdx = block to jump to
+using EntryFn = void (*)(unsigned char *, Context *, const unsigned char *);
+
+// Register usage inside blocks:
+//   rbx  &V[0], every Chip8 field is addressed as [rbx + disp32]
+//   r12  remaining cycle budget
+//   r13d I
+//   r14d pc, only set on exit
+//   r15  Context
+//   eax, ecx, edx scratch
+class Emitter {
+public:
+  unsigned char *p;
+
+  explicit Emitter(unsigned char *p) : p(p) {}
+
+  void byte(unsigned char b) { *p++ = b; }
+
+  void bytes(std::initializer_list<unsigned char> bs) {
+    for (unsigned char b : bs)
+      byte(b);
+  }
+
+  void u16(unsigned short v) {
+    std::memcpy(p, &v, 2);
+    p += 2;
+  }
+
+  void u32(unsigned int v) {
+    std::memcpy(p, &v, 4);
+    p += 4;
+  }
+
+  // ModRM for [rbx + disp32] with reg field r, followed by the displacement
+  void mem(int reg, int disp) {
+    byte(0x80 | (reg << 3) | 3);
+    u32(static_cast<unsigned int>(disp));
+  }
+
+  // movzx eax/ecx, byte [rbx + disp]
+  void loadEax(int disp) {
+    bytes({0x0F, 0xB6});
+    mem(0, disp);
+  }
+  void loadEcx(int disp) {
+    bytes({0x0F, 0xB6});
+    mem(1, disp);
+  }
+
+  // mov byte [rbx + disp], al/dl
+  void storeAl(int disp) {
+    byte(0x88);
+    mem(0, disp);
+  }
+  void storeDl(int disp) {
+    byte(0x88);
+    mem(2, disp);
+  }
+
+  // mov/add/cmp byte [rbx + disp], imm8
+  void storeImm8(int disp, unsigned char v) {
+    byte(0xC6);
+    mem(0, disp);
+    byte(v);
+  }
+  void addImm8(int disp, unsigned char v) {
+    byte(0x80);
+    mem(0, disp);
+    byte(v);
+  }
+  void cmpImm8(int disp, unsigned char v) {
+    byte(0x80);
+    mem(7, disp);
+    byte(v);
+  }
+
+  // cmp al, byte [rbx + disp]
+  void cmpAl(int disp) {
+    byte(0x3A);
+    mem(0, disp);
+  }
+
+  // <op> al, cl with op one of the 8 bit ALU opcodes (00 add, 08 or, ...)
+  void aluAlCl(unsigned char op) {
+    byte(op);
+    byte(0xC8);
+  }
+  static constexpr unsigned char ADD = 0x00;
+  static constexpr unsigned char OR = 0x08;
+  static constexpr unsigned char AND = 0x20;
+  static constexpr unsigned char SUB = 0x28;
+  static constexpr unsigned char XOR = 0x30;
+
+  void andAl(unsigned char v) {
+    byte(0x24);
+    byte(v);
+  }
+  void shrAl() { bytes({0xD0, 0xE8}); }
+  void shlAl() { bytes({0xD0, 0xE0}); }
+  void shrAl7() { bytes({0xC0, 0xE8, 0x07}); }
+  void setcDl() { bytes({0x0F, 0x92, 0xC2}); }
+  void setncDl() { bytes({0x0F, 0x93, 0xC2}); }
+
+  // mov r13d, imm32
+  void setI(unsigned int v) {
+    bytes({0x41, 0xBD});
+    u32(v);
+  }
+
+  // add r13d, eax ; and r13d, 0xFFFF
+  void addIEax() {
+    bytes({0x41, 0x01, 0xC5});
+    bytes({0x41, 0x81, 0xE5});
+    u32(0xFFFF);
+  }
+
+  // lea r13d, [rax + rax * 4 + FONT_START]
+  void setIFontEax() {
+    bytes({0x44, 0x8D, 0xAC, 0x80});
+    u32(FONT_START);
+  }
+
+  // mov r14d, imm32
+  void setPc(unsigned int v) {
+    bytes({0x41, 0xBE});
+    u32(v);
+  }
+
+  // mov word [rbx + disp], imm16
+  void storeImm16(int disp, unsigned short v) {
+    bytes({0x66, 0xC7});
+    mem(0, disp);
+    u16(v);
+  }
+
+  // movzx r13d, word [rbx + disp] / mov word [rbx + disp], r13w / r14w
+  void loadI(int disp) {
+    bytes({0x44, 0x0F, 0xB7});
+    mem(5, disp);
+  }
+  void storeI(int disp) {
+    bytes({0x66, 0x44, 0x89});
+    mem(5, disp);
+  }
+  void storePc(int disp) {
+    bytes({0x66, 0x44, 0x89});
+    mem(6, disp);
+  }
+
+  // cmp r12, imm32 / sub r12, imm32, returning where the immediate is
+  unsigned char *cmpBudget(unsigned int v) {
+    bytes({0x49, 0x81, 0xFC});
+    unsigned char *imm = p;
+    u32(v);
+    return imm;
+  }
+  unsigned char *subBudget(unsigned int v) {
+    bytes({0x49, 0x81, 0xEC});
+    unsigned char *imm = p;
+    u32(v);
+    return imm;
+  }
+
+  // jmp/jcc rel32, returning where the displacement is
+  unsigned char *jmp() {
+    byte(0xE9);
+    unsigned char *rel = p;
+    u32(0);
+    return rel;
+  }
+  unsigned char *jcc(unsigned char condition) {
+    byte(0x0F);
+    byte(condition);
+    unsigned char *rel = p;
+    u32(0);
+    return rel;
+  }
+  static constexpr unsigned char JE = 0x84;
+  static constexpr unsigned char JNE = 0x85;
+  static constexpr unsigned char JL = 0x8C;
+
+  static void link(unsigned char *rel, const unsigned char *target) {
+    const int displacement = static_cast<int>(target - (rel + 4));
+    std::memcpy(rel, &displacement, 4);
+  }
+
+  static void patch(unsigned char *imm, unsigned int v) {
+    std::memcpy(imm, &v, 4);
+  }
+};
+
+} // namespace
+
+Jit::Jit(Chip8 &chip8)
+    : chip8(chip8), code(nullptr), codeSize(0), codeUsed(0), exitStub(0),
+      blocksStart(0),
+      blocks(4096, nullptr), pendingLinks(4096), compiledPages(0),
+      nativeCycles(0), interpretedCycles(0), blocksCompiled(0), flushes(0) {
+  const unsigned char *base = chip8.V;
+  offsetI =
+      static_cast<int>(reinterpret_cast<unsigned char *>(&chip8.I) - base);
+  offsetPc =
+      static_cast<int>(reinterpret_cast<unsigned char *>(&chip8.pc) - base);
+  offsetOpcode =
+      static_cast<int>(reinterpret_cast<unsigned char *>(&chip8.opcode) - base);
+  offsetDelayTimer = static_cast<int>(&chip8.delay_timer - base);
+
+#ifdef CHIP8_JIT_SUPPORTED
+  void *buffer = mmap(nullptr, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffer != MAP_FAILED) {
+    code = static_cast<unsigned char *>(buffer);
+    codeSize = CODE_SIZE;
+    emitRuntime();
+  }
+#endif
+}
+
+Jit::~Jit() {
+#ifdef CHIP8_JIT_SUPPORTED
+  if (code)
+    munmap(code, codeSize);
+#endif
+}
+
+// Trampoline at offset 0 followed by the exit stub every block leaves through
+void Jit::emitRuntime() {
+  Emitter e(code);
+
+  // push rbx, r12, r13, r14, r15
+  e.byte(0x53);
+  e.bytes({0x41, 0x54});
+  e.bytes({0x41, 0x55});
+  e.bytes({0x41, 0x56});
+  e.bytes({0x41, 0x57});
+  // mov rbx, rdi ; mov r15, rsi ; mov r12, [r15]
+  e.bytes({0x48, 0x89, 0xFB});
+  e.bytes({0x49, 0x89, 0xF7});
+  e.bytes({0x4D, 0x8B, 0x27});
+  e.loadI(offsetI);
+  // jmp rdx
+  e.bytes({0xFF, 0xE2});
+
+  // Exit stub: write back I, pc and the budget, then return to C++
+  exitStub = static_cast<unsigned long>(e.p - code);
+  e.storeI(offsetI);
+  e.storePc(offsetPc);
+  // mov [r15], r12
+  e.bytes({0x4D, 0x89, 0x27});
+  // pop r15, r14, r13, r12, rbx ; ret
+  e.bytes({0x41, 0x5F});
+  e.bytes({0x41, 0x5E});
+  e.bytes({0x41, 0x5D});
+  e.bytes({0x41, 0x5C});
+  e.byte(0x5B);
+  e.byte(0xC3);
+
+  blocksStart = static_cast<unsigned long>(e.p - code);
+  codeUsed = blocksStart;
+}
+
+void Jit::flush() {
+  // Keep the trampoline and the exit stub
+  codeUsed = blocksStart;
+
+  for (auto &block : blocks)
+    block = nullptr;
+  for (auto &links : pendingLinks)
+    links.clear();
+  compiledPages = 0;
+  ++flushes;
+}
+
+unsigned char *Jit::compile(unsigned short address) {
+  if (codeSize - codeUsed < MAX_BLOCK_BYTES)
+    flush();
+
+  unsigned char *const entry = code + codeUsed;
+  unsigned char *const stub = code + exitStub;
+  Emitter e(entry);
+
+  // Leave through the exit stub with pc set to target, or go straight into
+  // the block at target once it exists
+  auto exitTo = [&](unsigned short target) {
+    e.setPc(target);
+    unsigned char *rel = e.jmp();
+    if (target < 4095 && blocks[target] && blocks[target] != UNCOMPILABLE) {
+      Emitter::link(rel, blocks[target]);
+    } else {
+      Emitter::link(rel, stub);
+      if (target < 4095 && !blocks[target])
+        pendingLinks[target].push_back(
+            static_cast<unsigned long>(rel - code));
+    }
+  };
+  constexpr int EXIT_SIZE = 11;
+
+  // Run the block only if the budget covers all of it
+  unsigned char *cmpImm = e.cmpBudget(0);
+  unsigned char *bail = e.jcc(Emitter::JL);
+  unsigned char *subImm = e.subBudget(0);
+
+  const Op *table = opTable(chip8.machine);
+  // Blocks are flushed whenever the profile changes (see Chip8::setQuirks)
+  const QuirkSet quirks = quirkSet(chip8.quirks);
+  const int vf = 0xF;
+  // An XO-CHIP skip jumps over 4 bytes when the next opcode is F000 NNNN,
+  // which the exits below do not know about
+  const bool longSkips = chip8.machine == Machine::XoChip;
+  unsigned short pc = address;
+  unsigned short lastOpcode = 0;
+  int count = 0;
+  bool terminated = false;
+
+  while (!terminated && count < MAX_BLOCK_OPS && pc < 4095) {
+    const unsigned short opcode = chip8.memory[pc] << 8 | chip8.memory[pc + 1];
+    const Operands o = decodeOperands(opcode);
+
+    // Each sequence mirrors the interpreter step by step, reading the V
+    // registers again after VF was written in case X or Y is F
+    switch (table[opcode]) {
+    case Op::SetNN:
+      e.storeImm8(o.x, o.nn);
+      break;
+    case Op::AddNN:
+      e.addImm8(o.x, o.nn);
+      break;
+    case Op::SetReg:
+      e.loadEax(o.y);
+      e.storeAl(o.x);
+      break;
+    case Op::Or:
+    case Op::And:
+    case Op::Xor: {
+      const Op op = table[opcode];
+      e.loadEax(o.y);
+      e.loadEcx(o.x);
+      e.aluAlCl(op == Op::Or    ? Emitter::OR
+                : op == Op::And ? Emitter::AND
+                                : Emitter::XOR);
+      e.storeAl(o.x);
+      if (quirks.vfReset)
+        e.storeImm8(vf, 0);
+    } break;
+    case Op::AddReg:
+      e.loadEax(o.x);
+      e.loadEcx(o.y);
+      e.aluAlCl(Emitter::ADD);
+      e.setcDl();
+      e.storeDl(vf);
+      e.loadEax(o.x);
+      e.loadEcx(o.y);
+      e.aluAlCl(Emitter::ADD);
+      e.storeAl(o.x);
+      break;
+    case Op::SubReg:
+      e.loadEax(o.x);
+      e.loadEcx(o.y);
+      e.aluAlCl(Emitter::SUB);
+      e.setncDl();
+      e.storeDl(vf);
+      e.loadEax(o.x);
+      e.loadEcx(o.y);
+      e.aluAlCl(Emitter::SUB);
+      e.storeAl(o.x);
+      break;
+    case Op::SubnReg:
+      e.loadEax(o.y);
+      e.loadEcx(o.x);
+      e.aluAlCl(Emitter::SUB);
+      e.setncDl();
+      e.storeDl(vf);
+      e.loadEax(o.y);
+      e.loadEcx(o.x);
+      e.aluAlCl(Emitter::SUB);
+      e.storeAl(o.x);
+      break;
+    case Op::ShiftRight: {
+      const int source = quirks.shiftVy ? o.y : o.x;
+      e.loadEax(source);
+      e.andAl(0b1);
+      e.storeAl(vf);
+      e.loadEax(source);
+      e.shrAl();
+      e.storeAl(o.x);
+    } break;
+    case Op::ShiftLeft: {
+      const int source = quirks.shiftVy ? o.y : o.x;
+      e.loadEax(source);
+      e.shrAl7();
+      e.storeAl(vf);
+      e.loadEax(source);
+      e.shlAl();
+      e.storeAl(o.x);
+    } break;
+    case Op::SetI:
+      e.setI(o.nnn);
+      break;
+    case Op::AddI:
+      e.loadEax(o.x);
+      e.addIEax();
+      break;
+    case Op::FontChar:
+      e.loadEax(o.x);
+      e.andAl(0x0F);
+      e.setIFontEax();
+      break;
+    case Op::GetDelay:
+      e.loadEax(offsetDelayTimer);
+      e.storeAl(o.x);
+      break;
+    case Op::SetDelay:
+      e.loadEax(o.x);
+      e.storeAl(offsetDelayTimer);
+      break;
+
+    case Op::Jump:
+      e.storeImm16(offsetOpcode, opcode);
+      exitTo(o.nnn);
+      terminated = true;
+      break;
+    case Op::SkipEqNN:
+    case Op::SkipNeNN:
+    case Op::SkipEqReg:
+    case Op::SkipNeReg: {
+      if (longSkips)
+        goto done;
+      const Op op = table[opcode];
+      e.storeImm16(offsetOpcode, opcode);
+      if (op == Op::SkipEqNN || op == Op::SkipNeNN) {
+        e.cmpImm8(o.x, o.nn);
+      } else {
+        e.loadEax(o.x);
+        e.cmpAl(o.y);
+      }
+      unsigned char *taken = e.jcc(
+          (op == Op::SkipEqNN || op == Op::SkipEqReg) ? Emitter::JE
+                                                      : Emitter::JNE);
+      unsigned char *notTaken = e.p;
+      exitTo(pc + 2);
+      Emitter::link(taken, notTaken + EXIT_SIZE);
+      exitTo(pc + 4);
+      terminated = true;
+    } break;
+
+    default:
+      // Left to the interpreter, the block ends before it
+      goto done;
+    }
+
+    lastOpcode = opcode;
+    ++count;
+    if (!terminated)
+      pc += 2;
+  }
+done:
+
+  if (count == 0)
+    return UNCOMPILABLE;
+
+  if (!terminated) {
+    e.storeImm16(offsetOpcode, lastOpcode);
+    exitTo(pc);
+  }
+
+  // Budget too low: leave without running anything
+  Emitter::link(bail, e.p);
+  e.setPc(address);
+  Emitter::link(e.jmp(), stub);
+
+  Emitter::patch(cmpImm, static_cast<unsigned int>(count));
+  Emitter::patch(subImm, static_cast<unsigned int>(count));
+
+  codeUsed = static_cast<unsigned long>(e.p - code);
+  ++blocksCompiled;
+
+  const int lastByte = pc + 1;
+  for (int page = address >> 6; page <= lastByte >> 6 && page < 64; ++page)
+    compiledPages |= 1ULL << page;
+
+  // Exits already emitted towards this address can now jump straight in
+  for (unsigned long offset : pendingLinks[address])
+    Emitter::link(code + offset, entry);
+  pendingLinks[address].clear();
+
+  return entry;
+}
+
+void Jit::precompile(unsigned short address) {
+  if (!available() || address >= 4095)
+    return;
+  // Same as before running a block: memory written since then, by loading
+  // the ROM for one, makes the blocks over it stale
+  if (chip8.writtenPages) {
+    if (chip8.writtenPages & compiledPages)
+      flush();
+    chip8.writtenPages = 0;
+  }
+  if (!blocks[address])
+    blocks[address] = compile(address);
+}
+
+void Jit::runCycles(unsigned long count) {
+  if (!available()) {
+    chip8.runCycles(count);
+    interpretedCycles += count;
+    return;
+  }
+
+  const EntryFn enter = reinterpret_cast<EntryFn>(code);
+  Context context;
+  const unsigned long total = count;
+  chip8.soundSetAt = SOUND_NOT_SET;
+
+  while (count > 0) {
+    // Stores done by the interpreter (or anyone else) since the last block
+    if (chip8.writtenPages) {
+      if (chip8.writtenPages & compiledPages)
+        flush();
+      chip8.writtenPages = 0;
+    }
+
+    const unsigned short pc = chip8.pc;
+    unsigned char *block = pc < 4095 ? blocks[pc] : UNCOMPILABLE;
+    if (!block) {
+      block = compile(pc);
+      blocks[pc] = block;
+    }
+
+    if (block != UNCOMPILABLE) {
+      context.budget = static_cast<long long>(count);
+      enter(chip8.V, &context, block);
+
+      const unsigned long executed =
+          count - static_cast<unsigned long>(context.budget);
+      if (executed > 0) {
+        count -= executed;
+        nativeCycles += executed;
+        continue;
+      }
+    }
+
+    // FX18 is always left to the interpreter so that the moment the buzzer
+    // starts is known, see Chip8::soundSetAt
+    chip8.emulateCycle();
+    if ((chip8.opcode & 0xF0FF) == 0xF018)
+      chip8.soundSetAt = total - count;
+    --count;
+    ++interpretedCycles;
+  }
+}
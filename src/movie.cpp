@@ -0,0 +1,186 @@
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+
+#include "../include/bytes.hpp"
+#include "../include/hash.hpp"
+#include "../include/movie.hpp"
+#include "../include/savestate.hpp"
+
+static const unsigned char MOVIE_MAGIC[4] = {'C', '8', 'M', 'V'};
+
+// Fixed part of the file and size of each record, in bytes
+constexpr std::size_t MOVIE_HEADER_SIZE = 4 + 2 + 2 + 8 + 4 * 4 + 8 + 4;
+constexpr std::size_t KEY_CHANGE_SIZE = 4 + 8 + 2;
+
+bool Movie::save(const std::string &path) const {
+  std::vector<unsigned char> data(MOVIE_HEADER_SIZE +
+                                  keyChanges.size() * KEY_CHANGE_SIZE + 4 +
+                                  stateHashes.size() * 8);
+  ByteWriter w{data.data()};
+  w.bytes(MOVIE_MAGIC, sizeof(MOVIE_MAGIC));
+  w.u16(MOVIE_VERSION);
+  w.u8(static_cast<unsigned char>(machine));
+  w.u8(static_cast<unsigned char>(quirks));
+  w.u64(romHash);
+  w.u32(seed);
+  w.u32(instructionsPerFrame);
+  w.u32(hashInterval);
+  w.u32(frames);
+  w.u64(finalHash);
+
+  w.u32(static_cast<std::uint32_t>(keyChanges.size()));
+  for (const KeyChange &change : keyChanges) {
+    w.u32(change.frame);
+    w.u64(change.cycle);
+    w.u16(change.keys);
+  }
+
+  w.u32(static_cast<std::uint32_t>(stateHashes.size()));
+  for (std::uint64_t hash : stateHashes)
+    w.u64(hash);
+
+  std::ofstream file(path, std::ios::binary);
+  file.write(reinterpret_cast<const char *>(data.data()), data.size());
+  return file.good();
+}
+
+bool Movie::load(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file.is_open())
+    return false;
+
+  const std::vector<unsigned char> data((std::istreambuf_iterator<char>(file)),
+                                        std::istreambuf_iterator<char>());
+  if (data.size() < MOVIE_HEADER_SIZE ||
+      !std::equal(MOVIE_MAGIC, MOVIE_MAGIC + 4, data.begin()))
+    return false;
+
+  ByteReader r{data.data() + sizeof(MOVIE_MAGIC)};
+  if (r.u16() != MOVIE_VERSION)
+    return false;
+  const unsigned char machine = r.u8();
+  const unsigned char quirks = r.u8();
+  if (machine > static_cast<unsigned char>(Machine::XoChip) ||
+      quirks >= QUIRKS_COUNT)
+    return false;
+
+  Movie movie;
+  movie.machine = static_cast<Machine>(machine);
+  movie.quirks = static_cast<Quirks>(quirks);
+  movie.romHash = r.u64();
+  movie.seed = r.u32();
+  movie.instructionsPerFrame = r.u32();
+  movie.hashInterval = r.u32();
+  movie.frames = r.u32();
+  movie.finalHash = r.u64();
+  if (movie.hashInterval == 0)
+    return false;
+
+  // Every count is checked against what is left before reading the records
+  const unsigned char *end = data.data() + data.size();
+  const std::size_t changes = r.u32();
+  if (static_cast<std::size_t>(end - r.p) < changes * KEY_CHANGE_SIZE + 4)
+    return false;
+  movie.keyChanges.resize(changes);
+  for (KeyChange &change : movie.keyChanges) {
+    change.frame = r.u32();
+    change.cycle = r.u64();
+    change.keys = r.u16();
+  }
+
+  const std::size_t hashes = r.u32();
+  if (static_cast<std::size_t>(end - r.p) != hashes * 8)
+    return false;
+  movie.stateHashes.resize(hashes);
+  for (std::uint64_t &hash : movie.stateHashes)
+    hash = r.u64();
+
+  *this = std::move(movie);
+  return true;
+}
+
+std::uint64_t romHash(const Chip8 &chip8) {
+  return fnv1a64(chip8.memory.data() + ROM_START,
+                 chip8.memorySize() - ROM_START);
+}
+
+MovieRecorder::MovieRecorder(const Chip8 &chip8, Frontend &output,
+                             Movie &movie)
+    : chip8(chip8), output(output), movie(movie), lastKeys(0) {
+  movie.romHash = romHash(chip8);
+  movie.machine = chip8.machine;
+  movie.quirks = chip8.quirks;
+  movie.frames = 0;
+  movie.keyChanges.clear();
+  movie.stateHashes.clear();
+}
+
+void MovieRecorder::drawFrame(const Chip8 &chip8, std::uint64_t changedRows) {
+  output.drawFrame(chip8, changedRows);
+}
+
+void MovieRecorder::setBuzzer(bool on) { output.setBuzzer(on); }
+
+bool MovieRecorder::quitRequested() { return output.quitRequested(); }
+
+// Called at the start of every frame, when the state is the one left by the
+// previous frames. The hash is taken before key, which is usually the keypad
+// of the machine itself, is updated
+void MovieRecorder::pollInput(unsigned char key[16]) {
+  const std::uint32_t frame = movie.frames;
+  if (frame > 0 && frame % movie.hashInterval == 0)
+    movie.stateHashes.push_back(stateHash(chip8));
+
+  output.pollInput(key);
+
+  std::uint16_t keys = 0;
+  for (int k = 0; k < 16; ++k) {
+    if (key[k])
+      keys |= 1u << k;
+  }
+  if (frame == 0 || keys != lastKeys) {
+    movie.keyChanges.push_back(
+        {frame, static_cast<std::uint64_t>(frame) * movie.instructionsPerFrame,
+         keys});
+    lastKeys = keys;
+  }
+
+  ++movie.frames;
+}
+
+void MovieRecorder::finish() { movie.finalHash = stateHash(chip8); }
+
+MoviePlayer::MoviePlayer(const Chip8 &chip8, const Movie &movie)
+    : chip8(chip8), movie(movie), nextChange(0), keys(0), frame(0),
+      diverged(false), divergedFrame(0) {}
+
+void MoviePlayer::pollInput(unsigned char key[16]) {
+  if (!diverged && frame > 0 && frame % movie.hashInterval == 0) {
+    const std::size_t index = frame / movie.hashInterval - 1;
+    if (index < movie.stateHashes.size() &&
+        movie.stateHashes[index] != stateHash(chip8)) {
+      diverged = true;
+      divergedFrame = frame;
+    }
+  }
+
+  while (nextChange < movie.keyChanges.size() &&
+         movie.keyChanges[nextChange].frame <= frame) {
+    keys = movie.keyChanges[nextChange].keys;
+    ++nextChange;
+  }
+  for (int k = 0; k < 16; ++k)
+    key[k] = (keys >> k) & 1;
+
+  ++frame;
+}
+
+bool MoviePlayer::quitRequested() { return frame >= movie.frames; }
+
+void MoviePlayer::finish() {
+  if (!diverged && stateHash(chip8) != movie.finalHash) {
+    diverged = true;
+    divergedFrame = movie.frames;
+  }
+}
@@ -0,0 +1,291 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+#include "../include/chip8.hpp"
+#include "../include/profiler.hpp"
+
+static std::uint64_t nanosSince(std::chrono::steady_clock::time_point start,
+                                std::chrono::steady_clock::time_point end) {
+  return static_cast<std::uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+          .count());
+}
+
+// Addresses counted apart, every one XO-CHIP's pc can hold
+constexpr std::size_t PC_SLOTS = 65536;
+
+// Smallest interval seen between two clock reads, the cost of a read
+static std::uint64_t measureClockOverhead() {
+  std::uint64_t best = ~0ULL;
+  for (int i = 0; i < 1000; ++i) {
+    const auto start = std::chrono::steady_clock::now();
+    best = std::min(best, nanosSince(start, std::chrono::steady_clock::now()));
+  }
+  return best;
+}
+
+// Sample minus the cost of reading the clock, never below zero
+static std::uint64_t netNanos(std::uint64_t nanos, std::uint64_t overhead) {
+  return nanos > overhead ? nanos - overhead : 0;
+}
+
+Profiler::Profiler(unsigned sampleInterval)
+    : sampleInterval(sampleInterval ? sampleInterval : 1),
+      clockOverhead(measureClockOverhead()), pcCounts(PC_SLOTS),
+      pcOps(PC_SLOTS) {
+  reset();
+}
+
+void Profiler::reset() {
+  untilSample = sampleInterval;
+  std::fill(opCounts, opCounts + OP_COUNT, 0);
+  std::fill(opSamples, opSamples + OP_COUNT, 0);
+  std::fill(opNanos, opNanos + OP_COUNT, 0);
+  fetchSamples = 0;
+  fetchNanos = 0;
+  std::fill(pcCounts.begin(), pcCounts.end(), 0);
+  std::fill(pcOps.begin(), pcOps.end(), Op::Unknown);
+
+  contexts.assign(1, Context{0x200, 0, 0, 1});
+  children.clear();
+  current = 0;
+  depth = 0;
+}
+
+std::uint64_t Profiler::cycles() const {
+  std::uint64_t total = 0;
+  for (int op = 0; op < OP_COUNT; ++op)
+    total += opCounts[op];
+  return total;
+}
+
+void Profiler::cycle(Chip8 &chip8) {
+  using Clock = std::chrono::steady_clock;
+
+  const bool timed = --untilSample == 0;
+  Clock::time_point start;
+  if (timed) {
+    untilSample = sampleInterval;
+    start = Clock::now();
+  }
+
+  // Same fetch as emulateCycle
+  const DecodedOp *fetched = &chip8.codeCache[chip8.pc];
+  if (!fetched->valid)
+    fetched = &chip8.decodeAtPc();
+  const DecodedOp &entry = *fetched;
+  const unsigned short pc = chip8.pc;
+  chip8.opcode = entry.opcode;
+
+  // Kept aside, the handler may overwrite the entry it runs from
+  const Op op = entry.op;
+  const unsigned short target = entry.operands.nnn;
+  const int index = static_cast<int>(op);
+
+  if (timed) {
+    const Clock::time_point fetched = Clock::now();
+    chip8.handlers[index](chip8, entry.operands);
+    const Clock::time_point end = Clock::now();
+
+    fetchNanos += netNanos(nanosSince(start, fetched), clockOverhead);
+    ++fetchSamples;
+    opNanos[index] += netNanos(nanosSince(fetched, end), clockOverhead);
+    ++opSamples[index];
+  } else {
+    chip8.handlers[index](chip8, entry.operands);
+  }
+
+  ++opCounts[index];
+  // pc is wrapped already, by the fetch
+  ++pcCounts[pc];
+  pcOps[pc] = op;
+  ++contexts[current].self;
+
+  // A call or return that stopped on a stack error went nowhere
+  if (chip8.error != MachineError::None)
+    return;
+  if (op == Op::Call)
+    enter(target);
+  else if (op == Op::Ret)
+    leave();
+}
+
+void Profiler::enter(std::uint16_t address) {
+  if (depth >= MAX_DEPTH)
+    return;
+
+  const std::uint64_t key = static_cast<std::uint64_t>(current) << 12 | address;
+  auto found = children.find(key);
+  if (found == children.end()) {
+    const std::uint32_t index = static_cast<std::uint32_t>(contexts.size());
+    contexts.push_back(Context{address, current, 0, 0});
+    found = children.emplace(key, index).first;
+  }
+
+  current = found->second;
+  ++contexts[current].calls;
+  ++depth;
+}
+
+void Profiler::leave() {
+  // A return without a call (or from beyond MAX_DEPTH) stays where it is
+  if (depth == 0)
+    return;
+  current = contexts[current].parent;
+  --depth;
+}
+
+void Profiler::writeFrame(std::ostream &out, std::uint16_t address) {
+  char name[16];
+  std::snprintf(name, sizeof(name), "sub_%03X", address);
+  out << name;
+}
+
+void Profiler::writeStack(std::ostream &out, std::uint32_t context) const {
+  if (context == 0) {
+    out << "main";
+    return;
+  }
+  writeStack(out, contexts[context].parent);
+  out << ';';
+  writeFrame(out, contexts[context].address);
+}
+
+void Profiler::writeReport(std::ostream &out, std::size_t top) const {
+  const std::uint64_t total = cycles();
+  const double percent = total ? 100.0 / static_cast<double>(total) : 0.0;
+  char line[128];
+
+  std::snprintf(line, sizeof(line),
+                "%llu cycles, host time sampled every %u cycles\n\n",
+                static_cast<unsigned long long>(total), sampleInterval);
+  out << line;
+
+  // Ops by count, with the average of their samples
+  int ops[OP_COUNT];
+  for (int op = 0; op < OP_COUNT; ++op)
+    ops[op] = op;
+  std::sort(ops, ops + OP_COUNT,
+            [this](int a, int b) { return opCounts[a] > opCounts[b]; });
+
+  std::snprintf(line, sizeof(line), "%-12s %14s %7s %9s %12s\n", "Op",
+                "count", "%", "ns/op", "est. ms");
+  out << line;
+  for (int op : ops) {
+    if (opCounts[op] == 0)
+      break;
+    const double average =
+        opSamples[op] ? static_cast<double>(opNanos[op]) / opSamples[op] : 0.0;
+    std::snprintf(line, sizeof(line), "%-12s %14llu %7.2f %9.1f %12.2f\n",
+                  opName(static_cast<Op>(op)),
+                  static_cast<unsigned long long>(opCounts[op]),
+                  opCounts[op] * percent, average,
+                  average * opCounts[op] / 1e6);
+    out << line;
+  }
+  const double fetchAverage =
+      fetchSamples ? static_cast<double>(fetchNanos) / fetchSamples : 0.0;
+  std::snprintf(line, sizeof(line), "%-12s %14s %7s %9.1f %12.2f\n",
+                "(fetch)", "", "", fetchAverage, fetchAverage * total / 1e6);
+  out << line;
+
+  // Hottest addresses
+  std::vector<int> addresses;
+  for (int pc = 0; pc < static_cast<int>(PC_SLOTS); ++pc) {
+    if (pcCounts[pc])
+      addresses.push_back(pc);
+  }
+  const std::size_t shownAddresses = std::min(top, addresses.size());
+  std::partial_sort(
+      addresses.begin(), addresses.begin() + shownAddresses, addresses.end(),
+      [this](int a, int b) { return pcCounts[a] > pcCounts[b]; });
+
+  std::snprintf(line, sizeof(line), "\n%-8s %-12s %14s %7s\n", "Address",
+                "op", "count", "%");
+  out << line;
+  for (std::size_t i = 0; i < shownAddresses; ++i) {
+    const int pc = addresses[i];
+    // Past 4K, on XO-CHIP, the address takes the column's padding
+    std::snprintf(line, sizeof(line),
+                  pc > 0xFFF ? "0x%04X   %-12s %14llu %7.2f\n"
+                             : "0x%03X    %-12s %14llu %7.2f\n",
+                  pc, opName(pcOps[pc]),
+                  static_cast<unsigned long long>(pcCounts[pc]),
+                  pcCounts[pc] * percent);
+    out << line;
+  }
+
+  // Subroutines, merging the contexts of the same address. Total counts a
+  // context once per distinct subroutine on its stack, so recursion is not
+  // counted twice
+  std::vector<std::uint64_t> calls(4096, 0), self(4096, 0), inclusive(4096, 0);
+  std::vector<std::uint16_t> stack;
+  for (std::uint32_t c = 1; c < contexts.size(); ++c) {
+    calls[contexts[c].address] += contexts[c].calls;
+    self[contexts[c].address] += contexts[c].self;
+
+    stack.clear();
+    for (std::uint32_t a = c; a != 0; a = contexts[a].parent) {
+      const std::uint16_t address = contexts[a].address;
+      if (std::find(stack.begin(), stack.end(), address) == stack.end()) {
+        stack.push_back(address);
+        inclusive[address] += contexts[c].self;
+      }
+    }
+  }
+
+  std::vector<int> subroutines;
+  for (int address = 0; address < 4096; ++address) {
+    if (calls[address])
+      subroutines.push_back(address);
+  }
+  const std::size_t shownSubroutines = std::min(top, subroutines.size());
+  std::partial_sort(subroutines.begin(),
+                    subroutines.begin() + shownSubroutines, subroutines.end(),
+                    [&inclusive](int a, int b) {
+                      return inclusive[a] > inclusive[b];
+                    });
+
+  std::snprintf(line, sizeof(line), "\n%-10s %12s %8s %8s\n", "Subroutine",
+                "calls", "self %", "total %");
+  out << line;
+  std::snprintf(line, sizeof(line), "%-10s %12s %8.2f %8.2f\n", "main", "",
+                contexts[0].self * percent, 100.0 * (total != 0));
+  out << line;
+  for (std::size_t i = 0; i < shownSubroutines; ++i) {
+    const int address = subroutines[i];
+    std::snprintf(line, sizeof(line), "0x%03X      %12llu %8.2f %8.2f\n",
+                  address, static_cast<unsigned long long>(calls[address]),
+                  self[address] * percent, inclusive[address] * percent);
+    out << line;
+  }
+}
+
+void Profiler::writeGuestFolded(std::ostream &out) const {
+  for (std::uint32_t c = 0; c < contexts.size(); ++c) {
+    if (contexts[c].self == 0)
+      continue;
+    writeStack(out, c);
+    out << ' ' << contexts[c].self << '\n';
+  }
+}
+
+void Profiler::writeHostFolded(std::ostream &out) const {
+  const std::uint64_t total = cycles();
+  // In double, the products overflow 64 bits on long runs
+  if (fetchSamples)
+    out << "emulateCycle;fetch "
+        << static_cast<std::uint64_t>(static_cast<double>(fetchNanos) /
+                                      fetchSamples * total)
+        << '\n';
+
+  for (int op = 0; op < OP_COUNT; ++op) {
+    if (opSamples[op] == 0)
+      continue;
+    out << "emulateCycle;" << opName(static_cast<Op>(op)) << ' '
+        << static_cast<std::uint64_t>(static_cast<double>(opNanos[op]) /
+                                      opSamples[op] * opCounts[op])
+        << '\n';
+  }
+}
@@ -0,0 +1,265 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../include/bytes.hpp"
+#include "../include/chip8.hpp"
+#include "../include/hash.hpp"
+#include "../include/rom_store.hpp"
+#include "../include/scheduler.hpp"
+
+static const unsigned char ROM_ARCHIVE_MAGIC[4] = {'C', '8', 'R', 'A'};
+
+// Magic, version and ROM count, then per ROM everything but the name
+static constexpr std::size_t ARCHIVE_HEADER_SIZE = 10;
+static constexpr std::size_t ARCHIVE_ENTRY_SIZE = 16;
+
+std::uint64_t romContentHash(const unsigned char *data, std::size_t size) {
+  return fnv1a64(data, size);
+}
+
+RomStore::~RomStore() {
+  for (const Mapping &mapping : mappings)
+    munmap(mapping.address, mapping.size);
+}
+
+const unsigned char *RomStore::mapFile(const std::string &path,
+                                       std::size_t &size) {
+  const int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return nullptr;
+
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+    ::close(fd);
+    return nullptr;
+  }
+
+  size = static_cast<std::size_t>(info.st_size);
+  void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED)
+    return nullptr;
+
+  mappings.push_back({data, size});
+  return static_cast<const unsigned char *>(data);
+}
+
+void RomStore::unmapLast() {
+  munmap(mappings.back().address, mappings.back().size);
+  mappings.pop_back();
+}
+
+void RomStore::add(const std::string &name, std::uint64_t hash,
+                   const unsigned char *data, std::size_t size) {
+  if (byName.count(name))
+    return;
+
+  auto known = byHash.find(hash);
+  if (known != byHash.end()) {
+    // Same image under another name, point at the copy already mapped
+    data = roms[known->second].data;
+  } else {
+    byHash.emplace(hash, roms.size());
+  }
+  byName.emplace(name, roms.size());
+  roms.push_back({name, hash, data, size});
+}
+
+bool RomStore::addFile(const std::string &path) {
+  if (byName.count(path))
+    return true;
+
+  std::size_t size;
+  const unsigned char *data = mapFile(path, size);
+  if (!data)
+    return false;
+  if (size > MAX_ROM_SIZE) {
+    unmapLast();
+    return false;
+  }
+
+  const std::uint64_t hash = romContentHash(data, size);
+  add(path, hash, data, size);
+  // A copy of an image already mapped is not kept
+  if (roms.back().data != data)
+    unmapLast();
+  return true;
+}
+
+bool RomStore::addDirectory(const std::string &path) {
+  DIR *dir = opendir(path.c_str());
+  if (!dir)
+    return false;
+
+  std::vector<std::string> files;
+  while (const dirent *entry = readdir(dir)) {
+    const std::string name(entry->d_name);
+    const std::size_t dot = name.find_last_of('.');
+    if (dot == std::string::npos)
+      continue;
+    const std::string extension = name.substr(dot);
+    if (extension == ".ch8" || extension == ".c8" || extension == ".sc8" ||
+        extension == ".xo8")
+      files.push_back(path + "/" + name);
+  }
+  closedir(dir);
+
+  std::sort(files.begin(), files.end());
+  bool ok = true;
+  for (const std::string &file : files)
+    ok = addFile(file) && ok;
+  return ok;
+}
+
+bool RomStore::addArchive(const std::string &path) {
+  std::size_t size;
+  const unsigned char *data = mapFile(path, size);
+  if (!data)
+    return false;
+
+  // Check everything before adding anything, a bad archive adds nothing
+  const auto reject = [this] {
+    unmapLast();
+    return false;
+  };
+  if (size < ARCHIVE_HEADER_SIZE ||
+      std::memcmp(data, ROM_ARCHIVE_MAGIC, sizeof(ROM_ARCHIVE_MAGIC)) != 0)
+    return reject();
+
+  ByteReader r{data + sizeof(ROM_ARCHIVE_MAGIC)};
+  if (r.u16() != ROM_ARCHIVE_VERSION)
+    return reject();
+  const std::uint32_t count = r.u32();
+
+  struct Entry {
+    std::string name;
+    std::uint32_t offset;
+    std::uint16_t size;
+  };
+  std::vector<Entry> entries;
+  const unsigned char *end = data + size;
+  for (std::uint32_t i = 0; i < count; ++i) {
+    if (static_cast<std::size_t>(end - r.p) < ARCHIVE_ENTRY_SIZE)
+      return reject();
+    Entry entry;
+    r.u64(); // the hash, recomputed rather than trusted
+    entry.offset = r.u32();
+    entry.size = r.u16();
+    const std::uint16_t nameLength = r.u16();
+    if (static_cast<std::size_t>(end - r.p) < nameLength ||
+        entry.size == 0 || entry.size > MAX_ROM_SIZE ||
+        entry.offset > size || size - entry.offset < entry.size)
+      return reject();
+    entry.name.assign(reinterpret_cast<const char *>(r.p), nameLength);
+    r.p += nameLength;
+    entries.push_back(entry);
+  }
+
+  for (const Entry &entry : entries) {
+    const unsigned char *image = data + entry.offset;
+    add(entry.name, romContentHash(image, entry.size), image, entry.size);
+  }
+  return true;
+}
+
+bool RomStore::addPath(const std::string &path) {
+  struct stat info;
+  if (stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode))
+    return addDirectory(path);
+  return addArchive(path) || addFile(path);
+}
+
+bool RomStore::writeArchive(const std::string &path) const {
+  // Images in the order they were first added, and where each one goes
+  std::size_t indexSize = ARCHIVE_HEADER_SIZE;
+  for (const Rom &rom : roms)
+    indexSize += ARCHIVE_ENTRY_SIZE + rom.name.size();
+
+  std::unordered_map<std::uint64_t, std::uint32_t> offsets;
+  std::vector<const Rom *> images;
+  std::size_t total = indexSize;
+  for (const Rom &rom : roms) {
+    if (rom.name.size() > 0xFFFF)
+      return false;
+    if (offsets.emplace(rom.hash, static_cast<std::uint32_t>(total)).second) {
+      images.push_back(&rom);
+      total += rom.size;
+    }
+  }
+  if (total > 0xFFFFFFFFu)
+    return false;
+
+  std::vector<unsigned char> archive(total);
+  ByteWriter w{archive.data()};
+  w.bytes(ROM_ARCHIVE_MAGIC, sizeof(ROM_ARCHIVE_MAGIC));
+  w.u16(ROM_ARCHIVE_VERSION);
+  w.u32(static_cast<std::uint32_t>(roms.size()));
+  for (const Rom &rom : roms) {
+    w.u64(rom.hash);
+    w.u32(offsets[rom.hash]);
+    w.u16(static_cast<std::uint16_t>(rom.size));
+    w.u16(static_cast<std::uint16_t>(rom.name.size()));
+    w.bytes(rom.name.data(), rom.name.size());
+  }
+  for (const Rom *rom : images)
+    w.bytes(rom->data, rom->size);
+
+  std::ofstream file(path, std::ios::binary);
+  if (!file.is_open())
+    return false;
+  file.write(reinterpret_cast<const char *>(archive.data()),
+             static_cast<std::streamsize>(archive.size()));
+  return static_cast<bool>(file);
+}
+
+bool RomStore::loadProfiles(const std::string &path) {
+  std::ifstream file(path);
+  if (!file.is_open())
+    return false;
+
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream fields(line);
+    std::string hashText, speed, machine, quirks;
+    if (!(fields >> hashText) || hashText[0] == '#')
+      continue;
+
+    char *hashEnd;
+    const std::uint64_t hash = std::strtoull(hashText.c_str(), &hashEnd, 16);
+    RomProfile profile;
+    if (*hashEnd != '\0' || !(fields >> speed) ||
+        (profile.ips = parseSpeed(speed)) == 0)
+      return false;
+    // Anything else in the third and fourth columns is a comment
+    if (fields >> machine)
+      profile.hasMachine = parseMachine(machine, profile.machine);
+    if (profile.hasMachine && fields >> quirks)
+      profile.hasQuirks = parseQuirks(quirks, profile.quirks);
+    profiles[hash] = profile;
+  }
+  return true;
+}
+
+const Rom *RomStore::find(std::uint64_t hash) const {
+  auto found = byHash.find(hash);
+  return found != byHash.end() ? &roms[found->second] : nullptr;
+}
+
+const Rom *RomStore::findName(const std::string &name) const {
+  auto found = byName.find(name);
+  return found != byName.end() ? &roms[found->second] : nullptr;
+}
+
+const RomProfile *RomStore::profile(std::uint64_t hash) const {
+  auto found = profiles.find(hash);
+  return found != profiles.end() ? &found->second : nullptr;
+}
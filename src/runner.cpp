@@ -0,0 +1,110 @@
+#include <cstring>
+
+#include "../include/audio.hpp"
+#include "../include/jit.hpp"
+#include "../include/runner.hpp"
+#include "../include/video.hpp"
+
+Runner::Runner(Chip8 &chip8, Frontend &frontend,
+               unsigned long instructionsPerFrame)
+    : chip8(chip8), frontend(&frontend), buzzer(false), presented(),
+      presentedHires(false), presentedOnce(false),
+      instructionsPerFrame(instructionsPerFrame), jit(nullptr),
+      audio(nullptr), video(nullptr), cycles(0), frames(0), framesDrawn(0),
+      framesSkipped(0) {}
+
+void Runner::presentFrame() {
+  // A change of resolution changes how every row is shown
+  const bool full = !presentedOnce || chip8.hires != presentedHires;
+  std::uint64_t changedRows = full ? ~0ULL : 0;
+
+  for (std::uint64_t rows = chip8.dirtyRows; rows != 0; rows &= rows - 1) {
+    const int y = __builtin_ctzll(rows);
+    for (int plane = 0; plane < PLANE_COUNT; ++plane) {
+      std::uint64_t *row = presented[plane][y];
+      const std::uint64_t *current = chip8.gfx[plane][y];
+      if (row[0] != current[0] || row[1] != current[1]) {
+        row[0] = current[0];
+        row[1] = current[1];
+        changedRows |= 1ULL << y;
+      }
+    }
+  }
+  chip8.dirtyRows = 0;
+  chip8.drawFlag = false;
+
+  if (changedRows == 0) {
+    ++framesSkipped;
+    return;
+  }
+
+  if (full) {
+    std::memcpy(presented, chip8.gfx, sizeof(presented));
+    presentedHires = chip8.hires;
+    presentedOnce = true;
+  }
+
+  frontend->drawFrame(chip8, changedRows);
+  if (video)
+    video->capture(chip8);
+  ++framesDrawn;
+}
+
+void Runner::buzzerChanged(unsigned long long cycle) {
+  buzzer = !buzzer;
+  frontend->setBuzzer(buzzer);
+  if (audio)
+    audio->buzzerEdge(cycle, buzzer);
+}
+
+void Runner::presentNow() {
+  if (chip8.dirtyRows)
+    presentFrame();
+
+  if (chip8.isBuzzerOn() != buzzer)
+    buzzerChanged(cycles);
+}
+
+bool Runner::runFrame() {
+  if (frontend->quitRequested() || chip8.error != MachineError::None)
+    return false;
+
+  frontend->pollInput(chip8.key);
+
+  if (jit)
+    jit->runCycles(instructionsPerFrame);
+  else
+    chip8.runCycles(instructionsPerFrame);
+
+  // Only report edges, the frontend does not care about every frame the
+  // buzzer stays on. An FX18 starts (or stops) the buzzer right after it
+  // runs, and the timer then stops it at the end of a frame; checking
+  // before the tick too catches a sound timer of 1, which never outlives
+  // its frame
+  if (chip8.isBuzzerOn() != buzzer)
+    buzzerChanged(cycles + (chip8.soundSetAt != SOUND_NOT_SET
+                                ? chip8.soundSetAt + 1
+                                : instructionsPerFrame));
+  chip8.tickTimers();
+
+  cycles += instructionsPerFrame;
+  ++frames;
+
+  // Several draws in one frame are presented once, and only if they left
+  // the screen different from the last frame presented
+  if (chip8.dirtyRows)
+    presentFrame();
+
+  if (chip8.isBuzzerOn() != buzzer)
+    buzzerChanged(cycles);
+  if (audio) {
+    // Taken as it is at the end of the frame, like the picture
+    audio->setPattern(chip8.audioPatternLoaded ? chip8.audioPattern : nullptr,
+                      chip8.pitch);
+    audio->endFrame(cycles);
+  }
+  if (video)
+    video->frameDone();
+
+  return true;
+}
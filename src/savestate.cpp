@@ -0,0 +1,320 @@
+#include <cstring>
+#include <fstream>
+
+#include "../include/bytes.hpp"
+#include "../include/hash.hpp"
+#include "../include/savestate.hpp"
+
+static const unsigned char SAVE_STATE_MAGIC[4] = {'C', '8', 'S', 'T'};
+
+// Screen words a machine can draw on: planes, rows and words per row
+static int screenPlanes(Machine machine) {
+  return machine == Machine::XoChip ? 2 : 1;
+}
+
+static int screenRows(Machine machine) {
+  return machine == Machine::Classic ? 32 : SCREEN_HEIGHT_MAX;
+}
+
+static int screenWords(Machine machine) {
+  return machine == Machine::Classic ? 1 : 2;
+}
+
+// Everything but the memory and the screen
+constexpr std::size_t FIXED_STATE_SIZE = 120;
+
+std::size_t saveStateSize(Machine machine) {
+  return FIXED_STATE_SIZE +
+         (machine == Machine::XoChip ? 65536 : 4096) +
+         8 * screenPlanes(machine) * screenRows(machine) *
+             screenWords(machine);
+}
+
+void saveState(const Chip8 &chip8, unsigned char *out) {
+  const Machine machine = chip8.machine;
+  ByteWriter w{out};
+  w.bytes(SAVE_STATE_MAGIC, sizeof(SAVE_STATE_MAGIC));
+  w.u16(SAVE_STATE_VERSION);
+  w.u8(static_cast<unsigned char>(machine));
+  w.u8((chip8.hires ? 1 : 0) | (chip8.audioPatternLoaded ? 2 : 0) |
+       static_cast<unsigned char>(chip8.quirks) << 2);
+  w.bytes(chip8.memory.data(), chip8.memorySize());
+  w.bytes(chip8.V, sizeof(chip8.V));
+  w.u16(chip8.I);
+  w.u16(chip8.pc);
+  w.u16(chip8.sp);
+  w.u16(chip8.opcode);
+  for (int i = 0; i < STACK_DEPTH; ++i)
+    w.u16(chip8.stack[i]);
+  w.u8(chip8.delay_timer);
+  w.u8(chip8.sound_timer);
+  w.bytes(chip8.key, sizeof(chip8.key));
+  w.u32(chip8.rngState);
+  w.u8(chip8.planeMask);
+  w.u8(chip8.pitch);
+  w.bytes(chip8.audioPattern, sizeof(chip8.audioPattern));
+  w.bytes(chip8.rplFlags, sizeof(chip8.rplFlags));
+  for (int plane = 0; plane < screenPlanes(machine); ++plane)
+    for (int y = 0; y < screenRows(machine); ++y)
+      for (int word = 0; word < screenWords(machine); ++word)
+        w.u64(chip8.gfx[plane][y][word]);
+}
+
+bool loadState(Chip8 &chip8, const unsigned char *data, std::size_t size) {
+  if (size < 8 ||
+      std::memcmp(data, SAVE_STATE_MAGIC, sizeof(SAVE_STATE_MAGIC)) != 0)
+    return false;
+
+  ByteReader r{data + sizeof(SAVE_STATE_MAGIC)};
+  if (r.u16() != SAVE_STATE_VERSION)
+    return false;
+  const unsigned char machineByte = r.u8();
+  if (machineByte > static_cast<unsigned char>(Machine::XoChip))
+    return false;
+  const Machine machine = static_cast<Machine>(machineByte);
+  if (size != saveStateSize(machine))
+    return false;
+  const unsigned char mode = r.u8();
+  if ((mode >> 2) >= QUIRKS_COUNT)
+    return false;
+  const Quirks quirks = static_cast<Quirks>(mode >> 2);
+  // A stack pointer past the stack would have opcodes index out of it
+  ByteReader spField{r.p + (machine == Machine::XoChip ? 65536 : 4096) + 20};
+  if (spField.u16() > STACK_DEPTH)
+    return false;
+
+  if (chip8.machine != machine)
+    chip8.setMachine(machine);
+  if (chip8.quirks != quirks)
+    chip8.setQuirks(quirks);
+  r.bytes(chip8.memory.data(), chip8.memorySize());
+  r.bytes(chip8.V, sizeof(chip8.V));
+  chip8.I = r.u16();
+  // Kept in memory, where the fetch expects them
+  chip8.pc = r.u16() & chip8.memoryMask();
+  chip8.sp = r.u16();
+  chip8.opcode = r.u16();
+  for (int i = 0; i < STACK_DEPTH; ++i)
+    chip8.stack[i] = r.u16() & chip8.memoryMask();
+  // An error stops the opcode from running, which runs again once loaded
+  chip8.error = MachineError::None;
+  chip8.delay_timer = r.u8();
+  chip8.sound_timer = r.u8();
+  r.bytes(chip8.key, sizeof(chip8.key));
+  chip8.rngState = r.u32();
+  chip8.planeMask = r.u8();
+  chip8.pitch = r.u8();
+  r.bytes(chip8.audioPattern, sizeof(chip8.audioPattern));
+  r.bytes(chip8.rplFlags, sizeof(chip8.rplFlags));
+  chip8.hires = mode & 1;
+  chip8.audioPatternLoaded = mode & 2;
+  std::memset(chip8.gfx, 0, sizeof(chip8.gfx));
+  for (int plane = 0; plane < screenPlanes(machine); ++plane)
+    for (int y = 0; y < screenRows(machine); ++y)
+      for (int word = 0; word < screenWords(machine); ++word)
+        chip8.gfx[plane][y][word] = r.u64();
+
+  // Memory was replaced behind the back of the caches, and the screen has to
+  // be presented again whatever was shown before
+  chip8.flushCodeCache();
+  chip8.dirtyRows = ~0ULL;
+  chip8.drawFlag = true;
+  return true;
+}
+
+std::uint64_t stateHash(const Chip8 &chip8) {
+  std::vector<unsigned char> image(saveStateSize(chip8.machine));
+  saveState(chip8, image.data());
+  return fnv1a64(image.data(), image.size());
+}
+
+bool saveStateFile(const Chip8 &chip8, const std::string &path) {
+  std::vector<unsigned char> image(saveStateSize(chip8.machine));
+  saveState(chip8, image.data());
+
+  std::ofstream file(path, std::ios::binary);
+  file.write(reinterpret_cast<const char *>(image.data()), image.size());
+  return file.good();
+}
+
+bool loadStateFile(Chip8 &chip8, const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file.is_open())
+    return false;
+
+  // One byte more than expected, to tell a longer file from a valid one
+  std::vector<unsigned char> image(MAX_SAVE_STATE_SIZE + 1);
+  file.read(reinterpret_cast<char *>(image.data()), image.size());
+  return loadState(chip8, image.data(),
+                   static_cast<std::size_t>(file.gcount()));
+}
+
+Snapshot::Snapshot(const Chip8 &chip8) {
+  auto bytes = std::make_shared<std::vector<unsigned char>>(
+      saveStateSize(chip8.machine));
+  saveState(chip8, bytes->data());
+  image = std::move(bytes);
+}
+
+void Snapshot::restore(Chip8 &chip8) const {
+  loadState(chip8, image->data(), image->size());
+}
+
+std::unique_ptr<Chip8> Snapshot::fork() const {
+  std::unique_ptr<Chip8> chip8(new Chip8);
+  restore(*chip8);
+  return chip8;
+}
+
+// Delta encoding: the XOR of a state with its keyframe as a sequence of
+// (zero run, literal count, literal bytes), counts as LEB128 varints.
+
+static void putVarint(std::vector<unsigned char> &out, std::size_t value) {
+  while (value >= 0x80) {
+    out.push_back(static_cast<unsigned char>(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<unsigned char>(value));
+}
+
+static std::size_t getVarint(const unsigned char *&p) {
+  std::size_t value = 0;
+  for (int shift = 0;; shift += 7) {
+    const unsigned char byte = *p++;
+    value |= static_cast<std::size_t>(byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+      return value;
+  }
+}
+
+static void encodeDelta(const unsigned char *state, const unsigned char *key,
+                        std::size_t size, std::vector<unsigned char> &out) {
+  std::size_t i = 0;
+  while (i < size) {
+    const std::size_t zeroStart = i;
+    while (i < size && state[i] == key[i])
+      ++i;
+    if (i == size)
+      break;
+
+    // A literal run ends at the first two equal bytes in a row, a single
+    // equal byte costs less inside the literal than as a run of its own
+    const std::size_t literalStart = i;
+    while (i < size &&
+           (state[i] != key[i] ||
+            (i + 1 < size && state[i + 1] != key[i + 1])))
+      ++i;
+
+    putVarint(out, literalStart - zeroStart);
+    putVarint(out, i - literalStart);
+    for (std::size_t j = literalStart; j < i; ++j)
+      out.push_back(state[j] ^ key[j]);
+  }
+}
+
+static void decodeDelta(const std::vector<unsigned char> &delta,
+                        const std::vector<unsigned char> &key,
+                        std::vector<unsigned char> &state) {
+  state = key;
+
+  const unsigned char *p = delta.data();
+  const unsigned char *end = p + delta.size();
+  std::size_t i = 0;
+  while (p < end) {
+    i += getVarint(p);
+    const std::size_t literals = getVarint(p);
+    for (std::size_t j = 0; j < literals; ++j, ++i)
+      state[i] ^= *p++;
+  }
+}
+
+RewindBuffer::RewindBuffer(std::size_t capacity, std::size_t keyframeInterval)
+    : capacity(capacity), keyframeInterval(keyframeInterval), storedBytes(0),
+      sinceKeyframe(0), keyframe(nullptr) {
+  // Dropping the oldest keyframe must never drop the newest frame
+  if (this->keyframeInterval > capacity)
+    this->keyframeInterval = capacity;
+  if (this->keyframeInterval == 0)
+    this->keyframeInterval = 1;
+}
+
+void RewindBuffer::push(const Chip8 &chip8) {
+  if (capacity == 0)
+    return;
+
+  image.resize(saveStateSize(chip8.machine));
+  saveState(chip8, image.data());
+
+  // A state of another machine has another size, it can not be a delta
+  Frame frame;
+  if (!keyframe || sinceKeyframe >= keyframeInterval ||
+      keyframe->size() != image.size()) {
+    frame.keyframe = true;
+    frame.data = image;
+  } else {
+    frame.keyframe = false;
+    encodeDelta(image.data(), keyframe->data(), image.size(), frame.data);
+  }
+  storedBytes += frame.data.size();
+  frames.push_back(std::move(frame));
+
+  if (frames.back().keyframe) {
+    keyframe = &frames.back().data;
+    sinceKeyframe = 1;
+  } else {
+    ++sinceKeyframe;
+  }
+
+  while (frames.size() > capacity)
+    dropOldest();
+}
+
+bool RewindBuffer::stepBack(Chip8 &chip8) {
+  if (frames.empty())
+    return false;
+
+  const Frame &newest = frames.back();
+  if (newest.keyframe) {
+    loadState(chip8, newest.data.data(), newest.data.size());
+  } else {
+    decodeDelta(newest.data, *keyframe, image);
+    loadState(chip8, image.data(), image.size());
+  }
+
+  storedBytes -= newest.data.size();
+  frames.pop_back();
+  findKeyframe();
+  return true;
+}
+
+void RewindBuffer::clear() {
+  frames.clear();
+  storedBytes = 0;
+  sinceKeyframe = 0;
+  keyframe = nullptr;
+}
+
+// Point keyframe at the newest keyframe held, after frames were dropped
+void RewindBuffer::findKeyframe() {
+  keyframe = nullptr;
+  sinceKeyframe = 0;
+  for (auto it = frames.rbegin(); it != frames.rend(); ++it) {
+    ++sinceKeyframe;
+    if (it->keyframe) {
+      keyframe = &it->data;
+      return;
+    }
+  }
+}
+
+// Drop the oldest keyframe along with the deltas depending on it, they can
+// not be decoded without it
+void RewindBuffer::dropOldest() {
+  do {
+    storedBytes -= frames.front().data.size();
+    frames.pop_front();
+  } while (!frames.empty() && !frames.front().keyframe);
+
+  if (frames.empty())
+    findKeyframe();
+}
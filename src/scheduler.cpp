@@ -0,0 +1,47 @@
+#include <cctype>
+#include <cstdlib>
+#include <thread>
+
+#include "../include/scheduler.hpp"
+
+unsigned long instructionsPerFrame(unsigned long ips) {
+  unsigned long ipf = (ips + FRAMES_PER_SECOND / 2) / FRAMES_PER_SECOND;
+  return ipf > 0 ? ipf : 1;
+}
+
+unsigned long parseSpeed(const std::string &speed) {
+  if (speed == "slow")
+    return IPS_SLOW;
+  if (speed == "normal")
+    return IPS_NORMAL;
+  if (speed == "fast")
+    return IPS_FAST;
+
+  if (speed.empty() || !std::isdigit(static_cast<unsigned char>(speed[0])))
+    return 0;
+
+  char *end = nullptr;
+  unsigned long ips = std::strtoul(speed.c_str(), &end, 10);
+  return *end == '\0' ? ips : 0;
+}
+
+constexpr int FrameScheduler::MAX_LAG_FRAMES;
+
+FrameScheduler::FrameScheduler()
+    : period(std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::nanoseconds(1000000000 / FRAMES_PER_SECOND))),
+      deadline(std::chrono::steady_clock::now()) {}
+
+void FrameScheduler::start() { deadline = std::chrono::steady_clock::now(); }
+
+void FrameScheduler::waitForNextFrame() {
+  deadline += period;
+
+  const auto now = std::chrono::steady_clock::now();
+  if (now < deadline) {
+    std::this_thread::sleep_until(deadline);
+  } else if (now - deadline > period * MAX_LAG_FRAMES) {
+    // Too far behind to catch up, restart the grid from here
+    deadline = now;
+  }
+}
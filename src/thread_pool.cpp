@@ -0,0 +1,100 @@
+#include "../include/thread_pool.hpp"
+
+ThreadPool::ThreadPool(unsigned threads)
+    : queued(0), unfinished(0), next(0), stopping(false) {
+  if (threads == 0)
+    threads = std::thread::hardware_concurrency();
+  if (threads == 0)
+    threads = 1;
+
+  for (unsigned i = 0; i < threads; ++i) {
+    queues.emplace_back(new Queue);
+  }
+  for (unsigned i = 0; i < threads; ++i) {
+    workers.emplace_back(&ThreadPool::workerLoop, this, i);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  wait();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+  unsigned target;
+  {
+    // Counted before the task is visible, so wait() can not miss it
+    std::lock_guard<std::mutex> lock(mutex);
+    ++queued;
+    ++unfinished;
+    target = next;
+    next = (next + 1) % queues.size();
+  }
+  {
+    std::lock_guard<std::mutex> lock(queues[target]->mutex);
+    queues[target]->tasks.push_back(std::move(task));
+  }
+  wake.notify_one();
+}
+
+void ThreadPool::wait() {
+  std::unique_lock<std::mutex> lock(mutex);
+  done.wait(lock, [this] { return unfinished == 0; });
+}
+
+bool ThreadPool::takeTask(unsigned self, std::function<void()> &task) {
+  // Own deque first, newest task, its data is the most likely to be cached
+  {
+    Queue &own = *queues[self];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    if (!own.tasks.empty()) {
+      task = std::move(own.tasks.back());
+      own.tasks.pop_back();
+      return true;
+    }
+  }
+
+  // Then steal the oldest task of the others, starting with the next worker
+  for (std::size_t i = 1; i < queues.size(); ++i) {
+    Queue &victim = *queues[(self + i) % queues.size()];
+    std::lock_guard<std::mutex> lock(victim.mutex);
+    if (!victim.tasks.empty()) {
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void ThreadPool::workerLoop(unsigned self) {
+  for (;;) {
+    std::function<void()> task;
+    if (takeTask(self, task)) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        --queued;
+      }
+      task();
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--unfinished == 0)
+        done.notify_all();
+      continue;
+    }
+
+    // A task counted in queued may not be pushed yet, in which case this
+    // returns right away and the deques are searched again
+    std::unique_lock<std::mutex> lock(mutex);
+    wake.wait(lock, [this] { return stopping || queued > 0; });
+    if (stopping && queued == 0)
+      return;
+  }
+}
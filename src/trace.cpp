@@ -0,0 +1,280 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../include/bytes.hpp"
+#include "../include/dispatch.hpp"
+#include "../include/savestate.hpp"
+#include "../include/trace.hpp"
+
+static_assert(sizeof(TraceRun) == 24, "trace runs must stay packed");
+
+static const unsigned char TRACE_MAGIC[4] = {'C', '8', 'T', 'R'};
+
+TraceRecorder::TraceRecorder(std::size_t ringRuns)
+    : ring(ringRuns), stopping(false), fd(-1), window(nullptr),
+      windowOffset(0), stateSize(0), written(0), failed(false), current(),
+      ended(), opcodes(0), runs(0) {}
+
+TraceRecorder::~TraceRecorder() { close(); }
+
+bool TraceRecorder::open(const std::string &path, const Chip8 &chip8) {
+  if (fd >= 0)
+    return false;
+
+  fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return false;
+
+  written = 0;
+  failed = false;
+  current = TraceRun();
+  opcodes = 0;
+  runs = 0;
+  if (!mapWindow(0)) {
+    ::close(fd);
+    fd = -1;
+    return false;
+  }
+
+  // The first window always has room for it
+  stateSize = saveStateSize(chip8.machine);
+  saveState(chip8, window + TRACE_HEADER_SIZE);
+
+  stopping.store(false);
+  writer = std::thread(&TraceRecorder::writerLoop, this);
+  return true;
+}
+
+bool TraceRecorder::close() {
+  if (fd < 0)
+    return false;
+
+  if (current.calls != 0)
+    publishRun();
+  current = TraceRun();
+  stopping.store(true, std::memory_order_release);
+  writer.join();
+  if (window)
+    munmap(window, WINDOW_SIZE);
+  window = nullptr;
+
+  unsigned char header[TRACE_HEADER_SIZE];
+  ByteWriter w{header};
+  w.bytes(TRACE_MAGIC, sizeof(TRACE_MAGIC));
+  w.u16(TRACE_VERSION);
+  w.u16(sizeof(TraceRun));
+  w.u64(opcodes);
+  w.u64(written);
+  w.u32(static_cast<std::uint32_t>(stateSize));
+  w.u32(0);
+
+  bool ok = !failed;
+  if (ftruncate(fd, static_cast<off_t>(TRACE_HEADER_SIZE + stateSize +
+                                        written * sizeof(TraceRun))) != 0)
+    ok = false;
+  if (pwrite(fd, header, sizeof(header), 0) !=
+      static_cast<ssize_t>(sizeof(header)))
+    ok = false;
+  ::close(fd);
+  fd = -1;
+  return ok;
+}
+
+void TraceRecorder::publishRun() {
+  while (!ring.tryPush(current))
+    std::this_thread::yield();
+  ++runs;
+}
+
+void TraceRecorder::startRun(const Chip8 &chip8, unsigned long count) {
+  if (current.calls != 0)
+    publishRun();
+
+  std::uint16_t keys = 0;
+  for (int k = 0; k < 16; ++k) {
+    if (chip8.key[k])
+      keys |= 1 << k;
+  }
+  current.cycles = count;
+  current.calls = 1;
+  current.pc = chip8.pc;
+  current.I = chip8.I;
+  current.keys = keys;
+  current.delayTimer = chip8.delay_timer;
+  current.soundTimer = chip8.sound_timer;
+}
+
+// Map the window of the file starting at offset, growing the file to cover
+// it
+bool TraceRecorder::mapWindow(std::uint64_t offset) {
+  if (window)
+    munmap(window, WINDOW_SIZE);
+  window = nullptr;
+
+  if (ftruncate(fd, static_cast<off_t>(offset + WINDOW_SIZE)) != 0)
+    return false;
+  void *map = mmap(nullptr, WINDOW_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, static_cast<off_t>(offset));
+  if (map == MAP_FAILED)
+    return false;
+
+  window = static_cast<unsigned char *>(map);
+  windowOffset = offset;
+  return true;
+}
+
+void TraceRecorder::writeRuns(const TraceRun *first, std::size_t n) {
+  const unsigned char *source = reinterpret_cast<const unsigned char *>(first);
+  std::size_t bytes = n * sizeof(TraceRun);
+  std::uint64_t position =
+      TRACE_HEADER_SIZE + stateSize + written * sizeof(TraceRun);
+
+  while (bytes > 0) {
+    if (position >= windowOffset + WINDOW_SIZE &&
+        !mapWindow(windowOffset + WINDOW_SIZE)) {
+      failed = true;
+      return;
+    }
+    const std::size_t chunk = static_cast<std::size_t>(
+        std::min<std::uint64_t>(bytes, windowOffset + WINDOW_SIZE - position));
+    std::memcpy(window + (position - windowOffset), source, chunk);
+    source += chunk;
+    bytes -= chunk;
+    position += chunk;
+  }
+  written += n;
+}
+
+void TraceRecorder::writerLoop() {
+  for (;;) {
+    // Read the flag first: once it is set nothing more gets pushed, so an
+    // empty ring after that means everything was written
+    const bool stop = stopping.load(std::memory_order_acquire);
+
+    const TraceRun *first;
+    const std::size_t n = ring.peek(first);
+    if (n > 0) {
+      // After a failure keep draining, the emulation must not wait forever
+      if (!failed)
+        writeRuns(first, n);
+      ring.release(n);
+      continue;
+    }
+
+    if (stop)
+      return;
+    // Runs are rare, waking up more often only takes time from the
+    // emulation on a busy core
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+}
+
+TraceFile::TraceFile()
+    : map(nullptr), mapSize(0), runs(nullptr), runsLeft(0), count(0),
+      cycles(0), cyclesLeft(0), callsLeft(0), replayed(0), mismatch(false) {}
+
+TraceFile::~TraceFile() {
+  if (map)
+    munmap(map, mapSize);
+}
+
+bool TraceFile::open(const std::string &path) {
+  const int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat info;
+  if (fstat(fd, &info) != 0 ||
+      static_cast<std::size_t>(info.st_size) < TRACE_HEADER_SIZE) {
+    ::close(fd);
+    return false;
+  }
+
+  const std::size_t size = static_cast<std::size_t>(info.st_size);
+  void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED)
+    return false;
+
+  const unsigned char *bytes = static_cast<const unsigned char *>(data);
+  ByteReader r{bytes + sizeof(TRACE_MAGIC)};
+  const std::uint16_t version = r.u16();
+  const std::uint16_t runSize = r.u16();
+  const std::uint64_t opcodes = r.u64();
+  const std::uint64_t runCount = r.u64();
+  const std::uint32_t stateSize = r.u32();
+  if (std::memcmp(bytes, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 ||
+      version != TRACE_VERSION || runSize != sizeof(TraceRun) ||
+      stateSize > size - TRACE_HEADER_SIZE ||
+      runCount > (size - TRACE_HEADER_SIZE - stateSize) / sizeof(TraceRun) ||
+      !loadState(chip8, bytes + TRACE_HEADER_SIZE, stateSize)) {
+    munmap(data, size);
+    return false;
+  }
+
+  if (map)
+    munmap(map, mapSize);
+  map = data;
+  mapSize = size;
+  runs = bytes + TRACE_HEADER_SIZE + stateSize;
+  runsLeft = runCount;
+  count = opcodes;
+  cyclesLeft = callsLeft = 0;
+  replayed = 0;
+  mismatch = false;
+  return true;
+}
+
+bool TraceFile::startRun() {
+  ByteReader r{runs};
+  runs += sizeof(TraceRun);
+  --runsLeft;
+
+  cycles = cyclesLeft = r.u64();
+  callsLeft = r.u64() - 1;
+  const std::uint16_t pc = r.u16();
+  const std::uint16_t I = r.u16();
+  if (pc != chip8.pc || I != chip8.I) {
+    mismatch = true;
+    runsLeft = cyclesLeft = callsLeft = 0;
+    return false;
+  }
+
+  const std::uint16_t keys = r.u16();
+  for (int k = 0; k < 16; ++k)
+    chip8.key[k] = keys >> k & 1;
+  chip8.delay_timer = r.u8();
+  chip8.sound_timer = r.u8();
+  return true;
+}
+
+bool TraceFile::next(TraceRecord &record) {
+  while (cyclesLeft == 0) {
+    if (callsLeft > 0) {
+      // Between two frames of the same run
+      chip8.tickTimers();
+      cyclesLeft = cycles;
+      --callsLeft;
+    } else if (runsLeft == 0 || !startRun()) {
+      return false;
+    }
+  }
+
+  record.pc = chip8.pc;
+  chip8.emulateCycle();
+  --cyclesLeft;
+  ++replayed;
+
+  record.opcode = chip8.opcode;
+  record.I = chip8.I;
+  const std::uint8_t writes = traceWrites(opTable(chip8.machine)[chip8.opcode]);
+  record.reg = writes == TRACE_WRITES_VX ? (chip8.opcode >> 8 & 0xF) : writes;
+  record.value = record.reg < 16 ? chip8.V[record.reg] : 0;
+  return true;
+}
@@ -0,0 +1,565 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+
+#include "../include/bytes.hpp"
+#include "../include/video.hpp"
+
+static const unsigned char VIDEO_MAGIC[4] = {'C', '8', 'V', 'D'};
+
+// Largest image of a picture: both planes of the 128 x 64 mode
+constexpr std::size_t MAX_IMAGE_SIZE = PLANE_COUNT * SCREEN_HEIGHT_MAX * 16;
+
+// Size of the image of a picture in the given mode
+static std::size_t imageSize(bool hires) {
+  return hires ? MAX_IMAGE_SIZE : PLANE_COUNT * 32 * 8;
+}
+
+// Rows and bytes per row of the image of a picture
+static int imageRows(bool hires) { return hires ? SCREEN_HEIGHT_MAX : 32; }
+static int imageRowBytes(bool hires) { return hires ? 16 : 8; }
+
+// Pack the screen of picture into out, imageSize bytes, see VIDEO_HEADER_SIZE
+static void packImage(const VideoPicture &picture, unsigned char *out) {
+  for (int plane = 0; plane < PLANE_COUNT; ++plane)
+    for (int y = 0; y < imageRows(picture.hires); ++y)
+      for (int b = 0; b < imageRowBytes(picture.hires); ++b)
+        *out++ = static_cast<unsigned char>(
+            picture.gfx[plane][y][b >> 3] >> (56 - 8 * (b & 7)));
+}
+
+// The reverse of packImage
+static void unpackImage(const unsigned char *in, VideoPicture &picture) {
+  std::memset(picture.gfx, 0, sizeof(picture.gfx));
+  for (int plane = 0; plane < PLANE_COUNT; ++plane)
+    for (int y = 0; y < imageRows(picture.hires); ++y)
+      for (int b = 0; b < imageRowBytes(picture.hires); ++b)
+        picture.gfx[plane][y][b >> 3] |= static_cast<std::uint64_t>(*in++)
+                                         << (56 - 8 * (b & 7));
+}
+
+// Run-length encode size bytes of in at the end of out: runs of 2 to 129
+// equal bytes as one control byte and the byte, anything else copied behind
+// a control byte giving its length, up to 128
+static void encodeRuns(const unsigned char *in, std::size_t size,
+                       std::vector<unsigned char> &out) {
+  std::size_t literal = 0;
+  std::size_t literalStart = 0;
+  auto flushLiteral = [&]() {
+    while (literal > 0) {
+      const std::size_t n = std::min<std::size_t>(literal, 128);
+      out.push_back(static_cast<unsigned char>(n - 1));
+      out.insert(out.end(), in + literalStart, in + literalStart + n);
+      literalStart += n;
+      literal -= n;
+    }
+  };
+
+  std::size_t i = 0;
+  while (i < size) {
+    std::size_t run = 1;
+    while (i + run < size && run < 129 && in[i + run] == in[i])
+      ++run;
+    if (run >= 2) {
+      flushLiteral();
+      out.push_back(static_cast<unsigned char>(126 + run));
+      out.push_back(in[i]);
+      i += run;
+      literalStart = i;
+    } else {
+      ++literal;
+      ++i;
+    }
+  }
+  flushLiteral();
+}
+
+// Decode what encodeRuns made of exactly size bytes. Returns false if the
+// data does not hold that many, or holds more.
+static bool decodeRuns(const unsigned char *in, std::size_t length,
+                       unsigned char *out, std::size_t size) {
+  const unsigned char *const end = in + length;
+  std::size_t done = 0;
+  while (in < end) {
+    const unsigned char control = *in++;
+    if (control < 128) {
+      const std::size_t n = control + 1u;
+      if (static_cast<std::size_t>(end - in) < n || done + n > size)
+        return false;
+      std::memcpy(out + done, in, n);
+      in += n;
+      done += n;
+    } else {
+      const std::size_t n = control - 126u;
+      if (in == end || done + n > size)
+        return false;
+      std::memset(out + done, *in++, n);
+      done += n;
+    }
+  }
+  return done == size;
+}
+
+RawVideoWriter::RawVideoWriter()
+    : file(nullptr), pictures(0), previousHires(false),
+      previous(MAX_IMAGE_SIZE), image(MAX_IMAGE_SIZE), failed(false) {}
+
+RawVideoWriter::~RawVideoWriter() { close(0); }
+
+bool RawVideoWriter::open(const std::string &path) {
+  file = std::fopen(path.c_str(), "wb");
+  if (!file) {
+    failed = true;
+    return false;
+  }
+  pictures = 0;
+  failed = false;
+
+  // The counts are filled in by close()
+  unsigned char header[VIDEO_HEADER_SIZE] = {};
+  std::memcpy(header, VIDEO_MAGIC, sizeof(VIDEO_MAGIC));
+  failed = std::fwrite(header, sizeof(header), 1, file) != 1;
+  return !failed;
+}
+
+void RawVideoWriter::write(const VideoPicture &picture) {
+  if (!file)
+    return;
+
+  const std::size_t size = imageSize(picture.hires);
+  packImage(picture, image.data());
+  const bool key = pictures == 0 || picture.hires != previousHires;
+  if (!key) {
+    // Unchanged bytes become zeros, which the runs swallow
+    for (std::size_t i = 0; i < size; ++i)
+      previous[i] ^= image[i];
+  }
+
+  // The size goes in once known, the runs may move the buffer
+  encoded.assign(9, 0);
+  ByteWriter{encoded.data()}.u32(picture.frame);
+  encoded[4] = static_cast<unsigned char>((picture.hires ? 1 : 0) |
+                                          (key ? 2 : 0));
+  encodeRuns(key ? image.data() : previous.data(), size, encoded);
+  ByteWriter{encoded.data() + 5}.u32(
+      static_cast<std::uint32_t>(encoded.size() - 9));
+  if (std::fwrite(encoded.data(), encoded.size(), 1, file) != 1)
+    failed = true;
+
+  std::swap(previous, image);
+  previousHires = picture.hires;
+  ++pictures;
+}
+
+bool RawVideoWriter::close(std::uint32_t frames) {
+  if (!file)
+    return false;
+
+  unsigned char header[VIDEO_HEADER_SIZE];
+  ByteWriter w{header};
+  w.bytes(VIDEO_MAGIC, sizeof(VIDEO_MAGIC));
+  w.u16(VIDEO_VERSION);
+  w.u16(VIDEO_FRAME_RATE);
+  w.u32(frames);
+  w.u32(pictures);
+  if (std::fseek(file, 0, SEEK_SET) != 0 ||
+      std::fwrite(header, sizeof(header), 1, file) != 1)
+    failed = true;
+  if (std::fclose(file) != 0)
+    failed = true;
+  file = nullptr;
+  return !failed;
+}
+
+// GIF
+
+// Canvas every picture is drawn on, a low resolution pixel covering 2 x 2
+constexpr int CANVAS_WIDTH = SCREEN_WIDTH_MAX;
+constexpr int CANVAS_HEIGHT = SCREEN_HEIGHT_MAX;
+
+// Shortest delay viewers play as given, in hundredths of a second
+constexpr unsigned MIN_GIF_DELAY = 2;
+
+// Hundredths of a second at which frame starts
+static unsigned long centiseconds(std::uint32_t frame) {
+  return (static_cast<unsigned long>(frame) * 100 + VIDEO_FRAME_RATE / 2) /
+         VIDEO_FRAME_RATE;
+}
+
+// Colors of the planes, as the window shows them
+static const unsigned char GIF_PALETTE[4][3] = {
+    {0, 0, 0}, {255, 255, 255}, {170, 170, 170}, {85, 85, 85}};
+
+// Variable width LZW of GIF image data, for 2-bit pixels: codes are packed
+// least significant bit first and handed out in sub-blocks of 255 bytes
+class GifLzw {
+private:
+  static constexpr int MIN_CODE_SIZE = 2;
+  static constexpr unsigned CLEAR = 1 << MIN_CODE_SIZE;
+  static constexpr unsigned END = CLEAR + 1;
+  static constexpr unsigned MAX_CODES = 4096;
+
+  std::vector<unsigned char> &out;
+  // Code of the string made of code followed by pixel p at code * 4 + p, 0
+  // when there is none yet (no string is ever given code 0)
+  std::vector<std::uint16_t> children;
+  unsigned next;
+  int width;
+  int prefix;
+
+  std::uint32_t bits;
+  int bitCount;
+  unsigned char block[255];
+  std::size_t blockSize;
+
+  void flushBlock() {
+    if (blockSize == 0)
+      return;
+    out.push_back(static_cast<unsigned char>(blockSize));
+    out.insert(out.end(), block, block + blockSize);
+    blockSize = 0;
+  }
+
+  void emit(unsigned code) {
+    bits |= code << bitCount;
+    bitCount += width;
+    while (bitCount >= 8) {
+      block[blockSize++] = static_cast<unsigned char>(bits);
+      if (blockSize == sizeof(block))
+        flushBlock();
+      bits >>= 8;
+      bitCount -= 8;
+    }
+  }
+
+  void reset() {
+    std::fill(children.begin(), children.end(), 0);
+    next = END + 1;
+    width = MIN_CODE_SIZE + 1;
+  }
+
+public:
+  explicit GifLzw(std::vector<unsigned char> &out)
+      : out(out), children(MAX_CODES * 4), prefix(-1), bits(0), bitCount(0),
+        blockSize(0) {
+    out.push_back(static_cast<unsigned char>(MIN_CODE_SIZE));
+    reset();
+    emit(CLEAR);
+  }
+
+  void pixel(unsigned char color) {
+    if (prefix < 0) {
+      prefix = color;
+      return;
+    }
+    std::uint16_t &child = children[prefix * 4 + color];
+    if (child) {
+      prefix = child;
+      return;
+    }
+    emit(static_cast<unsigned>(prefix));
+    if (next < MAX_CODES) {
+      // The decoder widens its codes one string later than this, when it
+      // adds the same one
+      child = static_cast<std::uint16_t>(next++);
+      if (next > (1u << width) && width < 12)
+        ++width;
+    } else {
+      emit(CLEAR);
+      reset();
+    }
+    prefix = color;
+  }
+
+  void finish() {
+    if (prefix >= 0)
+      emit(static_cast<unsigned>(prefix));
+    emit(END);
+    if (bitCount > 0)
+      block[blockSize++] = static_cast<unsigned char>(bits);
+    flushBlock();
+    out.push_back(0);
+  }
+};
+
+// Draw the screen of picture on a canvas, one color per pixel
+static void drawCanvas(const VideoPicture &picture, unsigned char *canvas) {
+  const int shift = picture.hires ? 0 : 1;
+  for (int y = 0; y < CANVAS_HEIGHT; ++y)
+    for (int x = 0; x < CANVAS_WIDTH; ++x) {
+      const int px = x >> shift;
+      const int py = y >> shift;
+      const int bit = 63 - (px & 63);
+      canvas[y * CANVAS_WIDTH + x] = static_cast<unsigned char>(
+          ((picture.gfx[0][py][px >> 6] >> bit) & 1) |
+          ((picture.gfx[1][py][px >> 6] >> bit) & 1) << 1);
+    }
+}
+
+GifWriter::GifWriter(unsigned scale)
+    : scale(scale ? scale : 1), file(nullptr), failed(false),
+      shown(CANVAS_WIDTH * CANVAS_HEIGHT), pending(shown.size()),
+      pendingFrame(0), hasPending(false) {}
+
+GifWriter::~GifWriter() { close(0); }
+
+bool GifWriter::open(const std::string &path) {
+  file = std::fopen(path.c_str(), "wb");
+  if (!file) {
+    failed = true;
+    return false;
+  }
+  failed = false;
+  hasPending = false;
+  // A blank screen before the first picture
+  std::fill(shown.begin(), shown.end(), 0);
+
+  std::vector<unsigned char> header(13);
+  ByteWriter w{header.data()};
+  w.bytes("GIF89a", 6);
+  w.u16(static_cast<std::uint16_t>(CANVAS_WIDTH * scale));
+  w.u16(static_cast<std::uint16_t>(CANVAS_HEIGHT * scale));
+  // Global table of 4 colors, background color 0, square pixels
+  w.u8(0x91);
+  w.u8(0);
+  w.u8(0);
+  for (const auto &color : GIF_PALETTE)
+    header.insert(header.end(), color, color + 3);
+  // Loop forever
+  static const unsigned char loop[] = {0x21, 0xFF, 0x0B, 'N',  'E', 'T',
+                                       'S',  'C',  'A',  'P',  'E', '2',
+                                       '.',  '0',  0x03, 0x01, 0,   0,
+                                       0};
+  header.insert(header.end(), loop, loop + sizeof(loop));
+  failed = std::fwrite(header.data(), header.size(), 1, file) != 1;
+  return !failed;
+}
+
+void GifWriter::writePending(unsigned delay) {
+  // Only the rows that differ from what is on screen, at least one since a
+  // picture can not be empty
+  int top = 0;
+  int bottom = CANVAS_HEIGHT - 1;
+  const auto row = [](std::vector<unsigned char> &canvas, int y) {
+    return canvas.begin() + y * CANVAS_WIDTH;
+  };
+  while (top < bottom &&
+         std::equal(row(pending, top), row(pending, top + 1), row(shown, top)))
+    ++top;
+  while (bottom > top && std::equal(row(pending, bottom),
+                                    row(pending, bottom + 1),
+                                    row(shown, bottom)))
+    --bottom;
+
+  std::vector<unsigned char> data(18);
+  ByteWriter w{data.data()};
+  // Graphic control: left in place for the next picture to draw over
+  w.u8(0x21);
+  w.u8(0xF9);
+  w.u8(4);
+  w.u8(1 << 2);
+  w.u16(static_cast<std::uint16_t>(delay));
+  w.u8(0);
+  w.u8(0);
+  // Image descriptor, full width, no local color table
+  w.u8(0x2C);
+  w.u16(0);
+  w.u16(static_cast<std::uint16_t>(top * scale));
+  w.u16(static_cast<std::uint16_t>(CANVAS_WIDTH * scale));
+  w.u16(static_cast<std::uint16_t>((bottom - top + 1) * scale));
+  w.u8(0);
+
+  GifLzw lzw(data);
+  for (int y = top * static_cast<int>(scale);
+       y < (bottom + 1) * static_cast<int>(scale); ++y) {
+    const unsigned char *line = &pending[(y / scale) * CANVAS_WIDTH];
+    for (int x = 0; x < CANVAS_WIDTH * static_cast<int>(scale); ++x)
+      lzw.pixel(line[x / scale]);
+  }
+  lzw.finish();
+
+  if (std::fwrite(data.data(), data.size(), 1, file) != 1)
+    failed = true;
+  std::copy(row(pending, top), row(pending, bottom + 1), row(shown, top));
+}
+
+void GifWriter::write(const VideoPicture &picture) {
+  if (!file)
+    return;
+
+  std::uint32_t start = picture.frame;
+  if (hasPending) {
+    const unsigned long delay =
+        centiseconds(picture.frame) - centiseconds(pendingFrame);
+    if (delay >= MIN_GIF_DELAY)
+      writePending(static_cast<unsigned>(delay));
+    else
+      start = pendingFrame;
+  } else if (picture.frame > 0) {
+    // Blank until the first picture
+    hasPending = true;
+    pendingFrame = 0;
+    std::fill(pending.begin(), pending.end(), 0);
+    return write(picture);
+  }
+
+  drawCanvas(picture, pending.data());
+  pendingFrame = start;
+  hasPending = true;
+}
+
+bool GifWriter::close(std::uint32_t frames) {
+  if (!file)
+    return false;
+
+  if (hasPending) {
+    const unsigned long end = centiseconds(std::max(frames, pendingFrame));
+    writePending(static_cast<unsigned>(
+        std::max<unsigned long>(end - centiseconds(pendingFrame),
+                                MIN_GIF_DELAY)));
+  }
+  if (std::fputc(0x3B, file) == EOF)
+    failed = true;
+  if (std::fclose(file) != 0)
+    failed = true;
+  file = nullptr;
+  return !failed;
+}
+
+std::unique_ptr<VideoWriter> videoWriterForPath(const std::string &path,
+                                                unsigned scale) {
+  const std::size_t dot = path.rfind('.');
+  if (dot != std::string::npos && path.substr(dot) == ".gif")
+    return std::unique_ptr<VideoWriter>(new GifWriter(scale));
+  return std::unique_ptr<VideoWriter>(new RawVideoWriter());
+}
+
+VideoRecorder::VideoRecorder(bool dropWhenFull, std::size_t ringPictures)
+    : dropWhenFull(dropWhenFull), ring(ringPictures), stopping(false),
+      frames(0), captured(0), droppedPictures(0) {}
+
+VideoRecorder::~VideoRecorder() { close(); }
+
+bool VideoRecorder::open(const std::string &path, const Chip8 &chip8,
+                         unsigned scale) {
+  if (output)
+    return false;
+
+  output = videoWriterForPath(path, scale);
+  if (!output->open(path)) {
+    output.reset();
+    return false;
+  }
+  frames = 0;
+  captured = 0;
+  droppedPictures = 0;
+
+  stopping.store(false);
+  writer = std::thread(&VideoRecorder::writerLoop, this);
+  capture(chip8);
+  return true;
+}
+
+bool VideoRecorder::close() {
+  if (!output)
+    return false;
+
+  stopping.store(true, std::memory_order_release);
+  writer.join();
+  const bool ok = output->close(frames);
+  output.reset();
+  return ok;
+}
+
+VideoPicture *VideoRecorder::waitForSlot() {
+  if (dropWhenFull) {
+    ++droppedPictures;
+    return nullptr;
+  }
+  VideoPicture *slot;
+  while (ring.reserve(slot) == 0)
+    std::this_thread::yield();
+  return slot;
+}
+
+void VideoRecorder::writerLoop() {
+  for (;;) {
+    // Read the flag first: once it is set nothing more gets pushed, so an
+    // empty ring after that means everything was written
+    const bool stop = stopping.load(std::memory_order_acquire);
+
+    const VideoPicture *first;
+    const std::size_t n = ring.peek(first);
+    if (n > 0) {
+      for (std::size_t i = 0; i < n; ++i)
+        output->write(first[i]);
+      ring.release(n);
+      continue;
+    }
+
+    if (stop)
+      return;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+VideoFile::VideoFile()
+    : offset(0), frameCount(0), pictureCount(0), decoded(0), hires(false),
+      image(MAX_IMAGE_SIZE), delta(MAX_IMAGE_SIZE) {}
+
+bool VideoFile::open(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file.is_open())
+    return false;
+
+  std::vector<unsigned char> bytes((std::istreambuf_iterator<char>(file)),
+                                   std::istreambuf_iterator<char>());
+  if (bytes.size() < VIDEO_HEADER_SIZE ||
+      std::memcmp(bytes.data(), VIDEO_MAGIC, sizeof(VIDEO_MAGIC)) != 0)
+    return false;
+
+  ByteReader r{bytes.data() + sizeof(VIDEO_MAGIC)};
+  if (r.u16() != VIDEO_VERSION || r.u16() != VIDEO_FRAME_RATE)
+    return false;
+  frameCount = r.u32();
+  pictureCount = r.u32();
+  data = std::move(bytes);
+  offset = VIDEO_HEADER_SIZE;
+  decoded = 0;
+  return true;
+}
+
+bool VideoFile::next(VideoPicture &picture) {
+  if (decoded == pictureCount || data.size() - offset < 9)
+    return false;
+
+  ByteReader r{data.data() + offset};
+  const std::uint32_t frame = r.u32();
+  const unsigned char mode = r.u8();
+  const std::uint32_t length = r.u32();
+  if (data.size() - offset - 9 < length)
+    return false;
+
+  const bool pictureHires = mode & 1;
+  const bool key = mode & 2;
+  // A delta applies to a picture of the same resolution
+  if (!key && (decoded == 0 || pictureHires != hires))
+    return false;
+
+  const std::size_t size = imageSize(pictureHires);
+  if (!decodeRuns(r.p, length, key ? image.data() : delta.data(), size))
+    return false;
+  if (!key) {
+    for (std::size_t i = 0; i < size; ++i)
+      image[i] ^= delta[i];
+  }
+  hires = pictureHires;
+
+  picture.frame = frame;
+  picture.hires = hires;
+  unpackImage(image.data(), picture);
+  offset += 9 + length;
+  ++decoded;
+  return true;
+}
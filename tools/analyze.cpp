@@ -0,0 +1,295 @@
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../include/analysis.hpp"
+#include "../include/chip8.hpp"
+#include "../include/disasm.hpp"
+#include "../include/dispatch.hpp"
+#include "../include/rom_store.hpp"
+
+// Bytes of data shown per DB line
+constexpr std::size_t DATA_PER_LINE = 8;
+
+void printUsage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [-m machine] [-q quirks] [-c cache_dir] <rom_file>\n"
+          "Decodes the ROM the way the interpreter does, without running\n"
+          "it, and prints its annotated disassembly: the basic blocks and\n"
+          "subroutines reached from 0x200 with their callers, indirect\n"
+          "jumps, the sprites drawn from it as pixels and its data.\n"
+          "  -m <machine>    chip8, schip or xochip (default from the ROM's\n"
+          "                  extension: .sc8, .xo8)\n"
+          "  -q <quirks>     cosmac, chip48, schip or xochip (default the\n"
+          "                  machine's own)\n"
+          "  -c <cache_dir>  Keep the analysis there, keyed by the ROM's\n"
+          "                  hash, for the next run and for\n"
+          "                  chip8_headless --analysis\n",
+          program);
+}
+
+// Everything reading the flags alone does not tell: who calls what
+struct Listing {
+  const Rom &rom;
+  const RomAnalysis &analysis;
+  const Op *table;
+  std::map<unsigned, std::vector<unsigned>> callers;
+  // Hex digits of an address, four on XO-CHIP where code can go past 4K
+  int digits;
+
+  Listing(const Rom &rom, const RomAnalysis &analysis)
+      : rom(rom), analysis(analysis), table(opTable(analysis.machine)),
+        digits(analysis.machine == Machine::XoChip ? 4 : 3) {
+    for (std::size_t offset = 0; offset + 1 < rom.size; ++offset) {
+      if (!(analysis.flags[offset] & BYTE_CODE))
+        continue;
+      const unsigned short opcode = opcodeAt(offset);
+      if (table[opcode] == Op::Call)
+        callers[opcode & 0x0FFF].push_back(
+            static_cast<unsigned>(ROM_START + offset));
+    }
+  }
+
+  unsigned short opcodeAt(std::size_t offset) const {
+    return static_cast<unsigned short>(rom.data[offset] << 8 |
+                                       rom.data[offset + 1]);
+  }
+
+  std::string label(unsigned address) const {
+    char text[16];
+    const std::uint8_t flags = analysis.at(address);
+    if (address == ROM_START)
+      return "start";
+    std::snprintf(text, sizeof(text), "%s_%0*X",
+                  flags & BYTE_SUBROUTINE ? "sub" : "L", digits, address);
+    return text;
+  }
+
+  // Where a jump or call lands, by label when it is code of the ROM
+  std::string target(unsigned address) const {
+    if (analysis.at(address) & BYTE_BLOCK)
+      return "-> " + label(address);
+    return "outside the ROM";
+  }
+
+  // What I points at after ANNN or F000 NNNN
+  static const char *pointee(std::uint8_t flags) {
+    if (flags & BYTE_SPRITE)
+      return "sprite";
+    if (flags & BYTE_DATA)
+      return "data";
+    if (flags & BYTE_CODE)
+      return "code";
+    return nullptr;
+  }
+
+  void printLabel(unsigned address) const {
+    const auto found = callers.find(address);
+    if (found == callers.end()) {
+      printf("%s:\n", label(address).c_str());
+      return;
+    }
+    std::string from;
+    for (unsigned caller : found->second) {
+      char text[16];
+      std::snprintf(text, sizeof(text), "%s0x%0*X", from.empty() ? "" : ", ",
+                    digits, caller);
+      from += text;
+    }
+    printf("%s:  ; called from %s\n", label(address).c_str(), from.c_str());
+  }
+
+  // One opcode, returns how many bytes it takes
+  std::size_t printCode(std::size_t offset) const {
+    const unsigned address = static_cast<unsigned>(ROM_START + offset);
+    const unsigned short opcode = opcodeAt(offset);
+    const Op op = table[opcode];
+    std::string text = disassemble(opcode, analysis.machine);
+    std::string comment;
+    std::size_t length = 2;
+    char buffer[32];
+
+    switch (op) {
+    case Op::Jump:
+    case Op::Call:
+      comment = target(opcode & 0x0FFF);
+      break;
+    case Op::JumpV0:
+      comment = "indirect jump, not followed";
+      break;
+    case Op::SetI:
+      if (const char *what = pointee(analysis.at(opcode & 0x0FFF)))
+        comment = what;
+      break;
+    case Op::SetILong:
+      if (offset + 3 < rom.size) {
+        const unsigned long_ = opcodeAt(offset + 2);
+        std::snprintf(buffer, sizeof(buffer), "LD I, 0x%04X", long_);
+        text = buffer;
+        if (const char *what = pointee(analysis.at(long_)))
+          comment = what;
+        length = 4;
+      }
+      break;
+    case Op::Ret:
+    case Op::Exit:
+      comment = "end of path";
+      break;
+    case Op::Unknown:
+      std::snprintf(buffer, sizeof(buffer), "not a %s instruction, stops",
+                    machineName(analysis.machine));
+      comment = buffer;
+      break;
+    default:
+      break;
+    }
+
+    if (analysis.flags[offset] & (BYTE_SPRITE | BYTE_DATA))
+      comment += comment.empty() ? "overwritten or read as data"
+                                 : ", overwritten or read as data";
+
+    char bytes[16];
+    if (length == 4)
+      std::snprintf(bytes, sizeof(bytes), "%04X %04X", opcode,
+                    opcodeAt(offset + 2));
+    else
+      std::snprintf(bytes, sizeof(bytes), "%04X", opcode);
+    if (comment.empty())
+      printf("  0x%0*X  %-9s  %s\n", digits, address, bytes, text.c_str());
+    else
+      printf("  0x%0*X  %-9s  %-20s; %s\n", digits, address, bytes,
+             text.c_str(), comment.c_str());
+    return length;
+  }
+
+  // A sprite row, as the pixels it draws
+  void printSprite(std::size_t offset) const {
+    const unsigned char byte = rom.data[offset];
+    char pixels[9];
+    for (int bit = 0; bit < 8; ++bit)
+      pixels[bit] = byte & (0x80 >> bit) ? '#' : '.';
+    pixels[8] = '\0';
+    printf("  0x%0*X  %02X         DB 0x%02X              ; %s\n", digits,
+           static_cast<unsigned>(ROM_START + offset), byte, byte, pixels);
+  }
+
+  // A run of data, or of bytes nothing reaches, up to DATA_PER_LINE of them
+  std::size_t printData(std::size_t offset, std::size_t end) const {
+    const std::uint8_t kind = analysis.flags[offset] & BYTE_DATA;
+    std::string bytes;
+    std::size_t count = 0;
+    while (offset + count < end && count < DATA_PER_LINE) {
+      const std::uint8_t flags = analysis.flags[offset + count];
+      if (count > 0 && ((flags & BYTE_DATA) != kind ||
+                        (flags & (BYTE_CODE | BYTE_SPRITE))))
+        break;
+      char text[8];
+      std::snprintf(text, sizeof(text), "%s0x%02X", count ? ", " : "",
+                    rom.data[offset + count]);
+      bytes += text;
+      ++count;
+    }
+    printf("  0x%0*X             DB %s  ; %s\n", digits,
+           static_cast<unsigned>(ROM_START + offset), bytes.c_str(),
+           kind ? "data" : "unreached");
+    return count;
+  }
+
+  void print() const {
+    const std::size_t size = analysis.flags.size();
+    std::size_t offset = 0;
+    while (offset < size) {
+      const std::uint8_t flags = analysis.flags[offset];
+      if (flags & BYTE_CODE) {
+        if (flags & BYTE_BLOCK)
+          printLabel(static_cast<unsigned>(ROM_START + offset));
+        const std::size_t length = printCode(offset);
+        // Code can start inside another opcode, show it from there as well
+        std::size_t next = offset + 1;
+        while (next < offset + length && next < size &&
+               !(analysis.flags[next] & BYTE_CODE))
+          ++next;
+        offset = next;
+      } else if (flags & BYTE_SPRITE) {
+        printSprite(offset);
+        ++offset;
+      } else {
+        offset += printData(offset, size);
+      }
+    }
+  }
+};
+
+int main(int argc, char *argv[]) {
+  const char *romPath = nullptr;
+  const char *machineArg = nullptr;
+  const char *quirksArg = nullptr;
+  const char *cachePath = nullptr;
+
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg(argv[i]);
+    if (arg == "-m" && i + 1 < argc) {
+      machineArg = argv[++i];
+    } else if (arg == "-q" && i + 1 < argc) {
+      quirksArg = argv[++i];
+    } else if (arg == "-c" && i + 1 < argc) {
+      cachePath = argv[++i];
+    } else if (!romPath && arg[0] != '-') {
+      romPath = argv[i];
+    } else {
+      printUsage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (!romPath) {
+    printUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  Machine machine = machineForPath(romPath);
+  if (machineArg && !parseMachine(machineArg, machine)) {
+    fprintf(stderr, "Error: Unknown machine: %s\n", machineArg);
+    return EXIT_FAILURE;
+  }
+  Quirks quirks = defaultQuirks(machine);
+  if (quirksArg && !parseQuirks(quirksArg, quirks)) {
+    fprintf(stderr, "Error: Unknown quirks: %s\n", quirksArg);
+    return EXIT_FAILURE;
+  }
+
+  RomStore store;
+  if (!store.addFile(romPath)) {
+    fprintf(stderr, "Error: Failed to load ROM file: %s\n", romPath);
+    return EXIT_FAILURE;
+  }
+  const Rom &rom = store.all().front();
+
+  bool cached = false;
+  RomAnalysis analysis;
+  if (cachePath) {
+    AnalysisCache cache(cachePath);
+    analysis = cache.get(rom.data, rom.size, machine, quirks, cached);
+  } else {
+    analysis = analyzeRom(rom.data, rom.size, machine, quirks);
+  }
+
+  const std::size_t reached =
+      analysis.count(BYTE_CODE) + analysis.count(BYTE_OPERAND);
+  printf("; %s, hash %016llx, %s with %s quirks%s\n", rom.name.c_str(),
+         static_cast<unsigned long long>(rom.hash), machineName(machine),
+         quirksName(quirks), cached ? ", from the cache" : "");
+  printf("; %zu opcodes in %zu blocks, %zu subroutines, %zu indirect "
+         "jumps, %zu invalid\n",
+         analysis.count(BYTE_CODE), analysis.count(BYTE_BLOCK),
+         analysis.count(BYTE_SUBROUTINE), analysis.count(BYTE_INDIRECT),
+         analysis.count(BYTE_INVALID));
+  printf("; %zu code bytes, %zu sprite bytes, %zu data bytes of %zu\n\n",
+         reached, analysis.count(BYTE_SPRITE), analysis.count(BYTE_DATA),
+         analysis.flags.size());
+
+  Listing(rom, analysis).print();
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,451 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../include/chip8.hpp"
+#include "../include/frontend.hpp"
+#include "../include/jit.hpp"
+#include "../include/rom_store.hpp"
+#include "../include/runner.hpp"
+#include "../include/scheduler.hpp"
+#include "../include/thread_pool.hpp"
+
+// Default number of opcodes to execute per run when no budget is given
+constexpr unsigned long DEFAULT_CYCLES = 10000000;
+
+// One ROM with the configuration to run it with, ips 0 and the machine and
+// quirks unset until resolved from the command line, the ROM's profile or
+// the default (the ROM's extension for the machine, the machine's own
+// quirks)
+struct Job {
+  std::string rom;
+  unsigned long ips;
+  bool jit;
+  bool hasMachine;
+  Machine machine;
+  bool hasQuirks;
+  Quirks quirks;
+};
+
+// Outcome of one run, filled in by the worker that ran it
+struct Result {
+  bool loaded = false;
+  unsigned long long cycles = 0;
+  unsigned long long frames = 0;
+  double seconds = 0;
+  std::uint64_t screenHash = 0;
+  MachineError error = MachineError::None;
+};
+
+// How long each run lasts, in opcodes or in frames when frames is not 0
+struct Budget {
+  unsigned long cycles;
+  unsigned long frames;
+};
+
+void printUsage(const char *program) {
+  std::cerr << "Usage: " << program
+            << " [options] <rom|directory|archive>..." << std::endl;
+  std::cerr << "Runs every ROM on its own machine, spread over all the cores,"
+            << std::endl;
+  std::cerr << "and prints one result per run. ROMs are read once, whatever"
+            << std::endl;
+  std::cerr << "the number of runs. Directories and archives (see chip8_roms)"
+            << std::endl;
+  std::cerr << "stand for every ROM in them." << std::endl;
+  std::cerr << "Options:" << std::endl;
+  std::cerr << "  -n <cycles>    Opcodes to execute per run (default "
+            << DEFAULT_CYCLES << ")" << std::endl;
+  std::cerr << "  -f <frames>    Frames to execute per run, instead of -n"
+            << std::endl;
+  std::cerr << "  -s <speed>     Instructions per emulated second: slow,"
+            << std::endl;
+  std::cerr << "                 normal (default), fast or a number"
+            << std::endl;
+  std::cerr << "  -p <file>      Speeds per ROM hash, used when neither -s"
+            << std::endl;
+  std::cerr << "                 nor the job list give one:" << std::endl;
+  std::cerr << "                 <hash> <speed> [machine [quirks]] per line"
+            << std::endl;
+  std::cerr << "  -m <machine>   chip8, schip or xochip (default from the"
+            << std::endl;
+  std::cerr << "                 profile, else the extension: .sc8, .xo8)"
+            << std::endl;
+  std::cerr << "  -q <quirks>    cosmac, chip48, schip or xochip (default from"
+            << std::endl;
+  std::cerr << "                 the profile, else the machine's own)"
+            << std::endl;
+  std::cerr << "  --jit          Run through the x86-64 recompiler"
+            << std::endl;
+  std::cerr << "  -l <file>      Read more runs from file, one per line:"
+            << std::endl;
+  std::cerr << "                 <rom_file> [speed] [jit|interp] [machine]"
+            << std::endl;
+  std::cerr << "                 [quirks], the quirks after the machine"
+            << std::endl;
+  std::cerr << "  -r <count>     Run every entry count times (default 1)"
+            << std::endl;
+  std::cerr << "  -j <threads>   Worker threads (default: one per core)"
+            << std::endl;
+  std::cerr << "  --csv          Print CSV instead of JSON" << std::endl;
+  std::cerr << "  -o <file>      Write the results to file instead of stdout"
+            << std::endl;
+}
+
+// Append the runs listed in path to jobs, lines without a speed or an engine
+// use the defaults. Returns false if the file can not be read or a line is
+// malformed.
+bool readJobList(const char *path, const Job &defaults,
+                 std::vector<Job> &jobs) {
+  std::ifstream list(path);
+  if (!list.is_open()) {
+    std::cerr << "Error: Failed to open job list: " << path << std::endl;
+    return false;
+  }
+
+  std::string line;
+  int number = 0;
+  while (std::getline(list, line)) {
+    ++number;
+    std::istringstream fields(line);
+    Job job = defaults;
+    if (!(fields >> job.rom) || job.rom[0] == '#')
+      continue;
+
+    // "schip" and "xochip" name both a machine and quirks: the first one
+    // on a line is the machine
+    bool lineMachine = false;
+    std::string field;
+    while (fields >> field) {
+      if (field == "jit") {
+        job.jit = true;
+      } else if (field == "interp") {
+        job.jit = false;
+      } else if (!lineMachine && parseMachine(field, job.machine)) {
+        job.hasMachine = true;
+        lineMachine = true;
+      } else if (parseQuirks(field, job.quirks)) {
+        job.hasQuirks = true;
+      } else if ((job.ips = parseSpeed(field)) == 0) {
+        std::cerr << "Error: " << path << ":" << number
+                  << ": Invalid speed: " << field << std::endl;
+        return false;
+      }
+    }
+    jobs.push_back(job);
+  }
+
+  return true;
+}
+
+// Run one job on a fresh machine, everything lives on the worker's stack and
+// the ROM is copied from the store, which is only read
+Result runJob(const Job &job, const Budget &budget, const RomStore &store) {
+  Result result;
+
+  const Rom *rom = store.findName(job.rom);
+  if (!rom)
+    return result;
+
+  Chip8 chip8;
+  NullFrontend frontend;
+  Runner runner(chip8, frontend, instructionsPerFrame(job.ips));
+  Jit jit(chip8);
+  if (job.jit)
+    runner.jit = &jit;
+
+  chip8.setMachine(job.machine);
+  chip8.setQuirks(job.quirks);
+  chip8.initialize();
+  if (!chip8.loadRom(rom->data, rom->size))
+    return result;
+  result.loaded = true;
+
+  const auto start = std::chrono::steady_clock::now();
+  if (budget.frames) {
+    while (runner.frames < budget.frames && runner.runFrame()) {
+    }
+  } else {
+    while (runner.cycles < budget.cycles && runner.runFrame()) {
+    }
+  }
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  result.cycles = runner.cycles;
+  result.frames = runner.frames;
+  result.seconds = elapsed.count();
+  result.screenHash = chip8.screenHash();
+  result.error = chip8.error;
+  return result;
+}
+
+double instructionsPerSecond(unsigned long long cycles, double seconds) {
+  return seconds > 0 ? static_cast<double>(cycles) / seconds : 0;
+}
+
+std::string hexHash(std::uint64_t hash) {
+  char text[17];
+  std::snprintf(text, sizeof(text), "%016llx",
+                static_cast<unsigned long long>(hash));
+  return text;
+}
+
+// ROM paths are the only free-form text in the output
+std::string jsonString(const std::string &text) {
+  std::string quoted = "\"";
+  for (char c : text) {
+    if (c == '"' || c == '\\') {
+      quoted += '\\';
+      quoted += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char escaped[7];
+      std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      quoted += escaped;
+    } else {
+      quoted += c;
+    }
+  }
+  return quoted + "\"";
+}
+
+std::string csvField(const std::string &text) {
+  if (text.find_first_of(",\"\n") == std::string::npos)
+    return text;
+
+  std::string quoted = "\"";
+  for (char c : text) {
+    if (c == '"')
+      quoted += '"';
+    quoted += c;
+  }
+  return quoted + "\"";
+}
+
+void writeJson(std::ostream &out, const std::vector<Job> &jobs,
+               const std::vector<Result> &results) {
+  out << "[\n";
+  for (std::size_t i = 0; i < jobs.size(); ++i) {
+    const Job &job = jobs[i];
+    const Result &result = results[i];
+    out << "  {\"rom\": " << jsonString(job.rom) << ", \"ips\": " << job.ips
+        << ", \"engine\": \"" << (job.jit ? "jit" : "interp") << "\"";
+    if (result.loaded) {
+      out << ", \"screen_hash\": \"" << hexHash(result.screenHash)
+          << "\", \"cycles\": " << result.cycles
+          << ", \"frames\": " << result.frames
+          << ", \"seconds\": " << result.seconds
+          << ", \"instructions_per_second\": "
+          << instructionsPerSecond(result.cycles, result.seconds);
+      if (result.error != MachineError::None)
+        out << ", \"error\": \"" << machineErrorName(result.error) << "\"";
+    } else {
+      out << ", \"error\": \"failed to load\"";
+    }
+    out << "}" << (i + 1 < jobs.size() ? "," : "") << "\n";
+  }
+  out << "]\n";
+}
+
+void writeCsv(std::ostream &out, const std::vector<Job> &jobs,
+              const std::vector<Result> &results) {
+  out << "rom,ips,engine,screen_hash,cycles,frames,seconds,"
+         "instructions_per_second,error\n";
+  for (std::size_t i = 0; i < jobs.size(); ++i) {
+    const Job &job = jobs[i];
+    const Result &result = results[i];
+    out << csvField(job.rom) << "," << job.ips << ","
+        << (job.jit ? "jit" : "interp") << ",";
+    if (result.loaded) {
+      out << hexHash(result.screenHash) << "," << result.cycles << ","
+          << result.frames << "," << result.seconds << ","
+          << instructionsPerSecond(result.cycles, result.seconds) << ",";
+      if (result.error != MachineError::None)
+        out << machineErrorName(result.error);
+      out << "\n";
+    } else {
+      out << ",,,,,failed to load\n";
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  Job defaults{"", 0, false, false, Machine::Classic, false,
+               Quirks::CosmacVip};
+  Budget budget{DEFAULT_CYCLES, 0};
+  unsigned long repeat = 1;
+  unsigned threads = 0;
+  bool csv = false;
+  const char *outputPath = nullptr;
+  const char *profilesPath = nullptr;
+  std::vector<const char *> romPaths;
+  std::vector<const char *> listPaths;
+
+  // Parse command line arguments, the defaults apply to every ROM whatever
+  // their position
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg(argv[i]);
+    if (arg == "-n" && i + 1 < argc) {
+      budget.cycles = std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "-f" && i + 1 < argc) {
+      budget.frames = std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "-s" && i + 1 < argc) {
+      defaults.ips = parseSpeed(argv[++i]);
+      if (defaults.ips == 0) {
+        std::cerr << "Error: Invalid speed: " << argv[i] << std::endl;
+        return EXIT_FAILURE;
+      }
+    } else if (arg == "-p" && i + 1 < argc) {
+      profilesPath = argv[++i];
+    } else if (arg == "-m" && i + 1 < argc) {
+      if (!parseMachine(argv[++i], defaults.machine)) {
+        std::cerr << "Error: Unknown machine: " << argv[i] << std::endl;
+        return EXIT_FAILURE;
+      }
+      defaults.hasMachine = true;
+    } else if (arg == "-q" && i + 1 < argc) {
+      if (!parseQuirks(argv[++i], defaults.quirks)) {
+        std::cerr << "Error: Unknown quirks: " << argv[i] << std::endl;
+        return EXIT_FAILURE;
+      }
+      defaults.hasQuirks = true;
+    } else if (arg == "--jit") {
+      defaults.jit = true;
+    } else if (arg == "-l" && i + 1 < argc) {
+      listPaths.push_back(argv[++i]);
+    } else if (arg == "-r" && i + 1 < argc) {
+      repeat = std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "-j" && i + 1 < argc) {
+      threads = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--csv") {
+      csv = true;
+    } else if (arg == "-o" && i + 1 < argc) {
+      outputPath = argv[++i];
+    } else if (arg[0] != '-') {
+      romPaths.push_back(argv[i]);
+    } else {
+      printUsage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Every ROM is mapped once here, before the workers start reading the
+  // store
+  RomStore store;
+  if (profilesPath && !store.loadProfiles(profilesPath)) {
+    std::cerr << "Error: Failed to read profiles: " << profilesPath
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::vector<Job> entries;
+  for (const char *path : romPaths) {
+    // A path that can not be read stays a single run, reported as failed
+    const std::size_t known = store.all().size();
+    Job job = defaults;
+    if (!store.addPath(path) || store.findName(path)) {
+      job.rom = path;
+      entries.push_back(job);
+      continue;
+    }
+    for (std::size_t i = known; i < store.all().size(); ++i) {
+      job.rom = store.all()[i].name;
+      entries.push_back(job);
+    }
+  }
+  for (const char *path : listPaths) {
+    if (!readJobList(path, defaults, entries))
+      return EXIT_FAILURE;
+  }
+
+  if (entries.empty()) {
+    printUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  // Listed ROMs not seen yet are read now, those that can not be are
+  // reported as failed runs
+  for (Job &entry : entries) {
+    const Rom *rom = store.findName(entry.rom);
+    if (!rom && store.addFile(entry.rom))
+      rom = store.findName(entry.rom);
+    const RomProfile *profile = rom ? store.profile(rom->hash) : nullptr;
+    if (entry.ips == 0)
+      entry.ips = profile && profile->ips ? profile->ips : IPS_NORMAL;
+    if (!entry.hasMachine) {
+      entry.machine = profile && profile->hasMachine
+                          ? profile->machine
+                          : machineForPath(entry.rom);
+      entry.hasMachine = true;
+    }
+    if (!entry.hasQuirks) {
+      entry.quirks = profile && profile->hasQuirks
+                         ? profile->quirks
+                         : defaultQuirks(entry.machine);
+      entry.hasQuirks = true;
+    }
+  }
+
+  std::vector<Job> jobs;
+  for (unsigned long run = 0; run < repeat; ++run) {
+    jobs.insert(jobs.end(), entries.begin(), entries.end());
+  }
+  std::vector<Result> results(jobs.size());
+
+  const auto start = std::chrono::steady_clock::now();
+  unsigned workers;
+  {
+    ThreadPool pool(threads);
+    workers = pool.size();
+    // Each task writes only its own slot of results
+    for (std::size_t i = 0; i < jobs.size(); ++i) {
+      pool.submit([&jobs, &results, &budget, &store, i] {
+        results[i] = runJob(jobs[i], budget, store);
+      });
+    }
+    pool.wait();
+  }
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  std::ofstream outputFile;
+  if (outputPath) {
+    outputFile.open(outputPath);
+    if (!outputFile.is_open()) {
+      std::cerr << "Error: Failed to open output file: " << outputPath
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  std::ostream &out = outputPath ? outputFile : std::cout;
+  if (csv) {
+    writeCsv(out, jobs, results);
+  } else {
+    writeJson(out, jobs, results);
+  }
+
+  unsigned long long totalCycles = 0;
+  std::size_t failed = 0;
+  for (const Result &result : results) {
+    totalCycles += result.cycles;
+    if (!result.loaded)
+      ++failed;
+  }
+
+  const double seconds = elapsed.count();
+  std::cerr << jobs.size() << " runs on " << workers << " threads in "
+            << seconds << " s, "
+            << instructionsPerSecond(totalCycles, seconds)
+            << " instructions/s" << std::endl;
+  if (failed) {
+    std::cerr << "Error: " << failed << " runs failed to load" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
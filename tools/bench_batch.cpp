@@ -0,0 +1,172 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../include/batch_engine.hpp"
+#include "../include/chip8.hpp"
+#include "../include/scheduler.hpp"
+
+// Machines stepped together and frames run per ROM
+constexpr std::size_t DEFAULT_LANES = 1024;
+constexpr unsigned long DEFAULT_FRAMES = 300;
+
+// Keypad inputs fed to the lanes every frame
+enum class Inputs {
+  // Every lane gets the same keys, lanes stay in lockstep
+  Shared,
+  // Every lane gets its own keys, lanes diverge
+  PerLane
+};
+
+// Pseudo random key masks, pressing one key a quarter of the time
+struct ActionSource {
+  std::uint32_t state = 12345;
+
+  std::uint16_t next() {
+    state = state * 1664525u + 1013904223u;
+    if ((state >> 28) & 3)
+      return 0;
+    return static_cast<std::uint16_t>(1u << ((state >> 16) & 0xF));
+  }
+
+  void fill(std::vector<std::uint16_t> &actions, Inputs inputs) {
+    if (inputs == Inputs::Shared) {
+      std::fill(actions.begin(), actions.end(), next());
+    } else {
+      for (std::uint16_t &action : actions)
+        action = next();
+    }
+  }
+};
+
+struct Measure {
+  double separate = 0;
+  double batched = 0;
+  double uniformShare = 0;
+  std::size_t matching = 0;
+};
+
+// Run the same frames with the same inputs on lanes separate Chip8 objects
+// and on one BatchEngine, return both speeds and how many screens agree
+Measure measure(const char *romPath, std::size_t lanes, unsigned long frames,
+                unsigned long ipf, Inputs inputs) {
+  Measure result;
+
+  Chip8 loaded;
+  loaded.initialize();
+  if (!loaded.loadGame(romPath))
+    return result;
+
+  std::vector<std::uint16_t> actions(lanes);
+  const double cycles = static_cast<double>(lanes) * frames * ipf;
+
+  std::vector<Chip8> machines(lanes, loaded);
+  ActionSource source;
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned long frame = 0; frame < frames; ++frame) {
+    source.fill(actions, inputs);
+    for (std::size_t l = 0; l < lanes; ++l) {
+      Chip8 &chip8 = machines[l];
+      for (int k = 0; k < 16; ++k)
+        chip8.key[k] = (actions[l] >> k) & 1;
+      chip8.runCycles(ipf);
+      chip8.tickTimers();
+    }
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  result.separate = cycles / elapsed.count();
+
+  BatchEngine batch(lanes);
+  batch.loadAll(loaded);
+  batch.instructionsPerFrame = ipf;
+  source = ActionSource();
+  start = std::chrono::steady_clock::now();
+  for (unsigned long frame = 0; frame < frames; ++frame) {
+    source.fill(actions, inputs);
+    batch.step(actions.data());
+  }
+  elapsed = std::chrono::steady_clock::now() - start;
+  result.batched = cycles / elapsed.count();
+
+  const double total =
+      static_cast<double>(batch.uniformCycles + batch.groupedCycles);
+  result.uniformShare = total > 0 ? batch.uniformCycles / total : 0;
+
+  for (std::size_t l = 0; l < lanes; ++l) {
+    if (batch.screenHash(l) == machines[l].screenHash())
+      ++result.matching;
+  }
+
+  return result;
+}
+
+void printUsage(const char *program) {
+  std::cerr << "Usage: " << program
+            << " [-l lanes] [-f frames] [-s speed] <rom_file>..." << std::endl;
+  std::cerr << "Example: " << program << " games/*.ch8 games/*.c8"
+            << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  std::size_t lanes = DEFAULT_LANES;
+  unsigned long frames = DEFAULT_FRAMES;
+  unsigned long ips = IPS_NORMAL;
+  std::vector<const char *> romPaths;
+
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg(argv[i]);
+    if (arg == "-l" && i + 1 < argc) {
+      lanes = std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "-f" && i + 1 < argc) {
+      frames = std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "-s" && i + 1 < argc) {
+      ips = parseSpeed(argv[++i]);
+      if (ips == 0) {
+        std::cerr << "Error: Invalid speed: " << argv[i] << std::endl;
+        return EXIT_FAILURE;
+      }
+    } else if (arg[0] != '-') {
+      romPaths.push_back(argv[i]);
+    } else {
+      printUsage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (romPaths.empty() || lanes == 0) {
+    printUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+#ifdef __AVX2__
+  printf("%zu lanes, %lu frames, AVX2 kernels\n", lanes, frames);
+#else
+  printf("%zu lanes, %lu frames, scalar kernels\n", lanes, frames);
+#endif
+  printf("%-24s %-8s %10s %10s %8s %9s %9s\n", "ROM", "inputs", "separate",
+         "batch", "speedup", "uniform", "matching");
+
+  const Inputs modes[] = {Inputs::Shared, Inputs::PerLane};
+  for (const char *romPath : romPaths) {
+    std::string name(romPath);
+    name = name.substr(name.find_last_of('/') + 1);
+
+    for (Inputs inputs : modes) {
+      const Measure m =
+          measure(romPath, lanes, frames, instructionsPerFrame(ips), inputs);
+      printf("%-24s %-8s %10.1f %10.1f %7.2fx %8.1f%% %4zu/%-4zu\n",
+             name.c_str(), inputs == Inputs::Shared ? "shared" : "per-lane",
+             m.separate / 1e6, m.batched / 1e6,
+             m.separate > 0 ? m.batched / m.separate : 0,
+             m.uniformShare * 100, m.matching, lanes);
+      fflush(stdout);
+    }
+  }
+  printf("(separate and batch in million instructions/s, all lanes)\n");
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,102 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+#include "../include/chip8.hpp"
+#include "../include/scheduler.hpp"
+
+// Opcodes executed per ROM and per dispatcher
+constexpr unsigned long DEFAULT_CYCLES = 20000000;
+
+enum class Dispatcher { Switch, Table, RunCycles };
+
+const char *dispatcherName(Dispatcher dispatcher) {
+  switch (dispatcher) {
+  case Dispatcher::Switch:
+    return "switch";
+  case Dispatcher::Table:
+    return "table";
+  case Dispatcher::RunCycles:
+#ifdef CHIP8_COMPUTED_GOTO
+    return "goto";
+#else
+    return "runCycles";
+#endif
+  }
+  return "?";
+}
+
+// Run the ROM for the given number of opcodes, ticking the timers once per
+// frame like the Runner does, and return the instructions per second
+double measure(const char *romPath, Dispatcher dispatcher,
+               unsigned long cycles) {
+  Chip8 chip8;
+  chip8.initialize();
+  if (!chip8.loadGame(romPath))
+    return 0;
+
+  const unsigned long ipf = instructionsPerFrame(IPS_NORMAL);
+  const unsigned long frames = cycles / ipf;
+
+  const auto start = std::chrono::steady_clock::now();
+  for (unsigned long frame = 0; frame < frames; ++frame) {
+    switch (dispatcher) {
+    case Dispatcher::Switch:
+      for (unsigned long i = 0; i < ipf; ++i)
+        chip8.emulateCycleSwitch();
+      break;
+    case Dispatcher::Table:
+      for (unsigned long i = 0; i < ipf; ++i)
+        chip8.emulateCycle();
+      break;
+    case Dispatcher::RunCycles:
+      chip8.runCycles(ipf);
+      break;
+    }
+    chip8.tickTimers();
+  }
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  return static_cast<double>(frames * ipf) / elapsed.count();
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0] << " [-n cycles] <rom_file>..."
+              << std::endl;
+    std::cerr << "Example: " << argv[0] << " games/*.ch8 games/*.c8"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  unsigned long cycles = DEFAULT_CYCLES;
+  int first = 1;
+  if (std::string(argv[1]) == "-n" && argc > 3) {
+    cycles = std::strtoul(argv[2], nullptr, 10);
+    first = 3;
+  }
+
+  const Dispatcher dispatchers[] = {Dispatcher::Switch, Dispatcher::Table,
+                                    Dispatcher::RunCycles};
+
+  printf("%-24s", "ROM");
+  for (Dispatcher dispatcher : dispatchers)
+    printf(" %12s", dispatcherName(dispatcher));
+  printf("  (million instructions/s)\n");
+
+  for (int i = first; i < argc; ++i) {
+    std::string name(argv[i]);
+    name = name.substr(name.find_last_of('/') + 1);
+    printf("%-24s", name.c_str());
+
+    for (Dispatcher dispatcher : dispatchers) {
+      printf(" %12.1f", measure(argv[i], dispatcher, cycles) / 1e6);
+      fflush(stdout);
+    }
+    printf("\n");
+  }
+
+  return EXIT_SUCCESS;
+}
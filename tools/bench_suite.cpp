@@ -0,0 +1,621 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <regex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../include/chip8.hpp"
+#include "../include/frontend.hpp"
+#include "../include/jit.hpp"
+#include "../include/rom_store.hpp"
+#include "../include/runner.hpp"
+#include "../include/scheduler.hpp"
+
+// Benchmark suite in the spirit of Google Benchmark, without the dependency:
+// every benchmark is run with a growing number of iterations until it lasts
+// at least the minimum time, and the results can be written in the JSON
+// format of Google Benchmark so that its tools (compare.py) read them.
+
+// Opcodes run per iteration of the opcode family benchmarks
+constexpr unsigned long OPCODE_CYCLES = 100000;
+
+// Iterations are scaled up until a run lasts at least this long, by default
+constexpr double DEFAULT_MIN_TIME = 0.5;
+
+// Most iterations a benchmark is run for, whatever the time it takes
+constexpr unsigned long long MAX_ITERATIONS = 1000000000;
+
+using Clock = std::chrono::steady_clock;
+
+// One run of a benchmark: the body runs its work iterations times, calling
+// start() once its setup is done, and may report counters
+class Run {
+private:
+  Clock::time_point realStart;
+  std::clock_t cpuStart;
+
+public:
+  explicit Run(unsigned long long iterations) : iterations(iterations) {
+    start();
+  }
+
+  const unsigned long long iterations;
+
+  // Work units (opcodes, frames, bytes) done per iteration, for the items
+  // per second column. 0 when the benchmark has no natural unit.
+  double itemsPerIteration = 0;
+
+  // Extra columns, reported as user counters
+  std::vector<std::pair<std::string, double>> counters;
+
+  double realSeconds = 0;
+  double cpuSeconds = 0;
+
+  // Restart the clocks, everything before is setup.
+  void start() {
+    cpuStart = std::clock();
+    realStart = Clock::now();
+  }
+
+  void stop() {
+    const std::chrono::duration<double> real = Clock::now() - realStart;
+    realSeconds = real.count();
+    cpuSeconds = static_cast<double>(std::clock() - cpuStart) / CLOCKS_PER_SEC;
+  }
+};
+
+struct Benchmark {
+  std::string name;
+  std::function<void(Run &)> body;
+};
+
+struct Result {
+  std::string name;
+  unsigned long long iterations;
+  double realNs;
+  double cpuNs;
+  double itemsPerSecond;
+  std::vector<std::pair<std::string, double>> counters;
+};
+
+// Opcode family benchmarks
+
+// A loop exercising one family of opcodes, jumping back to its start
+struct Program {
+  const char *name;
+  std::vector<unsigned short> code;
+  // Data copied to 0x300, for the opcodes reading memory
+  std::vector<unsigned char> data;
+  // Machine it runs on; the switch dispatcher only runs classic programs
+  Machine machine = Machine::Classic;
+};
+
+std::vector<Program> opcodePrograms() {
+  return {
+      // 6XNN, 7XNN and 8XY0-8XYE
+      {"alu",
+       {0x6A05, 0x6B03, 0x7A01, 0x8AB4, 0x8AB5, 0x8AB1, 0x8AB2, 0x8AB3,
+        0x8AB6, 0x8AB7, 0x8ABE, 0x8AB0, 0x1200},
+       {}},
+      // 3XNN, 4XNN, 5XY0, 9XY0, EX9E and EXA1, half of them skipping
+      {"skip",
+       {0x6A00, 0x6B01, 0x3A00, 0x6001, 0x4A00, 0x6001, 0x5AB0, 0x6001,
+        0x9AB0, 0x6001, 0xEA9E, 0x6001, 0xEAA1, 0x6001, 0x1200},
+       {}},
+      // DXYN, 8 rows, moving across the screen and wrapping around
+      {"draw",
+       {0xA300, 0x6A00, 0x6B00, 0xDAB8, 0x7A07, 0x7B03, 0x1206},
+       {0x3C, 0x42, 0x81, 0xA5, 0x81, 0x99, 0x42, 0x3C}},
+      // FX55 then FX65, all 16 registers, I moving past them after each
+      {"store_load", {0xA300, 0xFF55, 0xA300, 0xFF65, 0x1200}, {}},
+      // FX33 on every value of VA
+      {"bcd", {0xA300, 0xFA33, 0x7A01, 0x1202}, {}},
+      // DXY0, 16x16 sprites in the 128x64 mode, wrapping around
+      {"hires_draw",
+       {0x00FF, 0xA300, 0x6A00, 0x6B00, 0xDAB0, 0x7A07, 0x7B03, 0x1208},
+       std::vector<unsigned char>(32, 0xA5),
+       Machine::SuperChip},
+      // 00CN, 00FB and 00FC over a full 128x64 screen
+      {"scroll",
+       {0x00FF, 0xA300, 0x6A00, 0x6B00, 0xDAB0, 0x00C1, 0x00FB, 0x00FC,
+        0x120A},
+       std::vector<unsigned char>(32, 0xFF),
+       Machine::SuperChip},
+      // DXYN on both XO-CHIP planes at once
+      {"planes",
+       {0x00FF, 0xF301, 0xA300, 0x6A00, 0x6B00, 0xDAB8, 0x7A07, 0x7B03,
+        0x120A},
+       {0x3C, 0x42, 0x81, 0xA5, 0x81, 0x99, 0x42, 0x3C, 0xFF, 0x81, 0x81,
+        0x81, 0x81, 0x81, 0x81, 0xFF},
+       Machine::XoChip},
+  };
+}
+
+// The opcodes the quirk profiles disagree on (8XY1-8XY3, 8XY6, 8XYE, FX55,
+// FX65 and BNNN), run under each profile: every profile has handlers of its
+// own, so they should all match the speed of the single hard-coded set the
+// interpreter had before profiles existed
+Program quirkProgram() {
+  return {"quirks",
+          {0xA300, 0x6A05, 0x6B03, 0x8AB1, 0x8AB2, 0x8AB3, 0x8AB6, 0x8ABE,
+           0xF155, 0xF165, 0x6200, 0xB200},
+          {}};
+}
+
+void loadProgram(Chip8 &chip8, const Program &program) {
+  chip8.setMachine(program.machine);
+  chip8.initialize();
+  chip8.seedRandom(1);
+  for (std::size_t i = 0; i < program.code.size(); ++i) {
+    chip8.memory[0x200 + 2 * i] =
+        static_cast<unsigned char>(program.code[i] >> 8);
+    chip8.memory[0x201 + 2 * i] =
+        static_cast<unsigned char>(program.code[i] & 0xFF);
+  }
+  std::copy(program.data.begin(), program.data.end(),
+            chip8.memory.begin() + 0x300);
+  chip8.invalidateCode(0x200, 0x200);
+}
+
+enum class Dispatcher { Switch, Table, RunCycles };
+
+void runOpcodes(Run &run, const Program &program, Dispatcher dispatcher,
+                Quirks quirks) {
+  Chip8 chip8;
+  loadProgram(chip8, program);
+  chip8.setQuirks(quirks);
+  run.itemsPerIteration = OPCODE_CYCLES;
+  run.start();
+
+  for (unsigned long long i = 0; i < run.iterations; ++i) {
+    switch (dispatcher) {
+    case Dispatcher::Switch:
+      for (unsigned long n = 0; n < OPCODE_CYCLES; ++n)
+        chip8.emulateCycleSwitch();
+      break;
+    case Dispatcher::Table:
+      for (unsigned long n = 0; n < OPCODE_CYCLES; ++n)
+        chip8.emulateCycle();
+      break;
+    case Dispatcher::RunCycles:
+      chip8.runCycles(OPCODE_CYCLES);
+      break;
+    }
+  }
+}
+
+// ROM benchmarks
+
+std::string baseName(const std::string &path) {
+  return path.substr(path.find_last_of('/') + 1);
+}
+
+bool loadRom(Chip8 &chip8, const std::string &path) {
+  chip8.initialize();
+  chip8.seedRandom(1);
+  if (chip8.loadGame(path))
+    return true;
+  fprintf(stderr, "Error: Failed to load ROM: %s\n", path.c_str());
+  return false;
+}
+
+// Whole frames through a Runner, uncapped: one iteration is one frame
+void runRom(Run &run, const std::string &path, bool useJit) {
+  Chip8 chip8;
+  if (!loadRom(chip8, path))
+    return;
+  NullFrontend frontend;
+  Runner runner(chip8, frontend, instructionsPerFrame(IPS_NORMAL));
+  Jit jit(chip8);
+  if (useJit)
+    runner.jit = &jit;
+  run.itemsPerIteration = static_cast<double>(runner.instructionsPerFrame);
+  run.start();
+
+  for (unsigned long long i = 0; i < run.iterations; ++i)
+    runner.runFrame();
+}
+
+// Every frame timed on its own, for the spread of the frame time rather than
+// its average
+void runFrameLatency(Run &run, const std::string &path) {
+  Chip8 chip8;
+  if (!loadRom(chip8, path))
+    return;
+  NullFrontend frontend;
+  Runner runner(chip8, frontend, instructionsPerFrame(IPS_NORMAL));
+  std::vector<double> frameNs(static_cast<std::size_t>(run.iterations));
+  run.itemsPerIteration = 1;
+  run.start();
+
+  for (double &ns : frameNs) {
+    const auto start = Clock::now();
+    runner.runFrame();
+    ns = std::chrono::duration<double, std::nano>(Clock::now() - start)
+             .count();
+  }
+
+  std::sort(frameNs.begin(), frameNs.end());
+  const auto percentile = [&frameNs](double p) {
+    return frameNs[static_cast<std::size_t>(p * (frameNs.size() - 1))];
+  };
+  run.counters = {{"p50_ns", percentile(0.5)},
+                  {"p99_ns", percentile(0.99)},
+                  {"max_ns", frameNs.back()}};
+}
+
+void runInitialize(Run &run) {
+  Chip8 chip8;
+  run.start();
+  for (unsigned long long i = 0; i < run.iterations; ++i)
+    chip8.initialize();
+}
+
+// One iteration is one load, the items are the bytes of the ROM
+void runLoadGame(Run &run, const std::string &path) {
+  Chip8 chip8;
+  chip8.initialize();
+  struct stat info;
+  if (stat(path.c_str(), &info) == 0)
+    run.itemsPerIteration = static_cast<double>(info.st_size);
+  run.start();
+  for (unsigned long long i = 0; i < run.iterations; ++i)
+    chip8.loadGame(path);
+}
+
+// Same from a RomStore, the file mapped once beforehand
+void runLoadRom(Run &run, const std::string &path) {
+  Chip8 chip8;
+  chip8.initialize();
+  RomStore store;
+  const Rom *rom = store.addFile(path) ? store.findName(path) : nullptr;
+  if (!rom)
+    return;
+  run.itemsPerIteration = static_cast<double>(rom->size);
+  run.start();
+  for (unsigned long long i = 0; i < run.iterations; ++i)
+    chip8.loadRom(rom->data, rom->size);
+}
+
+// The recompiler needs executable memory and an x86-64 host
+bool jitAvailable() {
+  Chip8 chip8;
+  return Jit(chip8).available();
+}
+
+// Suite
+
+std::vector<Benchmark>
+registerBenchmarks(const std::vector<std::string> &roms) {
+  std::vector<Benchmark> benchmarks;
+
+  const std::pair<Dispatcher, const char *> dispatchers[] = {
+      {Dispatcher::Switch, "switch"},
+      {Dispatcher::Table, "table"},
+#ifdef CHIP8_COMPUTED_GOTO
+      {Dispatcher::RunCycles, "goto"},
+#else
+      {Dispatcher::RunCycles, "runCycles"},
+#endif
+  };
+  for (const Program &program : opcodePrograms()) {
+    for (const auto &dispatcher : dispatchers) {
+      if (dispatcher.first == Dispatcher::Switch &&
+          program.machine != Machine::Classic)
+        continue;
+      benchmarks.push_back(
+          {std::string("opcodes/") + program.name + "/" + dispatcher.second,
+           [program, dispatcher](Run &run) {
+             runOpcodes(run, program, dispatcher.first,
+                        defaultQuirks(program.machine));
+           }});
+    }
+  }
+
+  const Program quirks = quirkProgram();
+  for (Quirks profile : {Quirks::CosmacVip, Quirks::Chip48, Quirks::SuperChip,
+                         Quirks::XoChip}) {
+    for (const auto &dispatcher : dispatchers) {
+      // The switch dispatcher only knows the COSMAC VIP quirks
+      if (dispatcher.first == Dispatcher::Switch &&
+          profile != Quirks::CosmacVip)
+        continue;
+      benchmarks.push_back({std::string("quirks/") + quirksName(profile) +
+                                "/" + dispatcher.second,
+                            [quirks, profile, dispatcher](Run &run) {
+                              runOpcodes(run, quirks, dispatcher.first,
+                                         profile);
+                            }});
+    }
+  }
+
+  for (const std::string &rom : roms) {
+    const std::string name = baseName(rom);
+    benchmarks.push_back({"rom/" + name + "/interp",
+                          [rom](Run &run) { runRom(run, rom, false); }});
+    if (jitAvailable())
+      benchmarks.push_back({"rom/" + name + "/jit",
+                            [rom](Run &run) { runRom(run, rom, true); }});
+    benchmarks.push_back({"frame_latency/" + name,
+                          [rom](Run &run) { runFrameLatency(run, rom); }});
+  }
+
+  benchmarks.push_back({"initialize", runInitialize});
+  for (const std::string &rom : roms)
+    benchmarks.push_back({"loadGame/" + baseName(rom),
+                          [rom](Run &run) { runLoadGame(run, rom); }});
+  for (const std::string &rom : roms)
+    benchmarks.push_back({"loadRom/" + baseName(rom),
+                          [rom](Run &run) { runLoadRom(run, rom); }});
+
+  return benchmarks;
+}
+
+// Run the benchmark with more and more iterations until it lasts minTime, the
+// way Google Benchmark does, and keep the last run
+Result measure(const Benchmark &benchmark, double minTime) {
+  unsigned long long iterations = 1;
+  for (;;) {
+    Run run(iterations);
+    benchmark.body(run);
+    run.stop();
+
+    if (run.realSeconds >= minTime || iterations >= MAX_ITERATIONS) {
+      Result result;
+      result.name = benchmark.name;
+      result.iterations = iterations;
+      result.realNs = run.realSeconds * 1e9 / iterations;
+      result.cpuNs = run.cpuSeconds * 1e9 / iterations;
+      result.itemsPerSecond =
+          run.itemsPerIteration > 0 && run.cpuSeconds > 0
+              ? run.itemsPerIteration * iterations / run.cpuSeconds
+              : 0;
+      result.counters = run.counters;
+      return result;
+    }
+
+    // Aim a little past minTime, growing tenfold at most per step
+    double multiplier = minTime * 1.4 / std::max(run.realSeconds, 1e-9);
+    multiplier = std::min(multiplier, 10.0);
+    const unsigned long long next =
+        static_cast<unsigned long long>(std::ceil(iterations * multiplier));
+    iterations = std::min(std::max(next, iterations + 1), MAX_ITERATIONS);
+  }
+}
+
+std::string humanCount(double value) {
+  const char *suffixes[] = {"", "k", "M", "G", "T"};
+  int i = 0;
+  while (value >= 1000 && i < 4) {
+    value /= 1000;
+    ++i;
+  }
+  char text[32];
+  std::snprintf(text, sizeof(text), "%.4g%s", value, suffixes[i]);
+  return text;
+}
+
+void printConsoleHeader(std::size_t width) {
+  printf("%-*s %15s %15s %12s UserCounters...\n", static_cast<int>(width),
+         "Benchmark", "Time", "CPU", "Iterations");
+  printf("%s\n", std::string(width + 60, '-').c_str());
+}
+
+void printConsole(const Result &result, std::size_t width) {
+  printf("%-*s %12.0f ns %12.0f ns %12llu", static_cast<int>(width),
+         result.name.c_str(), result.realNs, result.cpuNs, result.iterations);
+  if (result.itemsPerSecond > 0)
+    printf(" items_per_second=%s/s",
+           humanCount(result.itemsPerSecond).c_str());
+  for (const auto &counter : result.counters)
+    printf(" %s=%s", counter.first.c_str(),
+           humanCount(counter.second).c_str());
+  printf("\n");
+  fflush(stdout);
+}
+
+// The names are ours (ROM file names at worst), only quotes and backslashes
+// need escaping
+std::string jsonString(const std::string &text) {
+  std::string quoted = "\"";
+  for (char c : text) {
+    if (c == '"' || c == '\\')
+      quoted += '\\';
+    quoted += c;
+  }
+  return quoted + "\"";
+}
+
+void writeJson(FILE *out, const char *executable,
+               const std::vector<Result> &results) {
+  char date[32];
+  const std::time_t now = std::time(nullptr);
+  std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z",
+                std::localtime(&now));
+  char host[256] = "";
+  gethostname(host, sizeof(host) - 1);
+
+  fprintf(out, "{\n  \"context\": {\n");
+  fprintf(out, "    \"date\": %s,\n", jsonString(date).c_str());
+  fprintf(out, "    \"host_name\": %s,\n", jsonString(host).c_str());
+  fprintf(out, "    \"executable\": %s,\n", jsonString(executable).c_str());
+  fprintf(out, "    \"num_cpus\": %u,\n", std::thread::hardware_concurrency());
+#ifdef NDEBUG
+  fprintf(out, "    \"library_build_type\": \"release\",\n");
+#else
+  fprintf(out, "    \"library_build_type\": \"debug\",\n");
+#endif
+#ifdef CHIP8_COMPUTED_GOTO
+  fprintf(out, "    \"computed_goto\": true\n");
+#else
+  fprintf(out, "    \"computed_goto\": false\n");
+#endif
+  fprintf(out, "  },\n  \"benchmarks\": [\n");
+
+  for (std::size_t i = 0; i < results.size(); ++i) {
+    const Result &result = results[i];
+    fprintf(out, "    {\n");
+    fprintf(out, "      \"name\": %s,\n", jsonString(result.name).c_str());
+    fprintf(out, "      \"run_name\": %s,\n", jsonString(result.name).c_str());
+    fprintf(out, "      \"run_type\": \"iteration\",\n");
+    fprintf(out, "      \"repetitions\": 1,\n");
+    fprintf(out, "      \"repetition_index\": 0,\n");
+    fprintf(out, "      \"threads\": 1,\n");
+    fprintf(out, "      \"iterations\": %llu,\n", result.iterations);
+    fprintf(out, "      \"real_time\": %.6e,\n", result.realNs);
+    fprintf(out, "      \"cpu_time\": %.6e,\n", result.cpuNs);
+    fprintf(out, "      \"time_unit\": \"ns\"");
+    if (result.itemsPerSecond > 0)
+      fprintf(out, ",\n      \"items_per_second\": %.6e",
+              result.itemsPerSecond);
+    for (const auto &counter : result.counters)
+      fprintf(out, ",\n      %s: %.6e", jsonString(counter.first).c_str(),
+              counter.second);
+    fprintf(out, "\n    }%s\n", i + 1 < results.size() ? "," : "");
+  }
+  fprintf(out, "  ]\n}\n");
+}
+
+// ROM paths given on the command line, directories replaced by the .ch8 and
+// .c8 files they contain
+std::vector<std::string> collectRoms(const std::vector<std::string> &paths) {
+  std::vector<std::string> roms;
+  for (const std::string &path : paths) {
+    DIR *dir = opendir(path.c_str());
+    if (!dir) {
+      roms.push_back(path);
+      continue;
+    }
+    std::vector<std::string> found;
+    while (const dirent *entry = readdir(dir)) {
+      const std::string name(entry->d_name);
+      const std::size_t dot = name.find_last_of('.');
+      if (dot == std::string::npos)
+        continue;
+      const std::string extension = name.substr(dot);
+      if (extension == ".ch8" || extension == ".c8")
+        found.push_back(path + "/" + name);
+    }
+    closedir(dir);
+    std::sort(found.begin(), found.end());
+    roms.insert(roms.end(), found.begin(), found.end());
+  }
+  return roms;
+}
+
+void printUsage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [options] [rom_file|directory]...\n"
+          "Runs the benchmark suite: opcode families on each dispatcher,\n"
+          "whole ROMs (default: every .ch8 and .c8 in games), the time of\n"
+          "single frames, initialize(), loadGame() and loadRom().\n"
+          "Options:\n"
+          "  --benchmark_filter=<regex>       Only benchmarks matching it\n"
+          "  --benchmark_list_tests           List the benchmarks and exit\n"
+          "  --benchmark_min_time=<seconds>   Least time per benchmark\n"
+          "                                   (default %.1f)\n"
+          "  --benchmark_format=console|json  Format of the standard output\n"
+          "  --benchmark_out=<file>           Also write JSON results there\n",
+          program, DEFAULT_MIN_TIME);
+}
+
+// Value of a --name=value flag, nullptr if arg is not that flag
+const char *flagValue(const char *arg, const char *name) {
+  const std::size_t length = std::strlen(name);
+  return std::strncmp(arg, name, length) == 0 && arg[length] == '='
+             ? arg + length + 1
+             : nullptr;
+}
+
+int main(int argc, char *argv[]) {
+  std::string filter = ".";
+  double minTime = DEFAULT_MIN_TIME;
+  bool json = false;
+  bool list = false;
+  const char *outPath = nullptr;
+  std::vector<std::string> paths;
+
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg(argv[i]);
+    const char *value;
+    if ((value = flagValue(argv[i], "--benchmark_filter"))) {
+      filter = value;
+    } else if ((value = flagValue(argv[i], "--benchmark_min_time"))) {
+      minTime = std::strtod(value, nullptr);
+    } else if ((value = flagValue(argv[i], "--benchmark_format"))) {
+      json = std::string(value) == "json";
+      if (!json && std::string(value) != "console") {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    } else if ((value = flagValue(argv[i], "--benchmark_out"))) {
+      outPath = value;
+    } else if (arg == "--benchmark_list_tests") {
+      list = true;
+    } else if (arg[0] != '-') {
+      paths.push_back(arg);
+    } else {
+      printUsage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (paths.empty())
+    paths.push_back("games");
+
+  std::regex pattern;
+  try {
+    pattern = std::regex(filter);
+  } catch (const std::regex_error &) {
+    fprintf(stderr, "Error: Invalid filter: %s\n", filter.c_str());
+    return EXIT_FAILURE;
+  }
+
+  std::vector<Benchmark> benchmarks;
+  for (Benchmark &benchmark : registerBenchmarks(collectRoms(paths))) {
+    if (std::regex_search(benchmark.name, pattern))
+      benchmarks.push_back(std::move(benchmark));
+  }
+  if (list) {
+    for (const Benchmark &benchmark : benchmarks)
+      printf("%s\n", benchmark.name.c_str());
+    return EXIT_SUCCESS;
+  }
+
+  std::size_t width = 10;
+  for (const Benchmark &benchmark : benchmarks)
+    width = std::max(width, benchmark.name.size());
+
+  if (!json)
+    printConsoleHeader(width);
+  std::vector<Result> results;
+  for (const Benchmark &benchmark : benchmarks) {
+    results.push_back(measure(benchmark, minTime));
+    if (!json)
+      printConsole(results.back(), width);
+  }
+
+  if (json)
+    writeJson(stdout, argv[0], results);
+  if (outPath) {
+    FILE *out = std::fopen(outPath, "w");
+    if (!out) {
+      fprintf(stderr, "Error: Failed to write results: %s\n", outPath);
+      return EXIT_FAILURE;
+    }
+    writeJson(out, argv[0], results);
+    std::fclose(out);
+  }
+  return EXIT_SUCCESS;
+}
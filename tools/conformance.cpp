@@ -0,0 +1,315 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "../include/chip8.hpp"
+#include "../include/conformance.hpp"
+#include "../include/rom_store.hpp"
+#include "../include/thread_pool.hpp"
+
+// Defaults of the fuzzing: cases, their longest run and the first seed
+constexpr unsigned long DEFAULT_CASES = 10000;
+constexpr unsigned long DEFAULT_STEPS = 512;
+constexpr unsigned long DEFAULT_SEED = 1;
+
+// Opcodes a ROM runs for when it has no expectation yet
+constexpr unsigned long DEFAULT_ROM_CYCLES = 1000000;
+
+// Cases handed to a worker at once, each task builds its own checker
+constexpr unsigned long CASES_PER_TASK = 256;
+
+// Failures printed in full, the others are only counted
+constexpr std::size_t MAX_REPORTED = 20;
+
+void printUsage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [options] [rom|directory|archive]...\n"
+          "Checks every engine of the core against the reference\n"
+          "interpreter, spread over all the cores. Generated programs run\n"
+          "from random starting states on all of them side by side, the\n"
+          "whole state compared after every opcode. ROMs given run on every\n"
+          "engine from a fresh machine, their final screens compared with\n"
+          "each other and with the expected ones.\n"
+          "  -n <cases>   Programs to generate (default %lu), 0 for none\n"
+          "  -s <seed>    Seed of the first program (default %lu), program\n"
+          "               i gets seed + i: -s <seed> -n 1 runs one again\n"
+          "  -l <steps>   Opcodes each program runs at most (default %lu)\n"
+          "  -m <machine> Only programs for chip8, schip or xochip\n"
+          "  -q <quirks>  Only programs with the cosmac, chip48, schip or\n"
+          "               xochip quirks\n"
+          "  -e <file>    Expected screens of the ROMs: <rom hash> <cycles>\n"
+          "               <screen hash or @picture> [machine [quirks]]\n"
+          "               per line\n"
+          "  -c <cycles>  Opcodes to run ROMs without an expectation for\n"
+          "               (default %lu)\n"
+          "  --record     Print the expectations of the ROMs, once every\n"
+          "               engine agrees on them, instead of checking;\n"
+          "               those given with -e keep their machine\n"
+          "  -j <threads> Worker threads (default one per core)\n",
+          program, DEFAULT_CASES, DEFAULT_SEED, DEFAULT_STEPS,
+          DEFAULT_ROM_CYCLES);
+}
+
+// A program that made an engine disagree with the reference
+struct Failure {
+  ConformanceCase test;
+  Mismatch mismatch;
+};
+
+// Outcome of one task of generated programs
+struct FuzzResult {
+  unsigned long long steps = 0;
+  std::vector<Failure> failures;
+};
+
+// Machine and quirk profile of a case and how its program is made all
+// follow from its seed, so that a seed alone runs it again
+ConformanceCase caseFor(std::uint32_t seed,
+                        const std::vector<ConformanceCase> &profiles) {
+  ConformanceCase test = profiles[seed % profiles.size()];
+  test.seed = seed;
+  test.kind = (seed / profiles.size()) % 2 ? ProgramKind::Structured
+                                            : ProgramKind::Random;
+  return test;
+}
+
+const char *kindName(ProgramKind kind) {
+  return kind == ProgramKind::Structured ? "structured" : "random";
+}
+
+// One ROM checked on every engine, filled in by the worker that ran it
+struct RomCheck {
+  const Rom *rom = nullptr;
+  const ScreenExpectation *expected = nullptr;
+  Machine machine = Machine::Classic;
+  Quirks quirks = Quirks::CosmacVip;
+  unsigned long cycles = 0;
+  std::vector<Engine> engines;
+  std::vector<std::uint64_t> hashes;
+};
+
+void runRomCheck(RomCheck &check) {
+  for (Engine engine : check.engines)
+    check.hashes.push_back(runScreenHash(engine, check.rom->data,
+                                         check.rom->size, check.cycles,
+                                         check.machine, check.quirks));
+}
+
+int main(int argc, char *argv[]) {
+  unsigned long cases = DEFAULT_CASES;
+  unsigned long steps = DEFAULT_STEPS;
+  unsigned long seed = DEFAULT_SEED;
+  unsigned long romCycles = DEFAULT_ROM_CYCLES;
+  const char *machineArg = nullptr;
+  const char *quirksArg = nullptr;
+  const char *expectationsPath = nullptr;
+  bool record = false;
+  unsigned threads = 0;
+  std::vector<const char *> romPaths;
+
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg(argv[i]);
+    if (arg == "-n" && i + 1 < argc) {
+      cases = std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "-s" && i + 1 < argc) {
+      seed = std::strtoul(argv[++i], nullptr, 0);
+    } else if (arg == "-l" && i + 1 < argc) {
+      steps = std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "-m" && i + 1 < argc) {
+      machineArg = argv[++i];
+    } else if (arg == "-q" && i + 1 < argc) {
+      quirksArg = argv[++i];
+    } else if (arg == "-e" && i + 1 < argc) {
+      expectationsPath = argv[++i];
+    } else if (arg == "-c" && i + 1 < argc) {
+      romCycles = std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "--record") {
+      record = true;
+    } else if (arg == "-j" && i + 1 < argc) {
+      threads = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg[0] != '-') {
+      romPaths.push_back(argv[i]);
+    } else {
+      printUsage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Every machine with every quirk profile, unless narrowed down
+  const Machine machines[] = {Machine::Classic, Machine::SuperChip,
+                              Machine::XoChip};
+  const Quirks profiles[] = {Quirks::CosmacVip, Quirks::Chip48,
+                             Quirks::SuperChip, Quirks::XoChip};
+  Machine onlyMachine = Machine::Classic;
+  Quirks onlyQuirks = Quirks::CosmacVip;
+  if (machineArg && !parseMachine(machineArg, onlyMachine)) {
+    fprintf(stderr, "Error: Unknown machine: %s\n", machineArg);
+    return EXIT_FAILURE;
+  }
+  if (quirksArg && !parseQuirks(quirksArg, onlyQuirks)) {
+    fprintf(stderr, "Error: Unknown quirks: %s\n", quirksArg);
+    return EXIT_FAILURE;
+  }
+  std::vector<ConformanceCase> combinations;
+  for (Machine machine : machines) {
+    for (Quirks quirks : profiles) {
+      if ((machineArg && machine != onlyMachine) ||
+          (quirksArg && quirks != onlyQuirks))
+        continue;
+      ConformanceCase test;
+      test.machine = machine;
+      test.quirks = quirks;
+      combinations.push_back(test);
+    }
+  }
+
+  std::vector<ScreenExpectation> expectations;
+  if (expectationsPath && !loadExpectations(expectationsPath, expectations)) {
+    fprintf(stderr, "Error: Failed to read expectations: %s\n",
+            expectationsPath);
+    return EXIT_FAILURE;
+  }
+
+  // Every ROM is mapped before the workers start reading the store
+  RomStore store;
+  for (const char *path : romPaths) {
+    if (!store.addPath(path)) {
+      fprintf(stderr, "Error: Failed to load ROMs from: %s\n", path);
+      return EXIT_FAILURE;
+    }
+  }
+
+  std::vector<RomCheck> romChecks(store.all().size());
+  for (std::size_t i = 0; i < romChecks.size(); ++i) {
+    RomCheck &check = romChecks[i];
+    check.rom = &store.all()[i];
+    for (const ScreenExpectation &expectation : expectations) {
+      if (expectation.romHash == check.rom->hash)
+        check.expected = &expectation;
+    }
+    // Recording again keeps the machine, quirks and run of an expectation
+    const ScreenExpectation *expected = check.expected;
+    check.machine = expected && expected->hasMachine
+                        ? expected->machine
+                        : machineForPath(check.rom->name);
+    check.quirks = expected && expected->hasQuirks
+                       ? expected->quirks
+                       : defaultQuirks(check.machine);
+    check.cycles = expected ? expected->cycles : romCycles;
+    const bool cosmac = check.machine == Machine::Classic &&
+                        check.quirks == Quirks::CosmacVip;
+    check.engines.push_back(cosmac ? Engine::Switch : Engine::Table);
+    if (cosmac)
+      check.engines.push_back(Engine::Table);
+    check.engines.push_back(Engine::Threaded);
+    check.engines.push_back(Engine::Jit);
+    if (cosmac)
+      check.engines.push_back(Engine::Batch);
+  }
+
+  const unsigned long tasks = (cases + CASES_PER_TASK - 1) / CASES_PER_TASK;
+  std::vector<FuzzResult> fuzzResults(tasks);
+  const auto start = std::chrono::steady_clock::now();
+  unsigned workers;
+  {
+    ThreadPool pool(threads);
+    workers = pool.size();
+    // Each task writes only its own slot of the results
+    for (unsigned long task = 0; task < tasks; ++task) {
+      pool.submit([&, task] {
+        ConformanceChecker checker;
+        FuzzResult &result = fuzzResults[task];
+        const unsigned long first = task * CASES_PER_TASK;
+        const unsigned long last = first + CASES_PER_TASK < cases
+                                       ? first + CASES_PER_TASK
+                                       : cases;
+        for (unsigned long i = first; i < last; ++i) {
+          Failure failure;
+          failure.test =
+              caseFor(static_cast<std::uint32_t>(seed + i), combinations);
+          unsigned long run = 0;
+          if (!checker.check(failure.test, steps, failure.mismatch, run))
+            result.failures.push_back(failure);
+          result.steps += run;
+        }
+      });
+    }
+    for (RomCheck &check : romChecks)
+      pool.submit([&check] { runRomCheck(check); });
+    pool.wait();
+  }
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  unsigned long long fuzzSteps = 0;
+  std::size_t fuzzFailures = 0;
+  for (const FuzzResult &result : fuzzResults) {
+    fuzzSteps += result.steps;
+    for (const Failure &failure : result.failures) {
+      if (++fuzzFailures > MAX_REPORTED)
+        continue;
+      const Mismatch &m = failure.mismatch;
+      printf("case %lu (%s/%s, %s): %s: %s differs after %lu opcodes, "
+             "running %lu from pc 0x%03X (opcode 0x%04X)\n",
+             static_cast<unsigned long>(failure.test.seed),
+             machineName(failure.test.machine),
+             quirksName(failure.test.quirks), kindName(failure.test.kind),
+             engineName(m.engine), m.field.c_str(), m.step, m.chunk, m.pc,
+             m.opcode);
+    }
+  }
+  if (fuzzFailures > MAX_REPORTED)
+    printf("... and %zu more\n", fuzzFailures - MAX_REPORTED);
+  if (cases > 0)
+    printf("%lu programs, %llu opcodes each compared on every engine, "
+           "%zu failed\n",
+           cases, fuzzSteps, fuzzFailures);
+
+  std::size_t romFailures = 0;
+  if (record && !romChecks.empty())
+    printf("# <rom hash> <cycles> <screen hash> <machine> <quirks>\n");
+  for (const RomCheck &check : romChecks) {
+    // The reference comes first, the recompiler gives 0 on hosts it can
+    // not run on
+    const std::uint64_t reference = check.hashes.front();
+    std::string disagree;
+    for (std::size_t i = 1; i < check.engines.size(); ++i) {
+      if (check.hashes[i] != reference &&
+          !(check.engines[i] == Engine::Jit && check.hashes[i] == 0))
+        disagree += std::string(disagree.empty() ? "" : ", ") +
+                    engineName(check.engines[i]);
+    }
+
+    if (reference == 0) {
+      ++romFailures;
+      printf("%s: does not fit in memory\n", check.rom->name.c_str());
+    } else if (!disagree.empty()) {
+      ++romFailures;
+      printf("%s: %s not agreeing with %s\n", check.rom->name.c_str(),
+             disagree.c_str(), engineName(check.engines.front()));
+    } else if (record) {
+      printf("%016llx %lu %016llx %s %s  %s\n",
+             static_cast<unsigned long long>(check.rom->hash), check.cycles,
+             static_cast<unsigned long long>(reference),
+             machineName(check.machine), quirksName(check.quirks),
+             check.rom->name.c_str());
+    } else if (!check.expected) {
+      printf("%s: engines agree, no expectation\n", check.rom->name.c_str());
+    } else if (check.expected->screenHash != reference) {
+      ++romFailures;
+      printf("%s: screen %016llx after %lu opcodes, expected %016llx\n",
+             check.rom->name.c_str(),
+             static_cast<unsigned long long>(reference), check.cycles,
+             static_cast<unsigned long long>(check.expected->screenHash));
+    } else {
+      printf("%s: ok\n", check.rom->name.c_str());
+    }
+  }
+  if (!romChecks.empty() && !record)
+    printf("%zu ROMs, %zu failed\n", romChecks.size(), romFailures);
+
+  fprintf(stderr, "%.2f s on %u threads\n", elapsed.count(), workers);
+  return fuzzFailures == 0 && romFailures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,516 @@
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../include/chip8.hpp"
+#include "../include/debugger.hpp"
+#include "../include/disasm.hpp"
+#include "../include/scheduler.hpp"
+
+// Opcodes run between two looks at the input while continuing, so that a
+// line typed (or Ctrl-C) interrupts a ROM that never hits a breakpoint
+constexpr unsigned long long CONTINUE_CHUNK = 1 << 20;
+
+// Opcodes step over and step out run at most before giving up
+constexpr unsigned long long STEP_LIMIT = 100000000;
+
+volatile std::sig_atomic_t interrupted = 0;
+
+void onInterrupt(int) { interrupted = 1; }
+
+void printUsage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [options] <rom_file>\n"
+          "Loads the ROM stopped at its first opcode and reads debugger\n"
+          "commands (help lists them) from the terminal, or from clients\n"
+          "connecting to a local TCP port one at a time.\n"
+          "Options:\n"
+          "  -s <speed>      Instructions per emulated second: slow, normal\n"
+          "                  (default), fast or a number\n"
+          "  -m <machine>    chip8, schip or xochip (default from the ROM's\n"
+          "                  extension: .sc8, .xo8)\n"
+          "  -q <quirks>     cosmac, chip48, schip or xochip (default the\n"
+          "                  machine's own)\n"
+          "  --listen <port> Serve the commands on 127.0.0.1:port instead\n"
+          "                  of the terminal\n",
+          program);
+}
+
+const char HELP[] =
+    "break <addr> [if <cond>]   Stop before the opcode at addr, when cond\n"
+    "                           holds (\"V3 == 5\", \"I >= 0x300\", DT, ST\n"
+    "                           and SP too)\n"
+    "delete [<addr>]            Remove a breakpoint, or all of them and\n"
+    "                           every watchpoint\n"
+    "watch <addr>[-<addr>] [r|w|rw]\n"
+    "                           Stop after an opcode reads or writes there\n"
+    "                           (default w)\n"
+    "watch <Vx|I>               Stop after an opcode changes the register\n"
+    "unwatch <addr>[-<addr>]|<Vx|I>\n"
+    "info                       List breakpoints and watchpoints\n"
+    "step [n], s                Run n opcodes (default 1)\n"
+    "next, n                    Run one opcode, a whole call for 2NNN\n"
+    "finish                     Run until the subroutine returns\n"
+    "continue [frames], c       Run until something stops it, a line is\n"
+    "                           typed or frames frames went by\n"
+    "regs, r                    Registers, timers and the opcode at pc\n"
+    "mem <addr> [length], x     Dump memory (default 64 bytes)\n"
+    "dis [addr] [count]         Disassemble (default 10 opcodes at pc)\n"
+    "stack, bt                  Return addresses of the calls under way\n"
+    "screen                     The screen, one character per pixel\n"
+    "key <0-F> down|up          Press or release a key\n"
+    "quit                       Leave\n"
+    "An empty line repeats the last command.\n";
+
+// A count of opcodes or frames, decimal or 0x hexadecimal
+bool parseCount(const std::string &text, unsigned long &count) {
+  const bool hex = text.size() > 2 && text[0] == '0' &&
+                   (text[1] == 'x' || text[1] == 'X');
+  const char *digits = text.c_str() + (hex ? 2 : 0);
+  if (*digits < '0' || *digits > 'f')
+    return false;
+  char *end;
+  count = std::strtoul(digits, &end, hex ? 16 : 10);
+  return *end == '\0';
+}
+
+// A command session over one input and output
+class Session {
+private:
+  Chip8 &chip8;
+  Debugger &debugger;
+  FILE *in;
+  FILE *out;
+  // Whether a line typed while continuing stops it: not for scripts
+  // piped in, their next command would
+  const bool interactive;
+  std::string last;
+
+  void printOpcode(unsigned address) {
+    const unsigned short opcode = static_cast<unsigned short>(
+        chip8.memory[address & 0xFFFF] << 8 |
+        chip8.memory[(address + 1) & 0xFFFF]);
+    fprintf(out, "%s 0x%03X  %04X  %s\n", address == chip8.pc ? "=>" : "  ",
+            address, opcode, disassemble(opcode, chip8.machine).c_str());
+  }
+
+  void report(DebugStop stop) {
+    switch (stop) {
+    case DebugStop::Breakpoint:
+      fprintf(out, "Breakpoint at 0x%03X\n", chip8.pc);
+      break;
+    case DebugStop::Watchpoint:
+      if (debugger.watchLength > 0) {
+        fprintf(out, "Watchpoint: %s 0x%03X-0x%03X\n",
+                debugger.watchWrite ? "wrote" : "read", debugger.watchAddress,
+                (debugger.watchAddress + debugger.watchLength - 1) & 0xFFFF);
+      } else if (debugger.watchRegister == 16) {
+        fprintf(out, "Watchpoint: I 0x%03X -> 0x%03X\n",
+                debugger.watchOldValue, chip8.I);
+      } else {
+        fprintf(out, "Watchpoint: V%X 0x%02X -> 0x%02X\n",
+                debugger.watchRegister, debugger.watchOldValue,
+                chip8.V[debugger.watchRegister]);
+      }
+      break;
+    case DebugStop::Error:
+      fprintf(out, "Stopped: %s\n", machineErrorName(chip8.error));
+      break;
+    case DebugStop::Limit:
+    case DebugStop::Step:
+      break;
+    }
+    printOpcode(chip8.pc);
+  }
+
+  // Whether Ctrl-C was hit or a line typed, which is left to be read as
+  // the next command
+  bool inputPending() {
+    if (interrupted) {
+      interrupted = 0;
+      return true;
+    }
+    if (!interactive)
+      return false;
+    struct pollfd fd = {fileno(in), POLLIN, 0};
+    return poll(&fd, 1, 0) > 0;
+  }
+
+  void runUntilStopped(unsigned long long frames) {
+    unsigned long long left =
+        frames ? frames * debugger.instructionsPerFrame : ~0ULL;
+    interrupted = 0;
+    while (left > 0) {
+      const unsigned long long chunk = std::min(left, CONTINUE_CHUNK);
+      const DebugStop stop = debugger.run(chunk);
+      left -= chunk;
+      if (stop != DebugStop::Limit) {
+        report(stop);
+        return;
+      }
+      if (inputPending()) {
+        fprintf(out, "Interrupted\n");
+        // The empty line that stopped it does not continue again
+        last.clear();
+        break;
+      }
+    }
+    report(DebugStop::Limit);
+  }
+
+  // "addr" or "first-last"
+  static bool parseRange(const std::string &text, unsigned &first,
+                         unsigned &last) {
+    const std::size_t dash = text.find('-');
+    if (dash == std::string::npos) {
+      if (!parseAddress(text, first))
+        return false;
+      last = first;
+      return true;
+    }
+    return parseAddress(text.substr(0, dash), first) &&
+           parseAddress(text.substr(dash + 1), last) && first <= last;
+  }
+
+  void breakCommand(std::istringstream &args) {
+    std::string where, keyword;
+    unsigned address;
+    if (!(args >> where) || !parseAddress(where, address)) {
+      fprintf(out, "Usage: break <addr> [if <cond>]\n");
+      return;
+    }
+    if (!(args >> keyword)) {
+      debugger.addBreakpoint(address, nullptr);
+      fprintf(out, "Breakpoint at 0x%03X\n", address);
+      return;
+    }
+    std::string text;
+    std::getline(args, text);
+    DebugCondition condition;
+    if (keyword != "if" || !parseCondition(text, condition)) {
+      fprintf(out, "Invalid condition: %s\n", text.c_str());
+      return;
+    }
+    debugger.addBreakpoint(address, &condition);
+    fprintf(out, "Breakpoint at 0x%03X if %s\n", address,
+            condition.text().c_str());
+  }
+
+  void watchCommand(std::istringstream &args, bool watch) {
+    std::string what, how = "w";
+    args >> what >> how;
+    DebugRegister reg;
+    unsigned char index;
+    unsigned first, last;
+    if (parseRegister(what, reg, index)) {
+      if (!debugger.watchRegisterChange(reg, index, watch))
+        fprintf(out, "Only V0 to VF and I can be watched\n");
+    } else if (parseRange(what, first, last)) {
+      if (!watch)
+        debugger.unwatchMemory(first, last);
+      else if (how == "r" || how == "w" || how == "rw")
+        debugger.watchMemory(first, last, how != "w", how != "r");
+      else
+        fprintf(out, "Usage: watch <addr>[-<addr>] [r|w|rw]\n");
+    } else {
+      fprintf(out, "Usage: %s <addr>[-<addr>]|<Vx|I>\n",
+              watch ? "watch" : "unwatch");
+    }
+  }
+
+  void info() {
+    for (const auto &breakpoint : debugger.breakpoints()) {
+      if (breakpoint.second)
+        fprintf(out, "break 0x%03X if %s\n", breakpoint.first,
+                breakpoint.second->text().c_str());
+      else
+        fprintf(out, "break 0x%03X\n", breakpoint.first);
+    }
+    for (const std::string &watchpoint : debugger.watchpoints())
+      fprintf(out, "watch %s\n", watchpoint.c_str());
+  }
+
+  void registers() {
+    for (int i = 0; i < 16; ++i)
+      fprintf(out, "V%X=%02X%s", i, chip8.V[i], i % 8 == 7 ? "\n" : " ");
+    fprintf(out, "I=%03X  SP=%X  DT=%02X  ST=%02X  cycle %llu, frame %llu\n",
+            chip8.I, chip8.sp, chip8.delay_timer, chip8.sound_timer,
+            debugger.cycles, debugger.frames);
+    printOpcode(chip8.pc);
+  }
+
+  void memory(std::istringstream &args) {
+    std::string from, length;
+    unsigned address = chip8.I, count = 64;
+    if ((args >> from && !parseAddress(from, address)) ||
+        (args >> length && !parseAddress(length, count))) {
+      fprintf(out, "Usage: mem <addr> [length]\n");
+      return;
+    }
+    for (unsigned row = 0; row < count; row += 16) {
+      fprintf(out, "0x%03X ", (address + row) & 0xFFFF);
+      for (unsigned i = row; i < row + 16 && i < count; ++i)
+        fprintf(out, " %02X", chip8.memory[(address + i) & 0xFFFF]);
+      fprintf(out, "\n");
+    }
+  }
+
+  void disassembly(std::istringstream &args) {
+    std::string from, length;
+    unsigned address = chip8.pc, count = 10;
+    if ((args >> from && !parseAddress(from, address)) ||
+        (args >> length && !parseAddress(length, count))) {
+      fprintf(out, "Usage: dis [addr] [count]\n");
+      return;
+    }
+    for (unsigned i = 0; i < count; ++i)
+      printOpcode((address + 2 * i) & 0xFFFF);
+  }
+
+  void stack() {
+    if (chip8.sp == 0)
+      fprintf(out, "Not in a subroutine\n");
+    // The innermost call first, each returning after its 2NNN
+    for (int frame = chip8.sp - 1; frame >= 0 && frame < STACK_DEPTH;
+         --frame)
+      fprintf(out, "#%d  called from 0x%03X\n", chip8.sp - 1 - frame,
+              chip8.stack[frame]);
+  }
+
+  void screen() {
+    static const char shades[] = ".#+@";
+    for (int y = 0; y < chip8.height(); ++y) {
+      std::string line;
+      for (int x = 0; x < chip8.width(); ++x)
+        line += shades[chip8.pixel(x, y)];
+      fprintf(out, "%s\n", line.c_str());
+    }
+  }
+
+  void keyCommand(std::istringstream &args) {
+    std::string which, state;
+    args >> which >> state;
+    char *end;
+    const unsigned long key = std::strtoul(which.c_str(), &end, 16);
+    if (which.empty() || *end != '\0' || key > 0xF ||
+        (state != "down" && state != "up")) {
+      fprintf(out, "Usage: key <0-F> down|up\n");
+      return;
+    }
+    chip8.key[key] = state == "down";
+  }
+
+  // Returns false on quit
+  bool execute(const std::string &line) {
+    std::istringstream args(line);
+    std::string command;
+    args >> command;
+
+    if (command == "break" || command == "b") {
+      breakCommand(args);
+    } else if (command == "delete" || command == "d") {
+      std::string where;
+      unsigned address;
+      if (!(args >> where)) {
+        debugger.clear();
+      } else if (!parseAddress(where, address) ||
+                 !debugger.removeBreakpoint(address)) {
+        fprintf(out, "No breakpoint at %s\n", where.c_str());
+      }
+    } else if (command == "watch" || command == "unwatch") {
+      watchCommand(args, command == "watch");
+    } else if (command == "info") {
+      info();
+    } else if (command == "step" || command == "s") {
+      std::string count;
+      unsigned long n = 1;
+      if (args >> count && !parseCount(count, n)) {
+        fprintf(out, "Usage: step [n]\n");
+        return true;
+      }
+      DebugStop stop = DebugStop::Step;
+      for (unsigned long i = 0; i < n && stop == DebugStop::Step; ++i)
+        stop = debugger.step();
+      report(stop);
+    } else if (command == "next" || command == "n") {
+      report(debugger.stepOver(STEP_LIMIT));
+    } else if (command == "finish") {
+      if (chip8.sp == 0)
+        fprintf(out, "Not in a subroutine\n");
+      else
+        report(debugger.stepOut(STEP_LIMIT));
+    } else if (command == "continue" || command == "c") {
+      std::string count;
+      unsigned long frames = 0;
+      if (args >> count && !parseCount(count, frames)) {
+        fprintf(out, "Usage: continue [frames]\n");
+        return true;
+      }
+      runUntilStopped(frames);
+    } else if (command == "regs" || command == "r") {
+      registers();
+    } else if (command == "mem" || command == "x") {
+      memory(args);
+    } else if (command == "dis") {
+      disassembly(args);
+    } else if (command == "stack" || command == "bt") {
+      stack();
+    } else if (command == "screen") {
+      screen();
+    } else if (command == "key") {
+      keyCommand(args);
+    } else if (command == "help" || command == "h") {
+      fputs(HELP, out);
+    } else if (command == "quit" || command == "q") {
+      return false;
+    } else {
+      fprintf(out, "Unknown command: %s (help lists them)\n",
+              command.c_str());
+    }
+    return true;
+  }
+
+public:
+  Session(Chip8 &chip8, Debugger &debugger, FILE *in, FILE *out,
+          bool interactive)
+      : chip8(chip8), debugger(debugger), in(in), out(out),
+        interactive(interactive) {}
+
+  // Returns false once quit, true at the end of the input
+  bool run() {
+    printOpcode(chip8.pc);
+    char buffer[256];
+    for (;;) {
+      fputs("(chip8) ", out);
+      fflush(out);
+      if (!fgets(buffer, sizeof(buffer), in))
+        return true;
+      std::string line(buffer);
+      line.erase(line.find_last_not_of("\r\n") + 1);
+      if (line.find_first_not_of(" \t") == std::string::npos)
+        line = last;
+      else
+        last = line;
+      if (!line.empty() && !execute(line))
+        return false;
+      fflush(out);
+    }
+  }
+};
+
+// Serve sessions to one client at a time until one quits
+int listenOn(unsigned port, Chip8 &chip8, Debugger &debugger) {
+  const int server = socket(AF_INET, SOCK_STREAM, 0);
+  const int reuse = 1;
+  setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  struct sockaddr_in address;
+  std::memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(static_cast<std::uint16_t>(port));
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (server < 0 ||
+      bind(server, reinterpret_cast<struct sockaddr *>(&address),
+           sizeof(address)) != 0 ||
+      listen(server, 1) != 0) {
+    fprintf(stderr, "Error: Failed to listen on 127.0.0.1:%u\n", port);
+    return EXIT_FAILURE;
+  }
+  fprintf(stderr, "Listening on 127.0.0.1:%u\n", port);
+
+  // A client going away mid-reply must not kill the debugger
+  std::signal(SIGPIPE, SIG_IGN);
+  for (;;) {
+    const int client = accept(server, nullptr, nullptr);
+    if (client < 0)
+      continue;
+    FILE *in = fdopen(client, "r");
+    FILE *out = fdopen(dup(client), "w");
+    const bool more = Session(chip8, debugger, in, out, true).run();
+    fclose(in);
+    fclose(out);
+    if (!more)
+      break;
+  }
+  close(server);
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+  unsigned long ips = IPS_NORMAL;
+  const char *romPath = nullptr;
+  const char *machineArg = nullptr;
+  const char *quirksArg = nullptr;
+  const char *portArg = nullptr;
+
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg(argv[i]);
+    if (arg == "-s" && i + 1 < argc) {
+      ips = parseSpeed(argv[++i]);
+      if (ips == 0) {
+        fprintf(stderr, "Error: Invalid speed: %s\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    } else if (arg == "-m" && i + 1 < argc) {
+      machineArg = argv[++i];
+    } else if (arg == "-q" && i + 1 < argc) {
+      quirksArg = argv[++i];
+    } else if (arg == "--listen" && i + 1 < argc) {
+      portArg = argv[++i];
+    } else if (!romPath && arg[0] != '-') {
+      romPath = argv[i];
+    } else {
+      printUsage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (!romPath) {
+    printUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  Machine machine = machineForPath(romPath);
+  if (machineArg && !parseMachine(machineArg, machine)) {
+    fprintf(stderr, "Error: Unknown machine: %s\n", machineArg);
+    return EXIT_FAILURE;
+  }
+  Quirks quirks = defaultQuirks(machine);
+  if (quirksArg && !parseQuirks(quirksArg, quirks)) {
+    fprintf(stderr, "Error: Unknown quirks: %s\n", quirksArg);
+    return EXIT_FAILURE;
+  }
+  unsigned port = 0;
+  if (portArg && (!parseAddress(portArg, port) || port == 0)) {
+    fprintf(stderr, "Error: Invalid port: %s\n", portArg);
+    return EXIT_FAILURE;
+  }
+
+  Chip8 chip8;
+  chip8.setMachine(machine);
+  chip8.setQuirks(quirks);
+  chip8.initialize();
+  if (!chip8.loadGame(romPath)) {
+    fprintf(stderr, "Error: Failed to load ROM file: %s\n", romPath);
+    return EXIT_FAILURE;
+  }
+  Debugger debugger(chip8, instructionsPerFrame(ips));
+
+  if (portArg)
+    return listenOn(port, chip8, debugger);
+
+  std::signal(SIGINT, onInterrupt);
+  Session(chip8, debugger, stdin, stdout, isatty(STDIN_FILENO))
+      .run();
+  return EXIT_SUCCESS;
+}
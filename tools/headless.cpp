@@ -0,0 +1,356 @@
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "../include/analysis.hpp"
+#include "../include/audio.hpp"
+#include "../include/chip8.hpp"
+#include "../include/frontend.hpp"
+#include "../include/jit.hpp"
+#include "../include/profiler.hpp"
+#include "../include/rom_store.hpp"
+#include "../include/runner.hpp"
+#include "../include/savestate.hpp"
+#include "../include/scheduler.hpp"
+#include "../include/trace.hpp"
+#include "../include/video.hpp"
+
+// Default number of opcodes to execute when none is given
+constexpr unsigned long DEFAULT_CYCLES = 10000000;
+
+// Print the Chip-8 screen as text, one character per pixel in the current
+// resolution. XO-CHIP colors show as '#' (plane 1), '+' (plane 2) and '@'
+// (both)
+void dumpScreen(const Chip8 &chip8) {
+  static const char shades[] = ".#+@";
+  for (int y = 0; y < chip8.height(); ++y) {
+    std::string line;
+    for (int x = 0; x < chip8.width(); ++x) {
+      line += shades[chip8.pixel(x, y)];
+    }
+    std::cout << line << '\n';
+  }
+}
+
+void printUsage(const char *program) {
+  std::cerr << "Usage: " << program << " [options] <rom_file>" << std::endl;
+  std::cerr << "Runs the ROM without a window and as fast as possible, then"
+            << std::endl;
+  std::cerr << "prints the final screen and the execution speed." << std::endl;
+  std::cerr << "Options:" << std::endl;
+  std::cerr << "  -n <cycles>  Opcodes to execute (default " << DEFAULT_CYCLES
+            << ")" << std::endl;
+  std::cerr << "  -s <speed>   Instructions per emulated second: slow, normal"
+            << std::endl;
+  std::cerr << "               (default), fast or a number" << std::endl;
+  std::cerr << "  -m <machine>  chip8, schip or xochip (default from the ROM's"
+            << std::endl;
+  std::cerr << "               extension: .sc8, .xo8)" << std::endl;
+  std::cerr << "  -q <quirks>  cosmac, chip48, schip or xochip (default the"
+            << std::endl;
+  std::cerr << "               machine's own)" << std::endl;
+  std::cerr << "  --jit        Run through the x86-64 recompiler" << std::endl;
+  std::cerr << "  --analysis <dir>     Decode (and with --jit compile) the"
+            << std::endl;
+  std::cerr << "               code found by chip8_analyze before running,"
+            << std::endl;
+  std::cerr << "               the analysis cached in dir" << std::endl;
+  std::cerr << "  --load-state <file>  Start from a save state instead of"
+            << std::endl;
+  std::cerr << "               the beginning of the ROM" << std::endl;
+  std::cerr << "  --save-state <file>  Save the final state" << std::endl;
+  std::cerr << "  --trace <file>       Record every opcode executed, to read"
+            << std::endl;
+  std::cerr << "               with chip8_trace" << std::endl;
+  std::cerr << "  --wav <file>         Write the buzzer as heard to a WAV"
+            << std::endl;
+  std::cerr << "               file" << std::endl;
+  std::cerr << "  --video <file>       Record the screen, as an animated GIF"
+            << std::endl;
+  std::cerr << "               if file ends in .gif, else as a stream for"
+            << std::endl;
+  std::cerr << "               tools/video.cpp" << std::endl;
+  std::cerr << "  --profile <prefix>   Print a profile of the run and write"
+            << std::endl;
+  std::cerr << "               <prefix>.guest.folded and <prefix>.host.folded"
+            << std::endl;
+  std::cerr << "               (needs -DCHIP8_PROFILE, not with --jit)"
+            << std::endl;
+}
+
+#ifdef CHIP8_PROFILE
+// Print the report and write both folded stack files next to prefix
+bool writeProfile(const Profiler &profiler, const std::string &prefix) {
+  std::cout << std::endl;
+  profiler.writeReport(std::cout);
+  std::cout << std::endl;
+
+  std::ofstream guest(prefix + ".guest.folded");
+  profiler.writeGuestFolded(guest);
+  std::ofstream host(prefix + ".host.folded");
+  profiler.writeHostFolded(host);
+  if (!guest.good() || !host.good())
+    return false;
+
+  std::cout << "Folded stacks: " << prefix << ".guest.folded, " << prefix
+            << ".host.folded" << std::endl;
+  return true;
+}
+#endif
+
+int main(int argc, char *argv[]) {
+  unsigned long cycles = DEFAULT_CYCLES;
+  unsigned long ips = IPS_NORMAL;
+  bool useJit = false;
+  const char *romPath = nullptr;
+  const char *loadPath = nullptr;
+  const char *savePath = nullptr;
+  const char *profilePath = nullptr;
+  const char *tracePath = nullptr;
+  const char *wavPath = nullptr;
+  const char *videoPath = nullptr;
+  const char *analysisPath = nullptr;
+  const char *machineArg = nullptr;
+  const char *quirksArg = nullptr;
+
+  // Parse command line arguments
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg(argv[i]);
+    if (arg == "-n" && i + 1 < argc) {
+      cycles = std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "-s" && i + 1 < argc) {
+      ips = parseSpeed(argv[++i]);
+      if (ips == 0) {
+        std::cerr << "Error: Invalid speed: " << argv[i] << std::endl;
+        return EXIT_FAILURE;
+      }
+    } else if (arg == "-m" && i + 1 < argc) {
+      machineArg = argv[++i];
+    } else if (arg == "-q" && i + 1 < argc) {
+      quirksArg = argv[++i];
+    } else if (arg == "--jit") {
+      useJit = true;
+    } else if (arg == "--load-state" && i + 1 < argc) {
+      loadPath = argv[++i];
+    } else if (arg == "--save-state" && i + 1 < argc) {
+      savePath = argv[++i];
+    } else if (arg == "--trace" && i + 1 < argc) {
+      tracePath = argv[++i];
+    } else if (arg == "--wav" && i + 1 < argc) {
+      wavPath = argv[++i];
+    } else if (arg == "--video" && i + 1 < argc) {
+      videoPath = argv[++i];
+    } else if (arg == "--analysis" && i + 1 < argc) {
+      analysisPath = argv[++i];
+    } else if (arg == "--profile" && i + 1 < argc) {
+      profilePath = argv[++i];
+    } else if (!romPath && arg[0] != '-') {
+      romPath = argv[i];
+    } else {
+      printUsage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (!romPath) {
+    printUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (profilePath && useJit) {
+    std::cerr << "Error: --profile only sees the interpreter, drop --jit"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (tracePath && useJit) {
+    std::cerr << "Error: --trace only sees the interpreter, drop --jit"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+#ifndef CHIP8_PROFILE
+  if (profilePath) {
+    std::cerr << "Error: --profile needs a build with -DCHIP8_PROFILE"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+#endif
+
+  Machine machine = machineForPath(romPath);
+  if (machineArg && !parseMachine(machineArg, machine)) {
+    std::cerr << "Error: Unknown machine: " << machineArg << std::endl;
+    return EXIT_FAILURE;
+  }
+  Quirks quirks = defaultQuirks(machine);
+  if (quirksArg && !parseQuirks(quirksArg, quirks)) {
+    std::cerr << "Error: Unknown quirks: " << quirksArg << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  Chip8 chip8;
+  chip8.setMachine(machine);
+  chip8.setQuirks(quirks);
+  NullFrontend frontend;
+  Runner runner(chip8, frontend, instructionsPerFrame(ips));
+  Jit jit(chip8);
+
+  if (useJit) {
+    if (!jit.available()) {
+      std::cerr << "Warning: recompiler not available on this host, "
+                << "using the interpreter" << std::endl;
+    }
+    runner.jit = &jit;
+  }
+
+  chip8.initialize();
+  if (!chip8.loadGame(romPath)) {
+    std::cerr << "Error: Failed to load ROM file: " << romPath << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (loadPath && !loadStateFile(chip8, loadPath)) {
+    std::cerr << "Error: Failed to load state: " << loadPath << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // Found in the cache, or analyzed now for the next run
+  bool analysisCached = false;
+  RomAnalysis analysis;
+  if (analysisPath) {
+    RomStore store;
+    if (!store.addFile(romPath)) {
+      std::cerr << "Error: Failed to load ROM file: " << romPath << std::endl;
+      return EXIT_FAILURE;
+    }
+    const Rom &rom = store.all().front();
+    AnalysisCache cache(analysisPath);
+    analysis = cache.get(rom.data, rom.size, machine, quirks, analysisCached);
+    warmUp(analysis, chip8, useJit ? &jit : nullptr);
+  }
+
+#ifdef CHIP8_PROFILE
+  Profiler profiler;
+  if (profilePath)
+    chip8.profiler = &profiler;
+#endif
+
+  TraceRecorder tracer;
+  if (tracePath) {
+    if (!tracer.open(tracePath, chip8)) {
+      std::cerr << "Error: Failed to create trace: " << tracePath
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+    chip8.tracer = &tracer;
+  }
+
+  AudioMixer mixer;
+  WavWriter wav(wavPath ? wavPath : "");
+  if (wavPath) {
+    if (!wav.start(mixer)) {
+      std::cerr << "Error: Failed to create WAV file: " << wavPath
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+    runner.audio = &mixer;
+  }
+
+  // Uncapped, the run waits for the encoder rather than drop pictures
+  VideoRecorder video(false);
+  if (videoPath) {
+    if (!video.open(videoPath, chip8)) {
+      std::cerr << "Error: Failed to create video: " << videoPath
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+    runner.video = &video;
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  // Uncapped: frames run back to back, the timers still tick once per frame
+  // so the ROM sees the same emulated time as in real-time mode
+  while (runner.cycles < cycles) {
+    if (!runner.runFrame())
+      break;
+    if (wavPath)
+      wav.frameDone();
+  }
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  dumpScreen(chip8);
+
+  if (tracePath && !tracer.close()) {
+    std::cerr << "Error: Failed to write trace: " << tracePath << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (wavPath) {
+    wav.stop();
+    if (!wav.ok()) {
+      std::cerr << "Error: Failed to write WAV file: " << wavPath
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (videoPath && !video.close()) {
+    std::cerr << "Error: Failed to write video: " << videoPath << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (savePath && !saveStateFile(chip8, savePath)) {
+    std::cerr << "Error: Failed to save state: " << savePath << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  const double seconds = elapsed.count();
+  std::cout << "Cycles: " << runner.cycles << std::endl;
+  std::cout << "Frames: " << runner.frames << " (" << runner.framesDrawn
+            << " drawn, " << runner.framesSkipped << " unchanged)"
+            << std::endl;
+  std::cout << "Time:   " << seconds << " s" << std::endl;
+  if (chip8.error != MachineError::None) {
+    std::cout << "Error:  " << machineErrorName(chip8.error) << " at 0x"
+              << std::hex << chip8.pc << std::dec << std::endl;
+  }
+  if (seconds > 0) {
+    std::cout << "Speed:  " << static_cast<double>(runner.cycles) / seconds
+              << " instructions/s" << std::endl;
+  }
+  if (useJit) {
+    std::cout << "JIT:    " << jit.nativeCycles << " native, "
+              << jit.interpretedCycles << " interpreted, "
+              << jit.blocksCompiled << " blocks, " << jit.flushes
+              << " flushes" << std::endl;
+  }
+  if (analysisPath) {
+    std::cout << "Analysis: " << analysis.count(BYTE_CODE) << " opcodes, "
+              << analysis.count(BYTE_BLOCK) << " blocks, "
+              << (analysisCached ? "from the cache" : "added to the cache")
+              << std::endl;
+  }
+  if (wavPath) {
+    std::cout << "Audio:  " << mixer.samplesProduced() << " samples in "
+              << wavPath << std::endl;
+  }
+  if (videoPath) {
+    std::cout << "Video:  " << video.framesRecorded() << " frames, "
+              << video.pictures() << " pictures, " << video.dropped()
+              << " dropped, in " << videoPath << std::endl;
+  }
+  if (tracePath) {
+    std::cout << "Trace:  " << tracer.records() << " opcodes, "
+              << tracer.runCount() << " runs, in " << tracePath << std::endl;
+  }
+
+#ifdef CHIP8_PROFILE
+  if (profilePath && !writeProfile(profiler, profilePath)) {
+    std::cerr << "Error: Failed to write profile: " << profilePath
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+#endif
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,153 @@
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "../include/chip8.hpp"
+#include "../include/conformance.hpp"
+#include "../include/jit.hpp"
+#include "../include/scheduler.hpp"
+
+// Default number of opcodes to execute per ROM
+constexpr unsigned long DEFAULT_CYCLES = 5000000;
+
+// Longest run of opcodes between two comparisons
+constexpr unsigned long MAX_CHUNK = 64;
+
+// Small deterministic generator for chunk sizes and key presses, so a failure
+// can be reproduced
+class Lcg {
+private:
+  unsigned int state;
+
+public:
+  explicit Lcg(unsigned int seed) : state(seed) {}
+
+  unsigned int next() {
+    state = state * 1664525u + 1013904223u;
+    return state >> 8;
+  }
+};
+
+// Run the ROM on the interpreter and on the recompiler side by side, comparing
+// the whole machine after every chunk the recompiler executes
+bool checkRom(const char *romPath, unsigned long cycles,
+              const Machine *machine, const Quirks *quirks) {
+  Chip8 reference;
+  Chip8 compiled;
+  Jit jit(compiled);
+
+  reference.setMachine(machine ? *machine : machineForPath(romPath));
+  compiled.setMachine(reference.machine);
+  if (quirks) {
+    reference.setQuirks(*quirks);
+    compiled.setQuirks(*quirks);
+  }
+  reference.initialize();
+  compiled.initialize();
+  // Same random sequence on both sides
+  reference.seedRandom(0xC8C8);
+  compiled.seedRandom(0xC8C8);
+  if (!reference.loadGame(romPath) || !compiled.loadGame(romPath)) {
+    printf("%s: failed to load\n", romPath);
+    return false;
+  }
+
+  Lcg lcg(0xC8C8);
+  const unsigned long ipf = instructionsPerFrame(IPS_NORMAL);
+  unsigned long done = 0;
+
+  while (done < cycles) {
+    // Press a random key now and then so input driven paths get covered
+    const unsigned int keys = lcg.next();
+    for (int i = 0; i < 16; ++i) {
+      reference.key[i] = compiled.key[i] = (keys >> i) % 8 == 0;
+    }
+
+    unsigned long frameLeft = ipf;
+    while (frameLeft > 0) {
+      unsigned long chunk = 1 + lcg.next() % MAX_CHUNK;
+      if (chunk > frameLeft)
+        chunk = frameLeft;
+
+      jit.runCycles(chunk);
+      for (unsigned long i = 0; i < chunk; ++i)
+        reference.emulateCycle();
+
+      const char *field = firstDifference(reference, compiled);
+      if (field) {
+        printf("%s: %s differs after %lu cycles (pc 0x%X, opcode 0x%04X)\n",
+               romPath, field, done + ipf - frameLeft + chunk, reference.pc,
+               reference.opcode);
+        return false;
+      }
+      frameLeft -= chunk;
+    }
+
+    reference.tickTimers();
+    compiled.tickTimers();
+    done += ipf;
+  }
+
+  printf("%s: ok, %llu native, %llu interpreted, %llu blocks, %llu flushes\n",
+         romPath, jit.nativeCycles, jit.interpretedCycles, jit.blocksCompiled,
+         jit.flushes);
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr,
+            "Usage: %s [-n cycles] [-m machine] [-q quirks] <rom_file>...\n",
+            argv[0]);
+    fprintf(stderr, "Runs each ROM on the interpreter and on the recompiler "
+                    "in lockstep and\nreports the first state that differs. "
+                    "The machine is guessed from\nthe extension of each ROM "
+                    "unless given, the quirks are the machine's\nown unless "
+                    "given.\n");
+    return EXIT_FAILURE;
+  }
+
+  unsigned long cycles = DEFAULT_CYCLES;
+  Machine forced = Machine::Classic;
+  const Machine *machine = nullptr;
+  Quirks forcedQuirks = Quirks::CosmacVip;
+  const Quirks *quirks = nullptr;
+  int first = 1;
+  while (first + 2 < argc) {
+    const std::string option(argv[first]);
+    if (option == "-n") {
+      cycles = std::strtoul(argv[first + 1], nullptr, 10);
+    } else if (option == "-m") {
+      if (!parseMachine(argv[first + 1], forced)) {
+        fprintf(stderr, "Unknown machine: %s\n", argv[first + 1]);
+        return EXIT_FAILURE;
+      }
+      machine = &forced;
+    } else if (option == "-q") {
+      if (!parseQuirks(argv[first + 1], forcedQuirks)) {
+        fprintf(stderr, "Unknown quirks: %s\n", argv[first + 1]);
+        return EXIT_FAILURE;
+      }
+      quirks = &forcedQuirks;
+    } else {
+      break;
+    }
+    first += 2;
+  }
+
+  {
+    Chip8 probe;
+    Jit jit(probe);
+    if (!jit.available()) {
+      fprintf(stderr, "Recompiler not available on this host\n");
+      return EXIT_FAILURE;
+    }
+  }
+
+  bool ok = true;
+  for (int i = first; i < argc; ++i) {
+    ok = checkRom(argv[i], cycles, machine, quirks) && ok;
+  }
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,160 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "../include/chip8.hpp"
+#include "../include/frontend.hpp"
+#include "../include/jit.hpp"
+#include "../include/movie.hpp"
+#include "../include/runner.hpp"
+#include "../include/scheduler.hpp"
+
+// Frontend pressing pseudo random keys, to record movies without a player
+class RandomInput : public NullFrontend {
+private:
+  std::uint32_t state;
+
+public:
+  explicit RandomInput(std::uint32_t seed) : state(seed) {}
+
+  // Hold a key (or none) for a few frames at a time, like a player would
+  void pollInput(unsigned char key[16]) override {
+    state = state * 1664525u + 1013904223u;
+    if ((state >> 24) % 8 != 0)
+      return;
+    const int pressed = (state >> 16) % 20;
+    for (int k = 0; k < 16; ++k)
+      key[k] = k == pressed;
+  }
+};
+
+void printUsage(const char *program) {
+  std::cerr << "Usage: " << program << " [--jit] <rom_file> <movie_file>"
+            << std::endl;
+  std::cerr << "       " << program
+            << " --record <frames> [-s speed] <rom_file> <movie_file>"
+            << std::endl;
+  std::cerr << "Replays a movie as fast as possible and checks the machine"
+            << std::endl;
+  std::cerr << "goes through the recorded states, or records one with"
+            << std::endl;
+  std::cerr << "pseudo random input." << std::endl;
+}
+
+int record(const char *romPath, const char *moviePath, unsigned long frames,
+           unsigned long ips) {
+  Chip8 chip8;
+  chip8.setMachine(machineForPath(romPath));
+  chip8.initialize();
+  if (!chip8.loadGame(romPath)) {
+    std::cerr << "Error: Failed to load ROM file: " << romPath << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  Movie movie;
+  movie.seed = 0xC8C8;
+  movie.instructionsPerFrame =
+      static_cast<std::uint32_t>(instructionsPerFrame(ips));
+  chip8.seedRandom(movie.seed);
+
+  RandomInput input(movie.seed);
+  MovieRecorder recorder(chip8, input, movie);
+  Runner runner(chip8, recorder, movie.instructionsPerFrame);
+  while (runner.frames < frames)
+    runner.runFrame();
+  recorder.finish();
+
+  if (!movie.save(moviePath)) {
+    std::cerr << "Error: Failed to write movie: " << moviePath << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::cout << "Recorded " << movie.frames << " frames, "
+            << movie.keyChanges.size() << " key changes" << std::endl;
+  return EXIT_SUCCESS;
+}
+
+int replay(const char *romPath, const char *moviePath, bool useJit) {
+  Movie movie;
+  if (!movie.load(moviePath)) {
+    std::cerr << "Error: Failed to read movie: " << moviePath << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // The machine and quirks come from the movie, whatever the ROM's
+  // extension says
+  Chip8 chip8;
+  chip8.setMachine(movie.machine);
+  chip8.setQuirks(movie.quirks);
+  chip8.initialize();
+  if (!chip8.loadGame(romPath)) {
+    std::cerr << "Error: Failed to load ROM file: " << romPath << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (romHash(chip8) != movie.romHash) {
+    std::cerr << "Error: The movie was recorded with another ROM" << std::endl;
+    return EXIT_FAILURE;
+  }
+  chip8.seedRandom(movie.seed);
+
+  MoviePlayer player(chip8, movie);
+  Runner runner(chip8, player, movie.instructionsPerFrame);
+  Jit jit(chip8);
+  if (useJit)
+    runner.jit = &jit;
+
+  const auto start = std::chrono::steady_clock::now();
+  while (runner.runFrame() && !player.diverged) {
+  }
+  player.finish();
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  std::cout << "Replayed " << runner.frames << " frames ("
+            << runner.frames / FRAMES_PER_SECOND << " s of play) in "
+            << elapsed.count() << " s" << std::endl;
+  if (player.diverged) {
+    std::cout << "Diverged: state differs after frame "
+              << player.divergedFrame << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::cout << "Matches the recording" << std::endl;
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+  bool useJit = false;
+  unsigned long recordFrames = 0;
+  unsigned long ips = IPS_NORMAL;
+  const char *paths[2] = {nullptr, nullptr};
+  int pathCount = 0;
+
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg(argv[i]);
+    if (arg == "--jit") {
+      useJit = true;
+    } else if (arg == "--record" && i + 1 < argc) {
+      recordFrames = std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "-s" && i + 1 < argc) {
+      ips = parseSpeed(argv[++i]);
+      if (ips == 0) {
+        std::cerr << "Error: Invalid speed: " << argv[i] << std::endl;
+        return EXIT_FAILURE;
+      }
+    } else if (arg[0] != '-' && pathCount < 2) {
+      paths[pathCount++] = argv[i];
+    } else {
+      printUsage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (pathCount != 2) {
+    printUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (recordFrames)
+    return record(paths[0], paths[1], recordFrames, ips);
+  return replay(paths[0], paths[1], useJit);
+}
@@ -0,0 +1,51 @@
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "../include/rom_store.hpp"
+
+void printUsage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s list <rom|directory|archive>...\n"
+          "       %s pack <archive> <rom|directory|archive>...\n"
+          "list prints the content hash, size and name of every ROM, the\n"
+          "hash being the one profiles are keyed by (see chip8_batch -p).\n"
+          "pack writes them all to one archive, each image stored once,\n"
+          "that chip8_batch maps in one go.\n",
+          program, program);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    printUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  const std::string command(argv[1]);
+  if (command != "list" && !(command == "pack" && argc > 3)) {
+    printUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  RomStore store;
+  for (int i = command == "pack" ? 3 : 2; i < argc; ++i) {
+    if (!store.addPath(argv[i])) {
+      fprintf(stderr, "Error: Failed to read ROMs from: %s\n", argv[i]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (command == "list") {
+    for (const Rom &rom : store.all())
+      printf("%016llx %5zu  %s\n", static_cast<unsigned long long>(rom.hash),
+             rom.size, rom.name.c_str());
+    return EXIT_SUCCESS;
+  }
+
+  if (!store.writeArchive(argv[2])) {
+    fprintf(stderr, "Error: Failed to write archive: %s\n", argv[2]);
+    return EXIT_FAILURE;
+  }
+  printf("%zu ROMs written to %s\n", store.all().size(), argv[2]);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,200 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <strings.h>
+#include <vector>
+
+#include "../include/disasm.hpp"
+#include "../include/dispatch.hpp"
+#include "../include/trace.hpp"
+
+// Records shown before the first difference by diff, by default
+constexpr std::size_t DEFAULT_CONTEXT = 5;
+
+// Which records print shows
+struct Filter {
+  unsigned long pcFirst = 0;
+  unsigned long pcLast = 0xFFFF;
+  int op = -1;
+  int reg = -1;
+  std::size_t from = 0;
+  std::size_t count = ~static_cast<std::size_t>(0);
+
+  bool matches(const TraceRecord &record) const {
+    if (record.pc < pcFirst || record.pc > pcLast)
+      return false;
+    if (op >= 0 && static_cast<int>(opTable()[record.opcode]) != op)
+      return false;
+    if (reg >= 0 && record.reg != reg)
+      return false;
+    return true;
+  }
+};
+
+void printUsage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s print [filters] <trace_file>\n"
+          "       %s diff [-c context] <trace_a> <trace_b>\n"
+          "Reads traces written by chip8_headless --trace.\n"
+          "Both replay the trace from the state it starts from to rebuild\n"
+          "the record of every opcode.\n"
+          "print shows the records as disassembly, with I and the register\n"
+          "written after each opcode. Filters:\n"
+          "  --pc <addr>[-<addr>]  Only opcodes run from these addresses\n"
+          "  --op <name>           Only this opcode (Draw, Call, SetNN, ...)\n"
+          "  --reg <x>             Only opcodes writing VX\n"
+          "  --from <n>            Start at record n\n"
+          "  --count <n>           Show at most n records\n"
+          "diff reports the first record where the traces differ, after\n"
+          "context records of the first trace (default %zu).\n",
+          program, program, DEFAULT_CONTEXT);
+}
+
+void printRecord(std::size_t index, const TraceRecord &record,
+                 const char *prefix = "") {
+  char written[16] = "";
+  if (record.reg != TRACE_NO_REGISTER)
+    std::snprintf(written, sizeof(written), "  V%X=%02X", record.reg,
+                  record.value);
+  printf("%s%10zu  %03X  %04X  %-18s I=%03X%s\n", prefix, index, record.pc,
+         record.opcode, disassemble(record.opcode).c_str(), record.I,
+         written);
+}
+
+bool openTrace(TraceFile &trace, const char *path) {
+  if (trace.open(path))
+    return true;
+  fprintf(stderr, "Error: Failed to read trace: %s\n", path);
+  return false;
+}
+
+// Whether the replay of trace stopped early, saying so
+bool replayFailed(const TraceFile &trace, const char *path) {
+  if (!trace.diverged())
+    return false;
+  fprintf(stderr,
+          "Error: %s stops replaying after %llu records, the machine was "
+          "changed from outside\n",
+          path, static_cast<unsigned long long>(trace.position()));
+  return true;
+}
+
+int print(const char *path, const Filter &filter) {
+  TraceFile trace;
+  if (!openTrace(trace, path))
+    return EXIT_FAILURE;
+
+  // The records before from are rebuilt all the same, each one depends on
+  // the ones before it
+  TraceRecord record;
+  std::size_t shown = 0;
+  while (shown < filter.count && trace.next(record)) {
+    const std::size_t index = trace.position() - 1;
+    if (index >= filter.from && filter.matches(record)) {
+      printRecord(index, record);
+      ++shown;
+    }
+  }
+  return replayFailed(trace, path) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int diff(const char *pathA, const char *pathB, std::size_t context) {
+  TraceFile a, b;
+  if (!openTrace(a, pathA) || !openTrace(b, pathB))
+    return EXIT_FAILURE;
+
+  // The last context records of a, oldest first from index i % context
+  std::vector<TraceRecord> last(context);
+  TraceRecord recordA, recordB;
+  std::size_t i = 0;
+  bool moreA, moreB;
+  for (;;) {
+    moreA = a.next(recordA);
+    moreB = b.next(recordB);
+    if (!moreA || !moreB ||
+        std::memcmp(&recordA, &recordB, sizeof(TraceRecord)) != 0)
+      break;
+    if (context > 0)
+      last[i % context] = recordA;
+    ++i;
+  }
+  if (replayFailed(a, pathA) || replayFailed(b, pathB))
+    return EXIT_FAILURE;
+
+  if (!moreA && !moreB) {
+    printf("Identical, %zu records\n", i);
+    return EXIT_SUCCESS;
+  }
+
+  for (std::size_t j = i > context ? i - context : 0; j < i; ++j)
+    printRecord(j, last[j % context], "  ");
+  if (moreA && moreB) {
+    printf("First difference at record %zu:\n", i);
+    printRecord(i, recordA, "a ");
+    printRecord(i, recordB, "b ");
+  } else {
+    const char *shorter = moreA ? pathB : pathA;
+    printf("%s ends after %zu records, the other one goes on\n", shorter, i);
+  }
+  return EXIT_FAILURE;
+}
+
+// Op called name in the profiler report and the Op enum, -1 if none
+int findOp(const char *name) {
+  for (int op = 0; op < OP_COUNT; ++op) {
+    if (strcasecmp(opName(static_cast<Op>(op)), name) == 0)
+      return op;
+  }
+  return -1;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    printUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  const std::string command(argv[1]);
+  Filter filter;
+  std::size_t context = DEFAULT_CONTEXT;
+  const char *paths[2] = {nullptr, nullptr};
+  int pathCount = 0;
+
+  for (int i = 2; i < argc; ++i) {
+    const std::string arg(argv[i]);
+    if (arg == "--pc" && i + 1 < argc) {
+      char *end;
+      filter.pcFirst = std::strtoul(argv[++i], &end, 0);
+      filter.pcLast = *end == '-' ? std::strtoul(end + 1, nullptr, 0)
+                                  : filter.pcFirst;
+    } else if (arg == "--op" && i + 1 < argc) {
+      filter.op = findOp(argv[++i]);
+      if (filter.op < 0) {
+        fprintf(stderr, "Error: Unknown opcode name: %s\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    } else if (arg == "--reg" && i + 1 < argc) {
+      filter.reg = static_cast<int>(std::strtoul(argv[++i], nullptr, 16));
+    } else if (arg == "--from" && i + 1 < argc) {
+      filter.from = std::strtoull(argv[++i], nullptr, 0);
+    } else if (arg == "--count" && i + 1 < argc) {
+      filter.count = std::strtoull(argv[++i], nullptr, 0);
+    } else if (arg == "-c" && i + 1 < argc) {
+      context = std::strtoull(argv[++i], nullptr, 0);
+    } else if (arg[0] != '-' && pathCount < 2) {
+      paths[pathCount++] = argv[i];
+    } else {
+      printUsage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (command == "print" && pathCount == 1)
+    return print(paths[0], filter);
+  if (command == "diff" && pathCount == 2)
+    return diff(paths[0], paths[1], context);
+
+  printUsage(argv[0]);
+  return EXIT_FAILURE;
+}
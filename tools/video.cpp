@@ -0,0 +1,116 @@
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "../include/video.hpp"
+
+// Pixels of the GIF per pixel of the 128 x 64 canvas, by default
+constexpr unsigned DEFAULT_SCALE = 4;
+
+void printUsage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s info <video_file>\n"
+          "       %s gif [-s scale] <video_file> <gif_file>\n"
+          "Reads video streams written by chip8_headless --video.\n"
+          "info prints the length of the video and how its pictures are\n"
+          "stored.\n"
+          "gif converts it to an animated GIF, scale times 128 x 64 pixels\n"
+          "(default %u).\n",
+          program, program, DEFAULT_SCALE);
+}
+
+bool openVideo(VideoFile &video, const char *path) {
+  if (video.open(path))
+    return true;
+  fprintf(stderr, "Error: Failed to read video: %s\n", path);
+  return false;
+}
+
+int info(const char *path) {
+  VideoFile video;
+  if (!openVideo(video, path))
+    return EXIT_FAILURE;
+
+  VideoPicture picture;
+  std::uint32_t decoded = 0;
+  std::uint32_t hires = 0;
+  while (video.next(picture)) {
+    ++decoded;
+    hires += picture.hires;
+  }
+
+  printf("Frames:   %u (%.2f s at %u Hz)\n", video.frames(),
+         static_cast<double>(video.frames()) / VIDEO_FRAME_RATE,
+         VIDEO_FRAME_RATE);
+  printf("Pictures: %u (%u in high resolution)\n", video.pictures(), hires);
+  if (decoded != video.pictures()) {
+    fprintf(stderr, "Error: Corrupt picture %u\n", decoded);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+int gif(const char *path, const char *gifPath, unsigned scale) {
+  VideoFile video;
+  if (!openVideo(video, path))
+    return EXIT_FAILURE;
+
+  GifWriter writer(scale);
+  if (!writer.open(gifPath)) {
+    fprintf(stderr, "Error: Failed to create GIF: %s\n", gifPath);
+    return EXIT_FAILURE;
+  }
+
+  VideoPicture picture;
+  std::uint32_t decoded = 0;
+  while (video.next(picture)) {
+    writer.write(picture);
+    ++decoded;
+  }
+  if (!writer.close(video.frames())) {
+    fprintf(stderr, "Error: Failed to write GIF: %s\n", gifPath);
+    return EXIT_FAILURE;
+  }
+  if (decoded != video.pictures()) {
+    fprintf(stderr, "Error: Corrupt picture %u, the GIF stops there\n",
+            decoded);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    printUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  const std::string command(argv[1]);
+  unsigned scale = DEFAULT_SCALE;
+  const char *paths[2] = {nullptr, nullptr};
+  int pathCount = 0;
+
+  for (int i = 2; i < argc; ++i) {
+    const std::string arg(argv[i]);
+    if (arg == "-s" && i + 1 < argc) {
+      scale = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+      if (scale == 0 || scale > 8) {
+        fprintf(stderr, "Error: Invalid scale: %s (1 to 8)\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    } else if (arg[0] != '-' && pathCount < 2) {
+      paths[pathCount++] = argv[i];
+    } else {
+      printUsage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (command == "info" && pathCount == 1)
+    return info(paths[0]);
+  if (command == "gif" && pathCount == 2)
+    return gif(paths[0], paths[1], scale);
+
+  printUsage(argv[0]);
+  return EXIT_FAILURE;
+}